@@ -111,6 +111,8 @@
 
 #define STATE_CODE16 0x0001
 #define STATE_ADDR16 0x0002
+// CS, DS, ES, and SS all have a base of zero (see cpu_seg_update_flat)
+#define STATE_FLAT 0x0008
 
 #define IS_USER_MODE() cpu.cpl == 3
 
@@ -187,17 +189,93 @@ enum {
     INTERRUPT_TYPE_HARDWARE // i.e. IRQ8
 };
 
-#define TRACE_INFO_ENTRIES (64 * 1024) // TODO: Enlarge?
-#define TRACE_CACHE_SIZE (TRACE_INFO_ENTRIES * 8) // TODO: Enlarge?
-#define MAX_TRACE_SIZE 32
+// The trace cache is sized at startup (see cpu_trace_init). These control its shape.
+#define TRACE_INFO_WAYS 4
+#define TRACE_CACHE_SEGMENTS 8
+#define TRACE_CACHE_MIN_BUDGET (4 << 20)
+#define TRACE_CACHE_MAX_BUDGET (32 << 20)
+// Number of decoded instructions in a trace, including op_trace_end. The default can be changed at startup (see
+// cpu.trace_length), up to the maximum.
+#define DEFAULT_TRACE_SIZE 32
+#define MAX_TRACE_SIZE 128
+// Direct jumps and calls a trace can carry on through to another part of the same page (see decode_follow)
+#define SUPERBLOCK_MAX_JUMPS 8
+// Calls remembered for the RETs that go back to them (see cpu.return_stack)
+#define RETURN_STACK_SIZE 16
 
 #define MAX_TLB_ENTRIES 8192
 
-#define TRACE_LENGTH(flags) (flags & 0x3FF)
+// The TLB is a direct-mapped table indexed by a hash of the linear page number. Everything needed to translate an access
+// (host pointer, permission tags, and attributes) sits in one entry, so a lookup touches a single cache line. An entry
+// only applies to the page it was filled for, and reads as invalid for every other page that hashes to it.
+//
+// The table holds translations for up to TLB_CONTEXTS address spaces (CR3 values) at once, so that switching back to a
+// recently used one does not start from an empty TLB. Each context XORs its own salt into the index, which keeps the
+// same linear page in two contexts apart without any extra check on the access path.
+#define TLB_SIZE 8192
+#define TLB_CONTEXTS 4
+#define TLB_INDEX_SALTED(lin, salt) (((lin) >> 12 ^ (lin) >> 25 ^ (salt)) & (TLB_SIZE - 1))
+#define TLB_INDEX(lin) TLB_INDEX_SALTED(lin, cpu.tlb_salt)
+#define TLB_CONTEXT_SALT(context) ((context) * (TLB_SIZE / TLB_CONTEXTS))
+struct tlb_entry {
+    void* ptr; // Host pointer minus the linear address
+    uint32_t page; // Linear page number this entry translates, or -1 if it is empty
+    uint8_t tags, attrs, context;
+};
+struct tlb_context {
+    uint32_t cr3, last_used;
+    // Cleared as soon as one of the page tables that the context's entries came from is written to. An invalid context
+    // is dropped when CR3 is next written, instead of being kept for later.
+    int valid;
+};
+
+// Page directory entries, and with PAE the PDPTE above them, that cpu_mmu_translate has recently walked through. A TLB miss
+// in a region with a cached entry only has to read the page table entry. Entries are tagged with CR3, so they survive
+// address space switches; the pages they were read from are tracked in cpu.page_tables like those of the TLB contexts,
+// and a write to one of them drops every entry that came from it.
+#define PAGE_WALK_CACHE_SIZE 256
+struct page_walk_entry {
+    uint32_t cr3, prefix; // Linear address >> 22 (>> 21 with PAE), or -1 if the entry is empty
+    uint32_t pdp_addr, pdpte, pdpte_high; // Without PAE, pdp_addr is the same as pde_addr
+    uint32_t pde_addr, pde, pde_high;
+};
+
+// Segment descriptors that cpu_seg_load_descriptor2 has recently read, indexed by selector and tagged with the base of
+// the table they came from. The pages they were read from are tracked in cpu.page_tables, and a write that overlaps a
+// descriptor drops it. An entry is only used while the TLB maps it to the same physical address as when it was read, so
+// a hit is exactly what reading the table again would have returned, without any chance of faulting.
+#define SEG_DESC_CACHE_SIZE 64
+struct seg_desc_cache_entry {
+    uint32_t key, base, phys; // Selector with its RPL cleared, or -1 if the entry is empty
+    struct seg_desc desc;
+};
+
+// How often code on a page of RAM has been overwritten recently (see smc.c)
+#define SMC_MAX_HOT_PAGES 16
+struct smc_page_heat {
+    uint16_t events; // Invalidations, halved every decay period
+    uint16_t hot; // Set while the page is decoded one instruction per trace
+    uint32_t epoch; // Decay period of the last invalidation
+};
+
+// A trace covers the bytes from TRACE_BACK bytes before its phys to TRACE_LENGTH bytes after that. Both are only larger
+// than the trace's straight-line length when it follows a jump to elsewhere on its page.
+#define TRACE_LENGTH(flags) (flags & 0x1FFF)
+#define TRACE_BACK(flags) (flags >> 16 & 0xFFF)
+
+// Traces are chained together by the branches that leave them: a direct jump, call, taken Jcc, or the fall-through at the
+// end of a trace stores the index of the trace_info entry it last went to (see cpu_get_trace_linked). Indirect jumps and
+// calls keep one as well, in imm32, which caches the last target of each site. A link is only ever followed after
+// checking that entry's phys and state_hash, so invalidating an entry unlinks every branch pointing to it.
 struct trace_info {
     uint32_t phys, state_hash;
     struct decoded_instruction* ptr;
     uint32_t flags;
+    // The other traces decoded from the same page of RAM (see cpu.trace_pages), as indexes into cpu.trace_info, or -1
+    uint32_t page_prev, page_next;
+    // Number of instructions charged to the cycle budget when the trace is entered (see cpu_trace_enter). This is one
+    // cycle per decoded instruction, not counting op_trace_end, or 0 if the trace always has to be charged one at a time.
+    uint32_t cycles;
 #ifdef DYNAREC
     uint32_t calls; // Used by the dynamic recompiler to determine whether the block should be compiled
 #endif
@@ -270,6 +348,14 @@ struct cpu {
         refill_counter, // If we have to exit the loop for some reason, cycles_to_run will be set to 1 and refill_counter will be set to old value of cycles_to_run -1
         hlt_counter, // Cycles remaining in the execution frame if we exit out due to a HLT
         cycle_offset;
+    // While a trace runs with its instructions charged up front, the range of instructions that have been paid for but
+    // not run yet ends at trace_end, and NULL otherwise. trace_start and trace_phys locate the trace so that the current
+    // instruction can be found from cpu.phys_eip (see cpu_trace_sync).
+    struct decoded_instruction *trace_start, *trace_end;
+    uint32_t trace_phys;
+    // The entry that cpu_trace_sync has pointed at op_trace_resync, and the handler that it had before, or NULL
+    struct decoded_instruction* trace_resync;
+    insn_handler_t trace_resync_handler;
 
     // ========================================================================
     // Protected Mode
@@ -304,6 +390,8 @@ struct cpu {
 
     // The number of instructions we have placed within the trace cache
     int trace_cache_usage;
+    // The segment of the trace cache that is currently being filled
+    int trace_cache_segment;
 
     // The amount to shift the TLB tag by. See docs/cpu/tlb.md for details.
     int tlb_shift_read, tlb_shift_write;
@@ -355,24 +443,52 @@ struct cpu {
 
     uint32_t smc_has_code_length;
     uint32_t* smc_has_code;
+    struct smc_page_heat* smc_heat;
+    uint32_t smc_hot_pages[SMC_MAX_HOT_PAGES], smc_hot_page_count;
 
     uint32_t tlb_entry_count;
     uint32_t tlb_entry_indexes[MAX_TLB_ENTRIES];
 
-    // TLB entries plus tags
-    uint8_t tlb_tags[1 << 20];
+    // TLB entries. Use the TLB_* macros below to access them.
 #define TLB_ATTR_NX 1
 #define TLB_ATTR_NON_GLOBAL 2
-    // Interesting information on TLB
-    uint8_t tlb_attrs[1 << 20];
-    void* tlb[1 << 20];
-
-    // Actual trace cache
-    struct decoded_instruction trace_cache[TRACE_CACHE_SIZE];
-    struct trace_info trace_info[TRACE_INFO_ENTRIES];
+    struct tlb_entry tlb[TLB_SIZE];
+    uint32_t tlb_salt, tlb_context, tlb_context_clock;
+    struct tlb_context tlb_contexts[TLB_CONTEXTS];
+    struct page_walk_entry page_walk_cache[PAGE_WALK_CACHE_SIZE];
+    struct seg_desc_cache_entry seg_desc_cache[SEG_DESC_CACHE_SIZE];
+
+    // One byte per page of RAM, recording which TLB contexts have read page directory or page table entries from it.
+    // Once a page has been used this way, it stays write-protected in the TLB until the next full flush, so that writes
+    // to it reach cpu_mmu_page_table_write. PAGE_TABLE_WALK_CACHED is set while the page walk cache holds entries from it,
+    // and PAGE_TABLE_DESCRIPTORS once the descriptor cache has held one (see cpu.seg_desc_cache).
+#define PAGE_TABLE_USERS ((1 << TLB_CONTEXTS) - 1)
+#define PAGE_TABLE_DESCRIPTORS 0x20
+#define PAGE_TABLE_WALK_CACHED 0x40
+#define PAGE_TABLE_WATCHED (PAGE_TABLE_USERS | PAGE_TABLE_DESCRIPTORS | PAGE_TABLE_WALK_CACHED)
+#define PAGE_TABLE_PROTECTED 0x80
+    uint8_t* page_tables;
+    uint32_t page_tables_protected;
+
+    // Actual trace cache. Allocated by cpu_trace_init.
+    uint32_t trace_cache_budget, trace_info_set_mask, trace_segment_size;
+    // Longest trace the decoder builds, including op_trace_end. Zero picks DEFAULT_TRACE_SIZE.
+    uint32_t trace_length;
+    struct decoded_instruction* trace_cache;
+    struct trace_info* trace_info;
+    // One list head per page of RAM, linking every committed trace that starts in it. This lets SMC invalidation find the
+    // traces on a page without probing the cache for every byte of it.
+    uint32_t* trace_pages;
+    // Return stack buffer. Each call pushes the trace that it returns to, as an index into trace_info, and each RET pops
+    // one and goes straight there if it is still the trace for the new EIP and state (see cpu_follow_return).
+    uint32_t return_stack[RETURN_STACK_SIZE], return_stack_top;
 };
 extern struct cpu cpu;
 
+// Performance counters, see cpuapi.h
+struct cpu_stats;
+extern struct cpu_stats cpu_stats;
+
 #define MEM32(e) *(uint32_t*)(cpu.mem + e)
 #define MEM16(e) *(uint16_t*)(cpu.mem + e)
 #ifdef LIBCPU
@@ -383,6 +499,13 @@ uint32_t cpulib_ptr_to_phys(void*);
 #define PTR_TO_PHYS(ptr) (uint32_t)(uintptr_t)((void*)ptr - cpu.mem)
 #endif
 
+// Entry for a linear address, and its tags and attributes (0xFF, meaning invalid, if the entry holds another page)
+#define TLB_ENTRY(lin) (&cpu.tlb[TLB_INDEX(lin)])
+#define TLB_TAGS(lin) (TLB_ENTRY(lin)->page == (lin) >> 12 ? TLB_ENTRY(lin)->tags : 0xFF)
+#define TLB_ATTRS(lin) (TLB_ENTRY(lin)->page == (lin) >> 12 ? TLB_ENTRY(lin)->attrs : 0xFF)
+// Host pointer for a linear address. Only meaningful if TLB_TAGS has a valid entry for the access.
+#define TLB_PTR(lin) (TLB_ENTRY(lin)->ptr + (lin))
+
 // Based on the linear address, the TLB tag for this entry, and the shift for the current mode
 #define TLB_ENTRY_INVALID8(addr, tag, shift) (tag >> shift & 1)
 #define TLB_ENTRY_INVALID16(addr, tag, shift) ((addr | tag >> shift) & 1)
@@ -440,68 +563,68 @@ uint32_t cpulib_ptr_to_phys(void*);
         cpu.cycle_offset = 1;                        \
     } while (0)
 
-#define cpu_read8(linaddr, dest, shift)                                            \
-    do {                                                                           \
-        uint32_t addr_ = linaddr, shift_ = shift, tag = cpu.tlb_tags[addr_ >> 12]; \
-        if (TLB_ENTRY_INVALID8(addr_, tag, shift_)) {                              \
-            if (!cpu_access_read8(addr_, tag >> shift, shift))                     \
-                dest = cpu.read_result;                                            \
-            else                                                                   \
-                EXCEPTION_HANDLER;                                                 \
-        } else                                                                     \
-            dest = *(uint8_t*)(cpu.tlb[addr_ >> 12] + addr_);                      \
+#define cpu_read8(linaddr, dest, shift)                                  \
+    do {                                                                 \
+        uint32_t addr_ = linaddr, shift_ = shift, tag = TLB_TAGS(addr_); \
+        if (TLB_ENTRY_INVALID8(addr_, tag, shift_)) {                    \
+            if (!cpu_access_read8(addr_, tag >> shift, shift))           \
+                dest = cpu.read_result;                                  \
+            else                                                         \
+                EXCEPTION_HANDLER;                                       \
+        } else                                                           \
+            dest = *(uint8_t*)TLB_PTR(addr_);                            \
     } while (0)
-#define cpu_read16(linaddr, dest, shift)                                           \
-    do {                                                                           \
-        uint32_t addr_ = linaddr, shift_ = shift, tag = cpu.tlb_tags[addr_ >> 12]; \
-        if (TLB_ENTRY_INVALID16(addr_, tag, shift_)) {                             \
-            if (!cpu_access_read16(addr_, tag >> shift, shift))                    \
-                dest = cpu.read_result;                                            \
-            else                                                                   \
-                EXCEPTION_HANDLER;                                                 \
-        } else                                                                     \
-            dest = *(uint16_t*)(cpu.tlb[addr_ >> 12] + addr_);                     \
+#define cpu_read16(linaddr, dest, shift)                                 \
+    do {                                                                 \
+        uint32_t addr_ = linaddr, shift_ = shift, tag = TLB_TAGS(addr_); \
+        if (TLB_ENTRY_INVALID16(addr_, tag, shift_)) {                   \
+            if (!cpu_access_read16(addr_, tag >> shift, shift))          \
+                dest = cpu.read_result;                                  \
+            else                                                         \
+                EXCEPTION_HANDLER;                                       \
+        } else                                                           \
+            dest = *(uint16_t*)TLB_PTR(addr_);                           \
     } while (0)
-#define cpu_read32(linaddr, dest, shift)                                           \
-    do {                                                                           \
-        uint32_t addr_ = linaddr, shift_ = shift, tag = cpu.tlb_tags[addr_ >> 12]; \
-        if (TLB_ENTRY_INVALID32(addr_, tag, shift_)) {                             \
-            if (!cpu_access_read32(addr_, tag >> shift, shift))                    \
-                dest = cpu.read_result;                                            \
-            else                                                                   \
-                EXCEPTION_HANDLER;                                                 \
-        } else                                                                     \
-            dest = *(uint32_t*)(cpu.tlb[addr_ >> 12] + addr_);                     \
+#define cpu_read32(linaddr, dest, shift)                                 \
+    do {                                                                 \
+        uint32_t addr_ = linaddr, shift_ = shift, tag = TLB_TAGS(addr_); \
+        if (TLB_ENTRY_INVALID32(addr_, tag, shift_)) {                   \
+            if (!cpu_access_read32(addr_, tag >> shift, shift))          \
+                dest = cpu.read_result;                                  \
+            else                                                         \
+                EXCEPTION_HANDLER;                                       \
+        } else                                                           \
+            dest = *(uint32_t*)TLB_PTR(addr_);                           \
     } while (0)
 #define cpu_write8(linaddr, data, shift)                              \
     do {                                                              \
         uint32_t addr_ = linaddr, shift_ = shift, data_ = data,       \
-                 tag = cpu.tlb_tags[addr_ >> 12];                     \
+                 tag = TLB_TAGS(addr_);                               \
         if (TLB_ENTRY_INVALID8(addr_, tag, shift_)) {                 \
             if (cpu_access_write8(addr_, data_, tag >> shift, shift)) \
                 EXCEPTION_HANDLER;                                    \
         } else                                                        \
-            *(uint8_t*)(cpu.tlb[addr_ >> 12] + addr_) = data_;        \
+            *(uint8_t*)TLB_PTR(addr_) = data_;                        \
     } while (0)
 #define cpu_write16(linaddr, data, shift)                              \
     do {                                                               \
         uint32_t addr_ = linaddr, shift_ = shift, data_ = data,        \
-                 tag = cpu.tlb_tags[addr_ >> 12];                      \
+                 tag = TLB_TAGS(addr_);                                \
         if (TLB_ENTRY_INVALID16(addr_, tag, shift_)) {                 \
             if (cpu_access_write16(addr_, data_, tag >> shift, shift)) \
                 EXCEPTION_HANDLER;                                     \
         } else                                                         \
-            *(uint16_t*)(cpu.tlb[addr_ >> 12] + addr_) = data_;        \
+            *(uint16_t*)TLB_PTR(addr_) = data_;                        \
     } while (0)
 #define cpu_write32(linaddr, data, shift)                              \
     do {                                                               \
         uint32_t addr_ = linaddr, shift_ = shift, data_ = data,        \
-                 tag = cpu.tlb_tags[addr_ >> 12];                      \
+                 tag = TLB_TAGS(addr_);                                \
         if (TLB_ENTRY_INVALID32(addr_, tag, shift_)) {                 \
             if (cpu_access_write32(addr_, data_, tag >> shift, shift)) \
                 EXCEPTION_HANDLER;                                     \
         } else                                                         \
-            *(uint32_t*)(cpu.tlb[addr_ >> 12] + addr_) = data_;        \
+            *(uint32_t*)TLB_PTR(addr_) = data_;                        \
     } while (0)
 
 // Macros to help with segmentation
@@ -526,6 +649,8 @@ uint32_t cpulib_ptr_to_phys(void*);
 
 // decoder.c
 int cpu_decode(struct trace_info* info, struct decoded_instruction* i);
+void cpu_decode_print_forms(void);
+void cpu_decode_add_stats(struct cpu_stats* stats);
 
 // General execution
 void cpu_execute(void);
@@ -547,6 +672,7 @@ int cpu_access_write32(uint32_t addr, uint32_t data, uint32_t tag, int shift);
 int cpu_access_verify(uint32_t addr, uint32_t end, int shift);
 
 // seg.c
+void cpu_seg_update_flat(void);
 void cpu_seg_load_virtual(int id, uint16_t sel);
 void cpu_seg_load_real(int id, uint16_t sel);
 int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info);
@@ -559,6 +685,8 @@ uint32_t cpu_seg_gate_target_segment(struct seg_desc* info);
 uint32_t cpu_seg_gate_target_offset(struct seg_desc* info);
 uint32_t cpu_seg_gate_parameter_count(struct seg_desc* info);
 uint32_t cpu_seg_descriptor_address(int tbl, uint16_t sel);
+void cpu_seg_cache_flush(void);
+void cpu_seg_cache_write(uint32_t phys, uint32_t length);
 int cpu_load_seg_value_mov(int seg, uint16_t val);
 void cpu_load_csip_real(uint16_t cs, uint32_t eip);
 void cpu_load_csip_virtual(uint16_t cs, uint32_t eip);
@@ -570,16 +698,27 @@ int cpu_smc_has_code(uint32_t phys);
 void cpu_smc_invalidate(uint32_t lin, uint32_t phys);
 void cpu_smc_invalidate_page(uint32_t phys);
 void cpu_smc_set_code(uint32_t phys);
+int cpu_smc_page_is_hot(uint32_t phys);
+void cpu_smc_cool_pages(void);
 
 // mmu.c
 void cpu_mmu_tlb_flush(void);
-void cpu_mmu_tlb_flush_nonglobal(void);
+void cpu_mmu_tlb_switch(void);
+void cpu_mmu_tlb_drop_inactive(void);
 int cpu_mmu_translate(uint32_t lin, int shift);
 void cpu_mmu_tlb_invalidate(uint32_t lin);
+void cpu_mmu_page_table_write(uint32_t phys);
+int cpu_mmu_watch_descriptors(uint32_t phys);
 
 // trace.c
-struct trace_info* cpu_trace_get_entry(uint32_t phys);
+void cpu_trace_init(uint32_t budget);
+int cpu_trace_invalidate_page(uint32_t phys, uint32_t lines, uint32_t hit);
+int cpu_trace_invalidate_write(uint32_t phys, int length);
 struct decoded_instruction* cpu_get_trace(void);
+struct decoded_instruction* cpu_get_trace_linked(uint32_t* link);
+void cpu_trace_find(uint32_t phys, uint32_t* link);
+struct decoded_instruction* cpu_trace_enter(struct trace_info* trace);
+void cpu_trace_sync(void);
 void cpu_trace_flush(void);
 
 // eflags.c
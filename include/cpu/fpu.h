@@ -13,6 +13,9 @@ int fpu_fxrstor(uint32_t linaddr);
 
 void fpu_debug(void);
 
+// Selects how transcendental instructions are computed, see FPU_ACCURACY_* in cpuapi.h
+void fpu_set_accuracy(int mode);
+
 int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg);
 int fpu_reg_op(struct decoded_instruction* i, uint32_t flags);
 
@@ -59,6 +62,8 @@ struct fpu {
 #ifdef FLOATX80
     float_status_t status;
 #endif
+    // Set when the control word allows basic arithmetic to be done with host doubles
+    int host_double;
 };
 extern struct fpu fpu;
 #endif
@@ -0,0 +1,158 @@
+#ifndef FPUHOST_H
+#define FPUHOST_H
+
+// Host double fast path for the x87 (see fpu.c)
+// With 53-bit precision and round-to-nearest, FADD, FSUB, FMUL, FDIV and FSQRT round the exact result once to 53 bits,
+// which is what the host does with doubles. The x87 keeps its 15-bit exponent when it rounds to 53 bits, so the two only
+// agree while nothing overflows, underflows or involves a special value. The host path is therefore only taken when
+// every operand converts to a double without loss and the result lies well inside the range of a double; anything else
+// goes to softfloat. The flags are rebuilt from the exact rounding error, which the host can compute for all of these
+// operations: precision if it is not zero, and C1 if the result was rounded away from zero. Denormals, NaNs and
+// infinities never take this path, so the denormal flag and the tag word come out the same as well.
+//
+// The functions here only do the arithmetic, and raise flags in the status that they are given. Deciding whether the
+// control word allows the host path is up to the caller. tools/fpu-host-compare.c checks them against softfloat.
+
+#include "softfloat/softfloat.h"
+#include <math.h>
+#include <stdint.h>
+
+// Nonzero operands and results must lie within 2^-FPU_HOST_EXP_LIMIT .. 2^FPU_HOST_EXP_LIMIT. This keeps the rounding
+// error of each operation representable, so that it can be computed exactly.
+#define FPU_HOST_EXP_LIMIT 960
+
+// Magnitudes below which FIST can round with the host for each destination size. Anything that might not fit is left to
+// softfloat, which knows how to raise invalid for it.
+#define FPU_HOST_INT16_LIMIT (0x1p15 - 1)
+#define FPU_HOST_INT32_LIMIT (0x1p31 - 1)
+#define FPU_HOST_INT64_LIMIT 0x1p62
+
+enum {
+    FPU_HOST_ADD,
+    FPU_HOST_SUB,
+    FPU_HOST_MUL,
+    FPU_HOST_DIV
+};
+
+union fpu_host_double {
+    double d;
+    uint64_t i;
+};
+
+// Converts "a" to a double if it is a zero or a normal number with no more than 53 significant bits in range
+static inline int fpu_to_host(floatx80 a, double* result)
+{
+    union fpu_host_double x;
+    int exponent = (a.exp & 0x7FFF) - 0x3FFF;
+    if ((a.exp & 0x7FFF) == 0) {
+        if (a.fraction)
+            return 0;
+        x.i = (uint64_t)(a.exp & 0x8000) << 48;
+    } else {
+        if (!(a.fraction >> 63) || (a.fraction & 0x7FF) || exponent < -FPU_HOST_EXP_LIMIT || exponent >= FPU_HOST_EXP_LIMIT)
+            return 0;
+        x.i = (uint64_t)(a.exp & 0x8000) << 48 | (uint64_t)(exponent + 1023) << 52 | (a.fraction << 1 >> 12);
+    }
+    *result = x.d;
+    return 1;
+}
+
+static inline floatx80 fpu_from_host(double d)
+{
+    union fpu_host_double x;
+    floatx80 result;
+    x.d = d;
+    int exponent = x.i >> 52 & 0x7FF;
+    result.exp = (x.i >> 48 & 0x8000) | (exponent ? exponent - 1023 + 0x3FFF : 0);
+    result.fraction = exponent ? 0x8000000000000000ULL | x.i << 11 : 0;
+    return result;
+}
+
+static inline int fpu_host_in_range(double d)
+{
+    d = fabs(d);
+    return d >= 0x1p-960 && d < 0x1p960;
+}
+
+// Raises the flags for a result whose exact value was "result" + "error"
+static inline void fpu_host_round(double result, double error, float_status_t* status)
+{
+    if (error != 0) {
+        float_raise(status, float_flag_inexact);
+        if (!signbit(error) != !signbit(result))
+            set_float_rounding_up(status);
+    }
+}
+
+// Tries to do a basic arithmetic operation with host doubles. Returns 0 if softfloat has to do it instead.
+static inline int fpu_host_binary(int op, floatx80 a, floatx80 b, floatx80* result, float_status_t* status)
+{
+    double x, y, z, error;
+    if (!fpu_to_host(a, &x) || !fpu_to_host(b, &y))
+        return 0;
+    switch (op) {
+    case FPU_HOST_SUB:
+        y = -y;
+    // fallthrough
+    case FPU_HOST_ADD: {
+        z = x + y;
+        if (z != 0 && !fpu_host_in_range(z))
+            return 0;
+        // Knuth's two-sum gives the exact rounding error of the addition
+        double t = z - x;
+        error = (x - (z - t)) + (y - t);
+        break;
+    }
+    case FPU_HOST_MUL:
+        z = x * y;
+        if (x != 0 && y != 0 && !fpu_host_in_range(z))
+            return 0;
+        error = fma(x, y, -z);
+        break;
+    case FPU_HOST_DIV:
+        if (y == 0)
+            return 0;
+        z = x / y;
+        if (x != 0 && !fpu_host_in_range(z))
+            return 0;
+        // The remainder is exact, and the quotient was rounded towards zero if it has the same sign as the divisor
+        error = fma(-z, y, x);
+        if (signbit(y))
+            error = -error;
+        break;
+    default:
+        return 0;
+    }
+    fpu_host_round(z, error, status);
+    *result = fpu_from_host(z);
+    return 1;
+}
+
+// The same for FSQRT
+static inline int fpu_host_sqrt(floatx80 a, floatx80* result, float_status_t* status)
+{
+    double x;
+    // Square roots of negative numbers are invalid, except for -0
+    if (!fpu_to_host(a, &x) || x < 0)
+        return 0;
+    double z = sqrt(x);
+    fpu_host_round(z, fma(-z, z, x), status);
+    *result = fpu_from_host(z);
+    return 1;
+}
+
+// Rounds "a" to an integer for FIST if it is a double whose magnitude is below "limit", one of the FPU_HOST_INT*_LIMITs.
+// Returns 0 if softfloat has to do it instead, which includes every value that does not fit the destination.
+static inline int fpu_host_to_int(floatx80 a, double limit, int64_t* result, float_status_t* status)
+{
+    double x;
+    if (!fpu_to_host(a, &x) || !(fabs(x) < limit))
+        return 0;
+    // Both rint(x) and x - rint(x) are exact
+    double z = rint(x);
+    fpu_host_round(z, x - z, status);
+    *result = (int64_t)z;
+    return 1;
+}
+
+#endif
@@ -43,6 +43,22 @@ typedef __insn_t* (*insn_handler_t)(__insn_t*);
 #define I_SET_OP(i, j) i |= (j) << I_OP_SHIFT
 #define I_SET_SEG_BASE(i, j) i |= (j) << I_SEG_SHIFT
 
+// Fused ALU + Jcc instructions. R/M, REG and the total length are in their usual places, I_OP3 holds the condition code,
+// imm32 holds the branch displacement, and disp32 holds the trace link. Only register forms are fused, so the effective
+// address fields are free to hold the rest.
+#define I_FUSED_LENGTH1_SHIFT 4 // Length of the ALU instruction alone
+#define I_FUSED_IMM8_SHIFT 16 // Sign-extended 8-bit immediate, if any
+#define I_FUSED_JCC16 (1 << 29) // Branch target wraps at 64K
+
+#define I_FUSED_LENGTH1(i) (i >> I_FUSED_LENGTH1_SHIFT & 15)
+#define I_FUSED_IMM8(i) (uint32_t)(int8_t)(i >> I_FUSED_IMM8_SHIFT)
+
+// Register-form handlers whose flags are dead ("_nf" handlers) keep the number of instructions until the flags are
+// overwritten in the otherwise unused index/scale fields
+#define I_NF_WINDOW_SHIFT 16
+#define I_NF_WINDOW_MAX 31
+#define I_NF_WINDOW(i) (i >> I_NF_WINDOW_SHIFT & I_NF_WINDOW_MAX)
+
 // Represents one decoded CPU instruction. Takes up 16 bytes on 32-bit, 20 bytes (padded out to 24 bytes) on 64-bit
 struct decoded_instruction {
     // Various flags holding x86 instruction operands like effective address, length, and source/dest
@@ -5,10 +5,31 @@
 
 #define OPTYPE struct decoded_instruction*
 OPTYPE op_trace_end(struct decoded_instruction* i);
+OPTYPE op_trace_resync(struct decoded_instruction* i);
 OPTYPE op_ud_exception(struct decoded_instruction* i);
 OPTYPE op_fatal_error(struct decoded_instruction* i);
 OPTYPE op_nop(struct decoded_instruction* i);
 
+// Fused ALU + Jcc
+OPTYPE op_fused_cmp_r16r16(struct decoded_instruction* i);
+OPTYPE op_fused_cmp_r32r32(struct decoded_instruction* i);
+OPTYPE op_fused_cmp_r16i8(struct decoded_instruction* i);
+OPTYPE op_fused_cmp_r32i8(struct decoded_instruction* i);
+OPTYPE op_fused_test_r16r16(struct decoded_instruction* i);
+OPTYPE op_fused_test_r32r32(struct decoded_instruction* i);
+OPTYPE op_fused_add_r16r16(struct decoded_instruction* i);
+OPTYPE op_fused_add_r32r32(struct decoded_instruction* i);
+OPTYPE op_fused_add_r16i8(struct decoded_instruction* i);
+OPTYPE op_fused_add_r32i8(struct decoded_instruction* i);
+OPTYPE op_fused_sub_r16r16(struct decoded_instruction* i);
+OPTYPE op_fused_sub_r32r32(struct decoded_instruction* i);
+OPTYPE op_fused_sub_r16i8(struct decoded_instruction* i);
+OPTYPE op_fused_sub_r32i8(struct decoded_instruction* i);
+OPTYPE op_fused_inc_r16(struct decoded_instruction* i);
+OPTYPE op_fused_inc_r32(struct decoded_instruction* i);
+OPTYPE op_fused_dec_r16(struct decoded_instruction* i);
+OPTYPE op_fused_dec_r32(struct decoded_instruction* i);
+
 // Data transfer
 OPTYPE op_mov_r32i32(struct decoded_instruction* i);
 
@@ -163,6 +184,7 @@ OPTYPE op_jmp_r32(struct decoded_instruction* i);
 OPTYPE op_jmp_e16(struct decoded_instruction* i);
 OPTYPE op_jmp_e32(struct decoded_instruction* i);
 OPTYPE op_jmp_rel32(struct decoded_instruction* i);
+OPTYPE op_jmp_rel32_follow(struct decoded_instruction* i);
 OPTYPE op_jmp_rel16(struct decoded_instruction* i);
 OPTYPE op_callf16_ap(struct decoded_instruction* i);
 OPTYPE op_callf32_ap(struct decoded_instruction* i);
@@ -215,6 +237,7 @@ OPTYPE op_jnle32(struct decoded_instruction* i);
 
 OPTYPE op_call_j16(struct decoded_instruction* i);
 OPTYPE op_call_j32(struct decoded_instruction* i);
+OPTYPE op_call_j32_follow(struct decoded_instruction* i);
 OPTYPE op_call_r16(struct decoded_instruction* i);
 OPTYPE op_call_r32(struct decoded_instruction* i);
 OPTYPE op_call_e16(struct decoded_instruction* i);
@@ -244,6 +267,85 @@ OPTYPE op_in_dxal(struct decoded_instruction* i);
 OPTYPE op_in_dxax(struct decoded_instruction* i);
 OPTYPE op_in_dxeax(struct decoded_instruction* i);
 
+// Same as above, but without computing flags (see decode_flags in decoder.c)
+OPTYPE op_arith_r8r8_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r8i8_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r16r16_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r16i16_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r32r32_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r32i32_nf(struct decoded_instruction* i);
+OPTYPE op_cmp_r8r8_nf(struct decoded_instruction* i);
+OPTYPE op_cmp_r8i8_nf(struct decoded_instruction* i);
+OPTYPE op_cmp_r16r16_nf(struct decoded_instruction* i);
+OPTYPE op_cmp_r16i16_nf(struct decoded_instruction* i);
+OPTYPE op_cmp_r32r32_nf(struct decoded_instruction* i);
+OPTYPE op_cmp_r32i32_nf(struct decoded_instruction* i);
+OPTYPE op_test_r8r8_nf(struct decoded_instruction* i);
+OPTYPE op_test_r8i8_nf(struct decoded_instruction* i);
+OPTYPE op_test_r16r16_nf(struct decoded_instruction* i);
+OPTYPE op_test_r16i16_nf(struct decoded_instruction* i);
+OPTYPE op_test_r32r32_nf(struct decoded_instruction* i);
+OPTYPE op_test_r32i32_nf(struct decoded_instruction* i);
+OPTYPE op_inc_r8_nf(struct decoded_instruction* i);
+OPTYPE op_inc_r16_nf(struct decoded_instruction* i);
+OPTYPE op_inc_r32_nf(struct decoded_instruction* i);
+OPTYPE op_dec_r8_nf(struct decoded_instruction* i);
+OPTYPE op_dec_r16_nf(struct decoded_instruction* i);
+OPTYPE op_dec_r32_nf(struct decoded_instruction* i);
+
+// Memory forms for code running while CS, DS, ES, and SS all have a base of zero (see decode_flat in decoder.c)
+OPTYPE op_mov_r8e8_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e8r8_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e8i8_flat(struct decoded_instruction* i);
+OPTYPE op_mov_r16e16_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e16r16_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e16i16_flat(struct decoded_instruction* i);
+OPTYPE op_mov_r32e32_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e32r32_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e32i32_flat(struct decoded_instruction* i);
+OPTYPE op_arith_r8e8_flat(struct decoded_instruction* i);
+OPTYPE op_arith_e8r8_flat(struct decoded_instruction* i);
+OPTYPE op_arith_e8i8_flat(struct decoded_instruction* i);
+OPTYPE op_arith_r16e16_flat(struct decoded_instruction* i);
+OPTYPE op_arith_e16r16_flat(struct decoded_instruction* i);
+OPTYPE op_arith_e16i16_flat(struct decoded_instruction* i);
+OPTYPE op_arith_r32e32_flat(struct decoded_instruction* i);
+OPTYPE op_arith_e32r32_flat(struct decoded_instruction* i);
+OPTYPE op_arith_e32i32_flat(struct decoded_instruction* i);
+OPTYPE op_cmp_e8r8_flat(struct decoded_instruction* i);
+OPTYPE op_cmp_r8e8_flat(struct decoded_instruction* i);
+OPTYPE op_cmp_e8i8_flat(struct decoded_instruction* i);
+OPTYPE op_cmp_e32r32_flat(struct decoded_instruction* i);
+OPTYPE op_cmp_r32e32_flat(struct decoded_instruction* i);
+OPTYPE op_cmp_e32i32_flat(struct decoded_instruction* i);
+OPTYPE op_movzx_r32e8_flat(struct decoded_instruction* i);
+OPTYPE op_movzx_r32e16_flat(struct decoded_instruction* i);
+OPTYPE op_movsx_r32e8_flat(struct decoded_instruction* i);
+OPTYPE op_movsx_r32e16_flat(struct decoded_instruction* i);
+OPTYPE op_push_e32_flat(struct decoded_instruction* i);
+
+// Memory forms specialised by addressing form, with and without the segment base (see decode_addr_forms in decoder.c)
+#define DECLARE_FORMS(name)                                      \
+    OPTYPE name##_disp(struct decoded_instruction* i);           \
+    OPTYPE name##_base(struct decoded_instruction* i);           \
+    OPTYPE name##_base_disp(struct decoded_instruction* i);      \
+    OPTYPE name##_disp_flat(struct decoded_instruction* i);      \
+    OPTYPE name##_base_flat(struct decoded_instruction* i);      \
+    OPTYPE name##_base_disp_flat(struct decoded_instruction* i);
+DECLARE_FORMS(op_mov_r8e8)
+DECLARE_FORMS(op_mov_e8r8)
+DECLARE_FORMS(op_mov_r16e16)
+DECLARE_FORMS(op_mov_e16r16)
+DECLARE_FORMS(op_mov_r32e32)
+DECLARE_FORMS(op_mov_e32r32)
+DECLARE_FORMS(op_mov_e32i32)
+DECLARE_FORMS(op_arith_r32e32)
+DECLARE_FORMS(op_arith_e32r32)
+DECLARE_FORMS(op_arith_e32i32)
+DECLARE_FORMS(op_cmp_r32e32)
+DECLARE_FORMS(op_cmp_e32r32)
+DECLARE_FORMS(op_cmp_e32i32)
+
 // Data transfer
 OPTYPE op_mov_r8i8(struct decoded_instruction* i);
 OPTYPE op_mov_r16i16(struct decoded_instruction* i);
@@ -0,0 +1,272 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+// Thin 128-bit vector layer for the packed instructions in ops/simd.c. Plain arithmetic, compares and shifts are
+// written with GCC vector extensions, which the compiler already lowers to NEON or SSE2. Everything that has no generic
+// spelling (saturation, packing, interleaving, high multiplies) is mapped to NEON on ARM, SSE2 on x86 and a lane-by-lane
+// loop everywhere else. Define VECTOR_PORTABLE to force the loops, for instance to compare them against the intrinsics.
+//
+// MMX operands live in the low 8 bytes of a vector. The upper half is zero after vec_load and is never stored back.
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) && !defined(VECTOR_PORTABLE)
+#define VECTOR_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__) && !defined(VECTOR_PORTABLE)
+#define VECTOR_SSE2
+#include <emmintrin.h>
+#endif
+
+typedef uint8_t vec_u8 __attribute__((vector_size(16)));
+typedef int8_t vec_i8 __attribute__((vector_size(16)));
+typedef uint16_t vec_u16 __attribute__((vector_size(16)));
+typedef int16_t vec_i16 __attribute__((vector_size(16)));
+typedef uint32_t vec_u32 __attribute__((vector_size(16)));
+typedef int32_t vec_i32 __attribute__((vector_size(16)));
+typedef uint64_t vec_u64 __attribute__((vector_size(16)));
+typedef int64_t vec_i64 __attribute__((vector_size(16)));
+typedef float vec_f32 __attribute__((vector_size(16)));
+typedef double vec_f64 __attribute__((vector_size(16)));
+
+// Loads and stores are unaligned, and "bytes" is 16 (SSE), 8 (MMX, scalar double) or 4 (scalar single). Each size is
+// spelled out so that it becomes a single load or store once the caller is inlined.
+static inline vec_u8 vec_load(const void* ptr, int bytes)
+{
+    vec_u8 v = { 0 };
+    if (bytes == 16)
+        memcpy(&v, ptr, 16);
+    else if (bytes == 8)
+        memcpy(&v, ptr, 8);
+    else
+        memcpy(&v, ptr, 4);
+    return v;
+}
+static inline void vec_store(void* ptr, vec_u8 v, int bytes)
+{
+    if (bytes == 16)
+        memcpy(ptr, &v, 16);
+    else if (bytes == 8)
+        memcpy(ptr, &v, 8);
+    else
+        memcpy(ptr, &v, 4);
+}
+
+// Nonzero if every lane in the first "bytes" bytes of a compare result is set
+static inline int vec_all(vec_u8 mask, int bytes)
+{
+    uint64_t m[2] = { ~0ULL, ~0ULL };
+    if (bytes == 16)
+        memcpy(m, &mask, 16);
+    else if (bytes == 8)
+        memcpy(m, &mask, 8);
+    else
+        memcpy(m, &mask, 4);
+    return (m[0] & m[1]) == ~0ULL;
+}
+
+#if defined(VECTOR_NEON)
+
+static inline vec_u8 vec_adds_i8(vec_u8 a, vec_u8 b) { return (vec_u8)vqaddq_s8((int8x16_t)a, (int8x16_t)b); }
+static inline vec_u8 vec_adds_u8(vec_u8 a, vec_u8 b) { return (vec_u8)vqaddq_u8((uint8x16_t)a, (uint8x16_t)b); }
+static inline vec_u8 vec_adds_i16(vec_u8 a, vec_u8 b) { return (vec_u8)vqaddq_s16((int16x8_t)a, (int16x8_t)b); }
+static inline vec_u8 vec_adds_u16(vec_u8 a, vec_u8 b) { return (vec_u8)vqaddq_u16((uint16x8_t)a, (uint16x8_t)b); }
+static inline vec_u8 vec_subs_i8(vec_u8 a, vec_u8 b) { return (vec_u8)vqsubq_s8((int8x16_t)a, (int8x16_t)b); }
+static inline vec_u8 vec_subs_u8(vec_u8 a, vec_u8 b) { return (vec_u8)vqsubq_u8((uint8x16_t)a, (uint8x16_t)b); }
+static inline vec_u8 vec_subs_i16(vec_u8 a, vec_u8 b) { return (vec_u8)vqsubq_s16((int16x8_t)a, (int16x8_t)b); }
+static inline vec_u8 vec_subs_u16(vec_u8 a, vec_u8 b) { return (vec_u8)vqsubq_u16((uint16x8_t)a, (uint16x8_t)b); }
+
+static inline vec_u8 vec_min_u8(vec_u8 a, vec_u8 b) { return (vec_u8)vminq_u8((uint8x16_t)a, (uint8x16_t)b); }
+static inline vec_u8 vec_max_u8(vec_u8 a, vec_u8 b) { return (vec_u8)vmaxq_u8((uint8x16_t)a, (uint8x16_t)b); }
+static inline vec_u8 vec_min_i16(vec_u8 a, vec_u8 b) { return (vec_u8)vminq_s16((int16x8_t)a, (int16x8_t)b); }
+static inline vec_u8 vec_max_i16(vec_u8 a, vec_u8 b) { return (vec_u8)vmaxq_s16((int16x8_t)a, (int16x8_t)b); }
+
+// Narrow with saturation: the lanes of "a" end up in the low half of the result, the lanes of "b" in the high half
+static inline vec_u8 vec_packs_i16(vec_u8 a, vec_u8 b)
+{
+    return (vec_u8)vcombine_s8(vqmovn_s16((int16x8_t)a), vqmovn_s16((int16x8_t)b));
+}
+static inline vec_u8 vec_packus_i16(vec_u8 a, vec_u8 b)
+{
+    return (vec_u8)vcombine_u8(vqmovun_s16((int16x8_t)a), vqmovun_s16((int16x8_t)b));
+}
+static inline vec_u8 vec_packs_i32(vec_u8 a, vec_u8 b)
+{
+    return (vec_u8)vcombine_s16(vqmovn_s32((int32x4_t)a), vqmovn_s32((int32x4_t)b));
+}
+
+// Interleave the low ("lo") or high ("hi") halves of a and b, "size" bytes at a time, starting with a
+static inline vec_u8 vec_unpacklo(vec_u8 a, vec_u8 b, int size)
+{
+    switch (size) {
+    case 1:
+        return (vec_u8)vzipq_u8((uint8x16_t)a, (uint8x16_t)b).val[0];
+    case 2:
+        return (vec_u8)vzipq_u16((uint16x8_t)a, (uint16x8_t)b).val[0];
+    case 4:
+        return (vec_u8)vzipq_u32((uint32x4_t)a, (uint32x4_t)b).val[0];
+    default:
+        return (vec_u8)vcombine_u64(vget_low_u64((uint64x2_t)a), vget_low_u64((uint64x2_t)b));
+    }
+}
+static inline vec_u8 vec_unpackhi(vec_u8 a, vec_u8 b, int size)
+{
+    switch (size) {
+    case 1:
+        return (vec_u8)vzipq_u8((uint8x16_t)a, (uint8x16_t)b).val[1];
+    case 2:
+        return (vec_u8)vzipq_u16((uint16x8_t)a, (uint16x8_t)b).val[1];
+    case 4:
+        return (vec_u8)vzipq_u32((uint32x4_t)a, (uint32x4_t)b).val[1];
+    default:
+        return (vec_u8)vcombine_u64(vget_high_u64((uint64x2_t)a), vget_high_u64((uint64x2_t)b));
+    }
+}
+
+// Upper 16 bits of each 16x16-bit product
+static inline vec_u8 vec_mulhi_i16(vec_u8 a, vec_u8 b)
+{
+    int16x8_t x = (int16x8_t)a, y = (int16x8_t)b;
+    int32x4_t lo = vmull_s16(vget_low_s16(x), vget_low_s16(y)), hi = vmull_s16(vget_high_s16(x), vget_high_s16(y));
+    return (vec_u8)vcombine_s16(vshrn_n_s32(lo, 16), vshrn_n_s32(hi, 16));
+}
+static inline vec_u8 vec_mulhi_u16(vec_u8 a, vec_u8 b)
+{
+    uint16x8_t x = (uint16x8_t)a, y = (uint16x8_t)b;
+    uint32x4_t lo = vmull_u16(vget_low_u16(x), vget_low_u16(y)), hi = vmull_u16(vget_high_u16(x), vget_high_u16(y));
+    return (vec_u8)vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16));
+}
+
+#elif defined(VECTOR_SSE2)
+
+static inline vec_u8 vec_adds_i8(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_adds_epi8((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_adds_u8(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_adds_epu8((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_adds_i16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_adds_epi16((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_adds_u16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_adds_epu16((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_subs_i8(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_subs_epi8((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_subs_u8(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_subs_epu8((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_subs_i16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_subs_epi16((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_subs_u16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_subs_epu16((__m128i)a, (__m128i)b); }
+
+static inline vec_u8 vec_min_u8(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_min_epu8((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_max_u8(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_max_epu8((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_min_i16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_min_epi16((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_max_i16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_max_epi16((__m128i)a, (__m128i)b); }
+
+static inline vec_u8 vec_packs_i16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_packs_epi16((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_packus_i16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_packus_epi16((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_packs_i32(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_packs_epi32((__m128i)a, (__m128i)b); }
+
+static inline vec_u8 vec_unpacklo(vec_u8 a, vec_u8 b, int size)
+{
+    switch (size) {
+    case 1:
+        return (vec_u8)_mm_unpacklo_epi8((__m128i)a, (__m128i)b);
+    case 2:
+        return (vec_u8)_mm_unpacklo_epi16((__m128i)a, (__m128i)b);
+    case 4:
+        return (vec_u8)_mm_unpacklo_epi32((__m128i)a, (__m128i)b);
+    default:
+        return (vec_u8)_mm_unpacklo_epi64((__m128i)a, (__m128i)b);
+    }
+}
+static inline vec_u8 vec_unpackhi(vec_u8 a, vec_u8 b, int size)
+{
+    switch (size) {
+    case 1:
+        return (vec_u8)_mm_unpackhi_epi8((__m128i)a, (__m128i)b);
+    case 2:
+        return (vec_u8)_mm_unpackhi_epi16((__m128i)a, (__m128i)b);
+    case 4:
+        return (vec_u8)_mm_unpackhi_epi32((__m128i)a, (__m128i)b);
+    default:
+        return (vec_u8)_mm_unpackhi_epi64((__m128i)a, (__m128i)b);
+    }
+}
+
+static inline vec_u8 vec_mulhi_i16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_mulhi_epi16((__m128i)a, (__m128i)b); }
+static inline vec_u8 vec_mulhi_u16(vec_u8 a, vec_u8 b) { return (vec_u8)_mm_mulhi_epu16((__m128i)a, (__m128i)b); }
+
+#else
+
+static inline int vec_clamp(int x, int min, int max)
+{
+    return x < min ? min : x > max ? max : x;
+}
+
+// Applies "expr" to every lane of a and b, seen as vectors of "type"
+#define VEC_LANES(type, a, b, expr)                                              \
+    do {                                                                         \
+        type x = (type)a, y = (type)b, r;                                        \
+        for (unsigned int i = 0; i < sizeof(type) / sizeof(x[0]); i++)           \
+            r[i] = expr;                                                         \
+        return (vec_u8)r;                                                        \
+    } while (0)
+
+static inline vec_u8 vec_adds_i8(vec_u8 a, vec_u8 b) { VEC_LANES(vec_i8, a, b, vec_clamp(x[i] + y[i], -128, 127)); }
+static inline vec_u8 vec_adds_u8(vec_u8 a, vec_u8 b) { VEC_LANES(vec_u8, a, b, vec_clamp(x[i] + y[i], 0, 255)); }
+static inline vec_u8 vec_adds_i16(vec_u8 a, vec_u8 b) { VEC_LANES(vec_i16, a, b, vec_clamp(x[i] + y[i], -32768, 32767)); }
+static inline vec_u8 vec_adds_u16(vec_u8 a, vec_u8 b) { VEC_LANES(vec_u16, a, b, vec_clamp(x[i] + y[i], 0, 65535)); }
+static inline vec_u8 vec_subs_i8(vec_u8 a, vec_u8 b) { VEC_LANES(vec_i8, a, b, vec_clamp(x[i] - y[i], -128, 127)); }
+static inline vec_u8 vec_subs_u8(vec_u8 a, vec_u8 b) { VEC_LANES(vec_u8, a, b, vec_clamp(x[i] - y[i], 0, 255)); }
+static inline vec_u8 vec_subs_i16(vec_u8 a, vec_u8 b) { VEC_LANES(vec_i16, a, b, vec_clamp(x[i] - y[i], -32768, 32767)); }
+static inline vec_u8 vec_subs_u16(vec_u8 a, vec_u8 b) { VEC_LANES(vec_u16, a, b, vec_clamp(x[i] - y[i], 0, 65535)); }
+
+static inline vec_u8 vec_min_u8(vec_u8 a, vec_u8 b) { VEC_LANES(vec_u8, a, b, x[i] < y[i] ? x[i] : y[i]); }
+static inline vec_u8 vec_max_u8(vec_u8 a, vec_u8 b) { VEC_LANES(vec_u8, a, b, x[i] > y[i] ? x[i] : y[i]); }
+static inline vec_u8 vec_min_i16(vec_u8 a, vec_u8 b) { VEC_LANES(vec_i16, a, b, x[i] < y[i] ? x[i] : y[i]); }
+static inline vec_u8 vec_max_i16(vec_u8 a, vec_u8 b) { VEC_LANES(vec_i16, a, b, x[i] > y[i] ? x[i] : y[i]); }
+
+static inline vec_u8 vec_mulhi_i16(vec_u8 a, vec_u8 b) { VEC_LANES(vec_i16, a, b, (x[i] * y[i]) >> 16); }
+static inline vec_u8 vec_mulhi_u16(vec_u8 a, vec_u8 b) { VEC_LANES(vec_u16, a, b, ((uint32_t)x[i] * y[i]) >> 16); }
+
+static inline vec_u8 vec_packs_i16(vec_u8 a, vec_u8 b)
+{
+    vec_i16 x = (vec_i16)a, y = (vec_i16)b;
+    vec_i8 r;
+    for (int i = 0; i < 8; i++) {
+        r[i] = vec_clamp(x[i], -128, 127);
+        r[i + 8] = vec_clamp(y[i], -128, 127);
+    }
+    return (vec_u8)r;
+}
+static inline vec_u8 vec_packus_i16(vec_u8 a, vec_u8 b)
+{
+    vec_i16 x = (vec_i16)a, y = (vec_i16)b;
+    vec_u8 r;
+    for (int i = 0; i < 8; i++) {
+        r[i] = vec_clamp(x[i], 0, 255);
+        r[i + 8] = vec_clamp(y[i], 0, 255);
+    }
+    return r;
+}
+static inline vec_u8 vec_packs_i32(vec_u8 a, vec_u8 b)
+{
+    vec_i32 x = (vec_i32)a, y = (vec_i32)b;
+    vec_i16 r;
+    for (int i = 0; i < 4; i++) {
+        r[i] = x[i] < -32768 ? -32768 : x[i] > 32767 ? 32767 : x[i];
+        r[i + 4] = y[i] < -32768 ? -32768 : y[i] > 32767 ? 32767 : y[i];
+    }
+    return (vec_u8)r;
+}
+
+static inline vec_u8 vec_interleave(vec_u8 a, vec_u8 b, int size, int offset)
+{
+    vec_u8 r;
+    for (int i = 0; i < 16; i += size * 2) {
+        for (int j = 0; j < size; j++) {
+            r[i + j] = a[offset + (i >> 1) + j];
+            r[i + size + j] = b[offset + (i >> 1) + j];
+        }
+    }
+    return r;
+}
+static inline vec_u8 vec_unpacklo(vec_u8 a, vec_u8 b, int size) { return vec_interleave(a, b, size, 0); }
+static inline vec_u8 vec_unpackhi(vec_u8 a, vec_u8 b, int size) { return vec_interleave(a, b, size, 8); }
+
+#undef VEC_LANES
+#endif
+
+#endif
@@ -21,6 +21,12 @@ struct cpuid_level_info
     int level;
 };
 
+// How the x87 transcendental instructions (FSIN, FPATAN, FYL2X, ...) are computed
+enum {
+    FPU_ACCURACY_EXACT, // Softfloat, bit-exact with earlier versions
+    FPU_ACCURACY_FAST // Host libm in double precision. See fpu.c for the error bounds.
+};
+
 struct cpu_config
 {
     char *vendor_name;
@@ -28,6 +34,15 @@ struct cpu_config
 
     int cpuid_limit_winnt;
 
+    // Number of bytes of host memory to give to the trace cache. Zero picks a size based on guest memory.
+    uint32_t trace_cache_size;
+
+    // Longest trace to decode, in instructions. Zero picks the default.
+    int trace_length;
+
+    // One of FPU_ACCURACY_*
+    int fpu_accuracy;
+
     struct cpuid_level_info features[FEATURE_SIZE_MAX];
 };
 
@@ -69,6 +84,9 @@ int cpu_interrupt_pending(void);
 
 // Run "cycles" instructions. Returns number of cycles actually executed
 int cpu_run(int cycles);
+// Decode the traces that the CPU is likely to need next. Meant to be called in a loop on a core that doesn't run the CPU.
+// Returns the number of traces it was asked for since the last call.
+int cpu_decode_ahead(void);
 // Get reason why CPU broke out of main loop. Reason is reset every loop.
 int cpu_get_exit_reason(void);
 void cpu_halt(void);
@@ -90,6 +108,59 @@ int cpu_interrupts_masked(void);
 // Debug API
 void cpu_debug(void);
 
+// Performance counters maintained by the CPU core
+#define CPU_STATS_TRACE_LENGTHS 8
+struct cpu_stats {
+    // Trace cache lookups that found a trace, lookups that had to decode, decodes that displaced a live trace,
+    // and traces dropped because their segment of the trace cache was recycled
+    uint64_t trace_hits, trace_misses, trace_conflicts, trace_evictions;
+    // Branches and fall-throughs that went straight to the next trace through a direct link, skipping the lookup
+    uint64_t trace_chained;
+    // Indirect jumps and calls that found their target in the site's link, and ones that had to look it up
+    uint64_t indirect_hits, indirect_misses;
+    // RETs that found the trace they return to on the return stack, and ones that had to look it up
+    uint64_t return_stack_hits, return_stack_misses;
+    // Traces entered with all of their instructions charged to the time slice at once
+    uint64_t trace_batched;
+    // Traces decoded, by number of decoded instructions: 1, 2-3, 4-7, and so on up to 128
+    uint64_t trace_length[CPU_STATS_TRACE_LENGTHS];
+    // Traces that carried on through a direct jump or call to elsewhere on their page, and the jumps they followed
+    uint64_t superblocks, superblock_jumps;
+    // Traces charged up front that were left before their last instruction, by a taken branch or an exception
+    uint64_t trace_side_exits;
+    // Conditional branches decoded, and how many of them were fused with the instruction before them
+    uint64_t decoded_jcc, fused_pairs;
+    // Traces copied from the decode memo instead of being decoded, and ones that had to be decoded
+    uint64_t decode_memo_hits, decode_memo_misses;
+    // Traces asked of the background decoder, ones taken from it, and ones it decoded from code that has since changed
+    uint64_t decode_ahead_requests, decode_ahead_hits, decode_ahead_stale;
+    // Instructions given a handler that skips computing flags, because they were overwritten before being read
+    uint64_t dead_flags;
+    // Memory instructions given a handler that skips the segment base, because they were decoded with flat segments
+    uint64_t flat_handlers;
+    // Memory operands of the handlers specialised by addressing form, by form: [disp], [base], [base+disp], and ones with
+    // an index register, which keep the general handler. cpu_debug prints the same counts for each handler.
+    uint64_t addr_form_disp, addr_form_base, addr_form_base_disp, addr_form_index;
+    // CR3 writes that found the new address space's translations still in the TLB, and ones that had to start over
+    uint64_t tlb_context_hits, tlb_context_misses;
+    // TLB misses whose page directory entry was found in the page walk cache, and ones that had to read it from memory
+    uint64_t page_walk_hits, page_walk_misses;
+    // Segment descriptor loads that were found in the descriptor cache, and ones that had to read the GDT or LDT
+    uint64_t seg_desc_cache_hits, seg_desc_cache_misses;
+    // Writes and DMA transfers that invalidated code, the traces they dropped, and the host time spent doing it (in us,
+    // estimated from one invalidation in 64)
+    uint64_t smc_invalidations, smc_traces_invalidated, smc_invalidate_usec;
+    // Pages switched to single-instruction traces because their code kept being overwritten, and pages switched back
+    uint64_t smc_hot_pages, smc_cooled_pages;
+    // x87 operations done with host doubles, and ones that had to go to softfloat while the control word allowed it
+    uint64_t fpu_host_ops, fpu_host_fallbacks;
+    // x87 transcendental instructions executed, by instruction
+    uint64_t fpu_fsin, fpu_fcos, fpu_fsincos, fpu_fptan, fpu_fpatan, fpu_fyl2x, fpu_fyl2xp1, fpu_f2xm1;
+    // SSE float instructions done with host floats, and ones that had to go to softfloat while MXCSR allowed it
+    uint64_t sse_host_ops, sse_host_fallbacks;
+};
+struct cpu_stats* cpu_get_stats(void);
+
 // mmu.c
 uint32_t cpu_read_phys(uint32_t addr);
 
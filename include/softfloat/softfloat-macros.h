@@ -190,6 +190,12 @@ BX_CPP_INLINE void
 
 BX_CPP_INLINE void mul64To128(uint64_t a, uint64_t b, uint64_t *z0Ptr, uint64_t *z1Ptr)
 {
+#ifdef __SIZEOF_INT128__
+    // A single widening multiply (UMULH + MUL on AArch64, MUL on x86-64)
+    unsigned __int128 z = (unsigned __int128) a * b;
+    *z1Ptr = (uint64_t) z;
+    *z0Ptr = (uint64_t) (z >> 64);
+#else
     uint32_t aHigh, aLow, bHigh, bLow;
     uint64_t z0, zMiddleA, zMiddleB, z1;
 
@@ -208,6 +214,7 @@ BX_CPP_INLINE void mul64To128(uint64_t a, uint64_t b, uint64_t *z0Ptr, uint64_t
     z0 += (z1 < zMiddleA);
     *z1Ptr = z1;
     *z0Ptr = z0;
+#endif
 }
 
 /*----------------------------------------------------------------------------
@@ -242,6 +249,93 @@ static uint64_t estimateDiv128To64(uint64_t a0, uint64_t a1, uint64_t b)
 }
 #endif
 
+/*----------------------------------------------------------------------------
+| Returns the reciprocal of the normalized 64-bit divisor `d' (at least 2^63),
+| floor((2^128 - 1) / d) - 2^64.  The first 11 bits come from a table indexed
+| by the top 9 bits of `d', and three Newton-Raphson steps refine them to the
+| full 64 bits.  This is algorithm 2 of N. Moller and T. Granlund, "Improved
+| division by invariant integers", IEEE Trans. Computers 60 (2011).
+*----------------------------------------------------------------------------*/
+
+#ifdef USE_estimateDiv128To64
+static const uint16_t reciprocalTable[256] = {
+    0x7FD, 0x7F5, 0x7ED, 0x7E5, 0x7DD, 0x7D5, 0x7CE, 0x7C6,
+    0x7BF, 0x7B7, 0x7B0, 0x7A8, 0x7A1, 0x79A, 0x792, 0x78B,
+    0x784, 0x77D, 0x776, 0x76F, 0x768, 0x761, 0x75B, 0x754,
+    0x74D, 0x747, 0x740, 0x739, 0x733, 0x72C, 0x726, 0x720,
+    0x719, 0x713, 0x70D, 0x707, 0x700, 0x6FA, 0x6F4, 0x6EE,
+    0x6E8, 0x6E2, 0x6DC, 0x6D6, 0x6D1, 0x6CB, 0x6C5, 0x6BF,
+    0x6BA, 0x6B4, 0x6AE, 0x6A9, 0x6A3, 0x69E, 0x698, 0x693,
+    0x68D, 0x688, 0x683, 0x67D, 0x678, 0x673, 0x66E, 0x669,
+    0x664, 0x65E, 0x659, 0x654, 0x64F, 0x64A, 0x645, 0x640,
+    0x63C, 0x637, 0x632, 0x62D, 0x628, 0x624, 0x61F, 0x61A,
+    0x616, 0x611, 0x60C, 0x608, 0x603, 0x5FF, 0x5FA, 0x5F6,
+    0x5F1, 0x5ED, 0x5E9, 0x5E4, 0x5E0, 0x5DC, 0x5D7, 0x5D3,
+    0x5CF, 0x5CB, 0x5C6, 0x5C2, 0x5BE, 0x5BA, 0x5B6, 0x5B2,
+    0x5AE, 0x5AA, 0x5A6, 0x5A2, 0x59E, 0x59A, 0x596, 0x592,
+    0x58E, 0x58A, 0x586, 0x583, 0x57F, 0x57B, 0x577, 0x574,
+    0x570, 0x56C, 0x568, 0x565, 0x561, 0x55E, 0x55A, 0x556,
+    0x553, 0x54F, 0x54C, 0x548, 0x545, 0x541, 0x53E, 0x53A,
+    0x537, 0x534, 0x530, 0x52D, 0x52A, 0x526, 0x523, 0x520,
+    0x51C, 0x519, 0x516, 0x513, 0x50F, 0x50C, 0x509, 0x506,
+    0x503, 0x500, 0x4FC, 0x4F9, 0x4F6, 0x4F3, 0x4F0, 0x4ED,
+    0x4EA, 0x4E7, 0x4E4, 0x4E1, 0x4DE, 0x4DB, 0x4D8, 0x4D5,
+    0x4D2, 0x4CF, 0x4CC, 0x4CA, 0x4C7, 0x4C4, 0x4C1, 0x4BE,
+    0x4BB, 0x4B9, 0x4B6, 0x4B3, 0x4B0, 0x4AD, 0x4AB, 0x4A8,
+    0x4A5, 0x4A3, 0x4A0, 0x49D, 0x49B, 0x498, 0x495, 0x493,
+    0x490, 0x48D, 0x48B, 0x488, 0x486, 0x483, 0x481, 0x47E,
+    0x47C, 0x479, 0x477, 0x474, 0x472, 0x46F, 0x46D, 0x46A,
+    0x468, 0x465, 0x463, 0x461, 0x45E, 0x45C, 0x459, 0x457,
+    0x455, 0x452, 0x450, 0x44E, 0x44B, 0x449, 0x447, 0x444,
+    0x442, 0x440, 0x43E, 0x43B, 0x439, 0x437, 0x435, 0x432,
+    0x430, 0x42E, 0x42C, 0x42A, 0x428, 0x425, 0x423, 0x421,
+    0x41F, 0x41D, 0x41B, 0x419, 0x417, 0x414, 0x412, 0x410,
+    0x40E, 0x40C, 0x40A, 0x408, 0x406, 0x404, 0x402, 0x400,
+};
+
+BX_CPP_INLINE uint64_t reciprocal64(uint64_t d)
+{
+    uint64_t d0 = d & 1, d40 = (d>>24) + 1, d63 = (d>>1) + d0;
+    uint64_t v0 = reciprocalTable[(d>>55) - 256];
+    uint64_t v1 = (v0<<11) - ((v0*v0*d40)>>40) - 1;
+    uint64_t v2 = (v1<<13) + ((v1*((U64(1)<<60) - v1*d40))>>47);
+    uint64_t e = ((v2>>1) & (0 - d0)) - v2*d63, hi, lo;
+    mul64To128(v2, e, &hi, &lo);
+    uint64_t v3 = (v2<<31) + (hi>>1);
+    mul64To128(v3, d, &hi, &lo);
+    hi += (lo + d < lo);
+    return v3 - hi - d;
+}
+
+/*----------------------------------------------------------------------------
+| Returns the 64-bit integer quotient obtained by dividing `b' into the 128-bit
+| value formed by concatenating `a0' and `a1', truncated toward zero.  The
+| divisor `b' must be at least 2^63.  If the quotient is larger than 64 bits,
+| the maximum positive 64-bit unsigned integer is returned.  This is also a
+| valid result for `estimateDiv128To64', and replaces it wherever the final
+| result does not depend on where in the allowed range the estimate falls.  It
+| multiplies by the reciprocal of `b' instead of dividing (algorithm 4 of the
+| paper above).
+*----------------------------------------------------------------------------*/
+
+static uint64_t div128To64(uint64_t a0, uint64_t a1, uint64_t b)
+{
+    uint64_t q0, q1, r;
+
+    if (b <= a0) return U64(0xFFFFFFFFFFFFFFFF);
+    mul64To128(reciprocal64(b), a0, &q1, &q0);
+    add128(q1, q0, a0, a1, &q1, &q0);
+    ++q1;
+    r = a1 - q1*b;
+    if (r > q0) {
+        --q1;
+        r += b;
+    }
+    if (r >= b) ++q1;
+    return q1;
+}
+#endif
+
 /*----------------------------------------------------------------------------
 | Returns an approximation to the square root of the 32-bit significand given
 | by `a'.  Considered as an integer, `a' must be at least 2^31.  If bit 0 of
@@ -39,6 +39,8 @@ void afree(void* ptr);
 
 typedef uint64_t itick_t;
 itick_t get_now(void);
+// Host clock in microseconds, for profiling only. Wraps around, so only the difference between two readings is useful.
+uint32_t get_host_usec(void);
 extern uint32_t ticks_per_second;
 
 // Functions that mess around with timing
@@ -54,6 +54,7 @@ extern "C" {
     void mainloop_multi_core_zero();
     void mainloop_multi_core_one();
     void mainloop_multi_core_two();
+    void mainloop_multi_core_three();
 
 #ifdef __cplusplus
 }
@@ -831,9 +832,10 @@ void CStdlibAppMultiCore::Run(unsigned int nCore)
         // main loop with only debug writings, this should not return.
         mainloop_multi_core_two();
     }
-    else
+    else if (nCore == 3)
     {
-        // Core 3 has nothing to do right now.
+        // decodes traces ahead of the CPU on core 0, this should not return.
+        mainloop_multi_core_three();
     }
 }
 
@@ -7,9 +7,9 @@ int cpu_access_read8(uint32_t addr, uint32_t tag, int shift)
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     // Check for MMIO areas
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
@@ -25,7 +25,7 @@ int cpu_access_read16(uint32_t addr, uint32_t tag, int shift)
     if (addr & 1) {
         uint32_t res = 0;
         for (int i = 0, j = 0; i < 2; i++, j += 8) {
-            if (cpu_access_read8(addr + i, cpu.tlb_tags[(addr + i) >> 12] >> shift, shift))
+            if (cpu_access_read8(addr + i, TLB_TAGS(addr + i) >> shift, shift))
                 return 1;
             res |= cpu.read_result << j;
         }
@@ -36,9 +36,9 @@ int cpu_access_read16(uint32_t addr, uint32_t tag, int shift)
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
         cpu.read_result = io_handle_mmio_read(phys, 1);
@@ -52,7 +52,7 @@ int cpu_access_read32(uint32_t addr, uint32_t tag, int shift)
     if (addr & 3) {
         uint32_t res = 0;
         for (int i = 0, j = 0; i < 4; i++, j += 8) {
-            if (cpu_access_read8(addr + i, cpu.tlb_tags[(addr + i) >> 12] >> shift, shift))
+            if (cpu_access_read8(addr + i, TLB_TAGS(addr + i) >> shift, shift))
                 return 1;
             res |= cpu.read_result << j;
         }
@@ -63,9 +63,9 @@ int cpu_access_read32(uint32_t addr, uint32_t tag, int shift)
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
         cpu.read_result = io_handle_mmio_read(phys, 2);
@@ -80,9 +80,9 @@ int cpu_access_write8(uint32_t addr, uint32_t data, uint32_t tag, int shift)
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
 
     // Check for MMIO areas
@@ -92,6 +92,8 @@ int cpu_access_write8(uint32_t addr, uint32_t data, uint32_t tag, int shift)
     }
     if (cpu_smc_has_code(phys))
         cpu_smc_invalidate(addr, phys);
+    if (cpu.page_tables[phys >> 12] & PAGE_TABLE_WATCHED)
+        cpu_mmu_page_table_write(phys);
     *(uint8_t*)host_ptr = data;
     return 0;
 }
@@ -99,7 +101,7 @@ int cpu_access_write16(uint32_t addr, uint32_t data, uint32_t tag, int shift)
 {
     if (addr & 1) {
         for (int i = 0, j = 0; i < 2; i++, j += 8) {
-            if (cpu_access_write8(addr + i, data >> j, cpu.tlb_tags[(addr + i) >> 12] >> shift, shift))
+            if (cpu_access_write8(addr + i, data >> j, TLB_TAGS(addr + i) >> shift, shift))
                 return 1;
         }
         return 0;
@@ -107,9 +109,9 @@ int cpu_access_write16(uint32_t addr, uint32_t data, uint32_t tag, int shift)
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0x100000) || (phys >= cpu.memory_size)) {
         io_handle_mmio_write(phys, data, 1);
@@ -117,6 +119,8 @@ int cpu_access_write16(uint32_t addr, uint32_t data, uint32_t tag, int shift)
     }
     if (cpu_smc_has_code(phys))
         cpu_smc_invalidate(addr, phys);
+    if (cpu.page_tables[phys >> 12] & PAGE_TABLE_WATCHED)
+        cpu_mmu_page_table_write(phys);
     *(uint16_t*)host_ptr = data;
     return 0;
 }
@@ -124,7 +128,7 @@ int cpu_access_write32(uint32_t addr, uint32_t data, uint32_t tag, int shift)
 {
     if (addr & 3) {
         for (int i = 0, j = 0; i < 4; i++, j += 8) {
-            if (cpu_access_write8(addr + i, data >> j, cpu.tlb_tags[(addr + i) >> 12] >> shift, shift))
+            if (cpu_access_write8(addr + i, data >> j, TLB_TAGS(addr + i) >> shift, shift))
                 return 1;
         }
         return 0;
@@ -133,9 +137,9 @@ int cpu_access_write32(uint32_t addr, uint32_t data, uint32_t tag, int shift)
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0x100000) || (phys >= cpu.memory_size)) {
         io_handle_mmio_write(phys, data, 2);
@@ -143,6 +147,8 @@ int cpu_access_write32(uint32_t addr, uint32_t data, uint32_t tag, int shift)
     }
     if (cpu_smc_has_code(phys))
         cpu_smc_invalidate(addr, phys);
+    if (cpu.page_tables[phys >> 12] & PAGE_TABLE_WATCHED)
+        cpu_mmu_page_table_write(phys);
     *(uint32_t*)host_ptr = data;
     return 0;
 }
@@ -154,7 +160,7 @@ int cpu_access_verify(uint32_t addr, uint32_t end, int shift)
     uint32_t tag;
     if ((addr ^ end) & ~0xFFF) {
         // Check two pages
-        tag = cpu.tlb_tags[addr >> 12];
+        tag = TLB_TAGS(addr);
         if (tag & 2) {
             if (cpu_mmu_translate(addr, shift))
                 return 1;
@@ -163,7 +169,7 @@ int cpu_access_verify(uint32_t addr, uint32_t end, int shift)
         end = addr;
 
     // Check the second page, or the first one if it's a single page access
-    tag = cpu.tlb_tags[end >> 12];
+    tag = TLB_TAGS(end);
     if (tag & 2) {
         if (cpu_mmu_translate(end, shift))
             return 1;
@@ -213,15 +219,15 @@ void readphys(uint32_t lin, int bytes)
 
 uint32_t lin2phys(uint32_t addr)
 {
-    uint8_t tag = cpu.tlb_tags[addr >> 12];
+    uint8_t tag = TLB_TAGS(addr);
     if (tag & 2) {
         if (cpu_mmu_translate(addr, TLB_SYSTEM_READ)) {
             printf("ERROR TRANSLATING ADDRESS %08x\n", addr);
             return 1;
         }
-        tag = cpu.tlb_tags[addr >> 12] >> TLB_SYSTEM_READ;
+        tag = TLB_TAGS(addr) >> TLB_SYSTEM_READ;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     return phys;
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <string.h>
 
 struct cpu cpu;
+struct cpu_stats cpu_stats;
 
 void cpu_set_a20(int a20_enabled)
 {
@@ -30,6 +31,10 @@ int cpu_init_mem(int size)
 
     cpu.smc_has_code_length = (size + 4095) >> 12;
     cpu.smc_has_code = calloc(4, cpu.smc_has_code_length);
+    cpu.smc_heat = calloc(sizeof(struct smc_page_heat), cpu.smc_has_code_length);
+    cpu.page_tables = calloc(1, cpu.smc_has_code_length);
+
+    cpu_trace_init(cpu.trace_cache_budget);
 
 // It's possible that instrumentation callbacks will need a physical pointer to RAM
 #ifdef INSTRUMENT
@@ -42,8 +47,12 @@ int cpu_interrupts_masked(void)
     return cpu.eflags & EFLAGS_IF;
 }
 
+// In the middle of a trace that was charged up front, this goes back to counting instructions one at a time, so that
+// the result is the same as if every instruction had been charged as it ran.
 itick_t cpu_get_cycles(void)
 {
+    if (cpu.trace_end)
+        cpu_trace_sync();
     return cpu.cycles + (cpu.cycle_offset - cpu.cycles_to_run);
 }
 
@@ -58,6 +67,10 @@ int cpu_run(int cycles)
 
     uint64_t begin = cpu_get_cycles();
 
+    // Let pages that have stopped modifying themselves go back to normal traces
+    if (cpu.smc_hot_page_count)
+        cpu_smc_cool_pages();
+
     while (1) {
         // Check for interrupts
         if (cpu.intr_line_state) {
@@ -138,6 +151,15 @@ void cpu_cancel_execution_cycle(int reason)
     cpu.refill_counter = 0;
 }
 
+// Returns a snapshot of the counters, including the ones that the background decoder keeps for itself
+struct cpu_stats* cpu_get_stats(void)
+{
+    static struct cpu_stats stats;
+    stats = cpu_stats;
+    cpu_decode_add_stats(&stats);
+    return &stats;
+}
+
 void* cpu_get_ram_ptr(void)
 {
     return cpu.mem;
@@ -204,10 +226,8 @@ void cpu_reset(void)
     cpu.mxcsr = 0x1F80;
     cpu_update_mxcsr();
 
-    // Reset TLB
-    memset(cpu.tlb, 0, sizeof(void*) * (1 << 20));
-    memset(cpu.tlb_tags, 0xFF, 1 << 20);
-    memset(cpu.tlb_attrs, 0xFF, 1 << 20);
+    // Reset TLB. All ones makes every entry empty, with every access invalid.
+    memset(cpu.tlb, 0xFF, sizeof(cpu.tlb));
     cpu_mmu_tlb_flush();
 }
 
@@ -300,6 +320,14 @@ void cpu_init_dma(uint32_t page)
 
 void cpu_write_mem(uint32_t addr, void* data, uint32_t length)
 {
+    // DMA into a page table or descriptor table invalidates the TLB contexts and cache entries that were filled from it,
+    // just like a write from the CPU. A transfer can cover many descriptors, so drop all of them here.
+    for (uint32_t page = addr >> 12; length && page <= (addr + length - 1) >> 12 && page < cpu.smc_has_code_length; page++) {
+        if (cpu.page_tables[page] & PAGE_TABLE_DESCRIPTORS)
+            cpu_seg_cache_write(addr, length);
+        if (cpu.page_tables[page] & PAGE_TABLE_WATCHED)
+            cpu_mmu_page_table_write(page << 12);
+    }
     if (length <= 4) {
         switch (length) {
         case 1:
@@ -334,6 +362,7 @@ void cpu_debug(void)
     printf("ESP: %08x EBP: %08x ESI: %08x EDI: %08x\n", cpu.reg32[ESP], cpu.reg32[EBP], cpu.reg32[ESI], cpu.reg32[EDI]);
     printf("EFLAGS: %08x\n", cpu_get_eflags());
     printf("CS:EIP: %04x:%08x (lin: %08x) Physical EIP: %08x\n", cpu.seg[CS], VIRT_EIP(), LIN_EIP(), cpu.phys_eip);
-    printf("Translation mode: %d-bit\n", cpu.state_hash ? 16 : 32);
+    printf("Translation mode: %d-bit\n", cpu.state_hash & STATE_CODE16 ? 16 : 32);
     printf("Physical RAM base: %p Cycles to run: %d Cycles executed: %d\n", cpu.mem, cpu.cycles_to_run, (uint32_t)cpu_get_cycles());
+    cpu_decode_print_forms();
 }
\ No newline at end of file
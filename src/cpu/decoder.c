@@ -3,6 +3,8 @@
 #include "cpu/cpu.h"
 #include "cpu/opcodes.h"
 #include "cpu/simd.h"
+#include "cpuapi.h"
+#include <string.h>
 
 #ifdef LIBCPU
 void* get_phys_ram_ptr(uint32_t addr, int write);
@@ -11,41 +13,87 @@ void* get_phys_ram_ptr(uint32_t addr, int write);
 #endif
 
 // ============================================================================
-// Important state variable used by the emulator
+// Decoder state
 // ============================================================================
-static uint8_t* rawp; // Physical pointer used by decoder
-static uint8_t prefetch[16];
-static int state_hash;
-static int seg_prefix[2] = { DS, SS };
-#define rb() *rawp++
-#define rbs() (int8_t) * rawp++
-static inline uint32_t rw(void)
-{
-    uint32_t val = rawp[0] | rawp[1] << 8;
-    rawp += 2;
+
+// Everything that the decoder keeps while it works on a trace. The CPU core and the background decoder each have their
+// own (see cpu_decode and cpu_decode_ahead), so every decode function is passed the one it works on.
+struct decoder {
+    uint8_t* rawp; // Pointer to the byte being decoded
+    uint8_t* page; // Start of the page being decoded. For the background decoder, this is a copy of the guest page.
+    uint32_t phys; // Physical address of the start of the trace
+    int state_hash; // State hash for the current instruction, with its prefixes applied
+    int base_state_hash; // State hash the trace is being decoded for
+    int seg_prefix[2];
+    int sse_prefix;
+    int background; // Set for the background decoder, which has no access to the TLB
+    int page_end; // Set if the trace ended because its next instruction crosses onto the next page
+    int followed; // Set if the trace followed a jump (see decode_follow)
+    int failed; // Set if the background decoder found something that only the CPU core should deal with
+    struct cpu_stats* stats; // Counters for what the decoder does. The background decoder has its own, so that no counter is
+                             // written from two cores.
+    uint8_t prefetch[16];
+};
+#define rb(d) *(d)->rawp++
+#define rbs(d) (int8_t) * (d)->rawp++
+static inline uint32_t rw(struct decoder* d)
+{
+    uint32_t val = d->rawp[0] | d->rawp[1] << 8;
+    d->rawp += 2;
     return val;
 }
-static inline uint32_t rd(void)
+static inline uint32_t rd(struct decoder* d)
 {
-    uint32_t val = rawp[0] | rawp[1] << 8 | rawp[2] << 16 | rawp[3] << 24;
-    rawp += 4;
+    uint32_t val = d->rawp[0] | d->rawp[1] << 8 | d->rawp[2] << 16 | d->rawp[3] << 24;
+    d->rawp += 4;
     return val;
 }
-static inline uint32_t rv(void)
+static inline uint32_t rv(struct decoder* d)
 {
     // Read variable sized word/dword based on address size
-    if (state_hash & STATE_CODE16)
-        return rw();
+    if (d->state_hash & STATE_CODE16)
+        return rw(d);
     else
-        return rd();
+        return rd(d);
 }
-static inline uint32_t rvs(void)
+static inline uint32_t rvs(struct decoder* d)
 {
-    if (state_hash & STATE_CODE16)
-        return (int16_t)rw();
+    if (d->state_hash & STATE_CODE16)
+        return (int16_t)rw(d);
     else
-        return rd();
+        return rd(d);
+}
+
+// Gets a decoder ready for the trace at "phys" on the page at "page"
+static void decoder_reset(struct decoder* d, uint8_t* page, uint32_t phys, int state_hash)
+{
+    d->page = page;
+    d->phys = phys;
+    d->rawp = page + (phys & 0xFFF);
+    d->state_hash = d->base_state_hash = state_hash;
+    d->seg_prefix[0] = DS;
+    d->seg_prefix[1] = SS;
+    d->sse_prefix = 0;
+    d->page_end = 0;
+    d->followed = 0;
+    d->failed = 0;
+}
+
+// Speculatively decoded code may well be data. Anything that the CPU core would report or give up on is left for it to
+// find, by abandoning the trace.
+static int decode_give_up(struct decoder* d, struct decoded_instruction* i)
+{
+    d->failed = 1;
+    i->handler = op_ud_exception;
+    i->flags = 0;
+    return 1;
 }
+#define DECODE_FATAL(d, i, ...)              \
+    do {                                     \
+        if ((d)->background)                 \
+            return decode_give_up(d, i);     \
+        CPU_FATAL(__VA_ARGS__);              \
+    } while (0)
 
 // ============================================================================
 // x86 length decoder
@@ -111,33 +159,33 @@ static const uint8_t optable0F[0x100] = {
     /* F0 */ 0x05, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x05
 };
 // The following function determines the length of an instruction.
-// The address at which to start at is in rawp. Pass the maximum number of bytes that can be translated before it returns -1.
+// The address at which to start at is in d->rawp. Pass the maximum number of bytes that can be translated before it returns -1.
 // In the case that an invalid instruction is encountered, it simply returns the minimum number of bytes that need to be read before the decoder realizes it's an invalid instruction
 // Returns instruction length (>0) if instruction is shorter than max_bytes.
 // Returns 0 if instruction is longer than max_bytes
-static int find_instruction_length(int max_bytes)
+static int find_instruction_length(struct decoder* d, int max_bytes)
 {
-    int opcode, state_hash = cpu.state_hash, initial_max_bytes = max_bytes, opcode_info;
+    int opcode, state_hash = d->base_state_hash, initial_max_bytes = max_bytes, opcode_info;
     const uint8_t* tbl = optable;
 
 #define OPCODE_TOO_LONG() \
     if (max_bytes-- < 0)  \
     return -1
 top:
-    opcode = rawp[initial_max_bytes - max_bytes];
+    opcode = d->rawp[initial_max_bytes - max_bytes];
     OPCODE_TOO_LONG();
     switch (opcode) {
     case 0x0F:
         tbl = optable0F;
-        opcode = rawp[initial_max_bytes - max_bytes];
+        opcode = d->rawp[initial_max_bytes - max_bytes];
         OPCODE_TOO_LONG();
         goto done;
     case 0x66: // Operand size prefix
-        if (!((state_hash ^ cpu.state_hash) & STATE_CODE16))
+        if (!((state_hash ^ d->base_state_hash) & STATE_CODE16))
             state_hash ^= STATE_CODE16;
         break;
     case 0x67: // Address size prefix
-        if (!((state_hash ^ cpu.state_hash) & STATE_ADDR16))
+        if (!((state_hash ^ d->base_state_hash) & STATE_ADDR16))
             state_hash ^= STATE_ADDR16;
         break;
     case 0x26:
@@ -156,10 +204,10 @@ top:
     goto top;
 
 done:
-    //opcode = rawp[initial_max_bytes - max_bytes];
+    //opcode = d->rawp[initial_max_bytes - max_bytes];
     //OPCODE_TOO_LONG();
 
-    opcode_info = tbl[opcode]; // Note: no risk of overflow since rawp is 8-bits in width, and thus opcode will always be < 256
+    opcode_info = tbl[opcode]; // Note: no risk of overflow since d->rawp is 8-bits in width, and thus opcode will always be < 256
     switch (opcode_info & 15) {
     case opcode_singlebyte:
         break;
@@ -167,7 +215,7 @@ done:
         CPU_FATAL("Unknown special opcode: %02x\n", opcode);
     case opcode_modrm: {
         int modrm, sib;
-        modrm = rawp[initial_max_bytes - max_bytes];
+        modrm = d->rawp[initial_max_bytes - max_bytes];
         OPCODE_TOO_LONG();
 
         if (tbl == optable && ((opcode & 0xFE) == 0xF6)) {
@@ -196,7 +244,7 @@ done:
             } else {
                 switch ((modrm >> 3 & 0x18) | (modrm & 7)) { // Combine MOD and RM fields
                 case 4: { // SIB
-                    sib = rawp[initial_max_bytes - max_bytes];
+                    sib = d->rawp[initial_max_bytes - max_bytes];
                     OPCODE_TOO_LONG();
                     if ((sib & 7) == 5)
                         max_bytes -= 4;
@@ -251,8 +299,8 @@ done:
     return initial_max_bytes - max_bytes;
 }
 
-typedef int (*decode_handler_t)(struct decoded_instruction*);
-#define SIZEOP(a16, a32) state_hash& STATE_CODE16 ? a16 : a32
+typedef int (*decode_handler_t)(struct decoder*, struct decoded_instruction*);
+#define SIZEOP(a16, a32) d->state_hash & STATE_CODE16 ? a16 : a32
 #define REGOP(mem, reg) modrm < 0xC0 ? mem : reg
 
 #define R8(i) ((i)&3) << 2 | (i) >> 2
@@ -260,13 +308,13 @@ typedef int (*decode_handler_t)(struct decoded_instruction*);
 #define R32(i) (i)
 #define I_SET_RM8(dest, src) I_SET_RM(dest, R8(src));
 #define I_SET_RMv(dest, src)       \
-    if (state_hash & STATE_CODE16) \
+    if (d->state_hash & STATE_CODE16) \
         I_SET_RM(dest, R16(src));  \
     else                           \
     I_SET_RM(dest, src)
 #define I_SET_REG8(dest, src) I_SET_REG(dest, R8(src));
 #define I_SET_REGv(dest, src)      \
-    if (state_hash & STATE_CODE16) \
+    if (d->state_hash & STATE_CODE16) \
         I_SET_REG(dest, R16(src)); \
     else                           \
     I_SET_REG(dest, src)
@@ -300,9 +348,9 @@ static int addr32_lut2[] = {
     0, 0, 0, 0, 1, 1, 0, 0 // For SIB, only bases 4 and 5 have a SREG of SS
 };
 
-static int parse_modrm(struct decoded_instruction* i, uint8_t modrm, int is8)
+static int parse_modrm(struct decoder* d, struct decoded_instruction* i, uint8_t modrm, int is8)
 {
-    int addr16 = state_hash >> 1 & 1, flags = addr16 << 4, rm = modrm & 7, new_modrm = rm | ((modrm & 0xC0) >> 3); // Set ADDR16 bit
+    int addr16 = d->state_hash >> 1 & 1, flags = addr16 << 4, rm = modrm & 7, new_modrm = rm | ((modrm & 0xC0) >> 3); // Set ADDR16 bit
 
     switch (is8 & 3) {
     case 0:
@@ -323,30 +371,30 @@ static int parse_modrm(struct decoded_instruction* i, uint8_t modrm, int is8)
             I_SET_BASE(flags, addr16_lut[rm]);
             I_SET_INDEX(flags, addr16_lut[rm | 8]);
             I_SET_SCALE(flags, 0);
-            I_SET_SEG_BASE(flags, seg_prefix[addr16_lut[rm | 16]]);
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr16_lut[rm | 16]]);
             i->disp32 = 0; // Set it to zero because there is no displacement
             break;
         case 6: // [disp16]
             I_SET_BASE(flags, EZR);
             I_SET_INDEX(flags, EZR);
             I_SET_SCALE(flags, 0);
-            I_SET_SEG_BASE(flags, seg_prefix[0]);
-            i->disp32 = rw();
+            I_SET_SEG_BASE(flags, d->seg_prefix[0]);
+            i->disp32 = rw(d);
             break;
         case 8 ... 15: // [bx+si+disp8s], [bx+disp8s], etc.
             I_SET_BASE(flags, addr16_lut2[rm]);
             I_SET_INDEX(flags, addr16_lut2[rm | 8]);
             I_SET_SCALE(flags, 0);
-            I_SET_SEG_BASE(flags, seg_prefix[addr16_lut2[rm | 16]]);
-            //printf("Translated (modrm=%02x prefix=%d idx=%d rm=%d a=%d b=%d)\n", modrm, seg_prefix[addr16_lut2[rm | 16]], addr16_lut2[rm | 16], rm, addr16_lut2[0], addr16_lut2[1]);
-            i->disp32 = rbs();
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr16_lut2[rm | 16]]);
+            //printf("Translated (modrm=%02x prefix=%d idx=%d rm=%d a=%d b=%d)\n", modrm, d->seg_prefix[addr16_lut2[rm | 16]], addr16_lut2[rm | 16], rm, addr16_lut2[0], addr16_lut2[1]);
+            i->disp32 = rbs(d);
             break;
         case 16 ... 23: // [bx+si+disp16], [bx+disp16], etc.
             I_SET_BASE(flags, addr16_lut2[rm]);
             I_SET_INDEX(flags, addr16_lut2[rm | 8]);
             I_SET_SCALE(flags, 0);
-            I_SET_SEG_BASE(flags, seg_prefix[addr16_lut2[rm | 16]]);
-            i->disp32 = rw();
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr16_lut2[rm | 16]]);
+            i->disp32 = rw(d);
             break;
         case 24 ... 31: // mod=3
             if (is8 & 4) {
@@ -366,17 +414,17 @@ static int parse_modrm(struct decoded_instruction* i, uint8_t modrm, int is8)
             I_SET_BASE(flags, rm);
             I_SET_INDEX(flags, EZR);
             I_SET_SCALE(flags, 0);
-            I_SET_SEG_BASE(flags, seg_prefix[addr32_lut[rm]]);
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr32_lut[rm]]);
             i->disp32 = 0;
             break;
         case 4: // [sib]
-            sib = rb();
+            sib = rb(d);
             index = sib >> 3 & 7;
             base = sib & 7;
             if (base == 5) {
                 base = 0;
                 I_SET_BASE(flags, EZR);
-                i->disp32 = rd();
+                i->disp32 = rd(d);
             } else {
                 I_SET_BASE(flags, base);
                 i->disp32 = 0;
@@ -386,15 +434,15 @@ static int parse_modrm(struct decoded_instruction* i, uint8_t modrm, int is8)
                 I_SET_SCALE(flags, sib >> 6);
             } else
                 I_SET_INDEX(flags, EZR);
-            I_SET_SEG_BASE(flags, seg_prefix[addr32_lut2[base]]);
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr32_lut2[base]]);
             break;
         case 5: // [disp32]
             rm = modrm & 7;
             I_SET_BASE(flags, EZR);
             I_SET_INDEX(flags, EZR);
             I_SET_SCALE(flags, 0);
-            I_SET_SEG_BASE(flags, seg_prefix[0]);
-            i->disp32 = rd();
+            I_SET_SEG_BASE(flags, d->seg_prefix[0]);
+            i->disp32 = rd(d);
             break;
         case 0x08 ... 0x0B:
         case 0x0D ... 0x0F: // [eax+disp8s], [ebx+disp8s]
@@ -402,11 +450,11 @@ static int parse_modrm(struct decoded_instruction* i, uint8_t modrm, int is8)
             I_SET_BASE(flags, rm);
             I_SET_INDEX(flags, EZR);
             I_SET_SCALE(flags, 0);
-            I_SET_SEG_BASE(flags, seg_prefix[addr32_lut[rm]]);
-            i->disp32 = rbs();
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr32_lut[rm]]);
+            i->disp32 = rbs(d);
             break;
         case 0x0C: // [sib+disp8s]
-            sib = rb();
+            sib = rb(d);
             index = sib >> 3 & 7;
             base = sib & 7;
             I_SET_BASE(flags, base);
@@ -415,8 +463,8 @@ static int parse_modrm(struct decoded_instruction* i, uint8_t modrm, int is8)
                 I_SET_SCALE(flags, sib >> 6);
             } else
                 I_SET_INDEX(flags, EZR);
-            I_SET_SEG_BASE(flags, seg_prefix[addr32_lut2[base]]);
-            i->disp32 = rbs();
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr32_lut2[base]]);
+            i->disp32 = rbs(d);
             break;
         case 0x10 ... 0x13:
         case 0x15 ... 0x17: // [eax+disp32], [ecx+disp32]
@@ -424,11 +472,11 @@ static int parse_modrm(struct decoded_instruction* i, uint8_t modrm, int is8)
             I_SET_BASE(flags, rm);
             I_SET_INDEX(flags, EZR);
             I_SET_SCALE(flags, 0);
-            I_SET_SEG_BASE(flags, seg_prefix[addr32_lut[rm]]);
-            i->disp32 = rd();
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr32_lut[rm]]);
+            i->disp32 = rd(d);
             break;
         case 0x14: // [sib+disp32]
-            sib = rb();
+            sib = rb(d);
             index = sib >> 3 & 7;
             base = sib & 7;
             I_SET_BASE(flags, base);
@@ -437,8 +485,8 @@ static int parse_modrm(struct decoded_instruction* i, uint8_t modrm, int is8)
                 I_SET_SCALE(flags, sib >> 6);
             } else
                 I_SET_INDEX(flags, EZR);
-            I_SET_SEG_BASE(flags, seg_prefix[addr32_lut2[base]]);
-            i->disp32 = rd();
+            I_SET_SEG_BASE(flags, d->seg_prefix[addr32_lut2[base]]);
+            i->disp32 = rd(d);
             break;
         case 24 ... 31: // reg3
             if (is8 & 4) {
@@ -460,32 +508,36 @@ static int swap_rm_reg(int flags)
     return flags ^ ((x << 8) | (x << 12));
 }
 
-static int decode_invalid(struct decoded_instruction* i)
+static int decode_invalid(struct decoder* d, struct decoded_instruction* i)
 {
     UNUSED(i);
-    rawp--;
+    d->rawp--;
+    if (d->background)
+        return decode_give_up(d, i);
     for (int i = 0; i < 16; i++)
-        printf("%02x ", rawp[i - 16]);
+        printf("%02x ", d->rawp[i - 16]);
     printf("\n");
     for (int i = 0; i < 16; i++)
-        printf("%02x ", rawp[i]);
+        printf("%02x ", d->rawp[i]);
     printf("\n");
-    CPU_LOG("Unknown opcode: %02x\n", rawp[0]);
+    CPU_LOG("Unknown opcode: %02x\n", d->rawp[0]);
     i->handler = op_ud_exception;
     i->flags = 0;
     return 1;
 }
-static int decode_invalid0F(struct decoded_instruction* i)
+static int decode_invalid0F(struct decoder* d, struct decoded_instruction* i)
 {
     UNUSED(i);
-    rawp--;
+    d->rawp--;
+    if (d->background)
+        return decode_give_up(d, i);
     for (int i = 0; i < 16; i++)
-        printf("%02x ", rawp[i - 16]);
+        printf("%02x ", d->rawp[i - 16]);
     printf("\n");
     for (int i = 0; i < 16; i++)
-        printf("%02x ", rawp[i]);
+        printf("%02x ", d->rawp[i]);
     printf("\n");
-    CPU_LOG("Unknown opcode: 0F %02x\n", rawp[0]);
+    CPU_LOG("Unknown opcode: 0F %02x\n", d->rawp[0]);
     i->handler = op_ud_exception;
     i->flags = 0;
     return 1;
@@ -494,9 +546,9 @@ static int decode_invalid0F(struct decoded_instruction* i)
 static const decode_handler_t table0F[256];
 static const decode_handler_t table[256];
 
-static int decode_0F(struct decoded_instruction* i)
+static int decode_0F(struct decoder* d, struct decoded_instruction* i)
 {
-    return table0F[rb()](i);
+    return table0F[rb(d)](d, i);
 }
 
 // A variable set to see what the current SSE prefix is
@@ -507,52 +559,51 @@ enum {
     SSE_PREFIX_F3
 };
 
-static int sse_prefix = 0;
-static int decode_prefix(struct decoded_instruction* i)
+static int decode_prefix(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t prefix = rawp[-1];
+    uint8_t prefix = d->rawp[-1];
     int prefix_set = 0, return_value = 0;
     i->flags = 0;
     while (1) {
         switch (prefix) {
         case 0xF3: // repz
-            sse_prefix = SSE_PREFIX_F3;
+            d->sse_prefix = SSE_PREFIX_F3;
             if (!prefix_set)
-                if (find_instruction_length(15) == -1)
+                if (find_instruction_length(d, 15) == -1)
                     goto error;
             i->flags |= I_PREFIX_REPZ;
             prefix_set |= 1;
-            state_hash |= 4;
+            d->state_hash |= 4;
             break;
         case 0xF2: // repnz
-            sse_prefix = SSE_PREFIX_F2;
+            d->sse_prefix = SSE_PREFIX_F2;
             if (!prefix_set)
-                if (find_instruction_length(15) == -1)
+                if (find_instruction_length(d, 15) == -1)
                     goto error;
             i->flags |= I_PREFIX_REPNZ;
             prefix_set |= 1;
-            state_hash |= 4;
+            d->state_hash |= 4;
             break;
         case 0x66: // Operand size
-            sse_prefix = SSE_PREFIX_66;
+            d->sse_prefix = SSE_PREFIX_66;
             if (!prefix_set)
-                if (find_instruction_length(15) == -1)
+                if (find_instruction_length(d, 15) == -1)
                     goto error;
             if (!(prefix_set & 2)) // If prefix has not been set yet
-                state_hash ^= STATE_CODE16;
+                d->state_hash ^= STATE_CODE16;
             prefix_set |= 2;
             break;
         case 0x67: // Address size
             if (!prefix_set)
-                if (find_instruction_length(15) == -1)
+                if (find_instruction_length(d, 15) == -1)
                     goto error;
             if (!(prefix_set & 4))
-                state_hash ^= STATE_ADDR16;
+                d->state_hash ^= STATE_ADDR16;
             prefix_set |= 4;
             break;
         case 0xF0: // LOCK
             if (!prefix_set)
-                if (find_instruction_length(15) == -1)
+                if (find_instruction_length(d, 15) == -1)
                     goto error;
             prefix_set |= 8;
             break;
@@ -561,30 +612,30 @@ static int decode_prefix(struct decoded_instruction* i)
         case 0x36:
         case 0x3E: // Segment prefixes
             if (!prefix_set)
-                if (find_instruction_length(15) == -1)
+                if (find_instruction_length(d, 15) == -1)
                     goto error;
-            seg_prefix[0] = seg_prefix[1] = prefix >> 3 & 3;
+            d->seg_prefix[0] = d->seg_prefix[1] = prefix >> 3 & 3;
             prefix_set |= 16;
             break;
         case 0x64:
         case 0x65: // Segment prefixes, part 2
             if (!prefix_set)
-                if (find_instruction_length(15) == -1)
+                if (find_instruction_length(d, 15) == -1)
                     goto error;
-            seg_prefix[0] = seg_prefix[1] = FS + (prefix & 1);
+            d->seg_prefix[0] = d->seg_prefix[1] = FS + (prefix & 1);
             prefix_set |= 16;
             break;
         case 0x0F:
             prefix_set |= 32;
-            state_hash |= 4; // Set some random bit
-            return_value = table0F[prefix = rb()](i);
+            d->state_hash |= 4; // Set some random bit
+            return_value = table0F[prefix = rb(d)](d, i);
             goto done;
         default:
-            state_hash |= 4; // Set some random bit
-            return_value = table[prefix](i);
+            d->state_hash |= 4; // Set some random bit
+            return_value = table[prefix](d, i);
             goto done;
         }
-        prefix = rb();
+        prefix = rb(d);
     }
 done:
     if (prefix_set > 0) {
@@ -601,14 +652,14 @@ done:
         }
 
         // Reset all state
-        seg_prefix[0] = DS;
-        seg_prefix[1] = SS;
-        state_hash = cpu.state_hash;
+        d->seg_prefix[0] = DS;
+        d->seg_prefix[1] = SS;
+        d->state_hash = d->base_state_hash;
     }
-    sse_prefix = 0;
+    d->sse_prefix = 0;
     return return_value;
 error:
-    sse_prefix = 0;
+    d->sse_prefix = 0;
     i->handler = op_ud_exception;
     return 1;
 }
@@ -650,26 +701,102 @@ static const insn_handler_t jcc16[16] = {
     op_jnle16
 };
 
-static int decode_jcc8(struct decoded_instruction* i)
+// Macro-op fusion: if "jcc" is a conditional branch and "prev" is a register form of CMP, TEST, ADD, SUB, INC or DEC,
+// turn "prev" into a single instruction doing both (see op_fused_* in opcodes.c). Returns 1 if the pair was fused.
+static int decode_fuse(struct decoder* d, struct decoded_instruction* prev, struct decoded_instruction* jcc)
+{
+    insn_handler_t handler = prev->handler, fused;
+    uint32_t flags = prev->flags, imm8 = 0;
+    int op = I_OP(flags);
+
+    if (handler == op_cmp_r16r16)
+        fused = op_fused_cmp_r16r16;
+    else if (handler == op_cmp_r32r32)
+        fused = op_fused_cmp_r32r32;
+    else if (handler == op_test_r16r16)
+        fused = op_fused_test_r16r16;
+    else if (handler == op_test_r32r32)
+        fused = op_fused_test_r32r32;
+    else if (handler == op_inc_r16)
+        fused = op_fused_inc_r16;
+    else if (handler == op_inc_r32)
+        fused = op_fused_inc_r32;
+    else if (handler == op_dec_r16)
+        fused = op_fused_dec_r16;
+    else if (handler == op_dec_r32)
+        fused = op_fused_dec_r32;
+    else if (handler == op_arith_r16r16 && (op == 0 || op == 5))
+        fused = op ? op_fused_sub_r16r16 : op_fused_add_r16r16;
+    else if (handler == op_arith_r32r32 && (op == 0 || op == 5))
+        fused = op ? op_fused_sub_r32r32 : op_fused_add_r32r32;
+    else {
+        // Immediate forms, as long as the immediate fits in the eight bits we have room for
+        int is16 = handler == op_cmp_r16i16 || handler == op_arith_r16i16;
+        int32_t imm = is16 ? (int16_t)prev->imm16 : (int32_t)prev->imm32;
+        if (imm != (int8_t)imm)
+            return 0;
+        imm8 = imm & 0xFF;
+        if (handler == op_cmp_r16i16)
+            fused = op_fused_cmp_r16i8;
+        else if (handler == op_cmp_r32i32)
+            fused = op_fused_cmp_r32i8;
+        else if (handler == op_arith_r16i16 && (op == 0 || op == 5))
+            fused = op ? op_fused_sub_r16i8 : op_fused_add_r16i8;
+        else if (handler == op_arith_r32i32 && (op == 0 || op == 5))
+            fused = op ? op_fused_sub_r32i8 : op_fused_add_r32i8;
+        else
+            return 0;
+    }
+
+    int cond, jcc_is16 = 0;
+    for (cond = 0; cond < 16; cond++) {
+        if (jcc->handler == jcc32[cond])
+            break;
+        if (jcc->handler == jcc16[cond]) {
+            jcc_is16 = 1;
+            break;
+        }
+    }
+    int length = I_LENGTH(flags) + I_LENGTH(jcc->flags);
+    if (cond == 16 || length > 15)
+        return 0;
+
+    uint32_t fused_flags = length | I_LENGTH(flags) << I_FUSED_LENGTH1_SHIFT | (flags & 0xFF00) | imm8 << I_FUSED_IMM8_SHIFT;
+    I_SET_OP(fused_flags, cond);
+    if (jcc_is16)
+        fused_flags |= I_FUSED_JCC16;
+    prev->flags = fused_flags;
+    prev->handler = fused;
+    prev->imm32 = jcc->imm32;
+    prev->disp32 = 0; // Trace link, see STOP_LINKED
+    d->stats->fused_pairs++;
+    return 1;
+}
+
+static int decode_jcc8(struct decoder* d, struct decoded_instruction* i)
 {
+    d->stats->decoded_jcc++;
     i->flags = 0;
-    int cond = rawp[-1] & 15;
+    int cond = d->rawp[-1] & 15;
     i->handler = SIZEOP(jcc16[cond], jcc32[cond]);
-    i->imm32 = rbs();
+    i->imm32 = rbs(d);
+    i->disp32 = 0; // Trace link, see STOP_LINKED
     return 0;
 }
-static int decode_jccv(struct decoded_instruction* i)
+static int decode_jccv(struct decoder* d, struct decoded_instruction* i)
 {
+    d->stats->decoded_jcc++;
     i->flags = 0;
-    int cond = rawp[-1] & 15;
+    int cond = d->rawp[-1] & 15;
     i->handler = SIZEOP(jcc16[cond], jcc32[cond]);
-    i->imm32 = rvs();
+    i->imm32 = rvs(d);
+    i->disp32 = 0; // Trace link, see STOP_LINKED
     return 0;
 }
-static int decode_cmov(struct decoded_instruction* i)
+static int decode_cmov(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t cond = rawp[-1] & 15, modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t cond = d->rawp[-1] & 15, modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_cmov_r16e16, op_cmov_r32e32);
     else
@@ -677,10 +804,10 @@ static int decode_cmov(struct decoded_instruction* i)
     I_SET_OP(i->flags, cond);
     return 0;
 }
-static int decode_setcc(struct decoded_instruction* i)
+static int decode_setcc(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t cond = rawp[-1] & 15, modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t cond = d->rawp[-1] & 15, modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     if (modrm < 0xC0)
         i->handler = op_setcc_e8;
     else
@@ -688,113 +815,113 @@ static int decode_setcc(struct decoded_instruction* i)
     I_SET_OP(i->flags, cond);
     return 0;
 }
-static int decode_mov_rbib(struct decoded_instruction* i)
+static int decode_mov_rbib(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
-    I_SET_RM8(flags, rawp[-1] & 7);
+    I_SET_RM8(flags, d->rawp[-1] & 7);
     i->flags = flags;
     i->handler = op_mov_r8i8;
-    i->imm32 = rb();
+    i->imm32 = rb(d);
     return 0;
 }
-static int decode_mov_rviv(struct decoded_instruction* i)
+static int decode_mov_rviv(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
-    I_SET_RMv(flags, rawp[-1] & 7);
+    I_SET_RMv(flags, d->rawp[-1] & 7);
     i->flags = flags;
     i->handler = SIZEOP(op_mov_r16i16, op_mov_r32i32);
-    i->imm32 = rv();
+    i->imm32 = rv(d);
     return 0;
 }
-static int decode_push_rv(struct decoded_instruction* i)
+static int decode_push_rv(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
-    I_SET_RMv(flags, rawp[-1] & 7);
+    I_SET_RMv(flags, d->rawp[-1] & 7);
     i->flags = flags;
     i->handler = SIZEOP(op_push_r16, op_push_r32);
     return 0;
 }
-static int decode_pop_rv(struct decoded_instruction* i)
+static int decode_pop_rv(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
-    I_SET_RMv(flags, rawp[-1] & 7);
+    I_SET_RMv(flags, d->rawp[-1] & 7);
     i->flags = flags;
     i->handler = SIZEOP(op_pop_r16, op_pop_r32);
     return 0;
 }
-static int decode_push_sv(struct decoded_instruction* i)
+static int decode_push_sv(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
-    I_SET_RM(flags, rawp[-1] >> 3 & 3);
+    I_SET_RM(flags, d->rawp[-1] >> 3 & 3);
     i->flags = flags;
     i->handler = SIZEOP(op_push_s16, op_push_s32);
     return 0;
 }
-static int decode_pop_sv(struct decoded_instruction* i)
+static int decode_pop_sv(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
-    I_SET_RM(flags, rawp[-1] >> 3 & 3);
+    I_SET_RM(flags, d->rawp[-1] >> 3 & 3);
     i->flags = flags;
     i->handler = SIZEOP(op_pop_s16, op_pop_s32);
     return 0;
 }
-static int decode_inc_rv(struct decoded_instruction* i)
+static int decode_inc_rv(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_inc_r16, op_inc_r32);
     i->flags = 0;
-    I_SET_RMv(i->flags, rawp[-1] & 7);
+    I_SET_RMv(i->flags, d->rawp[-1] & 7);
     return 0;
 }
-static int decode_dec_rv(struct decoded_instruction* i)
+static int decode_dec_rv(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_dec_r16, op_dec_r32);
     i->flags = 0;
-    I_SET_RMv(i->flags, rawp[-1] & 7);
+    I_SET_RMv(i->flags, d->rawp[-1] & 7);
     return 0;
 }
-static int decode_fpu(struct decoded_instruction* i)
+static int decode_fpu(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t opcode = rawp[-1], modrm = rb();
+    uint8_t opcode = d->rawp[-1], modrm = rb(d);
     if (modrm < 0xC0) {
-        i->flags = parse_modrm(i, modrm, 2);
-        I_SET_OP(i->flags, state_hash & 1);
+        i->flags = parse_modrm(d, i, modrm, 2);
+        I_SET_OP(i->flags, d->state_hash & 1);
         i->handler = op_fpu_mem;
     } else {
         int flags = 0;
         I_SET_REG(flags, modrm >> 3 & 7);
         i->flags = flags;
-        I_SET_OP(i->flags, state_hash & 1);
+        I_SET_OP(i->flags, d->state_hash & 1);
         i->handler = op_fpu_reg;
     }
     i->imm32 = (opcode << 8 & 0x700) | modrm; // FPU opcode as featured in Intel manual
     return 0;
 }
 
-static int decode_arith_00(struct decoded_instruction* i)
+static int decode_arith_00(struct decoder* d, struct decoded_instruction* i)
 {
-    int op = rawp[-1] >> 3 & 7;
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 1);
+    int op = d->rawp[-1] >> 3 & 7;
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 1);
     I_SET_OP(flags, op);
     i->flags = flags;
     i->handler = REGOP(op_arith_e8r8, op_arith_r8r8);
     return 0;
 }
-static int decode_arith_01(struct decoded_instruction* i)
+static int decode_arith_01(struct decoder* d, struct decoded_instruction* i)
 {
-    int op = rawp[-1] >> 3 & 7;
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 0);
+    int op = d->rawp[-1] >> 3 & 7;
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 0);
     I_SET_OP(flags, op);
     i->flags = flags;
     i->handler = REGOP(SIZEOP(op_arith_e16r16, op_arith_e32r32), SIZEOP(op_arith_r16r16, op_arith_r32r32));
     return 0;
 }
-static int decode_arith_02(struct decoded_instruction* i)
+static int decode_arith_02(struct decoder* d, struct decoded_instruction* i)
 {
-    int op = rawp[-1] >> 3 & 7;
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 1);
+    int op = d->rawp[-1] >> 3 & 7;
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 1);
     I_SET_OP(flags, op);
     if (modrm < 0xC0) {
         i->flags = flags;
@@ -805,11 +932,11 @@ static int decode_arith_02(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_arith_03(struct decoded_instruction* i)
+static int decode_arith_03(struct decoder* d, struct decoded_instruction* i)
 {
-    int op = rawp[-1] >> 3 & 7;
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 0);
+    int op = d->rawp[-1] >> 3 & 7;
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 0);
     I_SET_OP(flags, op);
     if (modrm < 0xC0) {
         i->flags = flags;
@@ -820,90 +947,95 @@ static int decode_arith_03(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_arith_04(struct decoded_instruction* i)
+static int decode_arith_04(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
-    I_SET_OP(i->flags, rawp[-1] >> 3 & 7);
+    I_SET_OP(i->flags, d->rawp[-1] >> 3 & 7);
     i->handler = op_arith_r8i8;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_arith_05(struct decoded_instruction* i)
+static int decode_arith_05(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
-    I_SET_OP(i->flags, rawp[-1] >> 3 & 7);
+    I_SET_OP(i->flags, d->rawp[-1] >> 3 & 7);
     i->handler = SIZEOP(op_arith_r16i16, op_arith_r32i32);
-    i->imm32 = rv();
+    i->imm32 = rv(d);
     return 0;
 }
 
-static int decode_xchg(struct decoded_instruction* i)
+static int decode_xchg(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     // R/M is already implied to be zero
-    I_SET_REGv(i->flags, rawp[-1] & 7);
+    I_SET_REGv(i->flags, d->rawp[-1] & 7);
     i->handler = SIZEOP(op_xchg_r16r16, op_xchg_r32r32);
     return 0;
 }
-static int decode_bswap(struct decoded_instruction* i)
+static int decode_bswap(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
-    I_SET_RMv(i->flags, rawp[-1] & 7);
+    I_SET_RMv(i->flags, d->rawp[-1] & 7);
     i->handler = SIZEOP(op_bswap_r16, op_bswap_r32);
     return 0;
 }
 
-static int decode_ud(struct decoded_instruction* i)
+static int decode_ud(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_ud_exception;
     return 1;
 }
 
-static int decode_27(struct decoded_instruction* i)
+static int decode_27(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_daa;
     i->flags = 0;
     return 0;
 }
-static int decode_2F(struct decoded_instruction* i)
+static int decode_2F(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_das;
     i->flags = 0;
     return 0;
 }
-static int decode_37(struct decoded_instruction* i)
+static int decode_37(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_aaa;
     i->flags = 0;
     return 0;
 }
-static int decode_3F(struct decoded_instruction* i)
+static int decode_3F(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_aas;
     i->flags = 0;
     return 0;
 }
-static int decode_38(struct decoded_instruction* i)
+static int decode_38(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 1);
     i->flags = flags;
     i->handler = REGOP(op_cmp_e8r8, op_cmp_r8r8);
     return 0;
 }
-static int decode_39(struct decoded_instruction* i)
+static int decode_39(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 0);
     i->flags = flags;
     i->handler = REGOP(SIZEOP(op_cmp_e16r16, op_cmp_e32r32), SIZEOP(op_cmp_r16r16, op_cmp_r32r32));
     return 0;
 }
-static int decode_3A(struct decoded_instruction* i)
+static int decode_3A(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 1);
     if (modrm < 0xC0) {
         i->flags = flags;
         i->handler = op_cmp_r8e8;
@@ -913,10 +1045,10 @@ static int decode_3A(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_3B(struct decoded_instruction* i)
+static int decode_3B(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0) {
         i->flags = flags;
         i->handler = SIZEOP(op_cmp_r16e16, op_cmp_r32e32);
@@ -926,52 +1058,52 @@ static int decode_3B(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_3C(struct decoded_instruction* i)
+static int decode_3C(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = op_cmp_r8i8;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_3D(struct decoded_instruction* i)
+static int decode_3D(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_cmp_r16i16, op_cmp_r32i32);
-    i->imm32 = rv();
+    i->imm32 = rv(d);
     return 0;
 }
 
-static int decode_60(struct decoded_instruction* i)
+static int decode_60(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_pusha, op_pushad);
     return 0;
 }
-static int decode_61(struct decoded_instruction* i)
+static int decode_61(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_popa, op_popad);
     return 0;
 }
-static int decode_62(struct decoded_instruction* i)
+static int decode_62(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if(modrm >= 0xC0){
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     }
-    i->flags = parse_modrm(i, modrm, 0);
+    i->flags = parse_modrm(d, i, modrm, 0);
     i->handler = SIZEOP(op_bound_r16e16, op_bound_r32e32);
     return 0;
 }
-static int decode_63(struct decoded_instruction* i)
+static int decode_63(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int old_state_hash = cpu.state_hash;
-    state_hash |= STATE_CODE16;
-    i->flags = parse_modrm(i, modrm, 0);
-    state_hash = old_state_hash;
+    uint8_t modrm = rb(d);
+    int old_state_hash = d->base_state_hash;
+    d->state_hash |= STATE_CODE16;
+    i->flags = parse_modrm(d, i, modrm, 0);
+    d->state_hash = old_state_hash;
     if (modrm < 0xC0)
         i->handler = op_arpl_e16;
     else
@@ -979,82 +1111,82 @@ static int decode_63(struct decoded_instruction* i)
     return 0;
 }
 // 64 -- 67 are prefixes
-static int decode_68(struct decoded_instruction* i)
+static int decode_68(struct decoder* d, struct decoded_instruction* i)
 {
-    i->imm32 = rv();
+    i->imm32 = rv(d);
     i->handler = SIZEOP(op_push_i16, op_push_i32);
     i->flags = 0;
     return 0;
 }
-static int decode_69(struct decoded_instruction* i)
+static int decode_69(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     i->handler = REGOP(SIZEOP(op_imul_r16e16i16, op_imul_r32e32i32), SIZEOP(op_imul_r16r16i16, op_imul_r32r32i32));
-    i->imm32 = rvs();
+    i->imm32 = rvs(d);
     return 0;
 }
-static int decode_6A(struct decoded_instruction* i)
+static int decode_6A(struct decoder* d, struct decoded_instruction* i)
 {
-    i->imm32 = rbs();
+    i->imm32 = rbs(d);
     i->handler = SIZEOP(op_push_i16, op_push_i32);
     i->flags = 0;
     return 0;
 }
-static int decode_6B(struct decoded_instruction* i)
+static int decode_6B(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     i->handler = REGOP(SIZEOP(op_imul_r16e16i16, op_imul_r32e32i32), SIZEOP(op_imul_r16r16i16, op_imul_r32r32i32));
-    i->imm32 = rbs();
+    i->imm32 = rbs(d);
     return 0;
 }
-static int decode_6C(struct decoded_instruction* i)
+static int decode_6C(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
 
-    i->handler = state_hash & STATE_ADDR16 ? op_insb16 : op_insb32;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
+    i->handler = d->state_hash & STATE_ADDR16 ? op_insb16 : op_insb32;
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
     return 0;
 }
-static int decode_6D(struct decoded_instruction* i)
+static int decode_6D(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0; // Reset flags if no prefix
     static const insn_handler_t atbl[4] = {
         op_insd32, op_insw32, // STATE_CODE16 set, STATE_ADDR16 not set
         op_insd16, op_insw16 // STATE_CODE16 set, STATE_ADDR16 set
     };
-    i->handler = atbl[state_hash & 3];
+    i->handler = atbl[d->state_hash & 3];
     return 0;
 }
-static int decode_6E(struct decoded_instruction* i)
+static int decode_6E(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = state_hash & STATE_ADDR16 ? op_outsb16 : op_outsb32;
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
+    i->handler = d->state_hash & STATE_ADDR16 ? op_outsb16 : op_outsb32;
     return 0;
 }
-static int decode_6F(struct decoded_instruction* i)
+static int decode_6F(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0; // Reset flags if no prefix
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
     static const insn_handler_t atbl[4] = {
         op_outsd32, op_outsw32, // STATE_CODE16 set, STATE_ADDR16 not set
         op_outsd16, op_outsw16 // STATE_CODE16 set, STATE_ADDR16 set
     };
-    i->handler = atbl[state_hash & 3];
+    i->handler = atbl[d->state_hash & 3];
     return 0;
 }
 // 70 ~ 7F are jcc opcodes
-static int decode_80(struct decoded_instruction* i)
+static int decode_80(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 1);
-    i->imm8 = rb();
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 1);
+    i->imm8 = rb(d);
     if ((modrm & 0x38) == 0x38) {
         i->handler = REGOP(op_cmp_e8i8, op_cmp_r8i8);
     } else {
@@ -1064,11 +1196,11 @@ static int decode_80(struct decoded_instruction* i)
     i->flags = flags;
     return 0;
 }
-static int decode_81(struct decoded_instruction* i)
+static int decode_81(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 0);
-    i->imm32 = rvs();
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 0);
+    i->imm32 = rvs(d);
     if ((modrm & 0x38) == 0x38) {
         i->handler = SIZEOP(REGOP(op_cmp_e16i16, op_cmp_r16i16), REGOP(op_cmp_e32i32, op_cmp_r32i32));
     } else {
@@ -1078,11 +1210,11 @@ static int decode_81(struct decoded_instruction* i)
     i->flags = flags;
     return 0;
 }
-static int decode_83(struct decoded_instruction* i)
+static int decode_83(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 0);
-    i->imm32 = rbs();
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 0);
+    i->imm32 = rbs(d);
     if ((modrm & 0x38) == 0x38) {
         i->handler = SIZEOP(REGOP(op_cmp_e16i16, op_cmp_r16i16), REGOP(op_cmp_e32i32, op_cmp_r32i32));
     } else {
@@ -1092,20 +1224,20 @@ static int decode_83(struct decoded_instruction* i)
     i->flags = flags;
     return 0;
 }
-static int decode_84(struct decoded_instruction* i)
+static int decode_84(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     if (modrm < 0xC0)
         i->handler = op_test_e8r8;
     else
         i->handler = op_test_r8r8;
     return 0;
 }
-static int decode_85(struct decoded_instruction* i)
+static int decode_85(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_test_e16r16, op_test_e32r32);
     else
@@ -1113,20 +1245,20 @@ static int decode_85(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_86(struct decoded_instruction* i)
+static int decode_86(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     if (modrm < 0xC0)
         i->handler = op_xchg_r8e8;
     else
         i->handler = op_xchg_r8r8;
     return 0;
 }
-static int decode_87(struct decoded_instruction* i)
+static int decode_87(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_xchg_r16e16, op_xchg_r32e32);
     else
@@ -1134,27 +1266,27 @@ static int decode_87(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_88(struct decoded_instruction* i)
+static int decode_88(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     if (modrm < 0xC0)
         i->handler = op_mov_e8r8;
     else
         i->handler = op_mov_r8r8;
     return 0;
 }
-static int decode_89(struct decoded_instruction* i)
+static int decode_89(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     i->handler = REGOP(SIZEOP(op_mov_e16r16, op_mov_e32r32), SIZEOP(op_mov_r16r16, op_mov_r32r32));
     return 0;
 }
-static int decode_8A(struct decoded_instruction* i)
+static int decode_8A(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 1);
     if (modrm < 0xC0)
         i->handler = op_mov_r8e8;
     else {
@@ -1164,10 +1296,10 @@ static int decode_8A(struct decoded_instruction* i)
     i->flags = flags;
     return 0;
 }
-static int decode_8B(struct decoded_instruction* i)
+static int decode_8B(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_mov_r16e16, op_mov_r32e32);
     else {
@@ -1177,159 +1309,163 @@ static int decode_8B(struct decoded_instruction* i)
     i->flags = flags;
     return 0;
 }
-static int decode_8C(struct decoded_instruction* i)
+static int decode_8C(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 2);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 2);
     if (modrm < 0xC0)
         i->handler = op_mov_e16s16;
     else
         i->handler = SIZEOP(op_mov_r16s16, op_mov_r32s16);
     return 0;
 }
-static int decode_8D(struct decoded_instruction* i)
+static int decode_8D(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm >= 0xC0) {
         i->handler = op_ud_exception;
         i->flags = 0;
         return 1;
     }
-    i->flags = parse_modrm(i, modrm, 0);
+    i->flags = parse_modrm(d, i, modrm, 0);
     i->handler = SIZEOP(op_lea_r16e16, op_lea_r32e32);
     return 0;
 }
-static int decode_8E(struct decoded_instruction* i)
+static int decode_8E(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    int old_state_hash = cpu.state_hash;
-    state_hash |= STATE_CODE16;
-    i->flags = parse_modrm(i, modrm, 2);
-    state_hash = old_state_hash;
+    uint8_t modrm = rb(d);
+    int old_state_hash = d->base_state_hash;
+    d->state_hash |= STATE_CODE16;
+    i->flags = parse_modrm(d, i, modrm, 2);
+    d->state_hash = old_state_hash;
     if (modrm < 0xC0)
         i->handler = op_mov_s16e16;
     else
         i->handler = op_mov_s16r16;
     return 0;
 }
-static int decode_8F(struct decoded_instruction* i)
+static int decode_8F(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm >= 0xC0) {
-        i->flags = parse_modrm(i, modrm, 0);
+        i->flags = parse_modrm(d, i, modrm, 0);
         i->handler = SIZEOP(op_pop_r16, op_pop_r32);
     } else {
-        i->flags = parse_modrm(i, modrm, 0);
+        i->flags = parse_modrm(d, i, modrm, 0);
         i->handler = SIZEOP(op_pop_e16, op_pop_e32);
     }
     return 0;
 }
-static int decode_90(struct decoded_instruction* i)
+static int decode_90(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_nop;
     return 0;
 }
 
-static int decode_98(struct decoded_instruction* i)
+static int decode_98(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_cbw, op_cwde);
     return 0;
 }
-static int decode_99(struct decoded_instruction* i)
+static int decode_99(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_cwd, op_cdq);
     return 0;
 }
-static int decode_9A(struct decoded_instruction* i)
+static int decode_9A(struct decoder* d, struct decoded_instruction* i)
 {
     // Far call
     i->handler = SIZEOP(op_callf16_ap, op_callf32_ap);
-    i->imm32 = rv();
-    i->disp16 = rw();
+    i->imm32 = rv(d);
+    i->disp16 = rw(d);
     i->flags = 0;
     return 1;
 }
-static int decode_9B(struct decoded_instruction* i)
+static int decode_9B(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_fwait;
     i->flags = 0;
     return 0;
 }
-static int decode_9C(struct decoded_instruction* i)
+static int decode_9C(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_pushf, op_pushfd);
     return 0;
 }
-static int decode_9D(struct decoded_instruction* i)
+static int decode_9D(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_popf, op_popfd);
     return 0;
 }
-static int decode_9E(struct decoded_instruction* i)
+static int decode_9E(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_sahf;
     return 0;
 }
-static int decode_9F(struct decoded_instruction* i)
+static int decode_9F(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_lahf;
     return 0;
 }
 
-static int decode_A0(struct decoded_instruction* i)
+static int decode_A0(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = op_mov_alm8;
-    i->imm32 = state_hash & STATE_ADDR16 ? rw() : rd();
+    i->imm32 = d->state_hash & STATE_ADDR16 ? rw(d) : rd(d);
     i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
     return 0;
 }
-static int decode_A1(struct decoded_instruction* i)
+static int decode_A1(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_mov_axm16, op_mov_eaxm32);
-    i->imm32 = state_hash & STATE_ADDR16 ? rw() : rd();
+    i->imm32 = d->state_hash & STATE_ADDR16 ? rw(d) : rd(d);
     i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
     return 0;
 }
-static int decode_A2(struct decoded_instruction* i)
+static int decode_A2(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = op_mov_m8al;
-    i->imm32 = state_hash & STATE_ADDR16 ? rw() : rd();
+    i->imm32 = d->state_hash & STATE_ADDR16 ? rw(d) : rd(d);
     i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
     return 0;
 }
-static int decode_A3(struct decoded_instruction* i)
+static int decode_A3(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_mov_m16ax, op_mov_m32eax);
-    i->imm32 = state_hash & STATE_ADDR16 ? rw() : rd();
+    i->imm32 = d->state_hash & STATE_ADDR16 ? rw(d) : rd(d);
     i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
     return 0;
 }
 
-static int decode_A4(struct decoded_instruction* i)
+static int decode_A4(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = state_hash & STATE_ADDR16 ? op_movsb16 : op_movsb32;
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
+    i->handler = d->state_hash & STATE_ADDR16 ? op_movsb16 : op_movsb32;
     return 0;
 }
-static int decode_A5(struct decoded_instruction* i)
+static int decode_A5(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    switch (state_hash & 3) {
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
+    switch (d->state_hash & 3) {
     case 0: // 32 bit address, 32-bit data
         i->handler = op_movsd32;
         break;
@@ -1346,20 +1482,20 @@ static int decode_A5(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_A6(struct decoded_instruction* i)
+static int decode_A6(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = state_hash & STATE_ADDR16 ? op_cmpsb16 : op_cmpsb32;
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
+    i->handler = d->state_hash & STATE_ADDR16 ? op_cmpsb16 : op_cmpsb32;
     return 0;
 }
-static int decode_A7(struct decoded_instruction* i)
+static int decode_A7(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    switch (state_hash & 3) {
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
+    switch (d->state_hash & 3) {
     case 0: // 32 bit address, 32-bit data
         i->handler = op_cmpsd32;
         break;
@@ -1376,34 +1512,34 @@ static int decode_A7(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_A8(struct decoded_instruction* i)
+static int decode_A8(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = op_test_r8i8;
     i->flags = 0; // Set R/M to 0
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_A9(struct decoded_instruction* i)
+static int decode_A9(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_test_r16i16, op_test_r32i32);
     i->flags = 0;
-    i->imm32 = rv();
+    i->imm32 = rv(d);
     return 0;
 }
 
-static int decode_AA(struct decoded_instruction* i)
+static int decode_AA(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    //if(PTR_TO_PHYS(rawp) == 0x108796)__asm__("int3");
-    i->handler = state_hash & STATE_ADDR16 ? op_stosb16 : op_stosb32;
+    //if(PTR_TO_PHYS(d->rawp) == 0x108796)__asm__("int3");
+    i->handler = d->state_hash & STATE_ADDR16 ? op_stosb16 : op_stosb32;
     return 0;
 }
-static int decode_AB(struct decoded_instruction* i)
+static int decode_AB(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    switch (state_hash & 3) {
+    switch (d->state_hash & 3) {
     case 0: // 32 bit address, 32-bit data
         i->handler = op_stosd32;
         break;
@@ -1419,20 +1555,20 @@ static int decode_AB(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_AC(struct decoded_instruction* i)
+static int decode_AC(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = state_hash & STATE_ADDR16 ? op_lodsb16 : op_lodsb32;
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
+    i->handler = d->state_hash & STATE_ADDR16 ? op_lodsb16 : op_lodsb32;
     return 0;
 }
-static int decode_AD(struct decoded_instruction* i)
+static int decode_AD(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    switch (state_hash & 3) {
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
+    switch (d->state_hash & 3) {
     case 0: // 32 bit address, 32-bit data
         i->handler = op_lodsd32;
         break;
@@ -1448,18 +1584,18 @@ static int decode_AD(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_AE(struct decoded_instruction* i)
+static int decode_AE(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    i->handler = state_hash & STATE_ADDR16 ? op_scasb16 : op_scasb32;
+    i->handler = d->state_hash & STATE_ADDR16 ? op_scasb16 : op_scasb32;
     return 0;
 }
-static int decode_AF(struct decoded_instruction* i)
+static int decode_AF(struct decoder* d, struct decoded_instruction* i)
 {
-    if (!(state_hash & 4))
+    if (!(d->state_hash & 4))
         i->flags = 0;
-    switch (state_hash & 3) {
+    switch (d->state_hash & 3) {
     case 0:
         i->handler = op_scasd32;
         break;
@@ -1476,162 +1612,164 @@ static int decode_AF(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_C0(struct decoded_instruction* i)
+static int decode_C0(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
         i->handler = op_shift_e8i8;
     else
         i->handler = op_shift_r8i8;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_C1(struct decoded_instruction* i)
+static int decode_C1(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_shift_e16i16, op_shift_e32i32);
     else
         i->handler = SIZEOP(op_shift_r16i16, op_shift_r32i32);
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_C2(struct decoded_instruction* i)
+static int decode_C2(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_ret16_iw, op_ret32_iw);
-    i->imm16 = rw();
+    i->imm16 = rw(d);
     i->flags = 0;
     return 1;
 }
-static int decode_C3(struct decoded_instruction* i)
+static int decode_C3(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_ret16, op_ret32);
     i->flags = 0;
     return 1;
 }
-static int decode_C4(struct decoded_instruction* i)
+static int decode_C4(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm >= 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     } else {
-        i->flags = parse_modrm(i, modrm, 0);
+        i->flags = parse_modrm(d, i, modrm, 0);
         i->handler = SIZEOP(op_les_r16e16, op_les_r32e32);
     }
     return 0;
 }
-static int decode_C5(struct decoded_instruction* i)
+static int decode_C5(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm >= 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     } else {
-        i->flags = parse_modrm(i, modrm, 0);
+        i->flags = parse_modrm(d, i, modrm, 0);
         i->handler = SIZEOP(op_lds_r16e16, op_lds_r32e32);
     }
     return 0;
 }
-static int decode_C6(struct decoded_instruction* i)
+static int decode_C6(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if(modrm >> 3 & 7) {
         // TODO: RTX instructions
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     }
-    i->flags = parse_modrm(i, modrm, 1);
+    i->flags = parse_modrm(d, i, modrm, 1);
     if (modrm >= 0xC0)
         i->handler = op_mov_r8i8;
     else
         i->handler = op_mov_e8i8;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_C7(struct decoded_instruction* i)
+static int decode_C7(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if(modrm >> 3 & 7) {
         // TODO: RTX instructions
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     }
-    i->flags = parse_modrm(i, modrm, 0);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm >= 0xC0)
         i->handler = SIZEOP(op_mov_r16i16, op_mov_r32i32);
     else
         i->handler = SIZEOP(op_mov_e16i16, op_mov_e32i32);
-    i->imm32 = rv();
+    i->imm32 = rv(d);
     return 0;
 }
-static int decode_C8(struct decoded_instruction* i)
+static int decode_C8(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_enter16, op_enter32);
-    i->imm16 = rw();
-    i->disp8 = rb();
+    i->imm16 = rw(d);
+    i->disp8 = rb(d);
     return 0;
 }
-static int decode_C9(struct decoded_instruction* i)
+static int decode_C9(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_leave16, op_leave32);
     return 0;
 }
-static int decode_CA(struct decoded_instruction* i)
+static int decode_CA(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->imm16 = rw();
+    i->imm16 = rw(d);
     i->handler = SIZEOP(op_retf16, op_retf32);
     return 1;
 }
-static int decode_CB(struct decoded_instruction* i)
+static int decode_CB(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->imm16 = 0;
     i->handler = SIZEOP(op_retf16, op_retf32);
     return 1;
 }
-static int decode_CC(struct decoded_instruction* i)
+static int decode_CC(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->imm8 = 3;
     i->handler = op_int;
     return 1;
 }
-static int decode_CD(struct decoded_instruction* i)
+static int decode_CD(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     i->handler = op_int;
     return 1;
 }
-static int decode_CE(struct decoded_instruction* i)
+static int decode_CE(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_into;
     return 0;
 }
-static int decode_CF(struct decoded_instruction* i)
+static int decode_CF(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
     i->handler = SIZEOP(op_iret16, op_iret32);
     return 1;
 }
 
-static int decode_D0(struct decoded_instruction* i)
+static int decode_D0(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
         i->handler = op_shift_e8i8;
@@ -1640,10 +1778,10 @@ static int decode_D0(struct decoded_instruction* i)
     i->imm8 = 1;
     return 0;
 }
-static int decode_D1(struct decoded_instruction* i)
+static int decode_D1(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_shift_e16i16, op_shift_e32i32);
@@ -1652,10 +1790,10 @@ static int decode_D1(struct decoded_instruction* i)
     i->imm8 = 1;
     return 0;
 }
-static int decode_D2(struct decoded_instruction* i)
+static int decode_D2(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
         i->handler = op_shift_e8cl;
@@ -1664,10 +1802,10 @@ static int decode_D2(struct decoded_instruction* i)
     i->imm8 = 1;
     return 0;
 }
-static int decode_D3(struct decoded_instruction* i)
+static int decode_D3(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_shift_e16cl, op_shift_e32cl);
@@ -1675,166 +1813,173 @@ static int decode_D3(struct decoded_instruction* i)
         i->handler = SIZEOP(op_shift_r16cl, op_shift_r32cl);
     return 0;
 }
-static int decode_D4(struct decoded_instruction* i)
+static int decode_D4(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     i->handler = op_aam;
     return 0;
 }
-static int decode_D5(struct decoded_instruction* i)
+static int decode_D5(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     i->handler = op_aad;
     return 0;
 }
-static int decode_D7(struct decoded_instruction* i)
+static int decode_D7(struct decoder* d, struct decoded_instruction* i)
 {
     i->flags = 0;
-    I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = (state_hash & STATE_ADDR16) ? op_xlat16 : op_xlat32;
+    I_SET_SEG_BASE(i->flags, d->seg_prefix[0]);
+    i->handler = (d->state_hash & STATE_ADDR16) ? op_xlat16 : op_xlat32;
     return 0;
 }
 
-static int decode_E0(struct decoded_instruction* i)
+static int decode_E0(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_loopnz_rel16, op_loopnz_rel32);
     i->flags = 0;
-    i->disp32 = state_hash & STATE_ADDR16 ? 0xFFFF : -1;
-    i->imm32 = rbs();
+    i->disp32 = d->state_hash & STATE_ADDR16 ? 0xFFFF : -1;
+    i->imm32 = rbs(d);
     return 0;
 }
-static int decode_E1(struct decoded_instruction* i)
+static int decode_E1(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_loopz_rel16, op_loopz_rel32);
     i->flags = 0;
-    i->disp32 = state_hash & STATE_ADDR16 ? 0xFFFF : -1;
-    i->imm32 = rbs();
+    i->disp32 = d->state_hash & STATE_ADDR16 ? 0xFFFF : -1;
+    i->imm32 = rbs(d);
     return 0;
 }
-static int decode_E2(struct decoded_instruction* i)
+static int decode_E2(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_loop_rel16, op_loop_rel32);
     i->flags = 0;
-    i->disp32 = state_hash & STATE_ADDR16 ? 0xFFFF : -1;
-    i->imm32 = rbs();
+    i->disp32 = d->state_hash & STATE_ADDR16 ? 0xFFFF : -1;
+    i->imm32 = rbs(d);
     return 0;
 }
-static int decode_E3(struct decoded_instruction* i)
+static int decode_E3(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_jecxz_rel16, op_jecxz_rel32);
-    i->disp32 = state_hash & STATE_ADDR16 ? 0xFFFF : -1;
+    i->disp32 = d->state_hash & STATE_ADDR16 ? 0xFFFF : -1;
     i->flags = 0;
-    i->imm32 = rbs();
+    i->imm32 = rbs(d);
     return 0;
 }
-static int decode_E4(struct decoded_instruction* i)
+static int decode_E4(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = op_in_i8al;
     i->flags = 0;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_E5(struct decoded_instruction* i)
+static int decode_E5(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_in_i8ax, op_in_i8eax);
     i->flags = 0;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_E6(struct decoded_instruction* i)
+static int decode_E6(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = op_out_i8al;
     i->flags = 0;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_E7(struct decoded_instruction* i)
+static int decode_E7(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_out_i8ax, op_out_i8eax);
     i->flags = 0;
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     return 0;
 }
-static int decode_E8(struct decoded_instruction* i)
+static int decode_E8(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_call_j16, op_call_j32);
     i->flags = 0;
-    i->imm32 = rvs();
+    i->imm32 = rvs(d);
+    i->disp32 = 0; // Trace link, see STOP_LINKED
     return 1;
 }
-static int decode_E9(struct decoded_instruction* i)
+static int decode_E9(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_jmp_rel16, op_jmp_rel32);
     i->flags = 0;
-    i->imm32 = rvs();
+    i->imm32 = rvs(d);
+    i->disp32 = 0; // Trace link, see STOP_LINKED
     return 1;
 }
-static int decode_EA(struct decoded_instruction* i)
+static int decode_EA(struct decoder* d, struct decoded_instruction* i)
 {
     // Far jump
     i->handler = op_jmpf;
-    i->imm32 = rv();
-    i->disp16 = rw();
+    i->imm32 = rv(d);
+    i->disp16 = rw(d);
     i->flags = 0;
     return 1;
 }
-static int decode_EB(struct decoded_instruction* i)
+static int decode_EB(struct decoder* d, struct decoded_instruction* i)
 {
     // Far jump
     i->handler = SIZEOP(op_jmp_rel16, op_jmp_rel32);
-    i->imm32 = rbs();
+    i->imm32 = rbs(d);
     i->flags = 0;
+    i->disp32 = 0; // Trace link, see STOP_LINKED
     return 1;
 }
-static int decode_EC(struct decoded_instruction* i)
+static int decode_EC(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_in_dxal;
     i->flags = 0;
     return 0;
 }
-static int decode_ED(struct decoded_instruction* i)
+static int decode_ED(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_in_dxax, op_in_dxeax);
     i->flags = 0;
     return 0;
 }
-static int decode_EE(struct decoded_instruction* i)
+static int decode_EE(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_out_dxal;
     i->flags = 0;
     return 0;
 }
-static int decode_EF(struct decoded_instruction* i)
+static int decode_EF(struct decoder* d, struct decoded_instruction* i)
 {
     i->handler = SIZEOP(op_out_dxax, op_out_dxeax);
     i->flags = 0;
     return 0;
 }
 
-static int decode_F4(struct decoded_instruction* i)
+static int decode_F4(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_hlt;
     i->flags = 0;
     return 1;
 }
-static int decode_F5(struct decoded_instruction* i)
+static int decode_F5(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_cmc;
     i->flags = 0;
     return 0;
 }
-static int decode_F6(struct decoded_instruction* i)
+static int decode_F6(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb(), reg = modrm >> 3 & 7;
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d), reg = modrm >> 3 & 7;
+    i->flags = parse_modrm(d, i, modrm, 1);
     if (modrm < 0xC0)
         switch (modrm >> 3 & 7) {
         case 0:
         case 1:
             i->handler = op_test_e8i8;
-            i->imm8 = rb();
+            i->imm8 = rb(d);
             break;
         case 2:
             i->handler = op_not_e8;
@@ -1852,7 +1997,7 @@ static int decode_F6(struct decoded_instruction* i)
         case 0:
         case 1:
             i->handler = op_test_r8i8;
-            i->imm8 = rb();
+            i->imm8 = rb(d);
             break;
         case 2:
             i->handler = op_not_r8;
@@ -1868,16 +2013,16 @@ static int decode_F6(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_F7(struct decoded_instruction* i)
+static int decode_F7(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb(), reg = modrm >> 3 & 7;
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d), reg = modrm >> 3 & 7;
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         switch (modrm >> 3 & 7) {
         case 0:
         case 1:
             i->handler = SIZEOP(op_test_e16i16, op_test_e32i32);
-            i->imm32 = rv();
+            i->imm32 = rv(d);
             break;
         case 2:
             i->handler = SIZEOP(op_not_e16, op_not_e32);
@@ -1895,7 +2040,7 @@ static int decode_F7(struct decoded_instruction* i)
         case 0:
         case 1:
             i->handler = SIZEOP(op_test_r16i16, op_test_r32i32);
-            i->imm32 = rv();
+            i->imm32 = rv(d);
             break;
         case 2:
             i->handler = SIZEOP(op_not_r16, op_not_r32);
@@ -1910,48 +2055,54 @@ static int decode_F7(struct decoded_instruction* i)
         }
     return 0;
 }
-static int decode_F8(struct decoded_instruction* i)
+static int decode_F8(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_clc;
     i->flags = 0;
     return 0;
 }
-static int decode_F9(struct decoded_instruction* i)
+static int decode_F9(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_stc;
     i->flags = 0;
     return 0;
 }
 
-static int decode_FA(struct decoded_instruction* i)
+static int decode_FA(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_cli;
     i->flags = 0;
     return 0;
 }
-static int decode_FB(struct decoded_instruction* i)
+static int decode_FB(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_sti;
     i->flags = 0;
     return 0;
 }
-static int decode_FC(struct decoded_instruction* i)
+static int decode_FC(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_cld;
     i->flags = 0;
     return 0;
 }
-static int decode_FD(struct decoded_instruction* i)
+static int decode_FD(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->handler = op_std;
     i->flags = 0;
     return 0;
 }
 
-static int decode_FE(struct decoded_instruction* i)
+static int decode_FE(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     if (modrm < 0xC0) // MOD != 3
         switch (modrm >> 3 & 7) {
         case 0:
@@ -1978,10 +2129,10 @@ static int decode_FE(struct decoded_instruction* i)
         }
     return 0;
 }
-static int decode_FF(struct decoded_instruction* i)
+static int decode_FF(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0) // MOD != 3
         switch (modrm >> 3 & 7) {
         case 0:
@@ -1992,12 +2143,14 @@ static int decode_FF(struct decoded_instruction* i)
             return 0;
         case 2:
             i->handler = SIZEOP(op_call_e16, op_call_e32);
+            i->imm32 = 0; // Trace link, see STOP_INDIRECT
             return 1;
         case 3:
             i->handler = SIZEOP(op_callf_e16, op_callf_e32);
             return 1;
         case 4:
             i->handler = SIZEOP(op_jmp_e16, op_jmp_e32);
+            i->imm32 = 0; // Trace link, see STOP_INDIRECT
             return 1;
         case 5:
             i->handler = SIZEOP(op_jmpf_e16, op_jmpf_e32);
@@ -2019,9 +2172,11 @@ static int decode_FF(struct decoded_instruction* i)
             return 0;
         case 2:
             i->handler = SIZEOP(op_call_r16, op_call_r32);
+            i->imm32 = 0; // Trace link, see STOP_INDIRECT
             return 1;
         case 4:
             i->handler = SIZEOP(op_jmp_r16, op_jmp_r32);
+            i->imm32 = 0; // Trace link, see STOP_INDIRECT
             return 1;
         case 6:
             i->handler = SIZEOP(op_push_r16, op_push_r32);
@@ -2037,15 +2192,15 @@ static int decode_FF(struct decoded_instruction* i)
     CPU_FATAL("unreachable");
 }
 
-static int decode_0F00(struct decoded_instruction* i)
+static int decode_0F00(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb(), reg = modrm >> 3 & 7;
+    uint8_t modrm = rb(d), reg = modrm >> 3 & 7;
     if ((modrm & 48) == 32) {
         // Handle VERR/VERW
-        int old_state_hash = cpu.state_hash;
-        state_hash |= STATE_CODE16;
-        i->flags = parse_modrm(i, modrm, 0);
-        state_hash = old_state_hash;
+        int old_state_hash = d->base_state_hash;
+        d->state_hash |= STATE_CODE16;
+        i->flags = parse_modrm(d, i, modrm, 0);
+        d->state_hash = old_state_hash;
         if (modrm & 8) {
             // VERW
             i->handler = modrm < 0xC0 ? op_verw_e16 : op_verw_r16;
@@ -2055,7 +2210,7 @@ static int decode_0F00(struct decoded_instruction* i)
         }
         return 0;
     }
-    i->flags = parse_modrm(i, modrm, 6); // 32-bit R/M + Accurate REG
+    i->flags = parse_modrm(d, i, modrm, 6); // 32-bit R/M + Accurate REG
     if (modrm < 0xC0) {
         switch (reg) {
         case 0:
@@ -2070,14 +2225,14 @@ static int decode_0F00(struct decoded_instruction* i)
             i->handler = op_ltr_e16;
             break;
         default:
-            CPU_FATAL("Unknown opcode 0F 00 /%d\n", reg);
+            DECODE_FATAL(d, i, "Unknown opcode 0F 00 /%d\n", reg);
         }
     } else {
         switch (reg) {
         case 0:
         case 1:
             i->imm8 = reg == 0 ? SEG_LDTR : SEG_TR;
-            i->disp32 = state_hash & STATE_CODE16 ? 0xFFFF : -1;
+            i->disp32 = d->state_hash & STATE_CODE16 ? 0xFFFF : -1;
             i->handler = op_str_sldt_r16;
             break;
         case 2:
@@ -2087,15 +2242,15 @@ static int decode_0F00(struct decoded_instruction* i)
             i->handler = op_ltr_r16;
             break;
         default:
-            CPU_FATAL("Unknown opcode 0F 00 /%d\n", reg);
+            DECODE_FATAL(d, i, "Unknown opcode 0F 00 /%d\n", reg);
         }
     }
     return 0;
 }
-static int decode_0F01(struct decoded_instruction* i)
+static int decode_0F01(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb(), reg = modrm >> 3 & 7;
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d), reg = modrm >> 3 & 7;
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0) {
         switch (reg) {
         case 0:
@@ -2151,20 +2306,20 @@ static int decode_0F01(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_0F02(struct decoded_instruction* i)
+static int decode_0F02(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_lar_r16e16, op_lar_r32e32);
     else
         i->handler = SIZEOP(op_lar_r16r16, op_lar_r32r32);
     return 0;
 }
-static int decode_0F03(struct decoded_instruction* i)
+static int decode_0F03(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_lsl_r16e16, op_lsl_r32e32);
     else
@@ -2172,20 +2327,23 @@ static int decode_0F03(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_0F06(struct decoded_instruction* i)
+static int decode_0F06(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_clts;
     return 0;
 }
-static int decode_0F09(struct decoded_instruction* i)
+static int decode_0F09(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_wbinvd;
     return 0;
 }
-static int decode_0F0B(struct decoded_instruction* i)
+static int decode_0F0B(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_ud_exception;
     return 1;
@@ -2233,35 +2391,35 @@ static const int decode_sse10_17_tbl[8 * 4] = {
     MOVHPS_XEqXGq, // F2 0F 17 - invalid
     MOVHPS_XEqXGq // F3 0F 17 - invalid
 };
-static int decode_sse10_17(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sse10_17(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_10_17;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sse10_17_tbl[opcode << 2 | sse_prefix];
+    i->imm8 = decode_sse10_17_tbl[opcode << 2 | d->sse_prefix];
     return 0;
 }
-static int decode_0F18(struct decoded_instruction* i)
+static int decode_0F18(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    parse_modrm(i, modrm, 0); // We're just parsing ModR/M to find how many bytes to skip
+    uint8_t modrm = rb(d);
+    parse_modrm(d, i, modrm, 0); // We're just parsing ModR/M to find how many bytes to skip
     i->flags = 0;
     i->handler = op_prefetchh;
     return 0;
 }
 
-static int decode_0F1F(struct decoded_instruction* i){
-    uint8_t modrm = rb();
-    parse_modrm(i, modrm, 0);
+static int decode_0F1F(struct decoder* d, struct decoded_instruction* i){
+    uint8_t modrm = rb(d);
+    parse_modrm(d, i, modrm, 0);
     i->flags = 0;
     i->handler = op_nop;
     return 0;
 }
 
-static int decode_0F20(struct decoded_instruction* i)
+static int decode_0F20(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm < 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
@@ -2276,9 +2434,9 @@ static int decode_0F20(struct decoded_instruction* i)
     // End the trace here since we might be flushing the TLB
     return 1;
 }
-static int decode_0F21(struct decoded_instruction* i)
+static int decode_0F21(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm < 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
@@ -2292,9 +2450,9 @@ static int decode_0F21(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_0F22(struct decoded_instruction* i)
+static int decode_0F22(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm < 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
@@ -2308,9 +2466,9 @@ static int decode_0F22(struct decoded_instruction* i)
     }
     return 1;
 }
-static int decode_0F23(struct decoded_instruction* i)
+static int decode_0F23(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm < 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
@@ -2369,55 +2527,58 @@ static const int decode_sse28_2F_tbl[8 * 4] = {
     UCOMISS_XGdXEd, // F2 0F 2F - invalid
     UCOMISS_XGdXEd, // F3 0F 2F - invalid
 };
-static int decode_sse28_2F(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sse28_2F(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_28_2F;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sse28_2F_tbl[opcode << 2 | sse_prefix] | ((opcode & 1) << 4);
+    i->imm8 = decode_sse28_2F_tbl[opcode << 2 | d->sse_prefix] | ((opcode & 1) << 4);
     return 0;
 }
 
-static int decode_0F30(struct decoded_instruction* i)
+static int decode_0F30(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_wrmsr;
     return 0;
 }
-static int decode_0F31(struct decoded_instruction* i)
+static int decode_0F31(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_rdtsc;
     return 0;
 }
-static int decode_0F32(struct decoded_instruction* i)
+static int decode_0F32(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_rdmsr;
     return 0;
 }
 
-static int decode_0F38(struct decoded_instruction* i)
+static int decode_0F38(struct decoder* d, struct decoded_instruction* i)
 {
     // Opcode ordering:
     //  [prefixes] 0F 38 <minor opcode> <modr/m> [sib] [disp]
     // The minor opcode we put in imm8
-    i->imm8 = rb();
+    i->imm8 = rb(d);
 
-    uint8_t modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
-    if(sse_prefix == SSE_PREFIX_66) i->handler = op_sse_6638;
+    uint8_t modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
+    if(d->sse_prefix == SSE_PREFIX_66) i->handler = op_sse_6638;
     else i->handler = op_sse_38;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     return 0;
 }
 
-static int decode_sysenter_sysexit(struct decoded_instruction* i) // 0F34, 0F35
+static int decode_sysenter_sysexit(struct decoder* d, struct decoded_instruction* i) // 0F34, 0F35
 {
     i->flags = 0;
-    i->handler = rawp[-1] & 1 ? op_sysexit : op_sysenter;
+    i->handler = d->rawp[-1] & 1 ? op_sysexit : op_sysenter;
     return 0;
 }
 
@@ -2462,13 +2623,13 @@ static const int decode_sse50_57_tbl[8 * 4] = {
     XORPS_XGoXEo, // F2 0F 57 - invalid
     XORPS_XGoXEo // F3 0F 57 - invalid
 };
-static int decode_sse50_57(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sse50_57(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_50_57;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sse50_57_tbl[opcode << 2 | sse_prefix] | ((opcode & 1) << 4);
+    i->imm8 = decode_sse50_57_tbl[opcode << 2 | d->sse_prefix] | ((opcode & 1) << 4);
     return 0;
 }
 static const int decode_sse58_5F_tbl[8 * 4] = {
@@ -2512,13 +2673,13 @@ static const int decode_sse58_5F_tbl[8 * 4] = {
     MAXSD_XGqXEq, // F2 0F 5F
     MAXSS_XGdXEd // F3 0F 5F
 };
-static int decode_sse58_5F(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sse58_5F(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_58_5F;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sse58_5F_tbl[opcode << 2 | sse_prefix];
+    i->imm8 = decode_sse58_5F_tbl[opcode << 2 | d->sse_prefix];
     return 0;
 }
 
@@ -2548,13 +2709,13 @@ static const int decode_sse60_67_tbl[8 * 2] = {
     PACKUSWB_MGqMEq,
     PACKUSWB_XGoXEo
 };
-static int decode_sse60_67(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sse60_67(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_60_67;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sse60_67_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
+    i->imm8 = decode_sse60_67_tbl[opcode << 1 | (d->sse_prefix == SSE_PREFIX_66)];
     return 0;
 }
 
@@ -2599,13 +2760,13 @@ static const int decode_sse68_6F_tbl[8 * 4] = {
     MOVQ_MGqMEq, // F2 0F 6F - invalid
     MOVDQU_XGoXEo // F3 0F 6F
 };
-static int decode_sse68_6F(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sse68_6F(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_68_6F;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sse68_6F_tbl[opcode << 2 | sse_prefix] | ((opcode & 1) << 4);
+    i->imm8 = decode_sse68_6F_tbl[opcode << 2 | d->sse_prefix] | ((opcode & 1) << 4);
     return 0;
 }
 static const int decode_sse70_76_tbl[7 * 4] = {
@@ -2676,18 +2837,18 @@ static const int rm_table_pshift_sse[24] = {
     0, 0, // 4, 5
     PSHIFT_PSLLQ, PSHIFT_PSLLDQ // 6, 7
 };
-static int decode_sse70_76(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sse70_76(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_70_76;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     // Get the opcode information from the table
-    int op = decode_sse70_76_tbl[opcode << 2 | sse_prefix], combined_op = (modrm >> 3 & 7) | ((opcode - 1) & 3) << 3;
+    int op = decode_sse70_76_tbl[opcode << 2 | d->sse_prefix], combined_op = (modrm >> 3 & 7) | ((opcode - 1) & 3) << 3;
     
     // Get immediate, if necessary
     int or = 0;
-    if(op < PCMPEQB_MGqMEq) or = rb();
+    if(op < PCMPEQB_MGqMEq) or = rb(d);
     if((op & 15) == PSHIFT_MGqIb)
         op |= rm_table_pshift_mmx[combined_op] << 4;
     else if((op & 15) == PSHIFT_XEoIb) {
@@ -2701,8 +2862,9 @@ static int decode_sse70_76(struct decoded_instruction* i){
     return 0;
 }
 
-static int decode_0F77(struct decoded_instruction* i)
+static int decode_0F77(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_emms;
     return 0;
@@ -2714,17 +2876,17 @@ static const int decode_7C_7F[4] = {
     HSUBPD_XGoXEo,
     HSUBPS_XGoXEo
 };
-static int decode_sse7C_7D(struct decoded_instruction* i)
+static int decode_sse7C_7D(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t opcode = rawp[-1] & 1, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
-    if(sse_prefix != SSE_PREFIX_F2 && sse_prefix != SSE_PREFIX_66)
+    uint8_t opcode = d->rawp[-1] & 1, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
+    if(d->sse_prefix != SSE_PREFIX_F2 && d->sse_prefix != SSE_PREFIX_66)
         i->handler = op_ud_exception;
     else 
         i->handler = op_sse_7C_7D;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_7C_7F[opcode << 1 | (sse_prefix == SSE_PREFIX_F2)];
+    i->imm8 = decode_7C_7F[opcode << 1 | (d->sse_prefix == SSE_PREFIX_F2)];
     return 0;
 }
 
@@ -2739,17 +2901,17 @@ static const int decode_7E_7F[2 * 4] = {
     MOVQ_MEqMGq, // F2 0F 7F - invalid
     MOVDQU_XEqXGq // F3 0F 7F
 };
-static int decode_sse7E_7F(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 1, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sse7E_7F(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 1, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_7E_7F;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_7E_7F[opcode << 2 | sse_prefix];
+    i->imm8 = decode_7E_7F[opcode << 2 | d->sse_prefix];
     return 0;
 }
 
-static int decode_0FA0(struct decoded_instruction* i)
+static int decode_0FA0(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
     I_SET_RM(flags, FS);
@@ -2757,7 +2919,7 @@ static int decode_0FA0(struct decoded_instruction* i)
     i->handler = SIZEOP(op_push_s16, op_push_s32);
     return 0;
 }
-static int decode_0FA1(struct decoded_instruction* i)
+static int decode_0FA1(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
     I_SET_RM(flags, FS);
@@ -2765,16 +2927,17 @@ static int decode_0FA1(struct decoded_instruction* i)
     i->handler = SIZEOP(op_pop_s16, op_pop_s32);
     return 0;
 }
-static int decode_0FA2(struct decoded_instruction* i)
+static int decode_0FA2(struct decoder* d, struct decoded_instruction* i)
 {
+    UNUSED(d);
     i->flags = 0;
     i->handler = op_cpuid;
     return 0;
 }
-static int decode_0FA3(struct decoded_instruction* i)
+static int decode_0FA3(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 0);
         i->handler = SIZEOP(op_bt_e16, op_bt_e32);
@@ -2785,21 +2948,21 @@ static int decode_0FA3(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_0FA4(struct decoded_instruction* i)
+static int decode_0FA4(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
-    i->imm8 = rb();
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
+    i->imm8 = rb(d);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_shld_e16r16i8, op_shld_e32r32i8);
     else
         i->handler = SIZEOP(op_shld_r16r16i8, op_shld_r32r32i8);
     return 0;
 }
-static int decode_0FA5(struct decoded_instruction* i)
+static int decode_0FA5(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_shld_e16r16cl, op_shld_e32r32cl);
     else
@@ -2807,7 +2970,7 @@ static int decode_0FA5(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_0FA8(struct decoded_instruction* i)
+static int decode_0FA8(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
     I_SET_RM(flags, GS);
@@ -2815,7 +2978,7 @@ static int decode_0FA8(struct decoded_instruction* i)
     i->handler = SIZEOP(op_push_s16, op_push_s32);
     return 0;
 }
-static int decode_0FA9(struct decoded_instruction* i)
+static int decode_0FA9(struct decoder* d, struct decoded_instruction* i)
 {
     int flags = 0;
     I_SET_RM(flags, GS);
@@ -2824,10 +2987,10 @@ static int decode_0FA9(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_0FAB(struct decoded_instruction* i)
+static int decode_0FAB(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 0);
         i->handler = SIZEOP(op_bts_e16, op_bts_e32);
@@ -2838,32 +3001,32 @@ static int decode_0FAB(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_0FAC(struct decoded_instruction* i)
+static int decode_0FAC(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
-    i->imm8 = rb();
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
+    i->imm8 = rb(d);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_shrd_e16r16i8, op_shrd_e32r32i8);
     else
         i->handler = SIZEOP(op_shrd_r16r16i8, op_shrd_r32r32i8);
     return 0;
 }
-static int decode_0FAD(struct decoded_instruction* i)
+static int decode_0FAD(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_shrd_e16r16cl, op_shrd_e32r32cl);
     else
         i->handler = SIZEOP(op_shrd_r16r16cl, op_shrd_r32r32cl);
     return 0;
 }
-static int decode_0FAE(struct decoded_instruction* i)
+static int decode_0FAE(struct decoder* d, struct decoded_instruction* i)
 {
 #if 1
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     switch(modrm >> 3 & 7){
         case 0:
             if(modrm >= 0xC0) {
@@ -2903,7 +3066,7 @@ static int decode_0FAE(struct decoded_instruction* i)
             i->handler = op_mfence;
             break;
         default:
-            CPU_FATAL("Unknown opcode: 0F AE /%d\n", modrm >> 3 & 7);
+            DECODE_FATAL(d, i, "Unknown opcode: 0F AE /%d\n", modrm >> 3 & 7);
     }
     return 0;
 #else
@@ -2911,50 +3074,50 @@ static int decode_0FAE(struct decoded_instruction* i)
     return 1;
 #endif
 }
-static int decode_0FAF(struct decoded_instruction* i)
+static int decode_0FAF(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_imul_r16e16, op_imul_r32e32);
     else
         i->handler = SIZEOP(op_imul_r16r16, op_imul_r32r32);
     return 0;
 }
-static int decode_0FB0(struct decoded_instruction* i)
+static int decode_0FB0(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     i->handler = modrm < 0xC0 ? op_cmpxchg_e8r8 : op_cmpxchg_r8r8;
     return 0;
 }
-static int decode_0FB1(struct decoded_instruction* i)
+static int decode_0FB1(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
-    if (state_hash & STATE_CODE16)
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
+    if (d->state_hash & STATE_CODE16)
         i->handler = modrm < 0xC0 ? op_cmpxchg_e16r16 : op_cmpxchg_r16r16;
     else
         i->handler = modrm < 0xC0 ? op_cmpxchg_e32r32 : op_cmpxchg_r32r32;
     return 0;
 }
-static int decode_0FB2(struct decoded_instruction* i)
+static int decode_0FB2(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm >= 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     } else {
-        i->flags = parse_modrm(i, modrm, 0);
+        i->flags = parse_modrm(d, i, modrm, 0);
         i->handler = SIZEOP(op_lss_r16e16, op_lss_r32e32);
     }
     return 0;
 }
-static int decode_0FB3(struct decoded_instruction* i)
+static int decode_0FB3(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 0);
         i->handler = SIZEOP(op_btr_e16, op_btr_e32);
@@ -2965,67 +3128,67 @@ static int decode_0FB3(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_0FB4(struct decoded_instruction* i)
+static int decode_0FB4(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm >= 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     } else {
-        i->flags = parse_modrm(i, modrm, 0);
+        i->flags = parse_modrm(d, i, modrm, 0);
         i->handler = SIZEOP(op_lfs_r16e16, op_lfs_r32e32);
     }
     return 0;
 }
-static int decode_0FB5(struct decoded_instruction* i)
+static int decode_0FB5(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm >= 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     } else {
-        i->flags = parse_modrm(i, modrm, 0);
+        i->flags = parse_modrm(d, i, modrm, 0);
         i->handler = SIZEOP(op_lgs_r16e16, op_lgs_r32e32);
     }
     return 0;
 }
-static int decode_0FB6(struct decoded_instruction* i)
+static int decode_0FB6(struct decoder* d, struct decoded_instruction* i)
 {
     // movzx
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 3);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 3);
     static const insn_handler_t movzx[4] = {
         op_movzx_r32r8, op_movzx_r16r8,
         op_movzx_r32e8, op_movzx_r16e8
     };
-    i->handler = movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)];
+    i->handler = movzx[(modrm < 0xC0) << 1 | (d->state_hash & STATE_CODE16)];
     return 0;
 }
-static int decode_0FB7(struct decoded_instruction* i)
+static int decode_0FB7(struct decoder* d, struct decoded_instruction* i)
 {
     // movzx
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     static const insn_handler_t movzx[4] = {
         op_movzx_r32r16, op_mov_r16r16,
         op_movzx_r32e16, op_mov_r16e16
     };
-    i->handler = movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)];
+    i->handler = movzx[(modrm < 0xC0) << 1 | (d->state_hash & STATE_CODE16)];
     return 0;
 }
 
-static int decode_0FBA(struct decoded_instruction* i)
+static int decode_0FBA(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if ((modrm & 0x20) == 0) {
         // REG values 0 ... 3 are invalid
         i->handler = op_ud_exception;
         return 1;
     }
-    i->imm8 = rb();
+    i->imm8 = rb(d);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 1);
         switch (modrm >> 3 & 7) {
@@ -3062,10 +3225,10 @@ static int decode_0FBA(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_0FBB(struct decoded_instruction* i)
+static int decode_0FBB(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 0);
         i->handler = SIZEOP(op_btc_e16, op_btc_e32);
@@ -3076,20 +3239,20 @@ static int decode_0FBB(struct decoded_instruction* i)
     }
     return 0;
 }
-static int decode_0FBC(struct decoded_instruction* i)
+static int decode_0FBC(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_bsf_r16e16, op_bsf_r32e32);
     else
         i->handler = SIZEOP(op_bsf_r16r16, op_bsf_r32r32);
     return 0;
 }
-static int decode_0FBD(struct decoded_instruction* i)
+static int decode_0FBD(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm < 0xC0)
         i->handler = SIZEOP(op_bsr_r16e16, op_bsr_r32e32);
     else
@@ -3097,60 +3260,60 @@ static int decode_0FBD(struct decoded_instruction* i)
     return 0;
 }
 
-static int decode_0FBE(struct decoded_instruction* i)
+static int decode_0FBE(struct decoder* d, struct decoded_instruction* i)
 {
     // movzx
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 3);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 3);
     static const insn_handler_t movzx[4] = {
         op_movsx_r32r8, op_movsx_r16r8,
         op_movsx_r32e8, op_movsx_r16e8
     };
-    i->handler = movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)];
+    i->handler = movzx[(modrm < 0xC0) << 1 | (d->state_hash & STATE_CODE16)];
     return 0;
 }
-static int decode_0FBF(struct decoded_instruction* i)
+static int decode_0FBF(struct decoder* d, struct decoded_instruction* i)
 {
     // movzx
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     static const insn_handler_t movzx[4] = {
         op_movsx_r32r16, op_mov_r16r16,
         op_movsx_r32e16, op_mov_r16e16
     };
-    i->handler = movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)];
+    i->handler = movzx[(modrm < 0xC0) << 1 | (d->state_hash & STATE_CODE16)];
     return 0;
 }
 
-static int decode_0FC0(struct decoded_instruction* i)
+static int decode_0FC0(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 1);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 1);
     if (modrm >= 0xC0)
         i->handler = op_xadd_r8r8;
     else
         i->handler = op_xadd_r8e8;
     return 0;
 }
-static int decode_0FC1(struct decoded_instruction* i)
+static int decode_0FC1(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
-    i->flags = parse_modrm(i, modrm, 0);
+    uint8_t modrm = rb(d);
+    i->flags = parse_modrm(d, i, modrm, 0);
     if (modrm >= 0xC0)
         i->handler = SIZEOP(op_xadd_r16r16, op_xadd_r32r32);
     else
         i->handler = SIZEOP(op_xadd_r16e16, op_xadd_r32e32);
     return 0;
 }
-static int decode_0FC7(struct decoded_instruction* i)
+static int decode_0FC7(struct decoder* d, struct decoded_instruction* i)
 {
-    uint8_t modrm = rb();
+    uint8_t modrm = rb(d);
     if (modrm >= 0xC0) {
         i->flags = 0;
         i->handler = op_ud_exception;
         return 1;
     } else {
-        i->flags = parse_modrm(i, modrm, 6); // 32-bit reg, 32-bit rm
+        i->flags = parse_modrm(d, i, modrm, 6); // 32-bit reg, 32-bit rm
         i->handler = op_cmpxchg8b_e32;
         return 0;
     }
@@ -3181,15 +3344,15 @@ static const int decode_sseC2_C6_tbl[5 * 4] = {
     SHUFPS_XGoXEoIb, // F2 0F C6
     SHUFPS_XGoXEoIb // F3 0F C6
 };
-static int decode_sseC2_C6(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sseC2_C6(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_C2_C6;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     opcode -= 2; // C2 --> C0 for easy lookup
-    int op = decode_sseC2_C6_tbl[opcode << 2 | sse_prefix];
-    if(op != MOVNTI_EdGd) op |= rb() << 8;
+    int op = decode_sseC2_C6_tbl[opcode << 2 | d->sse_prefix];
+    if(op != MOVNTI_EdGd) op |= rb(d) << 8;
     i->imm16 = op;
     return 0;
 } 
@@ -3229,14 +3392,14 @@ static const int decode_sseD0_D7_tbl[8 * 4] = {
     PMOVMSKB_GdMEq, // F2 0F D7 - invalid
     PMOVMSKB_GdMEq // F3 0F D7 - invalid
 };
-static int decode_sseD0_D7(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sseD0_D7(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_D0_D7;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     opcode--;
-    i->imm8 = decode_sseD0_D7_tbl[opcode << 2 | sse_prefix];
+    i->imm8 = decode_sseD0_D7_tbl[opcode << 2 | d->sse_prefix];
     return 0;
 }
 static const int decode_sseD8_DF_tbl[8 * 2] = {
@@ -3265,13 +3428,13 @@ static const int decode_sseD8_DF_tbl[8 * 2] = {
     PANDN_MGqMEq,
     PANDN_XGoXEo
 };
-static int decode_sseD8_DF(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sseD8_DF(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_D8_DF;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sseD8_DF_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
+    i->imm8 = decode_sseD8_DF_tbl[opcode << 1 | (d->sse_prefix == SSE_PREFIX_66)];
     return 0;
 }
 static const int decode_sseE0_E7_tbl[8 * 4] = {
@@ -3315,13 +3478,13 @@ static const int decode_sseE0_E7_tbl[8 * 4] = {
     MOVNTQ_MEqMGq, // F2 0F E7 - invalid
     MOVNTQ_MEqMGq // F2 0F E7 - invalid
 };
-static int decode_sseE0_E7(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sseE0_E7(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_E0_E7;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sseE0_E7_tbl[opcode << 2 | sse_prefix];
+    i->imm8 = decode_sseE0_E7_tbl[opcode << 2 | d->sse_prefix];
     return 0;
 }
 
@@ -3351,13 +3514,13 @@ static const int decode_sseE8_EF_tbl[8 * 2] = {
     PXOR_MGqMEq,
     PXOR_XGoXEo
 };
-static int decode_sseE8_EF(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sseE8_EF(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_E8_EF;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sseE8_EF_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
+    i->imm8 = decode_sseE8_EF_tbl[opcode << 1 | (d->sse_prefix == SSE_PREFIX_66)];
     return 0;
 }
 static const int decode_sseF1_F7_tbl[7 * 2] = {
@@ -3383,14 +3546,14 @@ static const int decode_sseF1_F7_tbl[7 * 2] = {
     MASKMOVQ_MEqMGq,
     MASKMOVDQ_XEoXGo
 };
-static int decode_sseF1_F7(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sseF1_F7(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_F1_F7;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     opcode--;
-    i->imm8 = decode_sseF1_F7_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
+    i->imm8 = decode_sseF1_F7_tbl[opcode << 1 | (d->sse_prefix == SSE_PREFIX_66)];
     return 0;
 }
 
@@ -3417,117 +3580,778 @@ static const int decode_sseF8_FE_tbl[7 * 2] = {
     PADDD_MGqMEq,
     PADDD_XGoXEo
 };
-static int decode_sseF8_FE(struct decoded_instruction* i){
-    uint8_t opcode = rawp[-1] & 7, modrm = rb();
-    int flags = parse_modrm(i, modrm, 6);
+static int decode_sseF8_FE(struct decoder* d, struct decoded_instruction* i){
+    uint8_t opcode = d->rawp[-1] & 7, modrm = rb(d);
+    int flags = parse_modrm(d, i, modrm, 6);
     i->handler = op_sse_F8_FE;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
-    i->imm8 = decode_sseF8_FE_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
+    i->imm8 = decode_sseF8_FE_tbl[opcode << 1 | (d->sse_prefix == SSE_PREFIX_66)];
     return 0;
 }
 
-static void set_smc(int length, uint32_t lin)
+// Marks the code of a trace, which covers the bytes given by its trace_info flags (see TRACE_LENGTH)
+static void set_smc(uint32_t flags, uint32_t lin)
 {
-    cpu.tlb_tags[lin >> 12] |= 0x44; // Mark both user and supervisor write TLBs as SMC
-    int b128 = ((cpu.phys_eip + length) >> 7) - (cpu.phys_eip >> 7) + 1;
+    struct tlb_entry* entry = TLB_ENTRY(lin);
+    if (entry->page == lin >> 12)
+        entry->tags |= 0x44; // Mark both user and supervisor write TLBs as SMC
+    uint32_t start = cpu.phys_eip - TRACE_BACK(flags);
+    int b128 = ((start + TRACE_LENGTH(flags)) >> 7) - (start >> 7) + 1;
     for (int i = 0; i < b128; i++)
-        cpu_smc_set_code(cpu.phys_eip + (i << 7));
+        cpu_smc_set_code(start + (i << 7));
 }
 
 // Returns number of instructions translated that should be cached.
-int cpu_decode(struct trace_info* info, struct decoded_instruction* i)
+// ============================================================================
+// Flag liveness
+// ============================================================================
+
+// The two groups of flags that can be written separately: INC and DEC leave CF alone.
+#define FLAGS_CF 1
+#define FLAGS_OSZAP 2
+#define FLAGS_ALL 3
+
+// Register forms that write flags, the handlers to use when the flags they write are dead, and which flags they write
+static const struct {
+    insn_handler_t full, nf;
+    int writes;
+} flag_writers[] = {
+    { op_arith_r8r8, op_arith_r8r8_nf, FLAGS_ALL },
+    { op_arith_r8i8, op_arith_r8i8_nf, FLAGS_ALL },
+    { op_arith_r16r16, op_arith_r16r16_nf, FLAGS_ALL },
+    { op_arith_r16i16, op_arith_r16i16_nf, FLAGS_ALL },
+    { op_arith_r32r32, op_arith_r32r32_nf, FLAGS_ALL },
+    { op_arith_r32i32, op_arith_r32i32_nf, FLAGS_ALL },
+    { op_cmp_r8r8, op_cmp_r8r8_nf, FLAGS_ALL },
+    { op_cmp_r8i8, op_cmp_r8i8_nf, FLAGS_ALL },
+    { op_cmp_r16r16, op_cmp_r16r16_nf, FLAGS_ALL },
+    { op_cmp_r16i16, op_cmp_r16i16_nf, FLAGS_ALL },
+    { op_cmp_r32r32, op_cmp_r32r32_nf, FLAGS_ALL },
+    { op_cmp_r32i32, op_cmp_r32i32_nf, FLAGS_ALL },
+    { op_test_r8r8, op_test_r8r8_nf, FLAGS_ALL },
+    { op_test_r8i8, op_test_r8i8_nf, FLAGS_ALL },
+    { op_test_r16r16, op_test_r16r16_nf, FLAGS_ALL },
+    { op_test_r16i16, op_test_r16i16_nf, FLAGS_ALL },
+    { op_test_r32r32, op_test_r32r32_nf, FLAGS_ALL },
+    { op_test_r32i32, op_test_r32i32_nf, FLAGS_ALL },
+    { op_inc_r8, op_inc_r8_nf, FLAGS_OSZAP },
+    { op_inc_r16, op_inc_r16_nf, FLAGS_OSZAP },
+    { op_inc_r32, op_inc_r32_nf, FLAGS_OSZAP },
+    { op_dec_r8, op_dec_r8_nf, FLAGS_OSZAP },
+    { op_dec_r16, op_dec_r16_nf, FLAGS_OSZAP },
+    { op_dec_r32, op_dec_r32_nf, FLAGS_OSZAP },
+};
+
+// Handlers that neither touch the flags nor fault
+static const insn_handler_t flag_transparent[] = {
+    op_nop, op_mov_r8i8, op_mov_r16i16, op_mov_r32i32, op_mov_r8r8, op_mov_r16r16, op_mov_r32r32,
+    op_lea_r16e16, op_lea_r32e32, op_xchg_r8r8, op_xchg_r16r16, op_xchg_r32r32, op_not_r8,
+    op_not_r16, op_not_r32, op_movzx_r16r8, op_movzx_r32r8, op_movzx_r32r16, op_movsx_r16r8,
+    op_movsx_r32r8, op_movsx_r32r16, op_bswap_r16, op_bswap_r32, op_cbw, op_cwde, op_cwd, op_cdq,
+    op_jmp_rel32_follow,
+};
+
+// Backward flag liveness pass over a finished trace. An instruction whose flags are overwritten before anything reads
+// them is given its _nf handler, along with the distance to the instruction that overwrites them. Flags are considered
+// live at the end of the trace and before any instruction not listed above, which covers everything that can fault (so
+// exception handlers always see correct EFLAGS) or leave the trace.
+static void decode_flags(struct decoder* d, struct decoded_instruction* trace, int count)
+{
+    int live = FLAGS_ALL, kill_all = 0, kill_oszap = 0;
+    for (int k = count - 1; k >= 0; k--) {
+        struct decoded_instruction* i = &trace[k];
+        insn_handler_t handler = i->handler;
+        unsigned int j;
+
+        for (j = 0; j < sizeof(flag_transparent) / sizeof(flag_transparent[0]); j++)
+            if (handler == flag_transparent[j])
+                break;
+        if (j != sizeof(flag_transparent) / sizeof(flag_transparent[0]))
+            continue;
+
+        // Fused ALU + Jcc instructions read the flags they write themselves. INC and DEC also read CF.
+        if (handler == op_fused_cmp_r16r16 || handler == op_fused_cmp_r32r32 || handler == op_fused_cmp_r16i8 || handler == op_fused_cmp_r32i8
+            || handler == op_fused_test_r16r16 || handler == op_fused_test_r32r32 || handler == op_fused_add_r16r16 || handler == op_fused_add_r32r32
+            || handler == op_fused_add_r16i8 || handler == op_fused_add_r32i8 || handler == op_fused_sub_r16r16 || handler == op_fused_sub_r32r32
+            || handler == op_fused_sub_r16i8 || handler == op_fused_sub_r32i8) {
+            live = 0;
+            kill_all = kill_oszap = k;
+            continue;
+        }
+        if (handler == op_fused_inc_r16 || handler == op_fused_inc_r32 || handler == op_fused_dec_r16 || handler == op_fused_dec_r32) {
+            live = (live & ~FLAGS_OSZAP) | FLAGS_CF;
+            kill_oszap = k;
+            continue;
+        }
+
+        for (j = 0; j < sizeof(flag_writers) / sizeof(flag_writers[0]); j++)
+            if (handler == flag_writers[j].full)
+                break;
+        if (j == sizeof(flag_writers) / sizeof(flag_writers[0])) {
+            live = FLAGS_ALL;
+            continue;
+        }
+
+        if (flag_writers[j].writes == FLAGS_ALL) {
+            // ADC and SBB share a handler with the other arithmetic operations, but they read CF
+            int op = I_OP(i->flags);
+            if (handler == op_arith_r8r8 || handler == op_arith_r8i8 || handler == op_arith_r16r16
+                || handler == op_arith_r16i16 || handler == op_arith_r32r32 || handler == op_arith_r32i32) {
+                if (op == 2 || op == 3) {
+                    live = FLAGS_ALL;
+                    continue;
+                }
+            }
+            if (!live && kill_all - k <= I_NF_WINDOW_MAX) {
+                i->handler = flag_writers[j].nf;
+                i->flags |= (kill_all - k) << I_NF_WINDOW_SHIFT;
+                d->stats->dead_flags++;
+            }
+            live = 0;
+            kill_all = kill_oszap = k;
+        } else {
+            // When the handler falls back to computing flags, it reads CF. Whatever wrote CF before us has a window that
+            // reaches at least as far as ours, so it will have computed flags too.
+            if (!(live & FLAGS_OSZAP) && kill_oszap - k <= I_NF_WINDOW_MAX) {
+                i->handler = flag_writers[j].nf;
+                i->flags |= (kill_oszap - k) << I_NF_WINDOW_SHIFT;
+                d->stats->dead_flags++;
+            } else
+                live |= FLAGS_CF;
+            live &= ~FLAGS_OSZAP;
+            kill_oszap = k;
+        }
+    }
+}
+
+// ============================================================================
+// Flat segments
+// ============================================================================
+
+// Memory forms that have a variant skipping the segment base and the 16-bit address mask
+static const struct {
+    insn_handler_t full, flat;
+} flat_handlers[] = {
+    { op_mov_r8e8, op_mov_r8e8_flat },
+    { op_mov_e8r8, op_mov_e8r8_flat },
+    { op_mov_e8i8, op_mov_e8i8_flat },
+    { op_mov_r16e16, op_mov_r16e16_flat },
+    { op_mov_e16r16, op_mov_e16r16_flat },
+    { op_mov_e16i16, op_mov_e16i16_flat },
+    { op_mov_r32e32, op_mov_r32e32_flat },
+    { op_mov_e32r32, op_mov_e32r32_flat },
+    { op_mov_e32i32, op_mov_e32i32_flat },
+    { op_arith_r8e8, op_arith_r8e8_flat },
+    { op_arith_e8r8, op_arith_e8r8_flat },
+    { op_arith_e8i8, op_arith_e8i8_flat },
+    { op_arith_r16e16, op_arith_r16e16_flat },
+    { op_arith_e16r16, op_arith_e16r16_flat },
+    { op_arith_e16i16, op_arith_e16i16_flat },
+    { op_arith_r32e32, op_arith_r32e32_flat },
+    { op_arith_e32r32, op_arith_e32r32_flat },
+    { op_arith_e32i32, op_arith_e32i32_flat },
+    { op_cmp_e8r8, op_cmp_e8r8_flat },
+    { op_cmp_r8e8, op_cmp_r8e8_flat },
+    { op_cmp_e8i8, op_cmp_e8i8_flat },
+    { op_cmp_e32r32, op_cmp_e32r32_flat },
+    { op_cmp_r32e32, op_cmp_r32e32_flat },
+    { op_cmp_e32i32, op_cmp_e32i32_flat },
+    { op_movzx_r32e8, op_movzx_r32e8_flat },
+    { op_movzx_r32e16, op_movzx_r32e16_flat },
+    { op_movsx_r32e8, op_movsx_r32e8_flat },
+    { op_movsx_r32e16, op_movsx_r32e16_flat },
+    { op_push_e32, op_push_e32_flat },
+};
+
+// Pass over a finished trace decoded while CS, DS, ES, and SS all have a base of zero (STATE_FLAT). Instructions that use
+// 32-bit addressing through one of those segments are given their _flat handler. The state hash is part of the key a
+// trace is looked up by, so these handlers never run after a segment load has moved one of the bases.
+static void decode_flat(struct decoder* d, struct decoded_instruction* trace, int count)
+{
+    for (int k = 0; k < count; k++) {
+        struct decoded_instruction* i = &trace[k];
+        for (unsigned int j = 0; j < sizeof(flat_handlers) / sizeof(flat_handlers[0]); j++) {
+            if (i->handler != flat_handlers[j].full)
+                continue;
+            if (!(i->flags >> I_ADDR16_SHIFT & 1) && (I_SEG_BASE(i->flags)) <= DS) {
+                i->handler = flat_handlers[j].flat;
+                d->stats->flat_handlers++;
+            }
+            break;
+        }
+    }
+}
+
+// ============================================================================
+// Addressing forms
+// ============================================================================
+
+enum {
+    ADDR_FORM_DISP, // [disp]
+    ADDR_FORM_BASE, // [base]
+    ADDR_FORM_BASE_DISP, // [base+disp]
+    ADDR_FORM_INDEX, // Anything with an index register, which keeps the general handler
+    ADDR_FORMS
+};
+
+#define FORMS(name)                                                       \
+    {                                                                     \
+        #name, name, {                                                    \
+            { name##_disp, name##_base, name##_base_disp },               \
+            { name##_disp_flat, name##_base_flat, name##_base_disp_flat } \
+        }                                                                 \
+    }
+// Memory forms that have a variant for each addressing form, indexed by [flat][form]
+static const struct {
+    const char* name;
+    insn_handler_t full, forms[2][ADDR_FORM_INDEX];
+} form_handlers[] = {
+    FORMS(op_mov_r8e8),
+    FORMS(op_mov_e8r8),
+    FORMS(op_mov_r16e16),
+    FORMS(op_mov_e16r16),
+    FORMS(op_mov_r32e32),
+    FORMS(op_mov_e32r32),
+    FORMS(op_mov_e32i32),
+    FORMS(op_arith_r32e32),
+    FORMS(op_arith_e32r32),
+    FORMS(op_arith_e32i32),
+    FORMS(op_cmp_r32e32),
+    FORMS(op_cmp_e32r32),
+    FORMS(op_cmp_e32i32),
+};
+#define FORM_HANDLERS (sizeof(form_handlers) / sizeof(form_handlers[0]))
+
+// Number of times each of the handlers above was decoded, by addressing form, on the CPU core and by the background
+// decoder. These are what decides which handlers are worth keeping variants of.
+static uint32_t form_counts[2][FORM_HANDLERS][ADDR_FORMS];
+
+// Pass over a finished trace that gives instructions with a handler in form_handlers the variant for their addressing
+// form. The flat variants are chosen under the same conditions as decode_flat, which runs afterwards for the handlers
+// that are not specialised here.
+static void decode_addr_forms(struct decoder* d, struct decoded_instruction* trace, int count)
+{
+    int flat_state = d->base_state_hash & STATE_FLAT;
+    for (int k = 0; k < count; k++) {
+        struct decoded_instruction* i = &trace[k];
+        for (unsigned int j = 0; j < FORM_HANDLERS; j++) {
+            if (i->handler != form_handlers[j].full)
+                continue;
+            uint32_t flags = i->flags;
+            int form, flat = flat_state && !(flags >> I_ADDR16_SHIFT & 1) && (I_SEG_BASE(flags)) <= DS;
+            if ((I_INDEX(flags)) != EZR)
+                form = ADDR_FORM_INDEX;
+            else if ((I_BASE(flags)) == EZR)
+                form = ADDR_FORM_DISP;
+            else
+                form = i->disp32 ? ADDR_FORM_BASE_DISP : ADDR_FORM_BASE;
+            form_counts[d->background][j][form]++;
+            switch (form) {
+            case ADDR_FORM_DISP:
+                d->stats->addr_form_disp++;
+                break;
+            case ADDR_FORM_BASE:
+                d->stats->addr_form_base++;
+                break;
+            case ADDR_FORM_BASE_DISP:
+                d->stats->addr_form_base_disp++;
+                break;
+            case ADDR_FORM_INDEX:
+                d->stats->addr_form_index++;
+                break;
+            }
+            if (form != ADDR_FORM_INDEX) {
+                i->handler = form_handlers[j].forms[flat][form];
+                if (flat)
+                    d->stats->flat_handlers++;
+            }
+            break;
+        }
+    }
+}
+
+void cpu_decode_print_forms(void)
 {
-    state_hash = cpu.state_hash;
-    rawp = get_phys_ram_ptr(cpu.phys_eip, 0);
-    uint8_t* rawp_base = rawp;
-    uintptr_t high_mark = (uintptr_t)(get_phys_ram_ptr ((cpu.phys_eip & ~0xFFF) + 0xFF0, 0));
-    void* original = i;
-    //if(cpu.phys_eip == 0x1102b8) __asm__("int3");
+    printf("Addressing forms decoded ([disp] [base] [base+disp] [index]):\n");
+    for (unsigned int j = 0; j < FORM_HANDLERS; j++)
+        printf("  %-20s %10u %10u %10u %10u\n", form_handlers[j].name,
+            form_counts[0][j][ADDR_FORM_DISP] + form_counts[1][j][ADDR_FORM_DISP],
+            form_counts[0][j][ADDR_FORM_BASE] + form_counts[1][j][ADDR_FORM_BASE],
+            form_counts[0][j][ADDR_FORM_BASE_DISP] + form_counts[1][j][ADDR_FORM_BASE_DISP],
+            form_counts[0][j][ADDR_FORM_INDEX] + form_counts[1][j][ADDR_FORM_INDEX]);
+}
+
+// ============================================================================
+// Superblocks
+// ============================================================================
 
-    int instructions_translated = 0, instructions_mask = -1;
+// A direct jump or call to elsewhere on the same page does not have to end the trace. Decoding carries on at its target
+// instead, and the instruction is given a _follow handler that moves EIP there and falls through to the next entry.
+// Nothing else changes for the instructions after it: every handler keeps cpu.phys_eip up to date itself, so a taken
+// branch or an exception leaves the trace from the middle with the right EIP, just like it does in a straight trace.
+//
+// No two instructions of a trace may start at the same address, since that is how cpu_trace_sync finds the one that is
+// running. So a trace only follows a jump to code it has not decoded yet, and ends where it would run into such code.
+struct superblock {
+    int runs;
+    // Page offsets of the straight runs of code decoded before each jump that was followed
+    int start[SUPERBLOCK_MAX_JUMPS], end[SUPERBLOCK_MAX_JUMPS];
+};
+
+static int superblock_covers(struct superblock* sb, int offset)
+{
+    for (int k = 0; k < sb->runs; k++)
+        if (offset >= sb->start[k] && offset < sb->end[k])
+            return 1;
+    return 0;
+}
+
+// Called with a trace-ending instruction that has just been decoded, and the run of code it belongs to. Returns 1, and
+// points the decoder at the target, if decoding can carry on there.
+static int decode_follow(struct decoder* d, struct superblock* sb, struct decoded_instruction* i, uint8_t** run_start)
+{
+    if ((i->handler != op_jmp_rel32 && i->handler != op_call_j32) || sb->runs == SUPERBLOCK_MAX_JUMPS)
+        return 0;
+    int start = *run_start - d->page, end = d->rawp - d->page, target = end + (int32_t)i->imm32;
+    if (target < 0 || target >= 4096 || (target >= start && target < end) || superblock_covers(sb, target))
+        return 0;
+    sb->start[sb->runs] = start;
+    sb->end[sb->runs++] = end;
+    i->handler = i->handler == op_jmp_rel32 ? op_jmp_rel32_follow : op_call_j32_follow;
+    d->rawp = d->page + target;
+    *run_start = d->rawp;
+    d->stats->superblock_jumps++;
+    return 1;
+}
+
+static int decode_is_call(insn_handler_t handler)
+{
+    return handler == op_call_j16 || handler == op_call_j32 || handler == op_call_r16 || handler == op_call_r32
+        || handler == op_call_e16 || handler == op_call_e32;
+}
+
+// Returns the trace_info flags for a trace whose last run of code ends where the decoder is (see TRACE_LENGTH and
+// TRACE_BACK)
+static uint32_t superblock_span(struct decoder* d, struct superblock* sb, uint8_t* run_start)
+{
+    int phys = d->phys & 0xFFF, lo = run_start - d->page, hi = d->rawp - d->page;
+    for (int k = 0; k < sb->runs; k++) {
+        if (sb->start[k] < lo)
+            lo = sb->start[k];
+        if (sb->end[k] > hi)
+            hi = sb->end[k];
+    }
+    if (sb->runs) {
+        d->followed = 1;
+        d->stats->superblocks++;
+    }
+    return (hi - lo) | (phys - lo) << 16;
+}
+
+// ============================================================================
+// Decode memo
+// ============================================================================
+
+// A trace is decoded again every time it leaves the trace cache, whether through a flush, an SMC write, or a remap, and
+// the same code often shows up at more than one physical address (a DLL mapped into several processes). Decoded
+// instructions don't depend on where they are: branches keep their displacement, and links start out empty. So a trace
+// decoded from the same bytes in the same state can be copied instead. The memo is indexed by a hash of the first bytes
+// of the trace and the state hash. Each entry keeps all the bytes that its trace was decoded from, and an entry is only
+// used if they still match.
+//
+// Only traces that end on their own are kept. One that followed a jump, or stopped at the end of its page, might decode
+// differently at another position on a page.
+#define DECODE_MEMO_SIZE 256
+#define DECODE_MEMO_BYTES (DEFAULT_TRACE_SIZE * 15)
+struct decode_memo {
+    uint32_t state_hash, max_instructions, length, count; // count is 0 if the entry is empty
+    uint8_t bytes[DECODE_MEMO_BYTES];
+    struct decoded_instruction insns[DEFAULT_TRACE_SIZE];
+};
+static struct decode_memo decode_memo[DECODE_MEMO_SIZE];
+
+// Returns the entry for the trace the decoder is at, which must have 16 bytes left on its page
+static struct decode_memo* decode_memo_entry(struct decoder* d, uint32_t max_instructions)
+{
+    uint32_t w[4];
+    memcpy(w, d->rawp, sizeof(w));
+    uint32_t hash = (w[0] * 0x9E3779B1 ^ w[1]) * 0x85EBCA77 ^ (w[2] * 0xC2B2AE3D ^ w[3]) ^ d->state_hash * 0x27D4EB2F ^ max_instructions;
+    hash ^= hash >> 15;
+    return &decode_memo[(hash ^ hash >> 8) & (DECODE_MEMO_SIZE - 1)];
+}
+
+// Copies the trace the decoder is at out of the memo, and returns the number of instructions copied, or 0 if it isn't there
+static int decode_memo_lookup(struct decoder* d, struct decode_memo* memo, struct decoded_instruction* i, uint32_t max_instructions)
+{
+    uint32_t start = d->phys & 0xFFF, end = start + memo->length;
+    if (!memo->count || memo->state_hash != (uint32_t)d->state_hash || memo->max_instructions != max_instructions || end > 4096
+        || memcmp(d->rawp, memo->bytes, memo->length))
+        return 0;
+    // A direct jump at the end of the trace that had nowhere to go on its old page may be one that decode_follow takes here
+    struct decoded_instruction* last = &memo->insns[memo->count - 1];
+    if (last->handler == op_trace_end && memo->count > 1)
+        last--;
+    if (last->handler == op_jmp_rel32 || last->handler == op_call_j32) {
+        uint32_t target = end + last->imm32;
+        if (target < 4096 && (target < start || target >= end))
+            return 0;
+    }
+    memcpy(i, memo->insns, memo->count * sizeof(struct decoded_instruction));
+    return memo->count;
+}
+
+// Keeps a trace that has just been decoded, and ended where the decoder is now
+static void decode_memo_store(struct decoder* d, struct decode_memo* memo, struct decoded_instruction* i, uint32_t count,
+    uint32_t length, uint32_t max_instructions)
+{
+    if (count > DEFAULT_TRACE_SIZE || length > DECODE_MEMO_BYTES)
+        return;
+    memo->state_hash = d->base_state_hash;
+    memo->max_instructions = max_instructions;
+    memo->length = length;
+    memo->count = count;
+    memcpy(memo->bytes, d->rawp - length, length);
+    memcpy(memo->insns, i, count * sizeof(struct decoded_instruction));
+}
+
+// ============================================================================
+// Trace decoding
+// ============================================================================
+
+// Runs the passes over a finished trace of "count" instructions, and ends it with an op_trace_end entry if "end" is set.
+// Returns the number of entries in the trace.
+static int decode_finish(struct decoder* d, struct decoded_instruction* trace, int count, int end)
+{
+#ifndef INSTRUMENT
+    decode_flags(d, trace, count);
+#endif
+    decode_addr_forms(d, trace, count);
+    if (d->base_state_hash & STATE_FLAT)
+        decode_flat(d, trace, count);
+    if (end) {
+        trace[count].handler = op_trace_end;
+        trace[count].disp32 = 0;
+        count++;
+    }
+    return count;
+}
+
+// Decodes the trace that the decoder has been reset to into "i", and returns the number of entries written. *flags is set
+// to the trace_info flags of the trace, or to -1 if it can't be kept: either its first instruction crosses onto the next
+// page, which then has to be read through the TLB, or (for the background decoder, which can't do that) it needs to be
+// decoded by the CPU core. An instruction that faults while being read leaves a single op_trace_end entry behind, and
+// returns 0.
+static int decode_trace(struct decoder* d, struct decoded_instruction* i, int max_instructions, uint32_t* flags)
+{
+    uint8_t *high_mark = d->page + 0xFF0, *run_start = d->rawp;
+    struct superblock sb;
+    sb.runs = 0;
+    struct decoded_instruction* original = i;
+    *flags = -1;
+
+    int instructions_translated = 0;
     while (1) {
-        if ((uintptr_t)rawp > high_mark) {
+        if (d->rawp > high_mark) {
             // Determine instruction length and see if goes off the end of the page
-            uint32_t current_phys_eip = PTR_TO_PHYS(rawp), maximum_insn_length = 0x1000 - (current_phys_eip & 0xFFF);
-            //if(current_phys_eip == 0x4d9ffd) __asm__("int3");
-            //printf("[pos: %08x] Instruction length: %d\n", current_phys_eip, find_instruction_length(maximum_insn_length));
-            //if(current_phys_eip == 0x01ef8ffb) __asm__("int3");
-            //if (LIN_EIP() == 0x5ad72fff)
-            //    __asm__("int3");
-            if (maximum_insn_length > 15 || find_instruction_length(maximum_insn_length) == -1) {
+            uint32_t maximum_insn_length = 0x1000 - (d->rawp - d->page);
+            if (maximum_insn_length > 15 || find_instruction_length(d, maximum_insn_length) == -1) {
                 if (instructions_translated != 0) {
                     // End the trace here
-                    i->handler = op_trace_end;
-                    instructions_translated++;
-                    int length = (uintptr_t)rawp - (uintptr_t)rawp_base;
-                    if(instructions_mask != 0){ 
-                    info->phys = cpu.phys_eip;
-                    info->state_hash = cpu.state_hash;
-                    info->flags = length;
-                    info->ptr = original;
-                    set_smc(length, LIN_EIP());
-                    }
-                    return instructions_translated & instructions_mask;
+                    d->page_end = 1;
+                    *flags = superblock_span(d, &sb, run_start);
+                    return decode_finish(d, original, i - original, 1);
                 }
+                if (d->background)
+                    return 0;
                 uint32_t lin_eip = LIN_EIP();
 
 #define EXCEPTION_HANDLER          \
     do {                           \
         i->handler = op_trace_end; \
+        i->disp32 = 0;             \
         return 0;                  \
     } while (0)
                     uint32_t next_page = (lin_eip + 15) & ~0xFFF;
-                    uint8_t tlb_tag = cpu.tlb_tags[next_page >> 12];
-                    if (TLB_ENTRY_INVALID8(next_page, tlb_tag, cpu.tlb_shift_read) || cpu.tlb_attrs[next_page >> 12] & TLB_ATTR_NX) {
+                    uint8_t tlb_tag = TLB_TAGS(next_page);
+                    if (TLB_ENTRY_INVALID8(next_page, tlb_tag, cpu.tlb_shift_read) || TLB_ATTRS(next_page) & TLB_ATTR_NX) {
                         if (cpu_mmu_translate(next_page, cpu.tlb_shift_read | 8)) 
                             EXCEPTION_HANDLER;
                     }
                 // This is the only point at which an exception can be raised.
                 for (int j = 0; j < 15; j++)
-                    cpu_read8(lin_eip + j, prefetch[j], cpu.tlb_shift_read);
+                    cpu_read8(lin_eip + j, d->prefetch[j], cpu.tlb_shift_read);
 
-                rawp = prefetch;
-                instructions_translated = 1000; // Set this to an absurdly high value
-                instructions_mask = 0; // Don't cache this
+                // Decode the one instruction from the copy, and don't cache it
+                d->rawp = d->prefetch;
+                table[*d->rawp++](d, i);
+                i->flags = (i->flags & ~15) | (d->rawp - d->prefetch);
+                return decode_finish(d, original, 1, 1);
             }
             // Otherwise, the entire instruction can be read.
         }
 
         // Now, we have established that we will not fault while we fetch the opcode from memory.
 
-        uint8_t *prev_rawp = rawp, opcode = *rawp++;
+        uint8_t *prev_rawp = d->rawp, opcode = *d->rawp++;
 #ifdef TEST_CLEAR_FLAGS
         i->flags = 0x12345678;
 #endif
-        int end_of_trace = table[opcode](i);
+        int end_of_trace = table[opcode](d, i);
 #ifdef TEST_CLEAR_FLAGS
         if (i->flags == 0x12345678)
             CPU_FATAL("Opcode %02x is buggy\n", opcode);
 #endif
         instructions_translated++;
-        i->flags = (i->flags & ~15) | ((uintptr_t)rawp - (uintptr_t)prev_rawp);
+        i->flags = (i->flags & ~15) | ((uintptr_t)d->rawp - (uintptr_t)prev_rawp);
+#ifndef INSTRUMENT
+        // Instrumentation expects to see every instruction, so don't fuse in that case
+        if (i != original && decode_fuse(d, i - 1, i)) {
+            i--;
+            instructions_translated--;
+        }
+#endif
         ++i;
 
-        if (end_of_trace || instructions_translated >= (MAX_TRACE_SIZE-1)) {
-            if (!end_of_trace) {
-                // Handles the case where trace is too long or is a single-instruction trace.
-                i->handler = op_trace_end;
-                instructions_translated++;
-            }
-            int length = (uintptr_t)rawp - (uintptr_t)rawp_base;
-            if (instructions_mask != 0) { // Don't commit page split traces
-                info->phys = cpu.phys_eip;
-                info->state_hash = cpu.state_hash;
-                info->flags = length;
-                info->ptr = original;
-                set_smc(length, LIN_EIP());
-            }
-            return instructions_translated & instructions_mask;
+        if (end_of_trace && instructions_translated < max_instructions)
+            end_of_trace = !decode_follow(d, &sb, i - 1, &run_start);
+        // A trace that has followed a jump ends where it would run into code it already has, as if it had become too long
+        if (end_of_trace || instructions_translated >= max_instructions || (sb.runs && superblock_covers(&sb, d->rawp - d->page))) {
+            *flags = superblock_span(d, &sb, run_start);
+            // Handles the case where trace is too long or is a single-instruction trace. A call that ends the trace gets
+            // one too, which never runs: its link is where the call keeps the trace it returns to (see cpu_push_return).
+            return decode_finish(d, original, i - original, !end_of_trace || decode_is_call(i[-1].handler));
         }
     }
 }
 
+// ============================================================================
+// Background decoding
+// ============================================================================
+
+// On a multi-core host, a spare core can decode traces before the CPU needs them. Whenever the CPU core decodes a trace,
+// it asks for the traces that it can leave to on the same page (its fall-through, and the target of a direct branch at
+// its end) that aren't in the trace cache yet. cpu_decode_ahead, running on the other core, decodes them into a staging
+// area, and the next cpu_decode for one of them just copies it into the trace cache.
+//
+// The two cores share nothing but two lock-free structures:
+//  - A single-producer, single-consumer ring of requests, written by the CPU core and read by the worker.
+//  - A direct-mapped table of staging slots. Each slot is owned by whichever core moved it out of DECODE_AHEAD_EMPTY or
+//    DECODE_AHEAD_READY with a compare-and-swap, and handed back with a release store once the other core may use it.
+// The worker decodes from a private copy of the guest page, since the CPU core may be writing to it at the same time, and
+// keeps the bytes the trace was decoded from. The CPU core only takes a staged trace if those bytes still match guest
+// memory, which it alone writes to. A trace decoded from code that has since been modified is thrown away, exactly like
+// one that SMC invalidation would have dropped, so a race with the guest can only cost a decode.
+//
+// The worker counts what its decoding passes do in decode_ahead_stats instead of cpu_stats, and cpu_decode_add_stats adds
+// them in for display.
+#define DECODE_AHEAD_REQUESTS 64
+#define DECODE_AHEAD_SLOTS 16
+enum {
+    DECODE_AHEAD_EMPTY,
+    DECODE_AHEAD_BUSY, // Being decoded into by the worker
+    DECODE_AHEAD_READY,
+    DECODE_AHEAD_TAKING // Being copied out by the CPU core
+};
+struct decode_ahead_request {
+    uint32_t phys, state_hash, max_instructions;
+};
+struct decode_ahead_slot {
+    uint32_t state, phys, state_hash, max_instructions;
+    uint32_t flags, count, start, length; // The trace covers "length" bytes of its page from "start"
+    uint8_t bytes[4096];
+    struct decoded_instruction insns[MAX_TRACE_SIZE];
+};
+static struct decode_ahead_request decode_ahead_requests[DECODE_AHEAD_REQUESTS];
+static uint32_t decode_ahead_head, decode_ahead_tail, decode_ahead_running;
+static struct decode_ahead_slot decode_ahead_slots[DECODE_AHEAD_SLOTS];
+static struct cpu_stats decode_ahead_stats;
+
+static inline struct decode_ahead_slot* decode_ahead_slot(uint32_t phys)
+{
+    return &decode_ahead_slots[(phys ^ phys >> 7) & (DECODE_AHEAD_SLOTS - 1)];
+}
+
+// Asks the worker for the trace at "phys", unless it is already cached. Called on the CPU core.
+static void decode_ahead_request(uint32_t phys, uint32_t max_instructions)
+{
+    uint32_t link = -1, head = decode_ahead_head;
+    if ((phys >> 12) >= cpu.smc_has_code_length)
+        return;
+    cpu_trace_find(phys, &link);
+    if (link != (uint32_t)-1)
+        return;
+    if (head - __atomic_load_n(&decode_ahead_tail, __ATOMIC_ACQUIRE) == DECODE_AHEAD_REQUESTS)
+        return; // The worker is behind, so this one would be stale by the time it got to it
+    struct decode_ahead_request* request = &decode_ahead_requests[head & (DECODE_AHEAD_REQUESTS - 1)];
+    request->phys = phys;
+    request->state_hash = cpu.state_hash;
+    request->max_instructions = max_instructions;
+    __atomic_store_n(&decode_ahead_head, head + 1, __ATOMIC_RELEASE);
+#if defined(__aarch64__) || defined(__arm__)
+    __asm__ volatile("sev"); // Wakes the worker if it is waiting for a request (see mainloop_multi_core_three)
+#endif
+    cpu_stats.decode_ahead_requests++;
+}
+
+// Requests the traces that a trace of "count" entries, which ended where the decoder is, can leave to on its page
+static void decode_ahead_exits(struct decoder* d, struct decoded_instruction* trace, int count, uint32_t max_instructions)
+{
+    uint32_t page = d->phys & ~0xFFF, end = d->rawp - d->page;
+    if (!__atomic_load_n(&decode_ahead_running, __ATOMIC_RELAXED))
+        return;
+    if (end < 4096)
+        decode_ahead_request(page | end, max_instructions);
+
+    struct decoded_instruction* last = &trace[count - 1];
+    if (last->handler == op_trace_end && count > 1)
+        last--;
+    int branch = last->handler == op_jmp_rel32 || last->handler == op_call_j32;
+    for (int cond = 0; cond < 16 && !branch; cond++)
+        branch = last->handler == jcc32[cond];
+    if (branch && end + last->imm32 < 4096)
+        decode_ahead_request(page | (end + last->imm32), max_instructions);
+}
+
+// Copies the trace the decoder is at out of the staging area. Returns the number of entries, with its trace_info flags in
+// *flags, or 0 if the worker has not decoded it. Called on the CPU core.
+static int decode_ahead_take(struct decoder* d, struct decoded_instruction* i, uint32_t max_instructions, uint32_t* flags)
+{
+    struct decode_ahead_slot* slot = decode_ahead_slot(d->phys);
+    uint32_t expected = DECODE_AHEAD_READY;
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != DECODE_AHEAD_READY
+        || !__atomic_compare_exchange_n(&slot->state, &expected, DECODE_AHEAD_TAKING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    int count = 0;
+    if (slot->phys == d->phys && slot->state_hash == (uint32_t)d->base_state_hash && slot->max_instructions == max_instructions) {
+        if (!memcmp(d->page + slot->start, slot->bytes, slot->length)) {
+            count = slot->count;
+            memcpy(i, slot->insns, count * sizeof(struct decoded_instruction));
+            *flags = slot->flags;
+            cpu_stats.decode_ahead_hits++;
+        } else
+            cpu_stats.decode_ahead_stale++;
+    }
+    __atomic_store_n(&slot->state, count || slot->phys == d->phys ? DECODE_AHEAD_EMPTY : DECODE_AHEAD_READY, __ATOMIC_RELEASE);
+    return count;
+}
+
+// Decodes the traces that the CPU core has asked for. Returns the number of requests handled, so that the caller can
+// idle once there are none. Must only ever be called from one core.
+int cpu_decode_ahead(void)
+{
+    static struct decoder decoder;
+    static uint8_t page[4096];
+    struct decoder* d = &decoder;
+    uint32_t tail = decode_ahead_tail, handled = 0;
+    __atomic_store_n(&decode_ahead_running, 1, __ATOMIC_RELAXED);
+    d->background = 1;
+    d->stats = &decode_ahead_stats;
+    while (tail != __atomic_load_n(&decode_ahead_head, __ATOMIC_ACQUIRE)) {
+        struct decode_ahead_request request = decode_ahead_requests[tail & (DECODE_AHEAD_REQUESTS - 1)];
+        __atomic_store_n(&decode_ahead_tail, ++tail, __ATOMIC_RELEASE);
+        handled++;
+
+        // Claim the slot. One that is ready but hasn't been taken is replaced, since the CPU core has moved on.
+        struct decode_ahead_slot* slot = decode_ahead_slot(request.phys);
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if ((state != DECODE_AHEAD_EMPTY && state != DECODE_AHEAD_READY)
+            || !__atomic_compare_exchange_n(&slot->state, &state, DECODE_AHEAD_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        memcpy(page, get_phys_ram_ptr(request.phys & ~0xFFF, 0), sizeof(page));
+        decoder_reset(d, page, request.phys, request.state_hash);
+        uint32_t flags, count = decode_trace(d, slot->insns, request.max_instructions, &flags);
+        if (!count || flags == (uint32_t)-1 || d->failed) {
+            __atomic_store_n(&slot->state, DECODE_AHEAD_EMPTY, __ATOMIC_RELEASE);
+            continue;
+        }
+        // A trace that stopped short of the end of the page depends on the bytes up to it as well (see decode_trace)
+        slot->start = (request.phys & 0xFFF) - TRACE_BACK(flags);
+        slot->length = d->page_end ? 4096 - slot->start : TRACE_LENGTH(flags);
+        memcpy(slot->bytes, page + slot->start, slot->length);
+        slot->phys = request.phys;
+        slot->state_hash = request.state_hash;
+        slot->max_instructions = request.max_instructions;
+        slot->flags = flags;
+        slot->count = count;
+        __atomic_store_n(&slot->state, DECODE_AHEAD_READY, __ATOMIC_RELEASE);
+    }
+    return handled;
+}
+
+// Adds the background decoder's counters to "stats". They are read while the worker may be updating them, which is fine
+// for display.
+void cpu_decode_add_stats(struct cpu_stats* stats)
+{
+    struct cpu_stats* worker = &decode_ahead_stats;
+    stats->decoded_jcc += worker->decoded_jcc;
+    stats->fused_pairs += worker->fused_pairs;
+    stats->dead_flags += worker->dead_flags;
+    stats->flat_handlers += worker->flat_handlers;
+    stats->addr_form_disp += worker->addr_form_disp;
+    stats->addr_form_base += worker->addr_form_base;
+    stats->addr_form_base_disp += worker->addr_form_base_disp;
+    stats->addr_form_index += worker->addr_form_index;
+    stats->superblocks += worker->superblocks;
+    stats->superblock_jumps += worker->superblock_jumps;
+}
+
+// ============================================================================
+// Decoder entry point
+// ============================================================================
+
+static struct decoder cpu_decoder = { .stats = &cpu_stats };
+
+// Fills in a trace_info entry for a trace that is about to be committed, and returns its number of entries
+static int decode_commit(struct trace_info* info, struct decoded_instruction* i, int count, uint32_t flags)
+{
+    info->phys = cpu.phys_eip;
+    info->state_hash = cpu.state_hash;
+    info->flags = flags;
+    info->ptr = i;
+    set_smc(flags, LIN_EIP());
+    return count;
+}
+
+// Decodes the trace at the current EIP into "i". Returns the number of entries to commit, after filling in "info" for
+// them, or 0 if the trace can't be kept (in which case there is still a trace to run at "i").
+int cpu_decode(struct trace_info* info, struct decoded_instruction* i)
+{
+    struct decoder* d = &cpu_decoder;
+    uint8_t* code = get_phys_ram_ptr(cpu.phys_eip, 0);
+    decoder_reset(d, code - (cpu.phys_eip & 0xFFF), cpu.phys_eip, cpu.state_hash);
+    //if(cpu.phys_eip == 0x1102b8) __asm__("int3");
+
+    // Code on pages that keep modifying themselves is decoded one instruction at a time, so that each write only throws away
+    // the instruction it changed
+    int count, max_instructions = cpu_smc_page_is_hot(cpu.phys_eip) ? 1 : cpu.trace_length - 1;
+    uint32_t flags;
+
+    struct decode_memo* memo = NULL;
+    if ((cpu.phys_eip & 0xFFF) <= 0x1000 - 16) {
+        memo = decode_memo_entry(d, max_instructions);
+        count = decode_memo_lookup(d, memo, i, max_instructions);
+        if (count) {
+            cpu_stats.decode_memo_hits++;
+            return decode_commit(info, i, count, memo->length);
+        }
+        cpu_stats.decode_memo_misses++;
+    }
+
+    count = decode_ahead_take(d, i, max_instructions, &flags);
+    if (count)
+        return decode_commit(info, i, count, flags);
+
+    count = decode_trace(d, i, max_instructions, &flags);
+    if (flags == (uint32_t)-1)
+        return 0; // Don't commit page split traces
+    if (memo && !d->followed && !d->page_end)
+        decode_memo_store(d, memo, i, count, flags, max_instructions);
+    decode_ahead_exits(d, i, count, max_instructions);
+    return decode_commit(info, i, count, flags);
+}
+
 static const decode_handler_t table[256] = {
     /* 00 */ decode_arith_00,
     /* 01 */ decode_arith_01,
@@ -33,12 +33,11 @@ FADD:
 
 #ifndef LIBCPU
 #define FPU_DEBUG
-#ifdef FPU_DEBUG
-#include <math.h>
-#endif
 #endif
+#include <math.h>
 
 #include "cpu/cpu.h"
+#include "cpu/fpuhost.h"
 #include "cpu/instrument.h"
 #include "devices.h"
 #define EXCEPTION_HANDLER return 1
@@ -163,6 +162,9 @@ static void fpu_set_control_word(uint16_t control_word)
     fpu.status.float_suppress_exception = 0;
     fpu.status.float_exception_masks = control_word & 0x3F;
     fpu.status.denormals_are_zeros = 0;
+
+    // See the host double fast path below
+    fpu.host_double = rounding == FPU_ROUND_NEAREST && precision == FPU_PRECISION_53 && (control_word & 0x3F) == 0x3F;
 }
 
 static void fpu_state(void)
@@ -698,6 +700,268 @@ static void fpu_watchpoint2(void)
     //if(fpu.fpu_opcode == 0x77F8) __asm__("int3");
 }
 
+// Host double fast path, see cpu/fpuhost.h. It is only taken while fpu.host_double is set.
+
+// Define this to run every operation that takes the host path through softfloat as well and stop on any difference
+//#define FPU_HOST_VERIFY
+
+static floatx80 (*const fpu_soft_binary[])(floatx80 a, floatx80 b, float_status_t* status) = {
+    floatx80_add, floatx80_sub, floatx80_mul, floatx80_div
+};
+
+#ifdef FPU_HOST_VERIFY
+static void fpu_host_verify(const char* name, uint64_t result, uint64_t expected, int expected_flags)
+{
+    if (result != expected || fpu.status.float_exception_flags != expected_flags)
+        CPU_FATAL("FPU: host %s returned %016llx (flags %04x), softfloat %016llx (flags %04x)\n", name,
+            (unsigned long long)result, fpu.status.float_exception_flags, (unsigned long long)expected, expected_flags);
+}
+#define FPU_HOST_BITS(f) ((uint64_t)(f).exp << 48 ^ (f).fraction)
+#endif
+
+// Basic arithmetic for FADD, FSUB, FMUL, FDIV and their variants
+static floatx80 fpu_arith(int op, floatx80 a, floatx80 b)
+{
+    if (fpu.host_double) {
+        floatx80 result;
+#ifdef FPU_HOST_VERIFY
+        float_status_t expected_status = fpu.status;
+        floatx80 expected = fpu_soft_binary[op](a, b, &expected_status);
+#endif
+        if (fpu_host_binary(op, a, b, &result, &fpu.status)) {
+#ifdef FPU_HOST_VERIFY
+            fpu_host_verify("arithmetic", FPU_HOST_BITS(result), FPU_HOST_BITS(expected), expected_status.float_exception_flags);
+#endif
+            cpu_stats.fpu_host_ops++;
+            return result;
+        }
+        cpu_stats.fpu_host_fallbacks++;
+    }
+    return fpu_soft_binary[op](a, b, &fpu.status);
+}
+
+static floatx80 fpu_sqrt(floatx80 a)
+{
+    if (fpu.host_double) {
+        floatx80 result;
+#ifdef FPU_HOST_VERIFY
+        float_status_t expected_status = fpu.status;
+        floatx80 expected = floatx80_sqrt(a, &expected_status);
+#endif
+        if (fpu_host_sqrt(a, &result, &fpu.status)) {
+#ifdef FPU_HOST_VERIFY
+            fpu_host_verify("FSQRT", FPU_HOST_BITS(result), FPU_HOST_BITS(expected), expected_status.float_exception_flags);
+#endif
+            cpu_stats.fpu_host_ops++;
+            return result;
+        }
+        cpu_stats.fpu_host_fallbacks++;
+    }
+    return floatx80_sqrt(a, &fpu.status);
+}
+
+// FIST with host doubles, for a destination whose FPU_HOST_INT*_LIMIT is "limit". Returns 0 if softfloat has to do it.
+static int fpu_host_fist(floatx80 a, double limit, int64_t* result)
+{
+    if (!fpu.host_double)
+        return 0;
+    if (!fpu_host_to_int(a, limit, result, &fpu.status)) {
+        cpu_stats.fpu_host_fallbacks++;
+        return 0;
+    }
+    cpu_stats.fpu_host_ops++;
+    return 1;
+}
+
+static int32_t fpu_to_int32(floatx80 a)
+{
+    int64_t result;
+#ifdef FPU_HOST_VERIFY
+    float_status_t expected_status = fpu.status;
+    int32_t expected = floatx80_to_int32(a, &expected_status);
+#endif
+    if (fpu_host_fist(a, FPU_HOST_INT32_LIMIT, &result)) {
+#ifdef FPU_HOST_VERIFY
+        fpu_host_verify("FIST m32", result, expected, expected_status.float_exception_flags);
+#endif
+        return result;
+    }
+    return floatx80_to_int32(a, &fpu.status);
+}
+
+static int64_t fpu_to_int64(floatx80 a)
+{
+    int64_t result;
+#ifdef FPU_HOST_VERIFY
+    float_status_t expected_status = fpu.status;
+    int64_t expected = floatx80_to_int64(a, &expected_status);
+#endif
+    if (fpu_host_fist(a, FPU_HOST_INT64_LIMIT, &result)) {
+#ifdef FPU_HOST_VERIFY
+        fpu_host_verify("FIST m64", result, expected, expected_status.float_exception_flags);
+#endif
+        return result;
+    }
+    return floatx80_to_int64(a, &fpu.status);
+}
+
+static int16_t fpu_to_int16(floatx80 a)
+{
+    int64_t result;
+#ifdef FPU_HOST_VERIFY
+    float_status_t expected_status = fpu.status;
+    int16_t expected = floatx80_to_int16(a, &expected_status);
+#endif
+    if (fpu_host_fist(a, FPU_HOST_INT16_LIMIT, &result)) {
+#ifdef FPU_HOST_VERIFY
+        fpu_host_verify("FIST m16", result, expected, expected_status.float_exception_flags);
+#endif
+        return result;
+    }
+    return floatx80_to_int16(a, &fpu.status);
+}
+
+// Fast transcendental functions
+// With "transcendental=fast" in the [cpu] section of the configuration file, the instructions below are computed with
+// the host libm in double precision instead of with softfloat's polynomials. The operand is first rounded to a double,
+// and the result carries 53 significant bits. With a libm that is accurate to 1 ulp (newlib, glibc), the error relative
+// to the exact function of the rounded operand is at most:
+//   FSIN, FCOS, FSINCOS, FPTAN, FPATAN: 1 ulp of a double
+//   FYL2X: 1.5 ulp (log2, then a multiplication)
+//   F2XM1, FYL2XP1: 2.5 ulp (a multiplication by a constant, then expm1 or log1p, then another multiplication)
+// Precision is always raised and C1 is left clear. Operands that are zero, denormal, infinite, NaN or out of range,
+// and results that would not be normal doubles, still go to softfloat, so all of the exceptions and special cases
+// behave as before.
+static int fpu_accuracy = FPU_ACCURACY_EXACT;
+
+#define FPU_LN2 0.693147180559945309417
+#define FPU_LOG2E 1.44269504088896340736
+
+void fpu_set_accuracy(int mode)
+{
+    fpu_accuracy = mode;
+}
+
+// Rounds "a" to the nearest double if it is a finite number that stays normal as a double
+static int fpu_to_host_rounded(floatx80 a, double* result)
+{
+    int exponent = (a.exp & 0x7FFF) - 0x3FFF;
+    if (fpu_accuracy != FPU_ACCURACY_FAST || !(a.fraction >> 63) || exponent < -1022 || exponent > 1022)
+        return 0;
+    float_status_t status = fpu.status;
+    status.float_rounding_mode = float_round_nearest_even;
+    union fpu_host_double x;
+    x.i = floatx80_to_float64(a, &status);
+    *result = x.d;
+    return 1;
+}
+
+static int fpu_host_is_normal(double d)
+{
+    return isfinite(d) && (d == 0 || fabs(d) >= 0x1p-1022);
+}
+
+static int fpu_from_host_rounded(double d, floatx80* result)
+{
+    if (!fpu_host_is_normal(d))
+        return 0;
+    float_raise(&fpu.status, float_flag_inexact);
+    *result = fpu_from_host(d);
+    return 1;
+}
+
+static floatx80 fpu_f2xm1(floatx80 a)
+{
+    double x;
+    floatx80 result;
+    cpu_stats.fpu_f2xm1++;
+    if (fpu_to_host_rounded(a, &x) && fabs(x) <= 1 && fpu_from_host_rounded(expm1(x * FPU_LN2), &result))
+        return result;
+    return f2xm1(a, &fpu.status);
+}
+
+// ST(1) * log2(ST(0))
+static floatx80 fpu_fyl2x(floatx80 a, floatx80 b)
+{
+    double x, y;
+    floatx80 result;
+    cpu_stats.fpu_fyl2x++;
+    if (fpu_to_host_rounded(a, &x) && fpu_to_host_rounded(b, &y) && x > 0 && fpu_from_host_rounded(y * log2(x), &result))
+        return result;
+    return fyl2x(a, b, &fpu.status);
+}
+
+// ST(1) * log2(ST(0) + 1), defined for |ST(0)| < 1 - sqrt(2) / 2
+static floatx80 fpu_fyl2xp1(floatx80 a, floatx80 b)
+{
+    double x, y;
+    floatx80 result;
+    cpu_stats.fpu_fyl2xp1++;
+    if (fpu_to_host_rounded(a, &x) && fpu_to_host_rounded(b, &y) && fabs(x) < 0.29 && fpu_from_host_rounded(y * (log1p(x) * FPU_LOG2E), &result))
+        return result;
+    return fyl2xp1(a, b, &fpu.status);
+}
+
+// atan(ST(1) / ST(0)), in the quadrant given by the signs of both
+static floatx80 fpu_fpatan(floatx80 a, floatx80 b)
+{
+    double x, y;
+    floatx80 result;
+    cpu_stats.fpu_fpatan++;
+    if (fpu_to_host_rounded(a, &x) && fpu_to_host_rounded(b, &y) && fpu_from_host_rounded(atan2(y, x), &result))
+        return result;
+    return fpatan(a, b, &fpu.status);
+}
+
+// The trigonometric functions return -1 if the operand is too large (|x| >= 2^63), like their softfloat counterparts
+static int fpu_trig_in_range(floatx80 a)
+{
+    return (a.exp & 0x7FFF) < 0x3FFF + 63;
+}
+
+static int fpu_ftan(floatx80* a)
+{
+    double x;
+    cpu_stats.fpu_fptan++;
+    if (fpu_trig_in_range(*a) && fpu_to_host_rounded(*a, &x) && fpu_from_host_rounded(tan(x), a))
+        return 0;
+    return ftan(a, &fpu.status);
+}
+
+static int fpu_fsincos(floatx80 a, floatx80* sin_a, floatx80* cos_a)
+{
+    double x;
+    cpu_stats.fpu_fsincos++;
+    if (fpu_trig_in_range(a) && fpu_to_host_rounded(a, &x)) {
+        double s = sin(x), c = cos(x);
+        // Check both before writing either, so that a fallback starts from the original flags
+        if (fpu_host_is_normal(s) && fpu_host_is_normal(c)) {
+            fpu_from_host_rounded(s, sin_a);
+            fpu_from_host_rounded(c, cos_a);
+            return 0;
+        }
+    }
+    return fsincos(a, sin_a, cos_a, &fpu.status);
+}
+
+static int fpu_fsin(floatx80* a)
+{
+    double x;
+    cpu_stats.fpu_fsin++;
+    if (fpu_trig_in_range(*a) && fpu_to_host_rounded(*a, &x) && fpu_from_host_rounded(sin(x), a))
+        return 0;
+    return fsin(a, &fpu.status);
+}
+
+static int fpu_fcos(floatx80* a)
+{
+    double x;
+    cpu_stats.fpu_fcos++;
+    if (fpu_trig_in_range(*a) && fpu_to_host_rounded(*a, &x) && fpu_from_host_rounded(cos(x), a))
+        return 0;
+    return fcos(a, &fpu.status);
+}
+
 #define FPU_EXCEP() return 1
 #define FPU_ABORT()        \
     do {                   \
@@ -753,22 +1017,22 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
 
         switch (smaller_opcode & 7) {
         case 0: // FADD - Floating point add
-            dst = floatx80_add(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
+            dst = fpu_arith(FPU_HOST_ADD, fpu_get_st(0), fpu_get_st(st_index));
             break;
         case 1: // FMUL - Floating point multiply
-            dst = floatx80_mul(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
+            dst = fpu_arith(FPU_HOST_MUL, fpu_get_st(0), fpu_get_st(st_index));
             break;
         case 4: // FSUB - Floating point subtract
-            dst = floatx80_sub(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
+            dst = fpu_arith(FPU_HOST_SUB, fpu_get_st(0), fpu_get_st(st_index));
             break;
         case 5: // FSUBR - Floating point subtract reverse
-            dst = floatx80_sub(fpu_get_st(st_index), fpu_get_st(0), &fpu.status);
+            dst = fpu_arith(FPU_HOST_SUB, fpu_get_st(st_index), fpu_get_st(0));
             break;
         case 6: // FDIV - Floating point divide
-            dst = floatx80_div(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
+            dst = fpu_arith(FPU_HOST_DIV, fpu_get_st(0), fpu_get_st(st_index));
             break;
         case 7: // FDIVR - Floating point divide reverse
-            dst = floatx80_div(fpu_get_st(st_index), fpu_get_st(0), &fpu.status);
+            dst = fpu_arith(FPU_HOST_DIV, fpu_get_st(st_index), fpu_get_st(0));
             break;
         }
         if (!fpu_check_exceptions()) {
@@ -894,7 +1158,7 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
         case 0: // D9 F0: F2XM1 - Compute 2^ST(0) - 1
             if (fpu_check_stack_underflow(0, 1))
                 FPU_ABORT();
-            res = f2xm1(fpu_get_st(0), &fpu.status);
+            res = fpu_f2xm1(fpu_get_st(0));
             if (!fpu_check_exceptions())
                 fpu_set_st(0, res);
             break;
@@ -904,7 +1168,7 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
 
             old_rounding = fpu.status.float_rounding_precision;
             fpu.status.float_rounding_precision = 80;
-            res = fyl2x(fpu_get_st(0), fpu_get_st(1), &fpu.status);
+            res = fpu_fyl2x(fpu_get_st(0), fpu_get_st(1));
             fpu.status.float_rounding_precision = old_rounding;
 
             if (!fpu_check_exceptions()) {
@@ -916,13 +1180,13 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
             if (fpu_check_stack_underflow(0, 1))
                 FPU_ABORT();
             res = fpu_get_st(0);
-            if (!ftan(&res, &fpu.status))
+            if (!fpu_ftan(&res))
                 fpu_set_st(0, res);
             break;
         case 3: // D9 F3: FPATAN - Compute tan-1(ST(0)) partially
             if (fpu_check_stack_underflow(0, 1) || fpu_check_stack_underflow(1, 1))
                 FPU_ABORT();
-            res = fpatan(fpu_get_st(0), fpu_get_st(1), &fpu.status);
+            res = fpu_fpatan(fpu_get_st(0), fpu_get_st(1));
             if (!fpu_check_exceptions()) {
                 fpu_pop();
                 fpu_set_st(0, res);
@@ -1018,21 +1282,21 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
         case 1: // FYL2XP1 - Compute ST1 * log2(ST0 + 1) and pop
             if (fpu_check_stack_underflow(1, 1))
                 FPU_ABORT();
-            dest = fyl2xp1(fpu_get_st(0), fpu_get_st(1), &fpu.status);
+            dest = fpu_fyl2xp1(fpu_get_st(0), fpu_get_st(1));
             if (!fpu_check_exceptions()) {
                 fpu_pop();
                 fpu_set_st(0, dest);
             }
             return 0;
         case 2: // FSQRT - Compute sqrt(ST0)
-            dest = floatx80_sqrt(fpu_get_st(0), &fpu.status);
+            dest = fpu_sqrt(fpu_get_st(0));
             break;
         case 3: { // FSINCOS - Compute sin(ST0) and sin(ST1)
             // TODO: What if exceptions are masked?
             if (fpu_check_stack_overflow(-1))
                 FPU_ABORT();
             floatx80 sinres, cosres;
-            if (fsincos(fpu_get_st(0), &sinres, &cosres, &fpu.status) == -1) {
+            if (fpu_fsincos(fpu_get_st(0), &sinres, &cosres) == -1) {
                 SET_C2(1);
             } else if (!fpu_check_exceptions()) {
                 fpu_set_st(0, sinres);
@@ -1050,14 +1314,14 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
             break;
         case 6: // FSIN - Find sine of ST0
             dest = fpu_get_st(0);
-            if (fsin(&dest, &fpu.status) == -1) {
+            if (fpu_fsin(&dest) == -1) {
                 SET_C2(1);
                 FPU_ABORT();
             }
             break;
         case 7: // FCOS - Find cosine of ST0
             dest = fpu_get_st(0);
-            if (fcos(&dest, &fpu.status) == -1) {
+            if (fpu_fcos(&dest) == -1) {
                 SET_C2(1);
                 FPU_ABORT();
             }
@@ -1377,10 +1641,10 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
         floatx80 st0 = fpu_get_st(0);
         switch (op) {
         case 0: // FADD - Floating point add
-            st0 = floatx80_add(st0, temp80, &fpu.status);
+            st0 = fpu_arith(FPU_HOST_ADD, st0, temp80);
             break;
         case 1: // FMUL - Floating point multiply
-            st0 = floatx80_mul(st0, temp80, &fpu.status);
+            st0 = fpu_arith(FPU_HOST_MUL, st0, temp80);
             break;
         case 2: // FCOM - Floating point compare
         case 3: // FCOMP - Floating point compare and pop
@@ -1390,16 +1654,16 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
             }
             return 0;
         case 4: // FSUB - Floating point subtract
-            st0 = floatx80_sub(st0, temp80, &fpu.status);
+            st0 = fpu_arith(FPU_HOST_SUB, st0, temp80);
             break;
         case 5: // FSUBR - Floating point subtract with reversed operands
-            st0 = floatx80_sub(temp80, st0, &fpu.status);
+            st0 = fpu_arith(FPU_HOST_SUB, temp80, st0);
             break;
         case 6: // FDIV - Floating point divide
-            st0 = floatx80_div(st0, temp80, &fpu.status);
+            st0 = fpu_arith(FPU_HOST_DIV, st0, temp80);
             break;
         case 7: // FDIVR - Floating point divide with reversed operands
-            st0 = floatx80_div(temp80, st0, &fpu.status);
+            st0 = fpu_arith(FPU_HOST_DIV, temp80, st0);
             break;
         default: // FLD
             if (!fpu_check_exceptions())
@@ -1461,7 +1725,7 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
         case 1: { // DB
             uint32_t res;
             if (smaller_opcode & 2)
-                res = floatx80_to_int32(fpu_get_st(0), &fpu.status);
+                res = fpu_to_int32(fpu_get_st(0));
             else
                 res = floatx80_to_int32_round_to_zero(fpu_get_st(0), &fpu.status);
             if (!fpu_check_exceptions2(0))
@@ -1471,7 +1735,7 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
         case 2: { // DD
             uint64_t res;
             if (smaller_opcode & 2)
-                res = floatx80_to_int64(fpu_get_st(0), &fpu.status);
+                res = fpu_to_int64(fpu_get_st(0));
             else
                 res = floatx80_to_int64_round_to_zero(fpu_get_st(0), &fpu.status);
             if (!fpu_check_exceptions2(0)) {
@@ -1483,7 +1747,7 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
         case 3: { // DF
             uint16_t res;
             if (smaller_opcode & 2)
-                res = floatx80_to_int16(fpu_get_st(0), &fpu.status);
+                res = fpu_to_int16(fpu_get_st(0));
             else
                 res = floatx80_to_int16_round_to_zero(fpu_get_st(0), &fpu.status);
             if (!fpu_check_exceptions2(0))
@@ -1,7 +1,9 @@
 // Handles memory mapping
 #include "cpu/cpu.h"
 #include "cpu/instrument.h"
+#include "cpuapi.h"
 #include "io.h"
+#include <string.h>
 
 #define EXCEPTION_HANDLER return 1
 
@@ -13,33 +15,253 @@ void* get_lin_ram_ptr(uint32_t addr, int flags, int* fault);
 #define get_lin_ram_ptr(a, b) NULL
 #endif
 
+static inline void tlb_clear(struct tlb_entry* entry)
+{
+    entry->ptr = NULL;
+    entry->page = -1;
+    entry->tags = 0xFF;
+    entry->attrs = 0xFF;
+}
+
+// Upper limit on the number of write-protected page table pages. Pages that stop being page tables are not noticed, so
+// the set is started over at the next CR3 write once it grows this large.
+#define PAGE_TABLE_MAX_PROTECTED 1024
+
+// Flushes every context, and forgets about all page tables
 void cpu_mmu_tlb_flush(void)
 {
     for (unsigned int i = 0; i < cpu.tlb_entry_count; i++) {
         uint32_t entry = cpu.tlb_entry_indexes[i];
         if (entry == (uint32_t)-1)
             continue; // Don't flush entries we have already flushed
-        cpu.tlb[entry] = NULL;
-        cpu.tlb_tags[entry] = 0xFF;
+        tlb_clear(&cpu.tlb[entry]);
         cpu.tlb_entry_indexes[i] = -1;
-        cpu.tlb_attrs[entry] = 0xFF;
     }
     cpu.tlb_entry_count = 0;
+
+    // The current context carries on with an empty TLB, the others are free
+    for (int i = 0; i < TLB_CONTEXTS; i++)
+        cpu.tlb_contexts[i].valid = 0;
+    cpu.tlb_contexts[cpu.tlb_context].cr3 = cpu.cr[3];
+    cpu.tlb_contexts[cpu.tlb_context].valid = 1;
+    if (cpu.page_tables)
+        memset(cpu.page_tables, 0, cpu.smc_has_code_length);
+    cpu.page_tables_protected = 0;
+
+    // Nothing is watching the paging structures or descriptor tables anymore, so the caches filled from them have to go too
+    for (int i = 0; i < PAGE_WALK_CACHE_SIZE; i++)
+        cpu.page_walk_cache[i].prefix = -1;
+    cpu_seg_cache_flush();
 }
-void cpu_mmu_tlb_flush_nonglobal(void)
+
+// Removes all entries that belong to a context, and drops freed slots from the list of entries to flush
+static void tlb_clear_context(uint32_t context)
 {
+    unsigned int count = 0;
     for (unsigned int i = 0; i < cpu.tlb_entry_count; i++) {
-        uint32_t entry = cpu.tlb_entry_indexes[i];
-        if (entry == (uint32_t)-1)
-            continue; // Don't flush entries we have already flushed
-        if ((cpu.tlb_attrs[entry] & TLB_ATTR_NON_GLOBAL) == 0)
+        uint32_t index = cpu.tlb_entry_indexes[i];
+        if (index == (uint32_t)-1)
             continue;
-        cpu.tlb[entry] = NULL;
-        cpu.tlb_tags[entry] = 0xFF;
-        cpu.tlb_entry_indexes[i] = -1;
-        cpu.tlb_attrs[entry] = 0xFF;
+        struct tlb_entry* entry = &cpu.tlb[index];
+        if (entry->context == context)
+            tlb_clear(entry);
+        if (entry->page != (uint32_t)-1)
+            cpu.tlb_entry_indexes[count++] = index;
+    }
+    cpu.tlb_entry_count = count;
+}
+
+static void tlb_activate_context(uint32_t context)
+{
+    cpu.tlb_context = context;
+    cpu.tlb_salt = TLB_CONTEXT_SALT(context);
+    cpu.tlb_contexts[context].last_used = ++cpu.tlb_context_clock;
+}
+
+// Called after CR3 has been written. On real hardware, this flushes all non-global TLB entries. Here, the entries of the
+// old address space are kept if they are still exact, and those of the new one are brought back if it was used recently.
+// A context is only kept while none of its page tables have been written to, which makes reusing it indistinguishable
+// from walking the page tables again.
+void cpu_mmu_tlb_switch(void)
+{
+    if (cpu.page_tables_protected >= PAGE_TABLE_MAX_PROTECTED) {
+        // Start over with no contexts and no protected pages
+        cpu_mmu_tlb_flush();
+        cpu_stats.tlb_context_misses++;
+        return;
+    }
+
+    uint32_t victim = cpu.tlb_context;
+    for (uint32_t i = 0; i < TLB_CONTEXTS; i++) {
+        struct tlb_context* context = &cpu.tlb_contexts[i];
+        if (context->valid && context->cr3 == cpu.cr[3]) {
+            tlb_activate_context(i);
+            cpu_stats.tlb_context_hits++;
+            return;
+        }
+        // Prefer a free context, then the least recently used one
+        struct tlb_context* best = &cpu.tlb_contexts[victim];
+        if (best->valid && (!context->valid || context->last_used < best->last_used))
+            victim = i;
+    }
+
+    // Start the new address space from scratch. A context that was invalidated still has its entries in the table, and
+    // the current one may be invalid too, in which case it has to go as well.
+    tlb_clear_context(victim);
+    if (victim != cpu.tlb_context && !cpu.tlb_contexts[cpu.tlb_context].valid)
+        tlb_clear_context(cpu.tlb_context);
+    cpu.tlb_contexts[victim].cr3 = cpu.cr[3];
+    cpu.tlb_contexts[victim].valid = 1;
+    tlb_activate_context(victim);
+    cpu_stats.tlb_context_misses++;
+}
+
+// Stops the contexts of all other address spaces from being reused
+void cpu_mmu_tlb_drop_inactive(void)
+{
+    for (uint32_t i = 0; i < TLB_CONTEXTS; i++) {
+        if (i != cpu.tlb_context)
+            cpu.tlb_contexts[i].valid = 0;
+    }
+}
+
+// ============================================================================
+// Page table tracking
+// ============================================================================
+
+
+// Makes sure that writes to the page holding "phys" are seen by cpu_mmu_page_table_write
+static void tlb_protect_page(uint32_t phys)
+{
+    for (unsigned int i = 0; i < cpu.tlb_entry_count; i++) {
+        uint32_t index = cpu.tlb_entry_indexes[i];
+        if (index == (uint32_t)-1)
+            continue;
+        struct tlb_entry* entry = &cpu.tlb[index];
+        if (entry->page != (uint32_t)-1 && PTR_TO_PHYS(entry->ptr + (entry->page << 12)) >> 12 == phys >> 12)
+            entry->tags |= 0x44; // Same as SMC: both user and supervisor writes go through the slow path
+    }
+}
+
+// Returns 1 if all writes to the page holding "phys" go through cpu_access_write* or cpu_write_mem
+static inline int page_table_is_tracked(uint32_t phys)
+{
+    return (phys >> 12) < cpu.smc_has_code_length && !(phys >= 0xA0000 && phys < 0x100000);
+}
+
+// Records that the current context has read a page directory or page table entry at "phys"
+static void tlb_watch_page_table(uint32_t phys)
+{
+    uint32_t page = phys >> 12;
+    if (!page_table_is_tracked(phys)) {
+        // Writes here don't go through cpu_access_write*, so there's no way to tell if the entry changes
+        cpu.tlb_contexts[cpu.tlb_context].valid = 0;
+        return;
+    }
+    uint8_t users = cpu.page_tables[page];
+    if (!(users & PAGE_TABLE_PROTECTED)) {
+        cpu.page_tables_protected++;
+        tlb_protect_page(phys);
+    }
+    cpu.page_tables[page] = users | PAGE_TABLE_PROTECTED | 1 << cpu.tlb_context;
+}
+
+// Makes sure that writes to the page holding the descriptor at "phys" reach cpu_mmu_page_table_write, so that the
+// descriptor cache can drop it. Returns 0 if there is no way to see them.
+int cpu_mmu_watch_descriptors(uint32_t phys)
+{
+    uint32_t page = phys >> 12;
+    if (!page_table_is_tracked(phys))
+        return 0;
+    uint8_t users = cpu.page_tables[page];
+    if (!(users & PAGE_TABLE_PROTECTED)) {
+        cpu.page_tables_protected++;
+        tlb_protect_page(phys);
+    }
+    cpu.page_tables[page] = users | PAGE_TABLE_PROTECTED | PAGE_TABLE_DESCRIPTORS;
+    return 1;
+}
+
+// ============================================================================
+// Page walk cache
+// ============================================================================
+
+static inline struct page_walk_entry* page_walk_entry(uint32_t prefix)
+{
+    return &cpu.page_walk_cache[(prefix ^ cpu.cr[3] >> 12) & (PAGE_WALK_CACHE_SIZE - 1)];
+}
+
+// Returns the cached walk down to the page directory entry for "prefix" in the current address space, or NULL
+static inline struct page_walk_entry* page_walk_lookup(uint32_t prefix)
+{
+    struct page_walk_entry* entry = page_walk_entry(prefix);
+    if (entry->prefix == prefix && entry->cr3 == cpu.cr[3]) {
+        cpu_stats.page_walk_hits++;
+        return entry;
+    }
+    cpu_stats.page_walk_misses++;
+    return NULL;
+}
+
+// Remembers a walk that has completed without faulting. The entries must be stored with the accessed and dirty bits that
+// were just written back. Both pages must already have been passed to tlb_watch_page_table.
+static void page_walk_fill(uint32_t prefix, uint32_t pdp_addr, uint32_t pdpte, uint32_t pdpte_high, uint32_t pde_addr, uint32_t pde, uint32_t pde_high)
+{
+    if (!page_table_is_tracked(pdp_addr) || !page_table_is_tracked(pde_addr))
+        return;
+    struct page_walk_entry* entry = page_walk_entry(prefix);
+    entry->cr3 = cpu.cr[3];
+    entry->prefix = prefix;
+    entry->pdp_addr = pdp_addr;
+    entry->pdpte = pdpte;
+    entry->pdpte_high = pdpte_high;
+    entry->pde_addr = pde_addr;
+    entry->pde = pde;
+    entry->pde_high = pde_high;
+    cpu.page_tables[pdp_addr >> 12] |= PAGE_TABLE_WALK_CACHED;
+    cpu.page_tables[pde_addr >> 12] |= PAGE_TABLE_WALK_CACHED;
+}
+
+// Drops every entry that was read from the given page
+static void page_walk_invalidate_page(uint32_t page)
+{
+    for (int i = 0; i < PAGE_WALK_CACHE_SIZE; i++) {
+        struct page_walk_entry* entry = &cpu.page_walk_cache[i];
+        if (entry->pdp_addr >> 12 == page || entry->pde_addr >> 12 == page)
+            entry->prefix = -1;
+    }
+}
+
+// Called when cpu_mmu_translate sets the accessed or dirty bit in a paging structure. The entry being written may be the
+// one that the walk came through, or, with a self-referencing page directory, one that another walk was cached from.
+static void page_walk_update(uint32_t addr, uint32_t data)
+{
+    if (!page_table_is_tracked(addr) || !(cpu.page_tables[addr >> 12] & PAGE_TABLE_WALK_CACHED))
+        return;
+    for (int i = 0; i < PAGE_WALK_CACHE_SIZE; i++) {
+        struct page_walk_entry* entry = &cpu.page_walk_cache[i];
+        if (entry->pde_addr == addr)
+            entry->pde = data;
+        else if (entry->pdp_addr == addr)
+            entry->prefix = -1;
+    }
+}
+
+// Called when the guest writes to a page that a context or the page walk cache has read paging structures from, or that
+// holds cached descriptors. Writes are at most four bytes long.
+void cpu_mmu_page_table_write(uint32_t phys)
+{
+    uint32_t page = phys >> 12, users = cpu.page_tables[page] & PAGE_TABLE_USERS;
+    for (int i = 0; i < TLB_CONTEXTS; i++) {
+        if (users & (1 << i))
+            cpu.tlb_contexts[i].valid = 0;
     }
-    cpu.tlb_entry_count = cpu.tlb_entry_count; // We may still have global entries.
+    if (cpu.page_tables[page] & PAGE_TABLE_WALK_CACHED)
+        page_walk_invalidate_page(page);
+    // Only the descriptors that the write overlaps are dropped, so the page stays watched for the others
+    if (cpu.page_tables[page] & PAGE_TABLE_DESCRIPTORS)
+        cpu_seg_cache_write(phys, 4);
+    cpu.page_tables[page] &= ~(PAGE_TABLE_USERS | PAGE_TABLE_WALK_CACHED);
 }
 
 static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user, int write, int global, int nx)
@@ -66,8 +288,13 @@ static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user,
         tag_write = 1;
     }
 
+    if ((phys >> 12) < cpu.smc_has_code_length && cpu.page_tables[phys >> 12] & PAGE_TABLE_PROTECTED)
+        tag_write = 1; // Writes to page tables have to be seen by cpu_mmu_page_table_write
+
     if (cpu.tlb_entry_count >= MAX_TLB_ENTRIES) { // Flush TLB
         cpu_mmu_tlb_flush();
+        // The page tables that this entry came from are no longer being watched, so the context can't be kept
+        cpu.tlb_contexts[cpu.tlb_context].valid = 0;
 #ifdef INSTRUMENT
         cpu_instrument_tlb_full();
 #endif
@@ -78,13 +305,17 @@ static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user,
         user_read = (tag | (!user ? 3 : 0)) << TLB_USER_READ,
         user_write = (tag_write | ((!user | !write) ? 3 : 0)) << TLB_USER_WRITE;
 
-    uint32_t entry = lin >> 12;
-    cpu.tlb_entry_indexes[cpu.tlb_entry_count++] = entry;
-    cpu.tlb_attrs[entry] = (nx ? TLB_ATTR_NX : 0) | (global ? 0 : TLB_ATTR_NON_GLOBAL);
+    // Whatever page was in this entry before is simply replaced. Occupied entries are already on the list to flush.
+    struct tlb_entry* entry = TLB_ENTRY(lin);
+    if (entry->page == (uint32_t)-1)
+        cpu.tlb_entry_indexes[cpu.tlb_entry_count++] = TLB_INDEX(lin);
+    entry->attrs = (nx ? TLB_ATTR_NX : 0) | (global ? 0 : TLB_ATTR_NON_GLOBAL);
     if (!ptr)
         ptr = get_phys_ram_ptr(phys, write);
-    cpu.tlb[entry] = (void*)(((uintptr_t)ptr) - lin);
-    cpu.tlb_tags[entry] = system_read | system_write | user_read | user_write;
+    entry->ptr = (void*)(((uintptr_t)ptr) - lin);
+    entry->page = lin >> 12;
+    entry->context = cpu.tlb_context;
+    entry->tags = system_read | system_write | user_read | user_write;
 }
 
 uint32_t cpu_read_phys(uint32_t addr)
@@ -100,6 +331,10 @@ static void cpu_write_phys(uint32_t addr, uint32_t data)
         io_handle_mmio_write(addr, data, 2);
     else
         MEM32(addr) = data;
+    page_walk_update(addr, data);
+    // A page table may share a page with a descriptor table
+    if (page_table_is_tracked(addr) && cpu.page_tables[addr >> 12] & PAGE_TABLE_DESCRIPTORS)
+        cpu_seg_cache_write(addr, 4);
 }
 
 // Checks reserved fields for error. disable for speed.
@@ -143,7 +378,11 @@ int cpu_mmu_translate(uint32_t lin, int shift)
             uint32_t page_directory_entry_addr = cpu.cr[3] + (lin >> 20 & 0xFFC),
                      page_directory_entry = -1, page_table_entry_addr = -1, page_table_entry = -1;
 
-            page_directory_entry = cpu_read_phys(page_directory_entry_addr);
+            struct page_walk_entry* walk = page_walk_lookup(lin >> 22);
+            if (walk)
+                page_directory_entry = walk->pde;
+            else
+                page_directory_entry = cpu_read_phys(page_directory_entry_addr);
 
             if (!(page_directory_entry & 1)) {
                 // Not present
@@ -166,6 +405,9 @@ int cpu_mmu_translate(uint32_t lin, int shift)
 #endif
                 }
                 uint32_t phys = (page_directory_entry & 0xFFC00000) | (lin & 0x3FF000);
+                tlb_watch_page_table(page_directory_entry_addr);
+                if (!walk)
+                    page_walk_fill(lin >> 22, page_directory_entry_addr, 0, 0, page_directory_entry_addr, new_page_dierctory_entry, 0);
                 cpu_set_tlb_entry(lin & ~0xFFF, phys, NULL, user, write, page_directory_entry & 0x100, 0);
             } else {
                 page_table_entry = cpu_read_phys(page_table_entry_addr);
@@ -223,6 +465,10 @@ int cpu_mmu_translate(uint32_t lin, int shift)
 #endif
                 }
                 //if(lin == 0xe1001332) __asm__("int3");
+                tlb_watch_page_table(page_directory_entry_addr);
+                tlb_watch_page_table(page_table_entry_addr);
+                if (!walk)
+                    page_walk_fill(lin >> 22, page_directory_entry_addr, 0, 0, page_directory_entry_addr, page_directory_entry | 0x20, 0);
                 cpu_set_tlb_entry(lin & ~0xFFF, page_table_entry & ~0xFFF, NULL, user, write, page_table_entry & 0x100, 0);
             }
             return 0;
@@ -244,25 +490,37 @@ int cpu_mmu_translate(uint32_t lin, int shift)
             // http://www.rcollins.org/ddj/Jul96/
             // https://www.intel.com/content/dam/www/public/us/en/documents/manuals/64-ia-32-architectures-software-developer-vol-3a-part-1-manual.pdf (page 117)
             // Note that we only support 3 GB of RAM at max, so we're OK with ignoring the top bits
-            uint32_t pdp_addr = (cpu.cr[3] & ~31) | (lin >> 27 & 0x18),
-                     pdpte = cpu_read_phys(pdp_addr);
+            uint32_t pdp_addr = (cpu.cr[3] & ~31) | (lin >> 27 & 0x18), pdpte, pdpte2, pde_addr, pde, pde2;
             int fail = (write << 1) | (user << 2);
-            if ((pdpte & 1) == 0)
-                goto pae_page_fault;
+            struct page_walk_entry* walk = page_walk_lookup(lin >> 21);
+            if (walk) {
+                // The PDPTE was present and its reserved bits were clear when this was cached
+                pdpte = walk->pdpte;
+                pdpte2 = walk->pdpte_high;
+                pde_addr = walk->pde_addr;
+                pde = walk->pde;
+                pde2 = walk->pde_high;
+            } else {
+                pdpte = cpu_read_phys(pdp_addr);
+                if ((pdpte & 1) == 0)
+                    goto pae_page_fault;
 #if PAE_HANDLE_RESERVED
-            // "Writing to reserved bits in the PDPT generates a general protection fault (#GP),"
-            if (cpu_read_phys(pdp_addr + 4) & ~15)
-                EXCEPTION_GP(0);
+                // "Writing to reserved bits in the PDPT generates a general protection fault (#GP),"
+                if (cpu_read_phys(pdp_addr + 4) & ~15)
+                    EXCEPTION_GP(0);
 #endif
-            // Now look up page directory entry (which may end up being a page table entry, if we're lucky)
-            uint32_t pde_addr = (pdpte & ~0xFFF) | (lin >> 18 & 0xFF8),
-                     pde = cpu_read_phys(pde_addr), pde2 = cpu_read_phys(pde_addr + 4);
+                // Now look up page directory entry (which may end up being a page table entry, if we're lucky)
+                pde_addr = (pdpte & ~0xFFF) | (lin >> 18 & 0xFF8);
+                pde = cpu_read_phys(pde_addr);
+                pde2 = cpu_read_phys(pde_addr + 4);
+                pdpte2 = cpu_read_phys(pdp_addr + 4);
+            }
 
             // XXX yucky yucky
             uint32_t nx_mask = -1 ^ (cpu.ia32_efer << 20 & 0x80000000);
 
             // Check if our address is too
-            if (cpu_read_phys(pdp_addr + 4) & ~15 & nx_mask)
+            if (pdpte2 & ~15 & nx_mask)
                 EXCEPTION_GP(0);
 #if PAE_HANDLE_RESERVED
             if (pde2 & ~15 & nx_mask)
@@ -302,6 +560,10 @@ int cpu_mmu_translate(uint32_t lin, int shift)
 #endif
                 }
                 uint32_t phys = (pde & 0xFFE00000) | (lin & 0x1FF000);
+                tlb_watch_page_table(pdp_addr);
+                tlb_watch_page_table(pde_addr);
+                if (!walk)
+                    page_walk_fill(lin >> 21, pdp_addr, pdpte, pdpte2, pde_addr, new_pde, pde2);
                 cpu_set_tlb_entry(lin & ~0xFFF, phys, NULL, user, write, pde & 0x100, nx);
             } else {
                 uint32_t pte_addr = (pde & ~0xFFF) | (lin >> 9 & 0xFF8),
@@ -344,6 +606,11 @@ int cpu_mmu_translate(uint32_t lin, int shift)
                 printf("PDE: %08x PDE.addr: %08x\n", pde, pde_addr);
                 printf("PTE: %08x PTE.addr: %08x\n", pte, pte_addr);
 #endif
+                tlb_watch_page_table(pdp_addr);
+                tlb_watch_page_table(pde_addr);
+                tlb_watch_page_table(pte_addr);
+                if (!walk)
+                    page_walk_fill(lin >> 21, pdp_addr, pdpte, pdpte2, pde_addr, new_pde, pde2);
                 cpu_set_tlb_entry(lin & ~0xFFF, pte & ~0xFFF, NULL, user, write, pte & 0x100, nx);
             }
             return 0;
@@ -358,19 +625,17 @@ int cpu_mmu_translate(uint32_t lin, int shift)
     }
 }
 
+// Removes the translation for "lin" from every context. Global pages, at least, are shared between address spaces.
+// INVLPG also drops the paging structures cached for the address, like it does on real hardware.
 void cpu_mmu_tlb_invalidate(uint32_t lin)
 {
-    lin >>= 12;
-#if 0
-    if(cpu.cr[4] & CR4_PSE){
-        uint32_t linbase = lin & ~1023;
-        for(int i=0;i<1024;i++){
-            cpu.tlb[i + linbase] = NULL;
-            cpu.tlb_tags[i + linbase] = 0xFF;
-        }
-        return;
+    for (int i = 0; i < TLB_CONTEXTS; i++) {
+        struct tlb_entry* entry = &cpu.tlb[TLB_INDEX_SALTED(lin, TLB_CONTEXT_SALT(i))];
+        if (entry->page == lin >> 12)
+            tlb_clear(entry);
     }
-#endif
-    cpu.tlb[lin] = NULL;
-    cpu.tlb_tags[lin] = 0xFF;
+    uint32_t prefix = cpu.cr[4] & CR4_PAE ? lin >> 21 : lin >> 22;
+    struct page_walk_entry* walk = page_walk_entry(prefix);
+    if (walk->prefix == prefix)
+        walk->prefix = -1;
 }
\ No newline at end of file
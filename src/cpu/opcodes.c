@@ -33,18 +33,68 @@
         INSTRUMENT_INSN();     \
         return i + 1;          \
     } while (1)
+// Leaves a trace that was charged up front (see cpu_trace_enter) at "i", giving back the instructions after it. From here
+// on, the dispatch loop counts instructions one at a time again, starting with this one.
+#define TRACE_SYNC()                                \
+    do {                                            \
+        if (cpu.trace_end) {                        \
+            if (cpu.trace_end - i > 1)              \
+                cpu_stats.trace_side_exits++;       \
+            cpu.cycles_to_run += cpu.trace_end - i; \
+            cpu.trace_end = NULL;                   \
+        }                                           \
+    } while (0)
 // Stops the trace and moves onto next one
 #define STOP()                  \
     do {                        \
         INSTRUMENT_INSN();      \
+        TRACE_SYNC();           \
         return cpu_get_trace(); \
     } while (0)
 #define EXCEP()                 \
     do {                        \
+        TRACE_SYNC();           \
         cpu.cycles_to_run++;    \
         return cpu_get_trace(); \
     } while (0)
-#define STOP2() return i
+// Stops the trace and moves straight onto the one that "link" points to if it is still valid for the current EIP and
+// state. Otherwise, looks it up the normal way and patches the link.
+#define STOP_LINKED(link)                \
+    do {                                 \
+        INSTRUMENT_INSN();               \
+        TRACE_SYNC();                    \
+        return cpu_follow_link(&(link)); \
+    } while (0)
+// Stops the trace after an indirect jump or call, going through the site's link (see cpu_follow_indirect)
+#define STOP_INDIRECT(link)                  \
+    do {                                     \
+        INSTRUMENT_INSN();                   \
+        TRACE_SYNC();                        \
+        return cpu_follow_indirect(&(link)); \
+    } while (0)
+// Stops the trace after a RET, going through the return stack (see cpu_follow_return)
+#define STOP_RETURN()               \
+    do {                            \
+        INSTRUMENT_INSN();          \
+        TRACE_SYNC();               \
+        return cpu_follow_return(); \
+    } while (0)
+// Runs the same instruction again, which costs another cycle
+// Used after loading a segment register. If the load changed the state hash (see cpu_seg_update_flat), the rest of the
+// trace was decoded for the old state, so leave it.
+#define NEXT_SEG(flags, old_hash)           \
+    do {                                    \
+        if (cpu.state_hash != (old_hash)) { \
+            cpu.phys_eip += flags & 15;     \
+            STOP();                         \
+        }                                   \
+        NEXT(flags);                        \
+    } while (0)
+#define STOP2()       \
+    do {              \
+        TRACE_SYNC(); \
+        return i;     \
+    } while (0)
 #define R8(i) cpu.reg8[i]
 #define R16(i) cpu.reg16[i]
 #define R32(i) cpu.reg32[i]
@@ -63,16 +113,19 @@
         EXCEPTION_HANDLER;
 
 // Bunch of macros for repeated operations
-#define arith_re(sz, func)                                          \
-    uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i); \
-    uint##sz##_t res;                                               \
-    cpu_read##sz(linaddr, res, cpu.tlb_shift_read);                 \
-    func(I_OP(flags), &R##sz(I_REG(flags)), res);                   \
+// The _at forms take the expression computing the linear address, which can use "flags" and "i"
+#define arith_re(sz, func) arith_re_at(sz, func, cpu_get_linaddr(flags, i))
+#define arith_re_at(sz, func, addr)                     \
+    uint32_t flags = i->flags, linaddr = addr;          \
+    uint##sz##_t res;                                   \
+    cpu_read##sz(linaddr, res, cpu.tlb_shift_read);     \
+    func(I_OP(flags), &R##sz(I_REG(flags)), res);       \
     NEXT(flags)
-#define arith_rmw(sz, func, ...)                                                   \
+#define arith_rmw(sz, func, ...) arith_rmw_at(sz, func, cpu_get_linaddr(flags, i), ##__VA_ARGS__)
+#define arith_rmw_at(sz, func, addr, ...)                                          \
     uint32_t flags = i->flags,                                                     \
-             linaddr = cpu_get_linaddr(flags, i),                                  \
-             tlb_shift = cpu.tlb_tags[linaddr >> 12],                              \
+             linaddr = addr,                                                       \
+             tlb_shift = TLB_TAGS(linaddr),                                        \
              shift = cpu.tlb_shift_write;                                          \
     uint##sz##_t* ptr;                                                             \
     if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
@@ -81,14 +134,14 @@
         func(I_OP(flags), (void*)&cpu.read_result, ##__VA_ARGS__);                 \
         cpu_access_write##sz(linaddr, cpu.read_result, tlb_shift >> shift, shift); \
     } else {                                                                       \
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;                                    \
+        ptr = TLB_PTR(linaddr);                                                    \
         func(I_OP(flags), ptr, ##__VA_ARGS__);                                     \
     }                                                                              \
     NEXT(flags)
 #define arith_rmw2(sz, func, ...)                                                  \
     uint32_t flags = i->flags,                                                     \
              linaddr = cpu_get_linaddr(flags, i),                                  \
-             tlb_shift = cpu.tlb_tags[linaddr >> 12],                              \
+             tlb_shift = TLB_TAGS(linaddr),                                        \
              shift = cpu.tlb_shift_write;                                          \
     uint##sz##_t* ptr;                                                             \
     if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
@@ -97,14 +150,14 @@
         func((void*)&cpu.read_result, ##__VA_ARGS__);                              \
         cpu_access_write##sz(linaddr, cpu.read_result, tlb_shift >> shift, shift); \
     } else {                                                                       \
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;                                    \
+        ptr = TLB_PTR(linaddr);                                                    \
         func(ptr, ##__VA_ARGS__);                                                  \
     }                                                                              \
     NEXT(flags)
 #define arith_rmw3(sz, func, offset, ...)                                          \
     uint32_t flags = i->flags,                                                     \
              linaddr = cpu_get_linaddr(flags, i) + offset,                         \
-             tlb_shift = cpu.tlb_tags[linaddr >> 12],                              \
+             tlb_shift = TLB_TAGS(linaddr),                                        \
              shift = cpu.tlb_shift_write;                                          \
     uint##sz##_t* ptr;                                                             \
     if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
@@ -113,7 +166,7 @@
         func((void*)&cpu.read_result, ##__VA_ARGS__);                              \
         cpu_access_write##sz(linaddr, cpu.read_result, tlb_shift >> shift, shift); \
     } else {                                                                       \
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;                                    \
+        ptr = TLB_PTR(linaddr);                                                    \
         func(ptr, ##__VA_ARGS__);                                                  \
     }                                                                              \
     NEXT(flags)
@@ -122,16 +175,75 @@
     uint32_t virt = VIRT_EIP();                                      \
     if (cond) {                                                      \
         cpu.phys_eip += ((virt + flags + i->imm32) & 0xFFFF) - virt; \
-        STOP();                                                      \
+        STOP_LINKED(i->disp32);                                      \
     } else                                                           \
         NEXT2(flags);
 #define jcc32(cond)                       \
     int flags = i->flags;                 \
     if (cond) {                           \
         cpu.phys_eip += flags + i->imm32; \
-        STOP();                           \
+        STOP_LINKED(i->disp32);           \
     } else                                \
         NEXT2(flags);
+// Enters the trace that "link" names if it is the one for the current EIP and state, or returns NULL. The link is only a
+// hint: the entry it names is checked exactly like cpu_get_trace checks a set, so a stale link (the target was evicted,
+// invalidated by SMC, or flushed) simply falls back to a lookup.
+static inline struct decoded_instruction* cpu_try_link(uint32_t link)
+{
+    struct trace_info* trace = &cpu.trace_info[link];
+    if ((cpu.phys_eip ^ cpu.last_phys_eip) <= 4095 && trace->phys == cpu.phys_eip && trace->state_hash == cpu.state_hash) {
+        return cpu_trace_enter(trace);
+    }
+    return NULL;
+}
+static inline struct decoded_instruction* cpu_follow_link(uint32_t* link)
+{
+    struct decoded_instruction* next = cpu_try_link(*link);
+    if (next) {
+        cpu_stats.trace_chained++;
+        return next;
+    }
+    return cpu_get_trace_linked(link);
+}
+// Same as cpu_follow_link, for indirect jumps and calls. The link holds the last target, so it works as a one-entry
+// inline cache for the site.
+static inline struct decoded_instruction* cpu_follow_indirect(uint32_t* link)
+{
+    struct decoded_instruction* next = cpu_try_link(*link);
+    if (next) {
+        cpu_stats.indirect_hits++;
+        return next;
+    }
+    cpu_stats.indirect_misses++;
+    return cpu_get_trace_linked(link);
+}
+
+// Pushes the trace that a call "length" bytes long returns to onto the return stack. A call that ends its trace is
+// followed by an op_trace_end entry that never runs, and "slot" is the link of that entry, which the call keeps pointing
+// at the trace after it (see cpu_decode). Calls that the decoder followed have no such entry, so they pass a scratch link
+// and look the trace up every time.
+static inline void cpu_push_return(uint32_t* slot, uint32_t length)
+{
+    uint32_t phys = cpu.phys_eip + length;
+    struct trace_info* trace = &cpu.trace_info[*slot];
+    if (trace->phys != phys || trace->state_hash != cpu.state_hash)
+        cpu_trace_find(phys, slot);
+    cpu.return_stack_top = (cpu.return_stack_top + 1) & (RETURN_STACK_SIZE - 1);
+    cpu.return_stack[cpu.return_stack_top] = *slot;
+}
+// Leaves the trace after a RET through the return stack, if the trace on top is the one for the new EIP and state
+static inline struct decoded_instruction* cpu_follow_return(void)
+{
+    struct decoded_instruction* next = cpu_try_link(cpu.return_stack[cpu.return_stack_top]);
+    cpu.return_stack_top = (cpu.return_stack_top - 1) & (RETURN_STACK_SIZE - 1);
+    if (next) {
+        cpu_stats.return_stack_hits++;
+        return next;
+    }
+    cpu_stats.return_stack_misses++;
+    return cpu_get_trace();
+}
+
 static void interrupt_guard(void)
 {
     // Update cpu.cycles to have the right value
@@ -169,13 +281,40 @@ static inline uint32_t cpu_get_virtaddr(uint32_t i, struct decoded_instruction*
     addr += j->disp32;
     return FAST_BRANCHLESS_MASK(addr, i);
 }
+// cpu_get_linaddr for the _flat handlers: the address is 32-bit and the segment has a base of zero, so neither the mask
+// nor the segment base is needed
+static inline uint32_t cpu_get_flataddr(uint32_t i, struct decoded_instruction* j)
+{
+    return cpu.reg32[I_BASE(i)] + (cpu.reg32[I_INDEX(i)] << (I_SCALE(i))) + j->disp32;
+}
 
 void cpu_execute(void)
 {
-    struct decoded_instruction* i = cpu_get_trace();
+    struct decoded_instruction *i = cpu_get_trace(), *prev;
+    // No handler branched to this trace, so give back the cycle that cpu_trace_enter took for one
+    if (cpu.trace_end)
+        cpu.cycles_to_run++;
     do {
-        i = i->handler(i);
-        if (!--cpu.cycles_to_run)
+        struct decoded_instruction* end = cpu.trace_end;
+        if (end) {
+            // The trace was entered with enough of the time slice left to run all of it, and its instructions have
+            // already been charged, so the slice cannot end inside it. Every handler that stays in the trace returns the
+            // entry after its own; anything else has left it through TRACE_SYNC, or is op_trace_resync.
+            do {
+                prev = i;
+                i = i->handler(i);
+            } while (i == prev + 1 && i < end);
+            if (cpu.trace_resync) {
+                // The trace may have been recycled since cpu_trace_sync pointed the entry at op_trace_resync
+                if (cpu.trace_resync->handler == op_trace_resync)
+                    cpu.trace_resync->handler = cpu.trace_resync_handler;
+                cpu.trace_resync = NULL;
+            }
+        } else
+            i = i->handler(i);
+        // Charge the handler that just ran, unless it has entered a trace that took its cycle on the way in, or ran off the
+        // end of this one into op_trace_end, which is still paid for
+        if (!cpu.trace_end && !--cpu.cycles_to_run)
             break;
     } while (1);
 }
@@ -193,10 +332,18 @@ OPTYPE op_ud_exception(struct decoded_instruction* i)
     UNUSED(i);
     EXCEPTION_UD();
 }
+// Stands in for the next instruction after cpu_trace_sync has given back the rest of a charged trace. It returns the
+// same entry, which stops the uncounted loop in cpu_execute before the instruction runs.
+OPTYPE op_trace_resync(struct decoded_instruction* i)
+{
+    return i;
+}
 OPTYPE op_trace_end(struct decoded_instruction* i)
 {
-    UNUSED(i);
-    EXCEP(); // Don't call instrumentation callbacks since there's no instruction being executed here.
+    // Don't call instrumentation callbacks since there's no instruction being executed here.
+    TRACE_SYNC();
+    cpu.cycles_to_run++;
+    return cpu_follow_link(&i->disp32);
 }
 
 OPTYPE op_nop(struct decoded_instruction* i)
@@ -210,14 +357,14 @@ OPTYPE op_jmp_r16(struct decoded_instruction* i)
     uint32_t dest = R16(I_RM(i->flags));
     if(dest >= cpu.seg_limit[CS]) EXCEPTION_GP(0);
     SET_VIRT_EIP(dest);
-    STOP();
+    STOP_INDIRECT(i->imm32);
 }
 OPTYPE op_jmp_r32(struct decoded_instruction* i)
 {
     uint32_t dest = R32(I_RM(i->flags));
     if(dest >= cpu.seg_limit[CS]) EXCEPTION_GP(0);
     SET_VIRT_EIP(dest);
-    STOP();
+    STOP_INDIRECT(i->imm32);
 }
 OPTYPE op_jmp_e16(struct decoded_instruction* i)
 {
@@ -225,28 +372,30 @@ OPTYPE op_jmp_e16(struct decoded_instruction* i)
     uint16_t src;
     cpu_read16(linaddr, src, cpu.tlb_shift_read);
     SET_VIRT_EIP(src);
-    STOP();
+    STOP_INDIRECT(i->imm32);
 }
 OPTYPE op_jmp_e32(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), src;
     cpu_read32(linaddr, src, cpu.tlb_shift_read);
     SET_VIRT_EIP(src);
-    STOP();
+    STOP_INDIRECT(i->imm32);
 }
 OPTYPE op_call_r16(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags;
     push16(I_LENGTH(flags) + VIRT_EIP());
+    cpu_push_return(&i[1].disp32, I_LENGTH(flags));
     SET_VIRT_EIP(R16(I_RM(flags)));
-    STOP();
+    STOP_INDIRECT(i->imm32);
 }
 OPTYPE op_call_r32(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags;
     push32(I_LENGTH(flags) + VIRT_EIP());
+    cpu_push_return(&i[1].disp32, I_LENGTH(flags));
     SET_VIRT_EIP(R32(I_RM(flags)));
-    STOP();
+    STOP_INDIRECT(i->imm32);
 }
 OPTYPE op_call_e16(struct decoded_instruction* i)
 {
@@ -254,27 +403,42 @@ OPTYPE op_call_e16(struct decoded_instruction* i)
     uint16_t src;
     cpu_read16(linaddr, src, cpu.tlb_shift_read);
     push16(VIRT_EIP() + I_LENGTH(flags));
+    cpu_push_return(&i[1].disp32, I_LENGTH(flags));
     SET_VIRT_EIP(src);
-    STOP();
+    STOP_INDIRECT(i->imm32);
 }
 OPTYPE op_call_e32(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), src;
     cpu_read32(linaddr, src, cpu.tlb_shift_read);
     push32(VIRT_EIP() + I_LENGTH(flags));
+    cpu_push_return(&i[1].disp32, I_LENGTH(flags));
     SET_VIRT_EIP(src);
-    STOP();
+    STOP_INDIRECT(i->imm32);
 }
 OPTYPE op_jmp_rel32(struct decoded_instruction* i)
 {
     cpu.phys_eip += i->flags + i->imm32;
-    STOP();
+    STOP_LINKED(i->disp32);
+}
+// Jumps and calls that the decoder followed, so that the rest of the trace carries on at their target (see decode_follow
+// in decoder.c)
+OPTYPE op_jmp_rel32_follow(struct decoded_instruction* i)
+{
+    NEXT2(i->flags + i->imm32);
+}
+OPTYPE op_call_j32_follow(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, link = 0;
+    push32(VIRT_EIP() + flags);
+    cpu_push_return(&link, flags);
+    NEXT2(flags + i->imm32);
 }
 OPTYPE op_jmp_rel16(struct decoded_instruction* i)
 {
     uint32_t virt = VIRT_EIP();
     cpu.phys_eip += ((virt + i->flags + i->imm32) & 0xFFFF) - virt;
-    STOP();
+    STOP_LINKED(i->disp32);
 }
 OPTYPE op_jmpf(struct decoded_instruction* i)
 {
@@ -569,33 +733,222 @@ OPTYPE op_jnle32(struct decoded_instruction* i)
 }
 // <<< END AUTOGENERATE "jcc" >>>
 
+// Fused ALU + Jcc (see decode_fuse in decoder.c)
+// The ALU half updates the registers and lazy flags exactly like its unfused handler. The condition is then computed
+// from the operands directly instead of being read back through eflags.c. Operands of 16-bit forms are shifted into the
+// top half of the word so that the same carry, sign and overflow formulas work for both sizes.
+static inline int fused_cond(int cc, int of, int cf, int zf, int sf)
+{
+    int result;
+    switch (cc >> 1) {
+    case 0:
+        result = of;
+        break;
+    case 1:
+        result = cf;
+        break;
+    case 2:
+        result = zf;
+        break;
+    case 3:
+        result = cf | zf;
+        break;
+    case 4:
+        result = sf;
+        break;
+    case 5:
+        result = cpu_get_pf();
+        break;
+    case 6:
+        result = sf ^ of;
+        break;
+    default:
+        result = zf | (sf ^ of);
+        break;
+    }
+    return result ^ (cc & 1);
+}
+static inline int fused_cond_add(int cc, uint32_t a, uint32_t b, int cf)
+{
+    uint32_t r = a + b;
+    return fused_cond(cc, (~(a ^ b) & (a ^ r)) >> 31, cf, r == 0, r >> 31);
+}
+static inline int fused_cond_sub(int cc, uint32_t a, uint32_t b, int cf)
+{
+    uint32_t r = a - b;
+    return fused_cond(cc, ((a ^ b) & (a ^ r)) >> 31, cf, r == 0, r >> 31);
+}
+
+// The Jcc half. If the time slice ends between the two halves, stop at the Jcc like the unfused pair would have.
+// The dispatch loop is guaranteed to exit after this handler in that case, so it does not matter what we return.
+#define fused_jcc(cond)                                                                 \
+    do {                                                                                \
+        if (cpu.cycles_to_run == 1) {                                                   \
+            cpu.phys_eip += I_FUSED_LENGTH1(flags);                                     \
+            INSTRUMENT_INSN();                                                          \
+            return i + 1;                                                               \
+        }                                                                               \
+        cpu.cycles_to_run--;                                                            \
+        if (cond) {                                                                     \
+            if (flags & I_FUSED_JCC16) {                                                \
+                uint32_t virt = VIRT_EIP();                                             \
+                cpu.phys_eip += ((virt + I_LENGTH(flags) + i->imm32) & 0xFFFF) - virt; \
+            } else                                                                      \
+                cpu.phys_eip += I_LENGTH(flags) + i->imm32;                             \
+            STOP_LINKED(i->disp32);                                                     \
+        }                                                                               \
+        NEXT(flags);                                                                    \
+    } while (0)
+
+OPTYPE op_fused_cmp_r16r16(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R16(I_RM(flags)), b = R16(I_REG(flags));
+    cpu.lop2 = b;
+    cpu.lr = (int16_t)(a - b);
+    cpu.laux = SUB16;
+    fused_jcc(fused_cond_sub(I_OP3(flags), a << 16, b << 16, a < b));
+}
+OPTYPE op_fused_cmp_r32r32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R32(I_RM(flags)), b = R32(I_REG(flags));
+    cpu.lop2 = b;
+    cpu.lr = a - b;
+    cpu.laux = SUB32;
+    fused_jcc(fused_cond_sub(I_OP3(flags), a, b, a < b));
+}
+OPTYPE op_fused_cmp_r16i8(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R16(I_RM(flags)), b = I_FUSED_IMM8(flags) & 0xFFFF;
+    cpu.lop2 = b;
+    cpu.lr = (int16_t)(a - b);
+    cpu.laux = SUB16;
+    fused_jcc(fused_cond_sub(I_OP3(flags), a << 16, b << 16, a < b));
+}
+OPTYPE op_fused_cmp_r32i8(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R32(I_RM(flags)), b = I_FUSED_IMM8(flags);
+    cpu.lop2 = b;
+    cpu.lr = a - b;
+    cpu.laux = SUB32;
+    fused_jcc(fused_cond_sub(I_OP3(flags), a, b, a < b));
+}
+OPTYPE op_fused_test_r16r16(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, r = R16(I_RM(flags)) & R16(I_REG(flags));
+    cpu.lr = (int16_t)r;
+    cpu.laux = BIT;
+    fused_jcc(fused_cond(I_OP3(flags), 0, 0, r == 0, r >> 15));
+}
+OPTYPE op_fused_test_r32r32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, r = R32(I_RM(flags)) & R32(I_REG(flags));
+    cpu.lr = r;
+    cpu.laux = BIT;
+    fused_jcc(fused_cond(I_OP3(flags), 0, 0, r == 0, r >> 31));
+}
+OPTYPE op_fused_add_r16r16(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R16(I_RM(flags)), b = R16(I_REG(flags));
+    cpu_arith16(0, &R16(I_RM(flags)), b);
+    fused_jcc(fused_cond_add(I_OP3(flags), a << 16, b << 16, ((a + b) & 0xFFFF) < a));
+}
+OPTYPE op_fused_add_r32r32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R32(I_RM(flags)), b = R32(I_REG(flags));
+    cpu_arith32(0, &R32(I_RM(flags)), b);
+    fused_jcc(fused_cond_add(I_OP3(flags), a, b, a + b < a));
+}
+OPTYPE op_fused_add_r16i8(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R16(I_RM(flags)), b = I_FUSED_IMM8(flags) & 0xFFFF;
+    cpu_arith16(0, &R16(I_RM(flags)), b);
+    fused_jcc(fused_cond_add(I_OP3(flags), a << 16, b << 16, ((a + b) & 0xFFFF) < a));
+}
+OPTYPE op_fused_add_r32i8(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R32(I_RM(flags)), b = I_FUSED_IMM8(flags);
+    cpu_arith32(0, &R32(I_RM(flags)), b);
+    fused_jcc(fused_cond_add(I_OP3(flags), a, b, a + b < a));
+}
+OPTYPE op_fused_sub_r16r16(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R16(I_RM(flags)), b = R16(I_REG(flags));
+    cpu_arith16(5, &R16(I_RM(flags)), b);
+    fused_jcc(fused_cond_sub(I_OP3(flags), a << 16, b << 16, a < b));
+}
+OPTYPE op_fused_sub_r32r32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R32(I_RM(flags)), b = R32(I_REG(flags));
+    cpu_arith32(5, &R32(I_RM(flags)), b);
+    fused_jcc(fused_cond_sub(I_OP3(flags), a, b, a < b));
+}
+OPTYPE op_fused_sub_r16i8(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R16(I_RM(flags)), b = I_FUSED_IMM8(flags) & 0xFFFF;
+    cpu_arith16(5, &R16(I_RM(flags)), b);
+    fused_jcc(fused_cond_sub(I_OP3(flags), a << 16, b << 16, a < b));
+}
+OPTYPE op_fused_sub_r32i8(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R32(I_RM(flags)), b = I_FUSED_IMM8(flags);
+    cpu_arith32(5, &R32(I_RM(flags)), b);
+    fused_jcc(fused_cond_sub(I_OP3(flags), a, b, a < b));
+}
+// INC and DEC leave CF alone. cpu_inc* and cpu_dec* move its old value into cpu.eflags.
+OPTYPE op_fused_inc_r16(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R16(I_RM(flags));
+    cpu_inc16(&R16(I_RM(flags)));
+    fused_jcc(fused_cond_add(I_OP3(flags), a << 16, 1 << 16, cpu.eflags & EFLAGS_CF));
+}
+OPTYPE op_fused_inc_r32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R32(I_RM(flags));
+    cpu_inc32(&R32(I_RM(flags)));
+    fused_jcc(fused_cond_add(I_OP3(flags), a, 1, cpu.eflags & EFLAGS_CF));
+}
+OPTYPE op_fused_dec_r16(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R16(I_RM(flags));
+    cpu_dec16(&R16(I_RM(flags)));
+    fused_jcc(fused_cond_sub(I_OP3(flags), a << 16, 1 << 16, cpu.eflags & EFLAGS_CF));
+}
+OPTYPE op_fused_dec_r32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, a = R32(I_RM(flags));
+    cpu_dec32(&R32(I_RM(flags)));
+    fused_jcc(fused_cond_sub(I_OP3(flags), a, 1, cpu.eflags & EFLAGS_CF));
+}
+
 OPTYPE op_call_j16(struct decoded_instruction* i)
 {
     uint32_t virt_base = VIRT_EIP(), virt = virt_base + i->flags;
     push16(virt);
+    cpu_push_return(&i[1].disp32, i->flags);
     cpu.phys_eip += ((virt + i->imm32) & 0xFFFF) - virt_base;
-    STOP();
+    STOP_LINKED(i->disp32);
 }
 OPTYPE op_call_j32(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, virt = VIRT_EIP() + flags;
     push32(virt);
+    cpu_push_return(&i[1].disp32, flags);
     cpu.phys_eip += flags + i->imm32;
-    STOP();
+    STOP_LINKED(i->disp32);
 }
 OPTYPE op_ret16(struct decoded_instruction* i)
 {
     UNUSED(i);
     pop16(&temp.d16);
     SET_VIRT_EIP(temp.d16);
-    STOP();
+    STOP_RETURN();
 }
 OPTYPE op_ret32(struct decoded_instruction* i)
 {
     UNUSED(i);
     pop32(&temp.d32);
     SET_VIRT_EIP(temp.d32);
-    STOP();
+    STOP_RETURN();
 }
 OPTYPE op_ret16_iw(struct decoded_instruction* i)
 {
@@ -603,7 +956,7 @@ OPTYPE op_ret16_iw(struct decoded_instruction* i)
     pop16(&temp.d16);
     SET_VIRT_EIP(temp.d16);
     cpu.reg32[ESP] = ((cpu.reg32[ESP] + i->imm16) & cpu.esp_mask) | (cpu.reg32[ESP] & ~cpu.esp_mask);
-    STOP();
+    STOP_RETURN();
 }
 OPTYPE op_ret32_iw(struct decoded_instruction* i)
 {
@@ -611,7 +964,7 @@ OPTYPE op_ret32_iw(struct decoded_instruction* i)
     pop32(&temp.d32);
     SET_VIRT_EIP(temp.d32);
     cpu.reg32[ESP] = ((cpu.reg32[ESP] + i->imm16) & cpu.esp_mask) | (cpu.reg32[ESP] & ~cpu.esp_mask);
-    STOP();
+    STOP_RETURN();
 }
 
 OPTYPE op_int(struct decoded_instruction* i)
@@ -750,6 +1103,7 @@ OPTYPE op_pop_s16(struct decoded_instruction* i)
 {
     // This instruction must be treated very carefully
     // We cannot use pop16 for this operation
+    uint32_t state_hash = cpu.state_hash;
     int flags = i->flags, seg_dest = I_RM(flags);
     uint16_t dest;
     cpu_read16((cpu.reg32[ESP] & cpu.esp_mask) + cpu.seg_base[SS], dest, cpu.tlb_shift_read);
@@ -758,11 +1112,12 @@ OPTYPE op_pop_s16(struct decoded_instruction* i)
     cpu.reg32[ESP] = ((cpu.reg32[ESP] + 2) & cpu.esp_mask) | (cpu.reg32[ESP] & ~cpu.esp_mask);
     if (seg_dest == SS)
         interrupt_guard();
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_pop_s32(struct decoded_instruction* i)
 {
     // Identical to above except ESP is incremented by 4
+    uint32_t state_hash = cpu.state_hash;
     int flags = i->flags, seg_dest = I_RM(flags);
     uint16_t dest;
     cpu_read16((cpu.reg32[ESP] & cpu.esp_mask) + cpu.seg_base[SS], dest, cpu.tlb_shift_read);
@@ -771,7 +1126,7 @@ OPTYPE op_pop_s32(struct decoded_instruction* i)
     cpu.reg32[ESP] = ((cpu.reg32[ESP] + 4) & cpu.esp_mask) | (cpu.reg32[ESP] & ~cpu.esp_mask);
     if (seg_dest == SS)
         interrupt_guard();
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_pusha(struct decoded_instruction* i)
 {
@@ -1259,6 +1614,418 @@ OPTYPE op_dec_e32(struct decoded_instruction* i)
     arith_rmw2(32, cpu_dec32);
 }
 
+// Handlers for register-form instructions whose flags are overwritten before anything can read them (see decode_flags in
+// decoder.c). If the time slice can end before the flags are overwritten, an interrupt would see them, so fall back to
+// the full handler in that case.
+#define flags_dead(full)                                     \
+    do {                                                     \
+        if (cpu.cycles_to_run <= (int)I_NF_WINDOW(i->flags)) \
+            return full(i);                                  \
+    } while (0)
+static inline uint32_t arith_nf(int op, uint32_t a, uint32_t b)
+{
+    switch (op) {
+    case 0:
+        return a + b;
+    case 1:
+        return a | b;
+    case 4:
+        return a & b;
+    case 5:
+        return a - b;
+    default: // ADC and SBB read CF, so they are never given a _nf handler
+        return a ^ b;
+    }
+}
+OPTYPE op_arith_r8r8_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_arith_r8r8);
+    uint32_t flags = i->flags;
+    R8(I_RM(flags)) = arith_nf(I_OP(flags), R8(I_RM(flags)), R8(I_REG(flags)));
+    NEXT(flags);
+}
+OPTYPE op_arith_r8i8_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_arith_r8i8);
+    uint32_t flags = i->flags;
+    R8(I_RM(flags)) = arith_nf(I_OP(flags), R8(I_RM(flags)), i->imm8);
+    NEXT(flags);
+}
+OPTYPE op_arith_r16r16_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_arith_r16r16);
+    uint32_t flags = i->flags;
+    R16(I_RM(flags)) = arith_nf(I_OP(flags), R16(I_RM(flags)), R16(I_REG(flags)));
+    NEXT(flags);
+}
+OPTYPE op_arith_r16i16_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_arith_r16i16);
+    uint32_t flags = i->flags;
+    R16(I_RM(flags)) = arith_nf(I_OP(flags), R16(I_RM(flags)), i->imm16);
+    NEXT(flags);
+}
+OPTYPE op_arith_r32r32_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_arith_r32r32);
+    uint32_t flags = i->flags;
+    R32(I_RM(flags)) = arith_nf(I_OP(flags), R32(I_RM(flags)), R32(I_REG(flags)));
+    NEXT(flags);
+}
+OPTYPE op_arith_r32i32_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_arith_r32i32);
+    uint32_t flags = i->flags;
+    R32(I_RM(flags)) = arith_nf(I_OP(flags), R32(I_RM(flags)), i->imm32);
+    NEXT(flags);
+}
+OPTYPE op_cmp_r8r8_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_cmp_r8r8);
+    NEXT(i->flags);
+}
+OPTYPE op_cmp_r8i8_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_cmp_r8i8);
+    NEXT(i->flags);
+}
+OPTYPE op_cmp_r16r16_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_cmp_r16r16);
+    NEXT(i->flags);
+}
+OPTYPE op_cmp_r16i16_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_cmp_r16i16);
+    NEXT(i->flags);
+}
+OPTYPE op_cmp_r32r32_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_cmp_r32r32);
+    NEXT(i->flags);
+}
+OPTYPE op_cmp_r32i32_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_cmp_r32i32);
+    NEXT(i->flags);
+}
+OPTYPE op_test_r8r8_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_test_r8r8);
+    NEXT(i->flags);
+}
+OPTYPE op_test_r8i8_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_test_r8i8);
+    NEXT(i->flags);
+}
+OPTYPE op_test_r16r16_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_test_r16r16);
+    NEXT(i->flags);
+}
+OPTYPE op_test_r16i16_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_test_r16i16);
+    NEXT(i->flags);
+}
+OPTYPE op_test_r32r32_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_test_r32r32);
+    NEXT(i->flags);
+}
+OPTYPE op_test_r32i32_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_test_r32i32);
+    NEXT(i->flags);
+}
+OPTYPE op_inc_r8_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_inc_r8);
+    uint32_t flags = i->flags;
+    R8(I_RM(flags))++;
+    NEXT(flags);
+}
+OPTYPE op_inc_r16_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_inc_r16);
+    uint32_t flags = i->flags;
+    R16(I_RM(flags))++;
+    NEXT(flags);
+}
+OPTYPE op_inc_r32_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_inc_r32);
+    uint32_t flags = i->flags;
+    R32(I_RM(flags))++;
+    NEXT(flags);
+}
+OPTYPE op_dec_r8_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_dec_r8);
+    uint32_t flags = i->flags;
+    R8(I_RM(flags))--;
+    NEXT(flags);
+}
+OPTYPE op_dec_r16_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_dec_r16);
+    uint32_t flags = i->flags;
+    R16(I_RM(flags))--;
+    NEXT(flags);
+}
+OPTYPE op_dec_r32_nf(struct decoded_instruction* i)
+{
+    flags_dead(op_dec_r32);
+    uint32_t flags = i->flags;
+    R32(I_RM(flags))--;
+    NEXT(flags);
+}
+
+// Memory forms used while CS, DS, ES, and SS all have a base of zero (see decode_flat in decoder.c)
+OPTYPE op_mov_r8e8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_read8(linaddr, R8(I_REG(flags)), cpu.tlb_shift_read);
+    NEXT(flags);
+}
+OPTYPE op_mov_e8r8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_write8(linaddr, R8(I_REG(flags)), cpu.tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_mov_e8i8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_write8(linaddr, i->imm8, cpu.tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_mov_r16e16_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_read16(linaddr, R16(I_REG(flags)), cpu.tlb_shift_read);
+    NEXT(flags);
+}
+OPTYPE op_mov_e16r16_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_write16(linaddr, R16(I_REG(flags)), cpu.tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_mov_e16i16_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_write16(linaddr, i->imm16, cpu.tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_mov_r32e32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_read32(linaddr, R32(I_REG(flags)), cpu.tlb_shift_read);
+    NEXT(flags);
+}
+OPTYPE op_mov_e32r32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_write32(linaddr, R32(I_REG(flags)), cpu.tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_mov_e32i32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    cpu_write32(linaddr, i->imm32, cpu.tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_arith_r8e8_flat(struct decoded_instruction* i)
+{
+    arith_re_at(8, cpu_arith8, cpu_get_flataddr(flags, i));
+}
+OPTYPE op_arith_e8r8_flat(struct decoded_instruction* i)
+{
+    arith_rmw_at(8, cpu_arith8, cpu_get_flataddr(flags, i), R8(I_REG(flags)));
+}
+OPTYPE op_arith_e8i8_flat(struct decoded_instruction* i)
+{
+    arith_rmw_at(8, cpu_arith8, cpu_get_flataddr(flags, i), i->imm8);
+}
+OPTYPE op_arith_r16e16_flat(struct decoded_instruction* i)
+{
+    arith_re_at(16, cpu_arith16, cpu_get_flataddr(flags, i));
+}
+OPTYPE op_arith_e16r16_flat(struct decoded_instruction* i)
+{
+    arith_rmw_at(16, cpu_arith16, cpu_get_flataddr(flags, i), R16(I_REG(flags)));
+}
+OPTYPE op_arith_e16i16_flat(struct decoded_instruction* i)
+{
+    arith_rmw_at(16, cpu_arith16, cpu_get_flataddr(flags, i), i->imm16);
+}
+OPTYPE op_arith_r32e32_flat(struct decoded_instruction* i)
+{
+    arith_re_at(32, cpu_arith32, cpu_get_flataddr(flags, i));
+}
+OPTYPE op_arith_e32r32_flat(struct decoded_instruction* i)
+{
+    arith_rmw_at(32, cpu_arith32, cpu_get_flataddr(flags, i), R32(I_REG(flags)));
+}
+OPTYPE op_arith_e32i32_flat(struct decoded_instruction* i)
+{
+    arith_rmw_at(32, cpu_arith32, cpu_get_flataddr(flags, i), i->imm32);
+}
+OPTYPE op_cmp_e8r8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    uint8_t src;
+    cpu_read8(cpu_get_flataddr(flags, i), src, cpu.tlb_shift_read);
+    cpu.lop2 = R8(I_REG(flags));
+    cpu.lr = (int8_t)(src - cpu.lop2);
+    cpu.laux = SUB8;
+    NEXT(flags);
+}
+OPTYPE op_cmp_r8e8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    uint8_t src;
+    cpu_read8(cpu_get_flataddr(flags, i), src, cpu.tlb_shift_read);
+    cpu.lop2 = src;
+    cpu.lr = (int8_t)(R8(I_REG(flags)) - src);
+    cpu.laux = SUB8;
+    NEXT(flags);
+}
+OPTYPE op_cmp_e8i8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    uint8_t src;
+    cpu_read8(cpu_get_flataddr(flags, i), src, cpu.tlb_shift_read);
+    cpu.lop2 = i->imm8;
+    cpu.lr = (int8_t)(src - cpu.lop2);
+    cpu.laux = SUB8;
+    NEXT(flags);
+}
+OPTYPE op_cmp_e32r32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    uint32_t src;
+    cpu_read32(cpu_get_flataddr(flags, i), src, cpu.tlb_shift_read);
+    cpu.lop2 = R32(I_REG(flags));
+    cpu.lr = (int32_t)(src - cpu.lop2);
+    cpu.laux = SUB32;
+    NEXT(flags);
+}
+OPTYPE op_cmp_r32e32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    uint32_t src;
+    cpu_read32(cpu_get_flataddr(flags, i), src, cpu.tlb_shift_read);
+    cpu.lop2 = src;
+    cpu.lr = (int32_t)(R32(I_REG(flags)) - src);
+    cpu.laux = SUB32;
+    NEXT(flags);
+}
+OPTYPE op_cmp_e32i32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    uint32_t src;
+    cpu_read32(cpu_get_flataddr(flags, i), src, cpu.tlb_shift_read);
+    cpu.lop2 = i->imm32;
+    cpu.lr = (int32_t)(src - cpu.lop2);
+    cpu.laux = SUB32;
+    NEXT(flags);
+}
+OPTYPE op_movzx_r32e8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i), src = 0;
+    cpu_read8(linaddr, src, cpu.tlb_shift_read);
+    R32(I_REG(flags)) = src;
+    NEXT(flags);
+}
+OPTYPE op_movzx_r32e16_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i), src = 0;
+    cpu_read16(linaddr, src, cpu.tlb_shift_read);
+    R32(I_REG(flags)) = src;
+    NEXT(flags);
+}
+OPTYPE op_movsx_r32e8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i), src;
+    cpu_read8(linaddr, src, cpu.tlb_shift_read);
+    R32(I_REG(flags)) = (int8_t)src;
+    NEXT(flags);
+}
+OPTYPE op_movsx_r32e16_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_flataddr(flags, i), src;
+    cpu_read16(linaddr, src, cpu.tlb_shift_read);
+    R32(I_REG(flags)) = (int16_t)src;
+    NEXT(flags);
+}
+OPTYPE op_push_e32_flat(struct decoded_instruction* i)
+{
+    int flags = i->flags, linaddr = cpu_get_flataddr(flags, i);
+    uint32_t src;
+    cpu_read32(linaddr, src, cpu.tlb_shift_read);
+    push32(src);
+    NEXT(flags);
+}
+
+// Memory forms specialised by addressing form (see decode_addr_forms in decoder.c). Each handler below comes in six
+// variants: [disp], [base], and [base+disp], each either going through the segment base and address mask or, like the
+// _flat handlers, skipping both. Forms with an index register keep the general handlers.
+#define FORM_DISP(flags, i) (i)->disp32
+#define FORM_BASE(flags, i) cpu.reg32[I_BASE(flags)]
+#define FORM_BASE_DISP(flags, i) (cpu.reg32[I_BASE(flags)] + (i)->disp32)
+#define FORM_LINADDR(form) (FAST_BRANCHLESS_MASK((form(flags, i)), flags) + cpu.seg_base[I_SEG_BASE(flags)])
+#define FORM_FLATADDR(form) form(flags, i)
+
+#define DEFINE_FORM(name, suffix, body, addr, ...)     \
+    OPTYPE name##suffix(struct decoded_instruction* i) \
+    {                                                  \
+        body(addr, __VA_ARGS__);                       \
+    }
+#define DEFINE_FORMS(name, body, ...)                                                    \
+    DEFINE_FORM(name, _disp, body, FORM_LINADDR(FORM_DISP), __VA_ARGS__)                 \
+    DEFINE_FORM(name, _base, body, FORM_LINADDR(FORM_BASE), __VA_ARGS__)                 \
+    DEFINE_FORM(name, _base_disp, body, FORM_LINADDR(FORM_BASE_DISP), __VA_ARGS__)       \
+    DEFINE_FORM(name, _disp_flat, body, FORM_FLATADDR(FORM_DISP), __VA_ARGS__)           \
+    DEFINE_FORM(name, _base_flat, body, FORM_FLATADDR(FORM_BASE), __VA_ARGS__)           \
+    DEFINE_FORM(name, _base_disp_flat, body, FORM_FLATADDR(FORM_BASE_DISP), __VA_ARGS__)
+
+#define form_load(addr, sz)                                         \
+    uint32_t flags = i->flags, linaddr = addr;                      \
+    cpu_read##sz(linaddr, R##sz(I_REG(flags)), cpu.tlb_shift_read); \
+    NEXT(flags)
+#define form_store(addr, sz, src)                     \
+    uint32_t flags = i->flags, linaddr = addr;        \
+    cpu_write##sz(linaddr, src, cpu.tlb_shift_write); \
+    NEXT(flags)
+#define form_arith_re(addr, sz) arith_re_at(sz, cpu_arith##sz, addr)
+#define form_arith_rmw(addr, sz, src) arith_rmw_at(sz, cpu_arith##sz, addr, src)
+// "dst" and "src" can use the value read from memory, "mem"
+#define form_cmp(addr, sz, dst, src)                \
+    uint32_t flags = i->flags, linaddr = addr;      \
+    uint##sz##_t mem;                               \
+    cpu_read##sz(linaddr, mem, cpu.tlb_shift_read); \
+    cpu.lop2 = src;                                 \
+    cpu.lr = (int##sz##_t)(dst - cpu.lop2);         \
+    cpu.laux = SUB##sz;                             \
+    NEXT(flags)
+
+DEFINE_FORMS(op_mov_r8e8, form_load, 8)
+DEFINE_FORMS(op_mov_e8r8, form_store, 8, R8(I_REG(flags)))
+DEFINE_FORMS(op_mov_r16e16, form_load, 16)
+DEFINE_FORMS(op_mov_e16r16, form_store, 16, R16(I_REG(flags)))
+DEFINE_FORMS(op_mov_r32e32, form_load, 32)
+DEFINE_FORMS(op_mov_e32r32, form_store, 32, R32(I_REG(flags)))
+DEFINE_FORMS(op_mov_e32i32, form_store, 32, i->imm32)
+DEFINE_FORMS(op_arith_r32e32, form_arith_re, 32)
+DEFINE_FORMS(op_arith_e32r32, form_arith_rmw, 32, R32(I_REG(flags)))
+DEFINE_FORMS(op_arith_e32i32, form_arith_rmw, 32, i->imm32)
+DEFINE_FORMS(op_cmp_r32e32, form_cmp, 32, R32(I_REG(flags)), mem)
+DEFINE_FORMS(op_cmp_e32r32, form_cmp, 32, mem, R32(I_REG(flags)))
+DEFINE_FORMS(op_cmp_e32i32, form_cmp, 32, mem, i->imm32)
+
 OPTYPE op_not_r8(struct decoded_instruction* i)
 {
     int flags = i->flags, rm = I_RM(flags);
@@ -1710,15 +2477,17 @@ OPTYPE op_mov_e32i32(struct decoded_instruction* i)
 
 OPTYPE op_mov_s16r16(struct decoded_instruction* i)
 {
+    uint32_t state_hash = cpu.state_hash;
     int flags = i->flags, dest = I_REG(flags);
     if (cpu_load_seg_value_mov(dest, R16(I_RM(flags))))
         EXCEP();
     if (dest == SS)
         interrupt_guard();
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_mov_s16e16(struct decoded_instruction* i)
 {
+    uint32_t state_hash = cpu.state_hash;
     uint32_t flags = i->flags, dest = I_REG(flags), linaddr = cpu_get_linaddr(flags, i);
     uint16_t src;
     cpu_read16(linaddr, src, cpu.tlb_shift_read);
@@ -1726,7 +2495,7 @@ OPTYPE op_mov_s16e16(struct decoded_instruction* i)
         EXCEP();
     if (dest == SS)
         interrupt_guard();
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_mov_e16s16(struct decoded_instruction* i)
 {
@@ -1843,63 +2612,69 @@ OPTYPE op_lea_r32e32(struct decoded_instruction* i)
 
 OPTYPE op_lds_r16e16(struct decoded_instruction* i)
 {
+    uint32_t state_hash = cpu.state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 2, data, cpu.tlb_shift_read);
     if (cpu_load_seg_value_mov(DS, data))
         EXCEP();
     cpu_read16(linaddr, data, cpu.tlb_shift_read);
     R16(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_lds_r32e32(struct decoded_instruction* i)
 {
+    uint32_t state_hash = cpu.state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 4, data, cpu.tlb_shift_read);
     if (cpu_load_seg_value_mov(DS, data))
         EXCEP();
     cpu_read32(linaddr, data, cpu.tlb_shift_read);
     R32(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_les_r16e16(struct decoded_instruction* i)
 {
+    uint32_t state_hash = cpu.state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 2, data, cpu.tlb_shift_read);
     if (cpu_load_seg_value_mov(ES, data))
         EXCEP();
     cpu_read16(linaddr, data, cpu.tlb_shift_read);
     R16(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_les_r32e32(struct decoded_instruction* i)
 {
+    uint32_t state_hash = cpu.state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 4, data, cpu.tlb_shift_read);
     if (cpu_load_seg_value_mov(ES, data))
         EXCEP();
     cpu_read32(linaddr, data, cpu.tlb_shift_read);
     R32(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_lss_r16e16(struct decoded_instruction* i)
 {
+    uint32_t state_hash = cpu.state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 2, data, cpu.tlb_shift_read);
     if (cpu_load_seg_value_mov(SS, data))
         EXCEP();
     cpu_read16(linaddr, data, cpu.tlb_shift_read);
     R16(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_lss_r32e32(struct decoded_instruction* i)
 {
+    uint32_t state_hash = cpu.state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 4, data, cpu.tlb_shift_read);
     if (cpu_load_seg_value_mov(SS, data))
         EXCEP();
     cpu_read32(linaddr, data, cpu.tlb_shift_read);
     R32(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, state_hash);
 }
 OPTYPE op_lfs_r16e16(struct decoded_instruction* i)
 {
@@ -1969,7 +2744,7 @@ OPTYPE op_xchg_r32r32(struct decoded_instruction* i)
 OPTYPE op_xchg_r8e8(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i);
-    int tlb_info = cpu.tlb_tags[linaddr >> 12];
+    int tlb_info = TLB_TAGS(linaddr);
     uint8_t* ptr;
     if (TLB_ENTRY_INVALID8(linaddr, tlb_info, cpu.tlb_shift_write)) {
         if (cpu_access_read8(linaddr, tlb_info, cpu.tlb_shift_write))
@@ -1977,7 +2752,7 @@ OPTYPE op_xchg_r8e8(struct decoded_instruction* i)
         UNUSED2(cpu_access_write8(linaddr, R8(I_REG(flags)), tlb_info, cpu.tlb_shift_write));
         R8(I_REG(flags)) = cpu.read_result;
     } else {
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;
+        ptr = TLB_PTR(linaddr);
         uint8_t tmp = *ptr;
         *ptr = R8(I_REG(flags));
         R8(I_REG(flags)) = tmp;
@@ -1987,7 +2762,7 @@ OPTYPE op_xchg_r8e8(struct decoded_instruction* i)
 OPTYPE op_xchg_r16e16(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i);
-    int tlb_info = cpu.tlb_tags[linaddr >> 12];
+    int tlb_info = TLB_TAGS(linaddr);
     uint16_t* ptr;
     if (TLB_ENTRY_INVALID16(linaddr, tlb_info, cpu.tlb_shift_write)) {
         tlb_info >>= cpu.tlb_shift_write;
@@ -1996,7 +2771,7 @@ OPTYPE op_xchg_r16e16(struct decoded_instruction* i)
         UNUSED2(cpu_access_write16(linaddr, R16(I_REG(flags)), tlb_info, cpu.tlb_shift_write));
         R16(I_REG(flags)) = cpu.read_result;
     } else {
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;
+        ptr = TLB_PTR(linaddr);
         uint16_t tmp = *ptr;
         *ptr = R16(I_REG(flags));
         R16(I_REG(flags)) = tmp;
@@ -2006,7 +2781,7 @@ OPTYPE op_xchg_r16e16(struct decoded_instruction* i)
 OPTYPE op_xchg_r32e32(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i);
-    int tlb_info = cpu.tlb_tags[linaddr >> 12];
+    int tlb_info = TLB_TAGS(linaddr);
     uint32_t* ptr;
     if (TLB_ENTRY_INVALID32(linaddr, tlb_info, cpu.tlb_shift_write)) {
         tlb_info >>= cpu.tlb_shift_write;
@@ -2015,7 +2790,7 @@ OPTYPE op_xchg_r32e32(struct decoded_instruction* i)
         UNUSED2(cpu_access_write32(linaddr, R32(I_REG(flags)), tlb_info, cpu.tlb_shift_write));
         R32(I_REG(flags)) = cpu.read_result;
     } else {
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;
+        ptr = TLB_PTR(linaddr);
         uint32_t tmp = *ptr;
         *ptr = R32(I_REG(flags));
         R32(I_REG(flags)) = tmp;
@@ -365,6 +365,7 @@ static int do_task_switch(int sel, struct seg_desc* info, int type, int eip)
                 cpu.seg_base[i] = 0;
                 cpu.seg_limit[i] = 0;
                 cpu.seg_access[i] = 0;
+                cpu_seg_update_flat();
                 continue;
             }
             if (cpu_seg_load_descriptor(sel, &seg_info, EX_TS, sel_offs))
@@ -400,6 +401,9 @@ static int do_task_switch(int sel, struct seg_desc* info, int type, int eip)
 int cpu_interrupt(int vector, int error_code, int type, int eip_to_push)
 {
     FAST_STACK_INIT;
+    // EIP is about to move, so find out which instruction of the trace this is while it still can be (see cpu_trace_sync)
+    if (cpu.trace_end)
+        cpu_trace_sync();
     if (cpu.cr[0] & CR0_PE) {
         if (cpu.eflags & EFLAGS_VM && type == INTERRUPT_TYPE_SOFTWARE) {
             // Vrtual 8086 Mode interrupt
@@ -646,6 +650,7 @@ int cpu_interrupt(int vector, int error_code, int type, int eip_to_push)
                         cpu.seg_limit[ES] = 0;
                         cpu.seg_base[ES] = 0;
                         cpu.seg_access[ES] = 0;
+                        cpu_seg_update_flat();
                     }
                     push32(old_ss);
                     push32(old_esp);
@@ -680,6 +685,7 @@ int cpu_interrupt(int vector, int error_code, int type, int eip_to_push)
                         cpu.seg_limit[ES] = 0;
                         cpu.seg_base[ES] = 0;
                         cpu.seg_access[ES] = 0;
+                        cpu_seg_update_flat();
                     }
                     push16(old_ss);
                     push16(old_esp);
@@ -1175,6 +1181,7 @@ static void iret_handle_seg(int x)
         cpu.seg_base[x] = 0;
         cpu.seg_limit[x] = 0;
         cpu.seg_valid[x] = 0;
+        cpu_seg_update_flat();
     }
 }
 
@@ -1570,14 +1577,13 @@ static void reload_cs_base(void)
 {
     // For sysenter/sysexit, virt_eip == lin_eip
     uint32_t virt_eip = VIRT_EIP();
-    uint32_t lin_page = virt_eip >> 12,
-             shift = cpu.tlb_shift_read,
-             tag = cpu.tlb_tags[virt_eip >> 12] >> shift;
+    uint32_t shift = cpu.tlb_shift_read,
+             tag = TLB_TAGS(virt_eip) >> shift;
     if (tag & 2) {
         cpu.last_phys_eip = cpu.phys_eip + 0x1000;
         return;
     }
-    cpu.phys_eip = PTR_TO_PHYS(cpu.tlb[lin_page] + virt_eip);
+    cpu.phys_eip = PTR_TO_PHYS(TLB_PTR(virt_eip));
     cpu.last_phys_eip = cpu.phys_eip & ~0xFFF;
     cpu.eip_phys_bias = virt_eip - cpu.phys_eip;
 }
@@ -1607,6 +1613,7 @@ int sysenter(void)
     cpu.seg_limit[SS] = -1;
     cpu.seg_access[SS] = ACCESS_S | 0x03 | ACCESS_P | ACCESS_G | ACCESS_B; // 32-bit, r/x data, accessed, present, 4kb granularity, 32-bit
     cpu.esp_mask = -1;
+    cpu_seg_update_flat();
 
     reload_cs_base();
     return 0;
@@ -1634,6 +1641,7 @@ int sysexit(void)
     cpu.seg_limit[SS] = -1;
     cpu.seg_access[SS] = ACCESS_S | 0x03 | ACCESS_P | ACCESS_G | ACCESS_B | ACCESS_DPL_MASK; // 32-bit, r/x data, accessed, present, 4kb granularity, 32-bit, dpl=3
     cpu.esp_mask = -1;
+    cpu_seg_update_flat();
 
     reload_cs_base();
     return 0;
@@ -1,5 +1,6 @@
 // Miscellaneous operations
 #include "cpu/cpu.h"
+#include "cpu/fpu.h"
 #include "cpuapi.h"
 #ifdef INSTRUMENT
 #include "cpu/instrument.h"
@@ -19,10 +20,13 @@
 #define ATOM_N270_SUPPORT
 static int winnt_limit_cpuid;
 
-// Sets CPUID information. Currently unimplemented
+// Sets CPUID information and other configuration options. CPUID itself is currently unimplemented
 int cpu_set_cpuid(struct cpu_config* x)
 {
     winnt_limit_cpuid = x->cpuid_limit_winnt;
+    cpu.trace_cache_budget = x->trace_cache_size;
+    cpu.trace_length = x->trace_length;
+    fpu_set_accuracy(x->fpu_accuracy);
     return 0;
 }
 
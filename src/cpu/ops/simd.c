@@ -6,7 +6,10 @@
 #include "cpu/cpu.h"
 #include "cpu/fpu.h"
 #include "cpu/instrument.h"
+#include "cpu/vector.h"
+#include "cpuapi.h"
 #include "io.h"
+#include <math.h>
 #include <string.h>
 #define EXCEPTION_HANDLER return 1
 
@@ -57,6 +60,349 @@ int cpu_mmx_check(void)
     if (cpu_mmx_check()) \
     return 1
 
+///////////////////////////////////////////////////////////////////////////////
+// Host float fast path
+///////////////////////////////////////////////////////////////////////////////
+// With round-to-nearest and the precision exception masked, SSE arithmetic on ordinary numbers gives the same results as
+// the host's own single and double precision operations. cpu_update_mxcsr turns this path on for that setting. An
+// instruction then runs on host vectors if every lane it reads is zero or well inside the normal range and every lane it
+// writes is too, so that precision is the only flag it can raise. Anything else -- NaNs, infinities, denormals, results
+// near overflow or underflow -- sends the whole instruction to softfloat. DAZ and FTZ only matter for denormals, which
+// never get here. Precision is sticky, so the exact rounding error is only worked out while that flag is still clear.
+
+// Nonzero operands and results must lie within 2^-LIMIT .. 2^LIMIT. This keeps the rounding error of every operation
+// representable, so that it can be computed exactly.
+#define SSE_HOST_F32_LIMIT 100
+#define SSE_HOST_F64_LIMIT 960
+
+#define MXCSR_PE 0x20
+
+// Define this to run every instruction that takes the host path through softfloat as well and stop on any difference
+//#define SSE_HOST_VERIFY
+
+static int sse_host;
+
+enum {
+    SSE_HOST_ADD,
+    SSE_HOST_SUB,
+    SSE_HOST_MUL,
+    SSE_HOST_DIV,
+    SSE_HOST_MIN,
+    SSE_HOST_MAX,
+    SSE_HOST_SQRT,
+
+    SSE_HOST_PS2PD,
+    SSE_HOST_PD2PS,
+    SSE_HOST_DQ2PS,
+    SSE_HOST_PS2DQ,
+    SSE_HOST_TPS2DQ
+};
+
+// Lanes that are zero or within range
+static inline vec_i32 sse_host_f32_range(vec_f32 x)
+{
+    vec_u32 bits = (vec_u32)x, exponent = bits >> 23 & 0xFF;
+    return (exponent - (127 - SSE_HOST_F32_LIMIT) < 2 * SSE_HOST_F32_LIMIT) | (bits << 1 == 0);
+}
+static inline vec_i64 sse_host_f64_range(vec_f64 x)
+{
+    vec_u64 bits = (vec_u64)x, exponent = bits >> 52 & 0x7FF;
+    return (exponent - (1023 - SSE_HOST_F64_LIMIT) < 2 * SSE_HOST_F64_LIMIT) | (bits << 1 == 0);
+}
+// Same as sse_host_f32_range, for a single value
+static inline int sse_host_float_in_range(float x)
+{
+    x = fabsf(x);
+    return x == 0 || (x >= 0x1p-100f && x < 0x1p100f);
+}
+
+#ifdef SSE_HOST_VERIFY
+static float32 (*const sse_soft_f32[])(float32 a, float32 b, float_status_t* status) = {
+    float32_add, float32_sub, float32_mul, float32_div, float32_min, float32_max
+};
+static float64 (*const sse_soft_f64[])(float64 a, float64 b, float_status_t* status) = {
+    float64_add, float64_sub, float64_mul, float64_div, float64_min, float64_max
+};
+
+// Checks the host result of one lane against softfloat, and returns the flags softfloat raised for it
+static int sse_host_verify(int op, int size, const void* dest, const void* src, const void* result, int lane)
+{
+    float_status_t expected_status = status;
+    uint64_t expected, actual;
+    if (size == 4) {
+        float32 a = ((const float32*)dest)[lane], b = ((const float32*)src)[lane];
+        expected = op == SSE_HOST_SQRT ? float32_sqrt(b, &expected_status) : sse_soft_f32[op](a, b, &expected_status);
+        actual = ((const float32*)result)[lane];
+    } else {
+        float64 a = ((const float64*)dest)[lane], b = ((const float64*)src)[lane];
+        expected = op == SSE_HOST_SQRT ? float64_sqrt(b, &expected_status) : sse_soft_f64[op](a, b, &expected_status);
+        actual = ((const float64*)result)[lane];
+    }
+    int flags = expected_status.float_exception_flags & 0x3F;
+    if (actual != expected || (flags & ~MXCSR_PE))
+        CPU_FATAL("SSE: host op %d lane %d returned %llx, softfloat %llx (flags %02x)\n", op, lane,
+            (unsigned long long)actual, (unsigned long long)expected, flags);
+    return flags;
+}
+static void sse_host_verify_flags(int expected_flags, int inexact)
+{
+    if (!(cpu.mxcsr & MXCSR_PE) && !(expected_flags & MXCSR_PE) != !inexact)
+        CPU_FATAL("SSE: host precision flag %d, softfloat flags %02x\n", inexact, expected_flags);
+}
+#endif
+
+// Single precision arithmetic on the first "bytes" bytes of "dest" and "src". Returns 0 if softfloat has to do it.
+static inline int sse_host_f32(int op, void* dest, void* src, int bytes)
+{
+    vec_f32 x = (vec_f32)vec_load(dest, bytes), y = (vec_f32)vec_load(src, bytes), z, error = { 0 };
+    vec_i32 ok, less;
+    int lanes = bytes >> 2, inexact = 0;
+    if (op == SSE_HOST_SQRT)
+        x = y;
+    ok = sse_host_f32_range(x) & sse_host_f32_range(y);
+    switch (op) {
+    case SSE_HOST_SUB:
+        y = -y;
+    // fallthrough
+    case SSE_HOST_ADD: {
+        z = x + y;
+        ok &= sse_host_f32_range(z);
+        // Knuth's two-sum gives the exact rounding error of the addition
+        vec_f32 t = z - x;
+        error = (x - (z - t)) + (y - t);
+        break;
+    }
+    case SSE_HOST_MUL:
+        z = x * y;
+        // A zero product is only exact if one of the factors was zero
+        ok &= sse_host_f32_range(z) & ((z != 0) | (x == 0) | (y == 0));
+        break;
+    case SSE_HOST_DIV:
+        z = x / y;
+        ok &= sse_host_f32_range(z) & (y != 0) & ((z != 0) | (x == 0));
+        break;
+    case SSE_HOST_MIN:
+    case SSE_HOST_MAX:
+        // Unlike the C library, MINPS and MAXPS return the second operand unless the first one compares less (greater)
+        less = op == SSE_HOST_MIN ? x < y : x > y;
+        z = (vec_f32)(((vec_i32)x & less) | ((vec_i32)y & ~less));
+        break;
+    case SSE_HOST_SQRT:
+        for (int i = 0; i < 4; i++)
+            z[i] = x[i] < 0 ? 0 : sqrtf(x[i]);
+        ok &= x >= 0;
+        break;
+    default:
+        return 0;
+    }
+    if (!vec_all((vec_u8)ok, bytes))
+        return 0;
+
+    if (!(cpu.mxcsr & MXCSR_PE)) {
+        // The products below are exact in double precision
+        for (int i = 0; i < lanes; i++) {
+            switch (op) {
+            case SSE_HOST_ADD:
+            case SSE_HOST_SUB:
+                inexact |= error[i] != 0;
+                break;
+            case SSE_HOST_MUL:
+                inexact |= (double)x[i] * y[i] != z[i];
+                break;
+            case SSE_HOST_DIV:
+                inexact |= (double)z[i] * y[i] != x[i];
+                break;
+            case SSE_HOST_SQRT:
+                inexact |= (double)z[i] * z[i] != x[i];
+                break;
+            }
+        }
+    }
+#ifdef SSE_HOST_VERIFY
+    int expected_flags = 0;
+    if (op == SSE_HOST_SUB)
+        y = -y;
+    for (int i = 0; i < lanes; i++)
+        expected_flags |= sse_host_verify(op, 4, &x, &y, &z, i);
+    sse_host_verify_flags(expected_flags, inexact);
+#endif
+    vec_store(dest, (vec_u8)z, bytes);
+    if (inexact)
+        cpu.mxcsr |= MXCSR_PE;
+    return 1;
+}
+
+// Double precision arithmetic, same as above
+static inline int sse_host_f64(int op, void* dest, void* src, int bytes)
+{
+    vec_f64 x = (vec_f64)vec_load(dest, bytes), y = (vec_f64)vec_load(src, bytes), z, error = { 0 };
+    vec_i64 ok, less;
+    int lanes = bytes >> 3, inexact = 0;
+    if (op == SSE_HOST_SQRT)
+        x = y;
+    ok = sse_host_f64_range(x) & sse_host_f64_range(y);
+    switch (op) {
+    case SSE_HOST_SUB:
+        y = -y;
+    // fallthrough
+    case SSE_HOST_ADD: {
+        z = x + y;
+        ok &= sse_host_f64_range(z);
+        vec_f64 t = z - x;
+        error = (x - (z - t)) + (y - t);
+        break;
+    }
+    case SSE_HOST_MUL:
+        z = x * y;
+        ok &= sse_host_f64_range(z) & ((z != 0) | (x == 0) | (y == 0));
+        break;
+    case SSE_HOST_DIV:
+        z = x / y;
+        ok &= sse_host_f64_range(z) & (y != 0) & ((z != 0) | (x == 0));
+        break;
+    case SSE_HOST_MIN:
+    case SSE_HOST_MAX:
+        less = op == SSE_HOST_MIN ? x < y : x > y;
+        z = (vec_f64)(((vec_i64)x & less) | ((vec_i64)y & ~less));
+        break;
+    case SSE_HOST_SQRT:
+        for (int i = 0; i < 2; i++)
+            z[i] = x[i] < 0 ? 0 : sqrt(x[i]);
+        ok &= x >= 0;
+        break;
+    default:
+        return 0;
+    }
+    if (!vec_all((vec_u8)ok, bytes))
+        return 0;
+
+    if (!(cpu.mxcsr & MXCSR_PE)) {
+        // The remainders of multiplication, division and square root are exact as well, and fma computes them
+        for (int i = 0; i < lanes; i++) {
+            switch (op) {
+            case SSE_HOST_ADD:
+            case SSE_HOST_SUB:
+                inexact |= error[i] != 0;
+                break;
+            case SSE_HOST_MUL:
+                inexact |= fma(x[i], y[i], -z[i]) != 0;
+                break;
+            case SSE_HOST_DIV:
+                inexact |= fma(-z[i], y[i], x[i]) != 0;
+                break;
+            case SSE_HOST_SQRT:
+                inexact |= fma(-z[i], z[i], x[i]) != 0;
+                break;
+            }
+        }
+    }
+#ifdef SSE_HOST_VERIFY
+    int expected_flags = 0;
+    if (op == SSE_HOST_SUB)
+        y = -y;
+    for (int i = 0; i < lanes; i++)
+        expected_flags |= sse_host_verify(op, 8, &x, &y, &z, i);
+    sse_host_verify_flags(expected_flags, inexact);
+#endif
+    vec_store(dest, (vec_u8)z, bytes);
+    if (inexact)
+        cpu.mxcsr |= MXCSR_PE;
+    return 1;
+}
+
+// Conversions between singles, doubles and 32-bit integers, for "lanes" lanes. The packed form of CVTPD2PS (two lanes)
+// clears the upper half of the destination.
+static int sse_host_convert(int op, void* dest, void* src, int lanes)
+{
+    float f[4] = { 0 };
+    double d[2];
+    int32_t n[4];
+    int inexact = 0;
+    switch (op) {
+    case SSE_HOST_PS2PD:
+        memcpy(f, src, lanes << 2);
+        for (int i = 0; i < lanes; i++) {
+            if (!sse_host_float_in_range(f[i]))
+                return 0;
+            d[i] = f[i];
+        }
+        memcpy(dest, d, lanes << 3);
+        break;
+    case SSE_HOST_PD2PS:
+        memcpy(d, src, lanes << 3);
+        for (int i = 0; i < lanes; i++) {
+            f[i] = d[i];
+            if (!sse_host_float_in_range(f[i]) || (f[i] == 0 && d[i] != 0))
+                return 0;
+            inexact |= f[i] != d[i];
+        }
+        memcpy(dest, f, lanes == 2 ? 16 : 4);
+        break;
+    case SSE_HOST_DQ2PS:
+        memcpy(n, src, lanes << 2);
+        for (int i = 0; i < lanes; i++) {
+            f[i] = n[i];
+            inexact |= f[i] != (double)n[i];
+        }
+        memcpy(dest, f, lanes << 2);
+        break;
+    case SSE_HOST_PS2DQ:
+    case SSE_HOST_TPS2DQ:
+        memcpy(f, src, lanes << 2);
+        for (int i = 0; i < lanes; i++) {
+            // Out of range values produce the integer indefinite and raise invalid
+            if (!sse_host_float_in_range(f[i]) || fabsf(f[i]) >= 0x1p31f)
+                return 0;
+            float rounded = op == SSE_HOST_TPS2DQ ? truncf(f[i]) : rintf(f[i]);
+            n[i] = (int32_t)rounded;
+            inexact |= rounded != f[i];
+        }
+        memcpy(dest, n, lanes << 2);
+        break;
+    default:
+        return 0;
+    }
+    if (inexact)
+        cpu.mxcsr |= MXCSR_PE;
+    return 1;
+}
+
+// Entry points for the instructions below. Each one returns 1 if the instruction was done on the host, and 0 if it has to
+// go through softfloat.
+static int sse_host_ps(int op, void* dest, void* src, int bytes)
+{
+    if (!sse_host)
+        return 0;
+    if (sse_host_f32(op, dest, src, bytes)) {
+        cpu_stats.sse_host_ops++;
+        return 1;
+    }
+    cpu_stats.sse_host_fallbacks++;
+    return 0;
+}
+static int sse_host_pd(int op, void* dest, void* src, int bytes)
+{
+    if (!sse_host)
+        return 0;
+    if (sse_host_f64(op, dest, src, bytes)) {
+        cpu_stats.sse_host_ops++;
+        return 1;
+    }
+    cpu_stats.sse_host_fallbacks++;
+    return 0;
+}
+static int sse_host_cvt(int op, void* dest, void* src, int lanes)
+{
+    if (!sse_host)
+        return 0;
+    if (sse_host_convert(op, dest, src, lanes)) {
+        cpu_stats.sse_host_ops++;
+        return 1;
+    }
+    cpu_stats.sse_host_fallbacks++;
+    return 0;
+}
+
 void cpu_update_mxcsr(void)
 {
     // Regenerates the data inside of "status"
@@ -67,6 +413,9 @@ void cpu_update_mxcsr(void)
     status.float_exception_masks = cpu.mxcsr >> 7 & 63;
     status.float_suppress_exception = 0;
     status.denormals_are_zeros = cpu.mxcsr >> 6 & 1;
+
+    // Round to nearest, precision exception masked
+    sse_host = (cpu.mxcsr & 0x7000) == 0x1000;
 }
 int cpu_sse_handle_exceptions(void)
 {
@@ -136,13 +485,13 @@ static int get_read_ptr(uint32_t flags, struct decoded_instruction* i, int dword
         write_back_linaddr = linaddr;
         return 0;
     }
-    uint8_t tag = cpu.tlb_tags[linaddr >> 12] >> cpu.tlb_shift_read;
+    uint8_t tag = TLB_TAGS(linaddr) >> cpu.tlb_shift_read;
     if (tag & 2) {
         if (cpu_mmu_translate(linaddr, cpu.tlb_shift_read))
             return 1;
     }
 
-    uint32_t* host_ptr = cpu.tlb[linaddr >> 12] + linaddr;
+    uint32_t* host_ptr = TLB_PTR(linaddr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
         for (int i = 0, j = 0; i < dwords; i++, j += 4)
@@ -168,15 +517,16 @@ static int get_write_ptr(uint32_t flags, struct decoded_instruction* i, int dwor
         write_back_linaddr = linaddr;
         return 0;
     }
-    uint8_t tag = cpu.tlb_tags[linaddr >> 12] >> cpu.tlb_shift_write;
+    uint8_t tag = TLB_TAGS(linaddr) >> cpu.tlb_shift_write;
     if (tag & 2) {
         if (cpu_mmu_translate(linaddr, cpu.tlb_shift_write))
             return 1;
     }
 
-    uint32_t* host_ptr = cpu.tlb[linaddr >> 12] + linaddr;
+    uint32_t* host_ptr = TLB_PTR(linaddr);
     uint32_t phys = PTR_TO_PHYS(host_ptr);
-    if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
+    // Pages with code or page tables on them also have to be written through cpu_write32
+    if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size) || (TLB_TAGS(linaddr) >> cpu.tlb_shift_write & 1)) {
         write_back = 1;
         result_ptr = temp.d128;
         write_back_dwords = dwords;
@@ -258,174 +608,92 @@ static void* get_reg_dest(int x)
     return &cpu.reg32[x];
 }
 
+// The packed integer kernels below work on whole vectors (see cpu/vector.h). Each one loads both operands before it
+// stores anything, so the source and destination may be the same register. Byte counts are 8 for MMX and 16 for SSE.
+
+// dest = dest <op> src, lane by lane
+#define VEC_BINARY(type, dest, src, bytes, op) \
+    vec_store(dest, (vec_u8)((type)vec_load(dest, bytes) op (type)vec_load(src, bytes)), bytes)
+// dest = fn(dest, src)
+#define VEC_CALL(fn, dest, src, bytes) vec_store(dest, fn(vec_load(dest, bytes), vec_load(src, bytes)), bytes)
+
 static void punpckh(void* dst, void* src, int size, int copysize)
 {
-    // XXX -- make this faster
-    // too many xors
-    uint8_t *dst8 = dst, *src8 = src, tmp[16];
-    int idx = 0, nidx = 0;
-    const int xormask = (size - 1) ^ (copysize - 1);
-    while (idx < size) {
-        for (int i = 0; i < copysize; i++)
-            tmp[idx++ ^ xormask] = src8[(nidx + i) ^ xormask]; // Copy source bytes
-        for (int i = 0; i < copysize; i++)
-            tmp[idx++ ^ xormask] = dst8[(nidx + i) ^ xormask]; // Copy destination bytes
-        nidx += copysize;
-    }
-    memcpy(dst, tmp, size);
-}
-static inline uint16_t pack_i32_to_i16(uint32_t x)
-{
-    //printf("i32 -> i16: %08x\n", x);
-    if (x >= 0x80000000) {
-        if (x >= 0xFFFF8000)
-            x &= 0xFFFF;
-        else
-            return 0x8000; // x <= -65536
-    } else {
-        // x <= 0x7FFFFFFF
-        if (x > 0x7FFF)
-            return 0x7FFF;
-    }
-    return x;
+    vec_u8 a = vec_load(dst, size), b = vec_load(src, size);
+    if (size == 8) {
+        // The upper halves of two MMX operands are interleaved into the upper 8 bytes of the full interleave
+        a = vec_unpacklo(a, b, copysize);
+        vec_store(dst, vec_unpackhi(a, a, 8), 8);
+    } else
+        vec_store(dst, vec_unpackhi(a, b, copysize), 16);
 }
-static uint16_t pack_i16_to_u8(int16_t x)
+static void punpckl(void* dst, void* src, int size, int copysize)
 {
-    if (x >= 0xFF)
-        return 0xFF;
-    else if (x < 0)
-        return 0;
-    return x;
+    vec_store(dst, vec_unpacklo(vec_load(dst, size), vec_load(src, size), copysize), size);
 }
-static inline uint8_t pack_i16_to_i8(uint16_t x)
+// The MMX forms pack both operands out of a single vector: destination in the low half, source in the high half
+static void packssdw(void* dest, void* src, int dwordcount)
 {
-    if (x >= 0x8000) {
-        if (x >= 0xFF80)
-            x &= 0xFF;
-        else
-            return 0x80; // x <= -128
-    } else {
-        // x <= 0x7FFF
-        if (x > 0x7F)
-            return 0x7F;
-    }
-    return x;
+    vec_u8 a = vec_load(dest, dwordcount << 2), b = vec_load(src, dwordcount << 2);
+    if (dwordcount == 2)
+        a = b = vec_unpacklo(a, b, 8);
+    vec_store(dest, vec_packs_i32(a, b), dwordcount << 2);
 }
-static void packssdw(void* dest, void* src, int dwordcount)
+static void packsswb(void* dest, void* src, int wordcount)
 {
-    uint16_t res[8];
-    uint32_t *dest32 = dest, *src32 = src;
-    for (int i = 0; i < dwordcount; i++) {
-        res[i] = pack_i32_to_i16(dest32[i]);
-        res[i | dwordcount] = pack_i32_to_i16(src32[i]);
-    }
-    memcpy(dest, res, dwordcount << 2);
+    vec_u8 a = vec_load(dest, wordcount << 1), b = vec_load(src, wordcount << 1);
+    if (wordcount == 4)
+        a = b = vec_unpacklo(a, b, 8);
+    vec_store(dest, vec_packs_i16(a, b), wordcount << 1);
 }
-static void punpckl(void* dst, void* src, int size, int copysize)
+static void packuswb(void* dest, void* src, int wordcount)
 {
-    // XXX -- make this faster
-    uint8_t *dst8 = dst, *src8 = src, tmp[16];
-    int idx = 0, nidx = 0, xor = copysize - 1;
-    UNUSED (xor);
-    const int xormask = (size - 1) ^ (copysize - 1);
-    UNUSED(xormask);
-    while (idx < size) {
-        for (int i = 0; i < copysize; i++)
-            tmp[idx++] = dst8[(nidx + i)]; // Copy destination bytes
-        for (int i = 0; i < copysize; i++)
-            tmp[idx++] = src8[(nidx + i)]; // Copy source bytes
-        nidx += copysize;
-    }
-    memcpy(dst, tmp, size);
+    vec_u8 a = vec_load(dest, wordcount << 1), b = vec_load(src, wordcount << 1);
+    if (wordcount == 4)
+        a = b = vec_unpacklo(a, b, 8);
+    vec_store(dest, vec_packus_i16(a, b), wordcount << 1);
 }
 static void psubsb(uint8_t* dest, uint8_t* src, int bytecount)
 {
-    for (int i = 0; i < bytecount; i++) {
-        uint8_t x = dest[i], y = src[i], res = x - y;
-        x = (x >> 7) + 0x7F;
-        if ((int8_t)((x ^ y) & (x ^ res)) < 0)
-            res = x;
-        dest[i] = res;
-    }
+    VEC_CALL(vec_subs_i8, dest, src, bytecount);
 }
 static void psubsw(uint16_t* dest, uint16_t* src, int wordcount)
 {
-    for (int i = 0; i < wordcount; i++) {
-        uint16_t x = dest[i], y = src[i], res = x - y;
-        //printf("%x - %x = %x\n", x, y, res);
-        x = (x >> 15) + 0x7FFF;
-        if ((int16_t)((x ^ y) & (x ^ res)) < 0)
-            res = x;
-        dest[i] = res;
-    }
+    VEC_CALL(vec_subs_i16, dest, src, wordcount << 1);
 }
 static void pminub(uint8_t* dest, uint8_t* src, int bytecount)
 {
-    for (int i = 0; i < bytecount; i++)
-        if (src[i] < dest[i])
-            dest[i] = src[i];
+    VEC_CALL(vec_min_u8, dest, src, bytecount);
 }
 static void pmaxub(uint8_t* dest, uint8_t* src, int bytecount)
 {
-    for (int i = 0; i < bytecount; i++)
-        if (dest[i] < src[i])
-            dest[i] = src[i];
+    VEC_CALL(vec_max_u8, dest, src, bytecount);
 }
 static void pminsw(int16_t* dest, int16_t* src, int wordcount)
 {
-    for (int i = 0; i < wordcount; i++)
-        if (src[i] < dest[i])
-            dest[i] = src[i];
+    VEC_CALL(vec_min_i16, dest, src, wordcount << 1);
 }
 static void pmaxsw(int16_t* dest, int16_t* src, int wordcount)
 {
-    for (int i = 0; i < wordcount; i++)
-        if (src[i] > dest[i])
-            dest[i] = src[i];
+    VEC_CALL(vec_max_i16, dest, src, wordcount << 1);
 }
 static void paddsb(uint8_t* dest, uint8_t* src, int bytecount)
 {
-    // https://locklessinc.com/articles/sat_arithmetic/
-    for (int i = 0; i < bytecount; i++) {
-        uint8_t x = dest[i], y = src[i], res = x + y;
-        x = (x >> 7) + 0x7F;
-        if ((int8_t)((x ^ y) | ~(y ^ res)) >= 0)
-            res = x;
-        dest[i] = res;
-    }
+    VEC_CALL(vec_adds_i8, dest, src, bytecount);
 }
 static void paddsw(uint16_t* dest, uint16_t* src, int wordcount)
 {
-    for (int i = 0; i < wordcount; i++) {
-        uint16_t x = dest[i], y = src[i], res = x + y;
-        x = (x >> 15) + 0x7FFF;
-        if ((int16_t)((x ^ y) | ~(y ^ res)) >= 0)
-            res = x;
-        dest[i] = res;
-    }
+    VEC_CALL(vec_adds_i16, dest, src, wordcount << 1);
 }
 static void pshuf(void* dest, void* src, int imm, int shift)
 {
-    uint8_t* src8 = src;
-    uint8_t res[16];
-    int id = 0;
-    for (int i = 0; i < 4; i++) {
-        int index = imm & 3, index4 = index << shift;
-        if (shift == 2) { // Doubleword size
-            //printf("index: %d resid=%d %02x%02x%02x%02x\n", index, id, src8[index4 + 0], src8[index4 + 1], src8[index4 + 2], src8[index4 + 3]);
-            res[id + 0] = src8[index4 + 0];
-            res[id + 1] = src8[index4 + 1];
-            res[id + 2] = src8[index4 + 2];
-            res[id + 3] = src8[index4 + 3];
-            id += 4;
-        } else { // shift == 1: Word size
-            res[id + 0] = src8[index4 + 0];
-            res[id + 1] = src8[index4 + 1];
-            id += 2;
-        }
-        imm >>= 2;
+    if (shift == 2) { // Doubleword size
+        vec_u32 s = (vec_u32)vec_load(src, 16), r = { s[imm & 3], s[imm >> 2 & 3], s[imm >> 4 & 3], s[imm >> 6 & 3] };
+        vec_store(dest, (vec_u8)r, 16);
+    } else { // shift == 1: Word size, only 8 bytes
+        vec_u16 s = (vec_u16)vec_load(src, 8), r = { s[imm & 3], s[imm >> 2 & 3], s[imm >> 4 & 3], s[imm >> 6 & 3] };
+        vec_store(dest, (vec_u8)r, 8);
     }
-    memcpy(dest, res, 4 << shift);
 }
 
 // Not the same as pshuf
@@ -441,61 +709,6 @@ static void pshufb(void* dest, void* src, int bytes)
     memcpy(dest, res, bytes);
 }
 
-static void cpu_psraw(uint16_t* a, int shift, int mask, int wordcount)
-{
-    // SAR but with MMX/SSE operands
-    for (int i = 0; i < wordcount; i++)
-        a[i] = (int16_t)a[i] >> shift & mask;
-}
-static void cpu_psrlw(uint16_t* a, int shift, int mask, int wordcount)
-{
-    // SHR but with MMX/SSE operands
-    for (int i = 0; i < wordcount; i++)
-        a[i] = a[i] >> shift & mask;
-}
-static void cpu_psllw(uint16_t* a, int shift, int mask, int wordcount)
-{
-    // SHL but with MMX/SSE operands
-    for (int i = 0; i < wordcount; i++)
-        a[i] = a[i] << shift & mask;
-}
-static void cpu_psrad(uint32_t* a, int shift, int mask, int wordcount)
-{
-    int dwordcount = wordcount >> 1;
-    for (int i = 0; i < dwordcount; i++)
-        a[i] = (int32_t)a[i] >> shift & mask;
-}
-static void cpu_psrld(uint32_t* a, int shift, int mask, int wordcount)
-{
-    int dwordcount = wordcount >> 1;
-    for (int i = 0; i < dwordcount; i++)
-        a[i] = a[i] >> shift & mask;
-}
-static void cpu_pslld(uint32_t* a, int shift, int mask, int wordcount)
-{
-    int dwordcount = wordcount >> 1;
-    for (int i = 0; i < dwordcount; i++)
-        a[i] = a[i] << shift & mask;
-}
-static void cpu_psrlq(uint64_t* a, int shift, int mask, int wordcount)
-{
-    int qwordcount = wordcount >> 2;
-    for (int i = 0; i < qwordcount; i++) {
-        if (mask)
-            a[i] = a[i] >> shift;
-        else
-            a[i] = 0;
-    }
-}
-static void cpu_psllq(uint64_t* a, int shift, int mask, int wordcount)
-{
-    int qwordcount = wordcount >> 2;
-    for (int i = 0; i < qwordcount; i++)
-        if (mask)
-            a[i] = a[i] << shift;
-        else
-            a[i] = 0;
-}
 static void cpu_pslldq(uint64_t* a, int shift, int mask)
 {
     if (mask == 0) {
@@ -538,86 +751,41 @@ static void cpu_psrldq(uint64_t* a, int shift, int mask)
 }
 static void pcmpeqb(uint8_t* dest, uint8_t* src, int count)
 {
-    for (int i = 0; i < count; i++)
-        if (src[i] == dest[i])
-            dest[i] = 0xFF;
-        else
-            dest[i] = 0;
+    VEC_BINARY(vec_u8, dest, src, count, ==);
 }
 static void pcmpeqw(uint16_t* dest, uint16_t* src, int count)
 {
-    for (int i = 0; i < count; i++)
-        if (src[i] == dest[i])
-            dest[i] = 0xFFFF;
-        else
-            dest[i] = 0;
+    VEC_BINARY(vec_u16, dest, src, count << 1, ==);
 }
 static void pcmpeqd(uint32_t* dest, uint32_t* src, int count)
 {
-    for (int i = 0; i < count; i++)
-        if (src[i] == dest[i])
-            dest[i] = 0xFFFFFFFF;
-        else
-            dest[i] = 0;
+    VEC_BINARY(vec_u32, dest, src, count << 2, ==);
 }
 static void pcmpgtb(int8_t* dest, int8_t* src, int count)
 {
-    for (int i = 0; i < count; i++)
-        if (dest[i] > src[i])
-            dest[i] = 0xFF;
-        else
-            dest[i] = 0;
+    VEC_BINARY(vec_i8, dest, src, count, >);
 }
 static void pcmpgtw(int16_t* dest, int16_t* src, int count)
 {
-    for (int i = 0; i < count; i++)
-        if (dest[i] > src[i])
-            dest[i] = 0xFFFF;
-        else
-            dest[i] = 0;
+    VEC_BINARY(vec_i16, dest, src, count << 1, >);
 }
 static void pcmpgtd(int32_t* dest, int32_t* src, int count)
 {
-    for (int i = 0; i < count; i++)
-        if (dest[i] > src[i])
-            dest[i] = 0xFFFFFFFF;
-        else
-            dest[i] = 0;
-}
-static void packuswb(void* dest, void* src, int wordcount)
-{
-    uint8_t res[16];
-    uint16_t *dest16 = dest, *src16 = src;
-    for (int i = 0; i < wordcount; i++) {
-        res[i] = pack_i16_to_u8(dest16[i]);
-        res[i | wordcount] = pack_i16_to_u8(src16[i]);
-    }
-    memcpy(dest, res, wordcount << 1);
-}
-static void packsswb(void* dest, void* src, int wordcount)
-{
-    uint8_t res[16];
-    uint16_t *dest16 = dest, *src16 = src;
-    for (int i = 0; i < wordcount; i++) {
-        res[i] = pack_i16_to_i8(dest16[i]);
-        res[i | wordcount] = pack_i16_to_i8(src16[i]);
-    }
-    memcpy(dest, res, wordcount << 1);
+    VEC_BINARY(vec_i32, dest, src, count << 2, >);
 }
 static void pmullw(uint16_t* dest, uint16_t* src, int wordcount, int shift)
 {
-    for (int i = 0; i < wordcount; i++) {
-        uint32_t result = (uint32_t)(int16_t)dest[i] * (uint32_t)(int16_t)src[i];
-        dest[i] = result >> shift;
-    }
+    if (shift)
+        VEC_CALL(vec_mulhi_i16, dest, src, wordcount << 1);
+    else
+        VEC_BINARY(vec_u16, dest, src, wordcount << 1, *);
 }
 static void pmuluw(void* dest, void* src, int wordcount, int shift)
 {
-    uint16_t *dest16 = dest, *src16 = src;
-    for (int i = 0; i < wordcount; i++) {
-        uint32_t result = (uint32_t)dest16[i] * (uint32_t)src16[i];
-        dest16[i] = result >> shift;
-    }
+    if (shift)
+        VEC_CALL(vec_mulhi_u16, dest, src, wordcount << 1);
+    else
+        VEC_BINARY(vec_u16, dest, src, wordcount << 1, *);
 }
 static void pmuludq(void* dest, void* src, int dwordcount)
 {
@@ -638,94 +806,47 @@ static int pmovmskb(uint8_t* src, int bytecount)
 }
 static void psubusb(uint8_t* dest, uint8_t* src, int bytecount)
 {
-    for (int i = 0; i < bytecount; i++) {
-        uint8_t result = dest[i] - src[i];
-        dest[i] = -(result <= dest[i]) & result;
-    }
+    VEC_CALL(vec_subs_u8, dest, src, bytecount);
 }
 static void psubusw(uint16_t* dest, uint16_t* src, int wordcount)
 {
-    for (int i = 0; i < wordcount; i++) {
-        uint16_t result = dest[i] - src[i];
-        dest[i] = -(result <= dest[i]) & result;
-    }
+    VEC_CALL(vec_subs_u16, dest, src, wordcount << 1);
 }
 static void paddusb(uint8_t* dest, uint8_t* src, int bytecount)
 {
-    for (int i = 0; i < bytecount; i++) {
-        uint8_t result = dest[i] + src[i];
-        dest[i] = -(result < dest[i]) | result;
-    }
+    VEC_CALL(vec_adds_u8, dest, src, bytecount);
 }
 static void paddusw(uint16_t* dest, uint16_t* src, int wordcount)
 {
-    for (int i = 0; i < wordcount; i++) {
-        uint16_t result = dest[i] + src[i];
-        dest[i] = -(result < dest[i]) | result;
-    }
+    VEC_CALL(vec_adds_u16, dest, src, wordcount << 1);
 }
 static void paddb(uint8_t* dest, uint8_t* src, int bytecount)
 {
-    if (dest == src) // Faster alternative
-        for (int i = 0; i < bytecount; i++)
-            dest[i] <<= 1;
-    else
-        for (int i = 0; i < bytecount; i++)
-            dest[i] += src[i];
+    VEC_BINARY(vec_u8, dest, src, bytecount, +);
 }
 static void paddw(uint16_t* dest, uint16_t* src, int wordcount)
 {
-    if (dest == src)
-        for (int i = 0; i < wordcount; i++)
-            dest[i] <<= 1;
-    else
-        for (int i = 0; i < wordcount; i++)
-            dest[i] += src[i];
+    VEC_BINARY(vec_u16, dest, src, wordcount << 1, +);
 }
 static void paddd(uint32_t* dest, uint32_t* src, int dwordcount)
 {
-    if (dest == src)
-        for (int i = 0; i < dwordcount; i++)
-            dest[i] <<= 1;
-    else
-        for (int i = 0; i < dwordcount; i++)
-            dest[i] += src[i];
+    VEC_BINARY(vec_u32, dest, src, dwordcount << 2, +);
 }
 static void psubb(uint8_t* dest, uint8_t* src, int bytecount)
 {
-    if (dest == src)
-        for (int i = 0; i < bytecount; i++)
-            dest[i] >>= 1;
-    else
-        for (int i = 0; i < bytecount; i++)
-            dest[i] -= src[i];
+    VEC_BINARY(vec_u8, dest, src, bytecount, -);
 }
 static void psubw(uint16_t* dest, uint16_t* src, int wordcount)
 {
-    if (dest == src)
-        for (int i = 0; i < wordcount; i++)
-            dest[i] >>= 1;
-    else
-        for (int i = 0; i < wordcount; i++)
-            dest[i] -= src[i];
+    VEC_BINARY(vec_u16, dest, src, wordcount << 1, -);
 }
 static void psubd(uint32_t* dest, uint32_t* src, int dwordcount)
 {
-    if (dest == src)
-        for (int i = 0; i < dwordcount; i++)
-            dest[i] >>= 1;
-    else
-        for (int i = 0; i < dwordcount; i++)
-            dest[i] -= src[i];
+    VEC_BINARY(vec_u32, dest, src, dwordcount << 2, -);
 }
 static void psubq(uint64_t* dest, uint64_t* src, int qwordcount)
 {
-    if (dest == src)
-        for (int i = 0; i < qwordcount; i++)
-            dest[i] >>= 1;
-    else
-        for (int i = 0; i < qwordcount; i++)
-            dest[i] -= src[i];
+    VEC_BINARY(vec_u64, dest, src, qwordcount << 3, -);
 }
 static uint32_t cmpps(float32 dest, float32 src, int cmp)
 {
@@ -1246,6 +1367,8 @@ int execute_0F50_57(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 4, 1));
         src32 = result_ptr;
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_SQRT, dest32, src32, 16))
+            break;
         dest32[0] = float32_sqrt(src32[0], &status);
         dest32[1] = float32_sqrt(src32[1], &status);
         dest32[2] = float32_sqrt(src32[2], &status);
@@ -1256,6 +1379,8 @@ int execute_0F50_57(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 1, 1));
         src32 = result_ptr;
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_SQRT, dest32, src32, 4))
+            break;
         dest32[0] = float32_sqrt(src32[0], &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
@@ -1263,6 +1388,8 @@ int execute_0F50_57(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 4, 1));
         src32 = result_ptr;
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_SQRT, dest32, src32, 16))
+            break;
         *(uint64_t*)&dest32[0] = float64_sqrt(*(uint64_t*)&src32[0], &status);
         *(uint64_t*)&dest32[2] = float64_sqrt(*(uint64_t*)&src32[2], &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -1271,6 +1398,8 @@ int execute_0F50_57(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 2, 0));
         src32 = result_ptr;
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_SQRT, dest32, src32, 8))
+            break;
         *(uint64_t*)&dest32[0] = float64_sqrt(*(uint64_t*)&src32[0], &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
@@ -1567,59 +1696,42 @@ int execute_0FE8_EF(struct decoded_instruction* i)
 
 static void pshift(void* dest, int opcode, int wordcount, int imm)
 {
-    int mask = -1;
+    int bytes = wordcount << 1;
+    vec_u8 v = vec_load(dest, bytes), zero = { 0 };
     switch (opcode) {
     case PSHIFT_PSRLW:
-        if (imm >= 16)
-            mask = 0;
-        cpu_psrlw(dest, imm & 15, mask, wordcount);
+        v = imm >= 16 ? zero : (vec_u8)((vec_u16)v >> imm);
         break;
     case PSHIFT_PSRAW:
-        if (imm >= 16)
-            mask = 0;
-        cpu_psraw(dest, imm & 15, mask, wordcount);
+        // Arithmetic shifts fill every lane with its sign bit once the count is out of range
+        v = (vec_u8)((vec_i16)v >> (imm >= 16 ? 15 : imm));
         break;
     case PSHIFT_PSLLW:
-        if (imm >= 16)
-            mask = 0;
-        cpu_psllw(dest, imm & 15, mask, wordcount);
+        v = imm >= 16 ? zero : (vec_u8)((vec_u16)v << imm);
         break;
     case PSHIFT_PSRLD:
-        if (imm >= 32)
-            mask = 0;
-        cpu_psrld(dest, imm & 31, mask, wordcount);
+        v = imm >= 32 ? zero : (vec_u8)((vec_u32)v >> imm);
         break;
     case PSHIFT_PSRAD:
-        if (imm >= 32)
-            mask = 0;
-        cpu_psrad(dest, imm & 31, mask, wordcount);
+        v = (vec_u8)((vec_i32)v >> (imm >= 32 ? 31 : imm));
         break;
     case PSHIFT_PSLLD:
-        if (imm >= 32)
-            mask = 0;
-        cpu_pslld(dest, imm & 31, mask, wordcount);
+        v = imm >= 32 ? zero : (vec_u8)((vec_u32)v << imm);
         break;
     case PSHIFT_PSRLQ:
-        if (imm >= 64)
-            mask = 0;
-        cpu_psrlq(dest, imm & 63, mask, wordcount);
-        break;
-    case PSHIFT_PSRLDQ:
-        if (imm >= 128)
-            mask = 0;
-        cpu_psrldq(dest, imm & 127, mask);
+        v = imm >= 64 ? zero : (vec_u8)((vec_u64)v >> imm);
         break;
     case PSHIFT_PSLLQ:
-        if (imm >= 64)
-            mask = 0;
-        cpu_psllq(dest, imm & 63, mask, wordcount);
+        v = imm >= 64 ? zero : (vec_u8)((vec_u64)v << imm);
         break;
+    case PSHIFT_PSRLDQ:
+        cpu_psrldq(dest, imm & 127, imm < 128);
+        return;
     case PSHIFT_PSLLDQ:
-        if (imm >= 128)
-            mask = 0;
-        cpu_pslldq(dest, imm & 127, mask);
-        break;
+        cpu_pslldq(dest, imm & 127, imm < 128);
+        return;
     }
+    vec_store(dest, v, bytes);
 }
 
 int execute_0F70_76(struct decoded_instruction* i)
@@ -2271,6 +2383,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case ADDPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 0));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_ADD, dest32, result_ptr, 16))
+            break;
         dest32[0] = float32_add(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_add(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_add(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2280,12 +2394,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case ADDSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 0));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_ADD, dest32, result_ptr, 4))
+            break;
         dest32[0] = float32_add(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case ADDPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_ADD, dest64, result_ptr, 16))
+            break;
         dest64[0] = float64_add(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_add(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2293,12 +2411,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case ADDSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_ADD, dest64, result_ptr, 8))
+            break;
         dest64[0] = float64_add(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MULPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 0));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_MUL, dest32, result_ptr, 16))
+            break;
         dest32[0] = float32_mul(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_mul(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_mul(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2308,12 +2430,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MULSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 0));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_MUL, dest32, result_ptr, 4))
+            break;
         dest32[0] = float32_mul(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MULPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_MUL, dest64, result_ptr, 16))
+            break;
         dest64[0] = float64_mul(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_mul(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2321,12 +2447,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MULSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_MUL, dest64, result_ptr, 8))
+            break;
         dest64[0] = float64_mul(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case CVTPS2PD_XGoXEo: { // float --> double
         EX(get_sse_read_ptr(flags, i, 2, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_cvt(SSE_HOST_PS2PD, dest64, result_ptr, 2))
+            break;
         // The second dword might get overwritten by the first.
         float32 temp = *(float32*)(result_ptr + 4);
         dest64[0] = float32_to_float64(*(float32*)result_ptr, &status);
@@ -2337,6 +2467,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case CVTPD2PS_XGoXEo: // double --> float
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_cvt(SSE_HOST_PD2PS, dest32, result_ptr, 2))
+            break;
         dest32[0] = float64_to_float32(*(float64*)(result_ptr), &status);
         dest32[1] = float64_to_float32(*(float64*)(result_ptr + 8), &status);
         dest32[2] = 0;
@@ -2346,18 +2478,24 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case CVTSS2SD_XGoXEd: // float --> double
         EX(get_sse_read_ptr(flags, i, 1, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_cvt(SSE_HOST_PS2PD, dest64, result_ptr, 1))
+            break;
         dest64[0] = float32_to_float64(*(float32*)result_ptr, &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case CVTSD2SS_XGoXEq: // double --> float
         EX(get_sse_read_ptr(flags, i, 2, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_cvt(SSE_HOST_PD2PS, dest32, result_ptr, 1))
+            break;
         dest32[0] = float64_to_float32(*(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case CVTDQ2PS_XGoXEo: // int32 --> float
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_cvt(SSE_HOST_DQ2PS, dest32, result_ptr, 4))
+            break;
         dest32[0] = int32_to_float32(*(int32_t*)(result_ptr), &status);
         dest32[1] = int32_to_float32(*(int32_t*)(result_ptr + 4), &status);
         dest32[2] = int32_to_float32(*(int32_t*)(result_ptr + 8), &status);
@@ -2367,6 +2505,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case CVTPS2DQ_XGoXEo: // float --> int32
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_cvt(SSE_HOST_PS2DQ, dest32, result_ptr, 4))
+            break;
         dest32[0] = float32_to_int32(*(float32*)(result_ptr), &status);
         dest32[1] = float32_to_int32(*(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_to_int32(*(float32*)(result_ptr + 8), &status);
@@ -2376,6 +2516,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case CVTTPS2DQ_XGoXEo: // float --> int32
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_cvt(SSE_HOST_TPS2DQ, dest32, result_ptr, 4))
+            break;
         dest32[0] = float32_to_int32_round_to_zero(*(float32*)(result_ptr), &status);
         dest32[1] = float32_to_int32_round_to_zero(*(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_to_int32_round_to_zero(*(float32*)(result_ptr + 8), &status);
@@ -2385,6 +2527,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case SUBPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_SUB, dest32, result_ptr, 16))
+            break;
         dest32[0] = float32_sub(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_sub(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_sub(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2394,12 +2538,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case SUBSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_SUB, dest32, result_ptr, 4))
+            break;
         dest32[0] = float32_sub(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case SUBPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_SUB, dest64, result_ptr, 16))
+            break;
         dest64[0] = float64_sub(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_sub(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2407,12 +2555,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case SUBSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_SUB, dest64, result_ptr, 8))
+            break;
         dest64[0] = float64_sub(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MINPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_MIN, dest32, result_ptr, 16))
+            break;
         dest32[0] = float32_min(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_min(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_min(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2422,12 +2574,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MINSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_MIN, dest32, result_ptr, 4))
+            break;
         dest32[0] = float32_min(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MINPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_MIN, dest64, result_ptr, 16))
+            break;
         dest64[0] = float64_min(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_min(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2435,12 +2591,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MINSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_MIN, dest64, result_ptr, 8))
+            break;
         dest64[0] = float64_min(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case DIVPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_DIV, dest32, result_ptr, 16))
+            break;
         dest32[0] = float32_div(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_div(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_div(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2450,12 +2610,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case DIVSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_DIV, dest32, result_ptr, 4))
+            break;
         dest32[0] = float32_div(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case DIVPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_DIV, dest64, result_ptr, 16))
+            break;
         dest64[0] = float64_div(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_div(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2463,12 +2627,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case DIVSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_DIV, dest64, result_ptr, 8))
+            break;
         dest64[0] = float64_div(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MAXPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_MAX, dest32, result_ptr, 16))
+            break;
         dest32[0] = float32_max(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_max(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_max(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2478,12 +2646,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MAXSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_ps(SSE_HOST_MAX, dest32, result_ptr, 4))
+            break;
         dest32[0] = float32_max(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MAXPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_MAX, dest64, result_ptr, 16))
+            break;
         dest64[0] = float64_max(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_max(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2491,6 +2663,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MAXSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (sse_host_pd(SSE_HOST_MAX, dest64, result_ptr, 8))
+            break;
         dest64[0] = float64_max(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
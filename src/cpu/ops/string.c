@@ -3,10 +3,160 @@
 #include "cpu/cpu.h"
 #include "cpu/opcodes.h"
 #include "cpu/ops.h"
+#include <string.h>
 #define repz_or_repnz(flags) (flags & (I_PREFIX_REPZ | I_PREFIX_REPNZ))
 #define EXCEPTION_HANDLER return -1 // Note: -1, not 1 like most other exception handlers
 #define MAX_CYCLES_TO_RUN 65536
 
+// Bulk fast paths for REP string instructions
+// When every element of a run lies within one page of guest RAM, the pages are resolved once and the whole run is done
+// with a single host copy, fill, or scan. Anything the TLB would not let through directly (an unmapped or unwritable page,
+// MMIO, or a page that holds translated code) is left to the element loop, which takes any fault at exactly the right
+// element.
+
+// Number of elements, at most "count", starting at "lin" that lie within its page and that can be reached without "offset"
+// wrapping around. Only 16-bit offsets can wrap before the linear address leaves the page.
+static inline int string_elements(uint32_t lin, uint32_t offset, int size, int add, int count, int addr16)
+{
+    int page_offset = lin & 0xFFF, n;
+    if (add > 0) {
+        n = (4096 - page_offset) / size;
+        if (addr16 && (int)((0xFFFF - offset) / size + 1) < n)
+            n = (0xFFFF - offset) / size + 1;
+    } else {
+        if (page_offset + size > 4096)
+            return 0;
+        n = page_offset / size + 1;
+        if (addr16 && (int)(offset / size + 1) < n)
+            n = offset / size + 1;
+    }
+    return n < count ? n : count;
+}
+
+// Returns a host pointer to "lin", or NULL if the TLB entry cannot be used directly
+static inline uint8_t* string_host_ptr(uint32_t lin, int shift)
+{
+    if (TLB_TAGS(lin) >> shift & 1)
+        return NULL;
+    return (uint8_t*)TLB_PTR(lin);
+}
+
+// Copies as many elements as possible starting at the given addresses, and returns how many were copied (0 if the element
+// loop has to handle the next one). Registers are left to the caller.
+static inline int movs_bulk(uint32_t src, uint32_t src_offset, uint32_t dest, uint32_t dest_offset, int size, int add, int count, int addr16)
+{
+    int n = string_elements(src, src_offset, size, add, count, addr16);
+    n = string_elements(dest, dest_offset, size, add, n, addr16);
+    if (n < 2)
+        return 0;
+    uint8_t *s = string_host_ptr(src, cpu.tlb_shift_read), *d = string_host_ptr(dest, cpu.tlb_shift_write);
+    if (!s || !d)
+        return 0;
+
+    // Work upwards from the lowest address touched
+    int bytes = n * size;
+    if (add < 0) {
+        s -= bytes - size;
+        d -= bytes - size;
+    }
+    if (add > 0 ? (d > s && d < s + bytes) : (s > d && s < d + bytes)) {
+        // The destination runs into data that has yet to be read, so the copy has to replicate it the way the CPU does,
+        // one element at a time. An element can still overlap its own destination, and is read in full before it is written.
+        if (add > 0)
+            for (int i = 0; i < bytes; i += size)
+                memmove(d + i, s + i, size);
+        else
+            for (int i = bytes - size; i >= 0; i -= size)
+                memmove(d + i, s + i, size);
+    } else
+        memmove(d, s, bytes);
+    return n;
+}
+
+// Same as above, but fills the elements with "value"
+static inline int stos_bulk(uint32_t dest, uint32_t dest_offset, uint32_t value, int size, int add, int count, int addr16)
+{
+    int n = string_elements(dest, dest_offset, size, add, count, addr16);
+    if (n < 2)
+        return 0;
+    uint8_t* d = string_host_ptr(dest, cpu.tlb_shift_write);
+    if (!d)
+        return 0;
+
+    if (add < 0)
+        d -= (n - 1) * size;
+    if (size == 1)
+        memset(d, value, n);
+    else
+        for (int i = 0; i < n * size; i += size)
+            memcpy(d + i, &value, size);
+    return n;
+}
+
+// Scans "n" elements, in the direction given by "add", for the first one that ends a REPNZ ("until_equal") or REPZ scan.
+// Elements from "a" are compared against the ones at "b", or against "value" if there is no "b". Returns the index of
+// that element, or "n" if there is none. Eight bytes are checked at a time until the group holding it is found.
+static inline int string_scan(const uint8_t* a, const uint8_t* b, uint32_t value, int size, int add, int n, int until_equal)
+{
+    if (size == 1 && add > 0 && !b && until_equal) {
+        // The strlen/memchr case: let the C library do it
+        const uint8_t* hit = memchr(a, value, n);
+        return hit ? hit - a : n;
+    }
+
+    const uint64_t ones = size == 1 ? 0x0101010101010101ULL : size == 2 ? 0x0001000100010001ULL : 0x0000000100000001ULL;
+    uint64_t pattern = value * ones;
+    int per_group = 8 / size, k = 0;
+    for (; k + per_group <= n; k += per_group) {
+        // Going backwards, the group starts at its last element
+        int first = add > 0 ? k : k + per_group - 1;
+        uint64_t x, y = pattern;
+        memcpy(&x, a + first * add, 8);
+        if (b)
+            memcpy(&y, b + first * add, 8);
+        x ^= y;
+        // Equal elements show up as zero lanes
+        if (until_equal ? (x - ones) & ~x & ones << (size * 8 - 1) : x)
+            break;
+    }
+    for (; k < n; k++) {
+        uint32_t x = 0, y = value;
+        memcpy(&x, a + k * add, size);
+        if (b)
+            memcpy(&y, b + k * add, size);
+        if ((x == y) == until_equal)
+            break;
+    }
+    return k;
+}
+
+// Skips over as many elements as possible that would not end a REP SCAS, and returns how many there were. At most
+// "count" elements are skipped. The element that ends the scan is left to the element loop, so that the lazy flags are
+// set by the same code as before.
+static inline int scas_bulk(uint32_t dest, uint32_t dest_offset, uint32_t value, int size, int add, int count, int addr16, int until_equal)
+{
+    int n = string_elements(dest, dest_offset, size, add, count, addr16);
+    if (n < 2)
+        return 0;
+    uint8_t* d = string_host_ptr(dest, cpu.tlb_shift_read);
+    if (!d)
+        return 0;
+    return string_scan(d, NULL, value, size, add, n, until_equal);
+}
+
+// Same as above, but for REP CMPS
+static inline int cmps_bulk(uint32_t src, uint32_t src_offset, uint32_t dest, uint32_t dest_offset, int size, int add, int count, int addr16, int until_equal)
+{
+    int n = string_elements(src, src_offset, size, add, count, addr16);
+    n = string_elements(dest, dest_offset, size, add, n, addr16);
+    if (n < 2)
+        return 0;
+    uint8_t *s = string_host_ptr(src, cpu.tlb_shift_read), *d = string_host_ptr(dest, cpu.tlb_shift_read);
+    if (!s || !d)
+        return 0;
+    return string_scan(s, d, 0, size, add, n, until_equal);
+}
+
 // <<< BEGIN AUTOGENERATE "ops" >>>
 int movsb16(int flags)
 {
@@ -21,6 +171,14 @@ int movsb16(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = movs_bulk(ds_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 1, add, count - i, 1);
+        if (bulk) {
+            cpu.reg16[SI] += bulk * add;
+            cpu.reg16[DI] += bulk * add;
+            cpu.reg16[CX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_read8(ds_base + cpu.reg16[SI], src, cpu.tlb_shift_read);
         cpu_write8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[SI] += add;
@@ -43,6 +201,14 @@ int movsb32(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = movs_bulk(ds_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 1, add, count - i, 0);
+        if (bulk) {
+            cpu.reg32[ESI] += bulk * add;
+            cpu.reg32[EDI] += bulk * add;
+            cpu.reg32[ECX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_read8(ds_base + cpu.reg32[ESI], src, cpu.tlb_shift_read);
         cpu_write8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[ESI] += add;
@@ -65,6 +231,14 @@ int movsw16(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = movs_bulk(ds_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 2, add, count - i, 1);
+        if (bulk) {
+            cpu.reg16[SI] += bulk * add;
+            cpu.reg16[DI] += bulk * add;
+            cpu.reg16[CX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_read16(ds_base + cpu.reg16[SI], src, cpu.tlb_shift_read);
         cpu_write16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[SI] += add;
@@ -87,6 +261,14 @@ int movsw32(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = movs_bulk(ds_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 2, add, count - i, 0);
+        if (bulk) {
+            cpu.reg32[ESI] += bulk * add;
+            cpu.reg32[EDI] += bulk * add;
+            cpu.reg32[ECX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_read16(ds_base + cpu.reg32[ESI], src, cpu.tlb_shift_read);
         cpu_write16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[ESI] += add;
@@ -109,6 +291,14 @@ int movsd16(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = movs_bulk(ds_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 4, add, count - i, 1);
+        if (bulk) {
+            cpu.reg16[SI] += bulk * add;
+            cpu.reg16[DI] += bulk * add;
+            cpu.reg16[CX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_read32(ds_base + cpu.reg16[SI], src, cpu.tlb_shift_read);
         cpu_write32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[SI] += add;
@@ -131,6 +321,14 @@ int movsd32(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = movs_bulk(ds_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 4, add, count - i, 0);
+        if (bulk) {
+            cpu.reg32[ESI] += bulk * add;
+            cpu.reg32[EDI] += bulk * add;
+            cpu.reg32[ECX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_read32(ds_base + cpu.reg32[ESI], src, cpu.tlb_shift_read);
         cpu_write32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[ESI] += add;
@@ -151,6 +349,13 @@ int stosb16(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = stos_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], src, 1, add, count - i, 1);
+        if (bulk) {
+            cpu.reg16[DI] += bulk * add;
+            cpu.reg16[CX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_write8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
@@ -169,6 +374,13 @@ int stosb32(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = stos_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], src, 1, add, count - i, 0);
+        if (bulk) {
+            cpu.reg32[EDI] += bulk * add;
+            cpu.reg32[ECX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_write8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
@@ -187,6 +399,13 @@ int stosw16(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = stos_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], src, 2, add, count - i, 1);
+        if (bulk) {
+            cpu.reg16[DI] += bulk * add;
+            cpu.reg16[CX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_write16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
@@ -205,6 +424,13 @@ int stosw32(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = stos_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], src, 2, add, count - i, 0);
+        if (bulk) {
+            cpu.reg32[EDI] += bulk * add;
+            cpu.reg32[ECX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_write16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
@@ -223,6 +449,13 @@ int stosd16(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = stos_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], src, 4, add, count - i, 1);
+        if (bulk) {
+            cpu.reg16[DI] += bulk * add;
+            cpu.reg16[CX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_write32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
@@ -241,6 +474,13 @@ int stosd32(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        int bulk = stos_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], src, 4, add, count - i, 0);
+        if (bulk) {
+            cpu.reg32[EDI] += bulk * add;
+            cpu.reg32[ECX] -= bulk;
+            i += bulk - 1;
+            continue;
+        }
         cpu_write32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
@@ -264,6 +504,12 @@ int scasb16(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, 1, add, count - i - 1, 1, 0);
+            if (skip) {
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
@@ -277,6 +523,12 @@ int scasb16(int flags)
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, 1, add, count - i - 1, 1, 1);
+            if (skip) {
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
@@ -307,6 +559,12 @@ int scasb32(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, 1, add, count - i - 1, 0, 0);
+            if (skip) {
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
@@ -320,6 +578,12 @@ int scasb32(int flags)
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, 1, add, count - i - 1, 0, 1);
+            if (skip) {
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
@@ -350,6 +614,12 @@ int scasw16(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, 2, add, count - i - 1, 1, 0);
+            if (skip) {
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
@@ -363,6 +633,12 @@ int scasw16(int flags)
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, 2, add, count - i - 1, 1, 1);
+            if (skip) {
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
@@ -393,6 +669,12 @@ int scasw32(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, 2, add, count - i - 1, 0, 0);
+            if (skip) {
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
@@ -406,6 +688,12 @@ int scasw32(int flags)
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, 2, add, count - i - 1, 0, 1);
+            if (skip) {
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
@@ -436,6 +724,12 @@ int scasd16(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, 4, add, count - i - 1, 1, 0);
+            if (skip) {
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
@@ -449,6 +743,12 @@ int scasd16(int flags)
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, 4, add, count - i - 1, 1, 1);
+            if (skip) {
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
@@ -479,6 +779,12 @@ int scasd32(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, 4, add, count - i - 1, 0, 0);
+            if (skip) {
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
@@ -492,6 +798,12 @@ int scasd32(int flags)
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, 4, add, count - i - 1, 0, 1);
+            if (skip) {
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
@@ -776,6 +1088,13 @@ int cmpsb16(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 1, add, count - i - 1, 1, 0);
+            if (skip) {
+                cpu.reg16[SI] += skip * add;
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read8(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
@@ -791,6 +1110,13 @@ int cmpsb16(int flags)
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 1, add, count - i - 1, 1, 1);
+            if (skip) {
+                cpu.reg16[SI] += skip * add;
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read8(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
@@ -825,6 +1151,13 @@ int cmpsb32(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 1, add, count - i - 1, 0, 0);
+            if (skip) {
+                cpu.reg32[ESI] += skip * add;
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read8(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
@@ -840,6 +1173,13 @@ int cmpsb32(int flags)
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 1, add, count - i - 1, 0, 1);
+            if (skip) {
+                cpu.reg32[ESI] += skip * add;
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read8(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
@@ -874,6 +1214,13 @@ int cmpsw16(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 2, add, count - i - 1, 1, 0);
+            if (skip) {
+                cpu.reg16[SI] += skip * add;
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read16(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
@@ -889,6 +1236,13 @@ int cmpsw16(int flags)
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 2, add, count - i - 1, 1, 1);
+            if (skip) {
+                cpu.reg16[SI] += skip * add;
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read16(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
@@ -923,6 +1277,13 @@ int cmpsw32(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 2, add, count - i - 1, 0, 0);
+            if (skip) {
+                cpu.reg32[ESI] += skip * add;
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read16(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
@@ -938,6 +1299,13 @@ int cmpsw32(int flags)
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 2, add, count - i - 1, 0, 1);
+            if (skip) {
+                cpu.reg32[ESI] += skip * add;
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read16(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
@@ -972,6 +1340,13 @@ int cmpsd16(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 4, add, count - i - 1, 1, 0);
+            if (skip) {
+                cpu.reg16[SI] += skip * add;
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read32(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
@@ -987,6 +1362,13 @@ int cmpsd16(int flags)
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], 4, add, count - i - 1, 1, 1);
+            if (skip) {
+                cpu.reg16[SI] += skip * add;
+                cpu.reg16[DI] += skip * add;
+                cpu.reg16[CX] -= skip;
+                i += skip;
+            }
             cpu_read32(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
@@ -1021,6 +1403,13 @@ int cmpsd32(int flags)
         return 0;
         case 1: // REPZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 4, add, count - i - 1, 0, 0);
+            if (skip) {
+                cpu.reg32[ESI] += skip * add;
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read32(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
@@ -1036,6 +1425,13 @@ int cmpsd32(int flags)
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
         for (int i = 0; i < count; i++) {
+            int skip = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], 4, add, count - i - 1, 0, 1);
+            if (skip) {
+                cpu.reg32[ESI] += skip * add;
+                cpu.reg32[EDI] += skip * add;
+                cpu.reg32[ECX] -= skip;
+                i += skip;
+            }
             cpu_read32(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
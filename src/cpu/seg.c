@@ -1,5 +1,6 @@
 // Segment handlers
 #include "cpu/cpu.h"
+#include "cpuapi.h"
 
 #define EXCEPTION_HANDLER return 1
 
@@ -8,9 +9,8 @@ static void reload_cs_base(void)
     uint32_t virt_eip = VIRT_EIP(), lin_eip = virt_eip + cpu.seg_base[CS];
     // Calculate physical EIP
     // Refresh cpu.last_phys_eip
-    uint32_t lin_page = lin_eip >> 12,
-             shift = cpu.tlb_shift_read,
-             tag = cpu.tlb_tags[lin_eip >> 12] >> shift;
+    uint32_t shift = cpu.tlb_shift_read,
+             tag = TLB_TAGS(lin_eip) >> shift;
 
     if (tag & 2) {
         // Not translated yet - let cpu_get_trace handle this
@@ -19,7 +19,7 @@ static void reload_cs_base(void)
     }
 
     // Recompute the physical EIP state
-    cpu.phys_eip = PTR_TO_PHYS(cpu.tlb[lin_page] + lin_eip);
+    cpu.phys_eip = PTR_TO_PHYS(TLB_PTR(lin_eip));
     cpu.last_phys_eip = cpu.phys_eip & ~0xFFF;
     cpu.eip_phys_bias = virt_eip - cpu.phys_eip;
 }
@@ -46,6 +46,17 @@ int cpu_load_csip_protected(uint16_t cs, struct seg_desc* info, uint32_t eip)
     return 0;
 }
 
+// Sets or clears STATE_FLAT after the base of CS, DS, ES, or SS may have changed. Traces are looked up by state hash, so
+// code decoded for flat segments is never run with the other kind. Instructions that load a data segment in the middle
+// of a trace check whether the state hash changed and end the trace if so (see op_mov_s16r16).
+void cpu_seg_update_flat(void)
+{
+    if (cpu.seg_base[CS] | cpu.seg_base[DS] | cpu.seg_base[ES] | cpu.seg_base[SS])
+        cpu.state_hash &= ~STATE_FLAT;
+    else
+        cpu.state_hash |= STATE_FLAT;
+}
+
 void cpu_seg_load_virtual(int id, uint16_t sel)
 {
     cpu.seg[id] = sel;
@@ -60,6 +71,7 @@ void cpu_seg_load_virtual(int id, uint16_t sel)
         cpu.esp_mask = 0xFFFF;
         break;
     }
+    cpu_seg_update_flat();
 }
 void cpu_seg_load_real(int id, uint16_t sel)
 {
@@ -76,7 +88,62 @@ void cpu_seg_load_real(int id, uint16_t sel)
         cpu.esp_mask = 0xFFFF;
         break;
     }
+    cpu_seg_update_flat();
+}
+// Descriptor cache (see cpu.seg_desc_cache). The key is the selector's index and table indicator, which is enough to
+// tell a GDT entry from an LDT entry even when a caller passes the table explicitly.
+static inline uint32_t seg_desc_cache_key(int table, uint32_t selector)
+{
+    return (selector & ~7) | (table == SEG_LDTR) << 2;
+}
+static inline struct seg_desc_cache_entry* seg_desc_cache_entry(uint32_t key)
+{
+    return &cpu.seg_desc_cache[key >> 2 & (SEG_DESC_CACHE_SIZE - 1)];
 }
+
+// Returns the cache entry for the descriptor at "addr" if it can be used in place of reading it, or NULL
+static struct seg_desc_cache_entry* seg_desc_cache_lookup(int table, uint32_t selector, uint32_t addr)
+{
+    uint32_t key = seg_desc_cache_key(table, selector), tag = TLB_TAGS(addr);
+    struct seg_desc_cache_entry* entry = seg_desc_cache_entry(key);
+    if (entry->key != key || entry->base != cpu.seg_base[table] || TLB_ENTRY_INVALID8(addr, tag, TLB_SYSTEM_READ))
+        return NULL;
+    return PTR_TO_PHYS(TLB_PTR(addr)) == entry->phys ? entry : NULL;
+}
+
+// Remembers a descriptor that has just been read from "addr", so the TLB still holds its page
+static void seg_desc_cache_fill(int table, uint32_t selector, uint32_t addr, struct seg_desc* seg)
+{
+    // A descriptor that crosses a page boundary would need two TLB entries to check
+    if ((addr & 0xFFF) > 0xFF8 || TLB_ENTRY_INVALID8(addr, TLB_TAGS(addr), TLB_SYSTEM_READ))
+        return;
+    uint32_t phys = PTR_TO_PHYS(TLB_PTR(addr));
+    if (!cpu_mmu_watch_descriptors(phys))
+        return;
+    uint32_t key = seg_desc_cache_key(table, selector);
+    struct seg_desc_cache_entry* entry = seg_desc_cache_entry(key);
+    entry->key = key;
+    entry->base = cpu.seg_base[table];
+    entry->phys = phys;
+    entry->desc = *seg;
+}
+
+void cpu_seg_cache_flush(void)
+{
+    for (int i = 0; i < SEG_DESC_CACHE_SIZE; i++)
+        cpu.seg_desc_cache[i].key = -1;
+}
+
+// Drops every cached descriptor that overlaps a write to physical memory
+void cpu_seg_cache_write(uint32_t phys, uint32_t length)
+{
+    for (int i = 0; i < SEG_DESC_CACHE_SIZE; i++) {
+        struct seg_desc_cache_entry* entry = &cpu.seg_desc_cache[i];
+        if (entry->key != (uint32_t)-1 && phys < entry->phys + 8 && phys + length > entry->phys)
+            entry->key = -1;
+    }
+}
+
 // Note: May raise exception since there's a physical write to update the dirty bit
 int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info)
 {
@@ -88,8 +155,17 @@ int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info)
     uint32_t linaddr = cpu_seg_descriptor_address(-1, sel);
     if (linaddr == RESULT_INVALID)
         CPU_FATAL("Out of limits in internal function\n");
+    // Setting the accessed bit drops the descriptor from the cache like any other write. It is the only byte that
+    // changes, so the entry is put back afterwards with it updated.
+    struct seg_desc_cache_entry *entry = seg_desc_cache_lookup(SELECTOR_LDT(sel) ? SEG_LDTR : SEG_GDTR, sel, linaddr), cached;
+    if (entry)
+        cached = *entry;
     info->raw[1] |= 0x100;
     cpu_write8(linaddr + 5, info->raw[1] >> 8 & 0xFF, TLB_SYSTEM_WRITE);
+    if (entry) {
+        cached.desc.raw[1] = (cached.desc.raw[1] & ~0xFF00) | (info->raw[1] & 0xFF00);
+        *entry = cached;
+    }
 
     switch (id) {
     case CS:
@@ -107,6 +183,7 @@ int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info)
             cpu.esp_mask = 0xFFFF;
         break;
     }
+    cpu_seg_update_flat();
     return 0;
 }
 
@@ -118,9 +195,17 @@ int cpu_seg_load_descriptor2(int table, uint32_t selector, struct seg_desc* seg,
             return -1; // Some instructions, like VERR, don't cause write faults.
         EXCEPTION2(exception, code);
     }
-    int addr = (selector & ~7) + cpu.seg_base[table];
+    uint32_t addr = (selector & ~7) + cpu.seg_base[table];
+    struct seg_desc_cache_entry* entry = seg_desc_cache_lookup(table, selector, addr);
+    if (entry) {
+        *seg = entry->desc;
+        cpu_stats.seg_desc_cache_hits++;
+        return 0;
+    }
     cpu_read32(addr, seg->raw[0], TLB_SYSTEM_READ);
     cpu_read32(addr + 4, seg->raw[1], TLB_SYSTEM_READ);
+    seg_desc_cache_fill(table, selector, addr, seg);
+    cpu_stats.seg_desc_cache_misses++;
     return 0;
 }
 
@@ -270,6 +355,7 @@ int cpu_load_seg_value_mov(int seg, uint16_t val)
                 cpu.seg_base[seg] = 0;
                 cpu.seg_limit[seg] = 0;
                 cpu.seg_access[seg] = 0;
+                cpu_seg_update_flat();
             }
             break;
         }
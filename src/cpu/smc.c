@@ -2,6 +2,26 @@
 // Note that writes to address beyond cpu.memory_size can be ignored because the translation system forbids translation from MMIO pages.
 // Also, this subsystem cannot handle cross 128-byte accesses on its own. All unaligned accesses will be split up in access.c
 #include "cpu/cpu.h"
+#include "cpuapi.h"
+
+// Reading the host timer twice per invalidation costs more than many of the invalidations themselves, and self-modifying
+// guests hit this path constantly. So only one invalidation in SMC_TIMING_INTERVAL is timed, and stands in for the rest.
+#define SMC_TIMING_INTERVAL 64
+
+// Counts an invalidation, and returns 1, with the time it started at, if it is one to be timed
+static inline int smc_timing_start(uint32_t* start_time)
+{
+    if (cpu_stats.smc_invalidations++ & (SMC_TIMING_INTERVAL - 1))
+        return 0;
+    *start_time = get_host_usec();
+    return 1;
+}
+static inline void smc_timing_end(int timed, uint32_t start_time)
+{
+    if (timed)
+        cpu_stats.smc_invalidate_usec += (uint64_t)(get_host_usec() - start_time) * SMC_TIMING_INTERVAL;
+}
+
 int cpu_smc_page_has_code(uint32_t phys)
 {
     phys >>= 12;
@@ -23,17 +43,82 @@ void cpu_smc_set_code(uint32_t phys)
     phys >>= 7;
     if ((phys >> 5) >= cpu.smc_has_code_length)
         return;
+    // Other address spaces may have writable TLB entries for this page, which the decoder only marks in the current one
+    if (!cpu.smc_has_code[phys >> 5])
+        cpu_mmu_tlb_drop_inactive();
     cpu.smc_has_code[phys >> 5] |= 1 << (phys & 31);
 }
 
-// The maximum trace length is 32 instructions, and instructions are a maximum of 15 bytes long. 32 * 15 = 480, and that rounds up to 512 bytes.
-// If this value is set to zero, then only the last four 128-byte chunks are invalidated. If set to one, it will invalidate everything on the page until the start address
+// ============================================================================
+// Hot pages
+// ============================================================================
+
+// Some code writes to the page it runs from over and over: a loop patching its own operands, a decompressor unpacking
+// next to itself. Every write throws away the traces on the lines before it, and they are decoded again right away.
+// Once a page has seen SMC_HOT_THRESHOLD invalidations without enough time passing in between, it is decoded one
+// instruction per trace, and writes to it only drop the traces they actually overlap. The count is halved every
+// 2^SMC_DECAY_SHIFT cycles, and once it drops below SMC_COOL_THRESHOLD, cpu_smc_cool_pages puts the page back to normal.
+#define SMC_HOT_THRESHOLD 32
+#define SMC_COOL_THRESHOLD 4
+#define SMC_DECAY_SHIFT 20
+
+static inline uint32_t smc_decayed_events(struct smc_page_heat* heat, uint32_t epoch)
+{
+    uint32_t elapsed = epoch - heat->epoch;
+    return elapsed >= 16 ? 0 : heat->events >> elapsed;
+}
+
+static void smc_heat_event(uint32_t pageid)
+{
+    struct smc_page_heat* heat = &cpu.smc_heat[pageid];
+    uint32_t epoch = cpu_get_cycles() >> SMC_DECAY_SHIFT, events = smc_decayed_events(heat, epoch);
+    if (events < 0xFFFF)
+        events++;
+    heat->events = events;
+    heat->epoch = epoch;
+    if (!heat->hot && events >= SMC_HOT_THRESHOLD && cpu.smc_hot_page_count < SMC_MAX_HOT_PAGES) {
+        heat->hot = 1;
+        cpu.smc_hot_pages[cpu.smc_hot_page_count++] = pageid;
+        cpu_stats.smc_hot_pages++;
+    }
+}
+
+int cpu_smc_page_is_hot(uint32_t phys)
+{
+    phys >>= 12;
+    if (phys >= cpu.smc_has_code_length)
+        return 0;
+    return cpu.smc_heat[phys].hot;
+}
+
+// Called between runs of the CPU loop. Pages that have not been written to for a while have their single-instruction
+// traces thrown away, so that they are decoded as full traces again.
+void cpu_smc_cool_pages(void)
+{
+    uint32_t epoch = cpu_get_cycles() >> SMC_DECAY_SHIFT;
+    for (uint32_t i = 0; i < cpu.smc_hot_page_count;) {
+        uint32_t pageid = cpu.smc_hot_pages[i];
+        struct smc_page_heat* heat = &cpu.smc_heat[pageid];
+        if (smc_decayed_events(heat, epoch) >= SMC_COOL_THRESHOLD) {
+            i++;
+            continue;
+        }
+        heat->hot = 0;
+        cpu_trace_invalidate_page(pageid << 12, -1, -1);
+        cpu.smc_hot_pages[i] = cpu.smc_hot_pages[--cpu.smc_hot_page_count];
+        cpu_stats.smc_cooled_pages++;
+    }
+}
+
+// With the default trace length of 32 instructions, and instructions a maximum of 15 bytes long, a straight trace covers at most 32 * 15 = 480 bytes, which rounds up to 512 bytes.
+// If this value is set to zero, then only the last four 128-byte chunks are invalidated, which misses longer traces and ones that follow jumps (see decode_follow).
+// If set to one, it will invalidate everything on the page until the start address
 #define REMOVE_ALL_CODE_TRACES 1
 
 void cpu_smc_invalidate(uint32_t lin, uint32_t phys)
 {
     //printf("%08x %08x %08x %08x\n", lin, phys, cpu.smc_has_code_length, cpu.smc_has_code[phys >> 12]);
-    uint32_t pageid = phys >> 12, page_info, p128, invmask, pagebase = phys & ~0xFFF;
+    uint32_t pageid = phys >> 12, page_info, p128, invmask;
     int start, end, quit = 0;
 
     if (pageid >= cpu.smc_has_code_length)
@@ -63,21 +148,17 @@ void cpu_smc_invalidate(uint32_t lin, uint32_t phys)
             return;
     }
 
-    for (int i = start; i <= end; i++) {
-        uint32_t mask = 1 << i;
-        if (page_info & mask) {
-            uint32_t physbase = pagebase + (i << 7);
-            struct trace_info* info;
-            for (int j = 0; j < 128; j++) {
-                if ((info = cpu_trace_get_entry(physbase + j))) {
-                    // See if trace intersects given physical EIP and if so, exit
-                    if (!quit && phys >= info->phys && phys <= (info->phys + TRACE_LENGTH(info->flags)))
-                        quit = 1;
-                    info->phys = -1;
-                }
-            }
-        }
-    }
+    uint32_t start_time = 0;
+    int timed = smc_timing_start(&start_time);
+    smc_heat_event(pageid);
+    if (cpu.smc_heat[pageid].hot) {
+        // Only drop the traces that the write overlaps. Writes that reach here never cross a 128-byte line, and are at
+        // most four bytes long. The lines stay marked, since the other traces on them are still alive.
+        quit = cpu_trace_invalidate_write(phys, 4);
+        invmask = 0;
+    } else
+        quit = cpu_trace_invalidate_page(phys, page_info & invmask, phys);
+    smc_timing_end(timed, start_time);
 
     page_info &= ~invmask;
     cpu.smc_has_code[pageid] = page_info;
@@ -87,27 +168,21 @@ void cpu_smc_invalidate(uint32_t lin, uint32_t phys)
     if (quit)
         INTERNAL_CPU_LOOP_EXIT();
 }
-void cpu_smc_invalidate_page(uint32_t phys){
-    uint32_t pageid = phys >> 12,
-    page_info = cpu.smc_has_code[pageid], pagebase = phys & ~0xFFF, quit = 1;
-    for (int i = 0; i < 31; i++) {
-        uint32_t mask = 1 << i;
-        if (page_info & mask) {
-            uint32_t physbase = pagebase + (i << 7);
-            struct trace_info* info;
-            for (int j = 0; j < 128; j++) {
-                if ((info = cpu_trace_get_entry(physbase + j))) {
-                    // See if trace intersects given physical EIP and if so, exit
-                    if (!quit && phys >= info->phys && phys <= (info->phys + TRACE_LENGTH(info->flags)))
-                        quit = 1;
-                    info->phys = -1;
-                }
-            }
-        }
+
+// Called before DMA writes to a page: drops every trace on it
+void cpu_smc_invalidate_page(uint32_t phys)
+{
+    uint32_t pageid = phys >> 12;
+    if (pageid >= cpu.smc_has_code_length)
+        return;
+
+    if (cpu.smc_has_code[pageid]) {
+        uint32_t start_time = 0;
+        int timed = smc_timing_start(&start_time);
+        cpu_trace_invalidate_page(phys, cpu.smc_has_code[pageid], phys);
+        smc_timing_end(timed, start_time);
     }
 
-    cpu.smc_has_code[pageid] = page_info;
     // TODO: invalidate TLB
-    if (quit)
-        INTERNAL_CPU_LOOP_EXIT();
+    INTERNAL_CPU_LOOP_EXIT();
 }
\ No newline at end of file
@@ -2411,7 +2411,7 @@ float64 float64_div(float64 a, float64 b, float_status_t *status)
         aSig >>= 1;
         ++zExp;
     }
-    zSig = estimateDiv128To64(aSig, 0, bSig);
+    zSig = div128To64(aSig, 0, bSig);
     if ((zSig & 0x1FF) <= 2) {
         mul64To128(bSig, zSig, &term0, &term1);
         sub128(aSig, 0, term0, term1, &rem0, &rem1);
@@ -2466,7 +2466,7 @@ float64 float64_sqrt(float64 a, float_status_t *status)
     aSig |= U64(0x0010000000000000);
     zSig = estimateSqrt32(aExp, (uint32_t)(aSig>>21));
     aSig <<= 9 - (aExp & 1);
-    zSig = estimateDiv128To64(aSig, 0, zSig<<32) + (zSig<<30);
+    zSig = div128To64(aSig, 0, zSig<<32) + (zSig<<30);
     if ((zSig & 0x1FF) <= 5) {
         doubleZSig = zSig<<1;
         mul64To128(zSig, zSig, &term0, &term1);
@@ -3391,14 +3391,14 @@ floatx80 floatx80_div(floatx80 a, floatx80 b, float_status_t *status)
         shift128Right(aSig, 0, 1, &aSig, &rem1);
         ++zExp;
     }
-    zSig0 = estimateDiv128To64(aSig, rem1, bSig);
+    zSig0 = div128To64(aSig, rem1, bSig);
     mul64To128(bSig, zSig0, &term0, &term1);
     sub128(aSig, rem1, term0, term1, &rem0, &rem1);
     while ((int64_t) rem0 < 0) {
         --zSig0;
         add128(rem0, rem1, 0, bSig, &rem0, &rem1);
     }
-    zSig1 = estimateDiv128To64(rem1, 0, bSig);
+    zSig1 = div128To64(rem1, 0, bSig);
     if ((uint64_t) (zSig1<<1) <= 8) {
         mul64To128(bSig, zSig1, &term1, &term2);
         sub128(rem1, 0, term1, term2, &rem1, &rem2);
@@ -3455,7 +3455,7 @@ floatx80 floatx80_sqrt(floatx80 a, float_status_t *status)
     zExp = ((aExp - 0x3FFF)>>1) + 0x3FFF;
     zSig0 = estimateSqrt32(aExp, aSig0>>32);
     shift128Right(aSig0, 0, 2 + (aExp & 1), &aSig0, &aSig1);
-    zSig0 = estimateDiv128To64(aSig0, aSig1, zSig0<<32) + (zSig0<<30);
+    zSig0 = div128To64(aSig0, aSig1, zSig0<<32) + (zSig0<<30);
     doubleZSig0 = zSig0<<1;
     mul64To128(zSig0, zSig0, &term0, &term1);
     sub128(aSig0, aSig1, term0, term1, &rem0, &rem1);
@@ -3464,7 +3464,7 @@ floatx80 floatx80_sqrt(floatx80 a, float_status_t *status)
         doubleZSig0 -= 2;
         add128(rem0, rem1, zSig0>>63, doubleZSig0 | 1, &rem0, &rem1);
     }
-    zSig1 = estimateDiv128To64(rem1, 0, doubleZSig0);
+    zSig1 = div128To64(rem1, 0, doubleZSig0);
     if ((zSig1 & U64(0x3FFFFFFFFFFFFFFF)) <= 5) {
         if (zSig1 == 0) zSig1 = 1;
         mul64To128(doubleZSig0, zSig1, &term1, &term2);
@@ -3938,14 +3938,14 @@ float128 float128_div(float128 a, float128 b, float_status_t *status)
         shift128Right(aSig0, aSig1, 1, &aSig0, &aSig1);
         ++zExp;
     }
-    zSig0 = estimateDiv128To64(aSig0, aSig1, bSig0);
+    zSig0 = div128To64(aSig0, aSig1, bSig0);
     mul128By64To192(bSig0, bSig1, zSig0, &term0, &term1, &term2);
     sub192(aSig0, aSig1, 0, term0, term1, term2, &rem0, &rem1, &rem2);
     while ((int64_t) rem0 < 0) {
         --zSig0;
         add192(rem0, rem1, rem2, 0, bSig0, bSig1, &rem0, &rem1, &rem2);
     }
-    zSig1 = estimateDiv128To64(rem1, rem2, bSig0);
+    zSig1 = div128To64(rem1, rem2, bSig0);
     if ((zSig1 & 0x3FFF) <= 4) {
         mul128By64To192(bSig0, bSig1, zSig1, &term1, &term2, &term3);
         sub192(rem1, rem2, 0, term1, term2, term3, &rem1, &rem2, &rem3);
@@ -6398,6 +6398,8 @@ static uint64_t argument_reduction_kernel(uint64_t aSig0, int Exp, uint64_t *zSi
     uint64_t aSig1 = 0;
 
     shortShift128Left(aSig1, aSig0, Exp, &aSig1, &aSig0);
+    // The remainder below is only partially corrected, so this has to be the original estimate rather than the exact
+    // quotient to give the same results
     uint64_t q = estimateDiv128To64(aSig1, aSig0, FLOAT_PI_HI);
     mul128By64To192(FLOAT_PI_HI, FLOAT_PI_LO, q, &term0, &term1, &term2);
     sub128(aSig1, aSig0, term0, term1, zSig1, zSig0);
@@ -6840,7 +6842,7 @@ static uint64_t remainder_kernel(uint64_t aSig0, uint64_t bSig, int expDiff, uin
     uint64_t aSig1 = 0;
 
     shortShift128Left(aSig1, aSig0, expDiff, &aSig1, &aSig0);
-    uint64_t q = estimateDiv128To64(aSig1, aSig0, bSig);
+    uint64_t q = div128To64(aSig1, aSig0, bSig);
     mul64To128(bSig, q, &term0, &term1);
     sub128(aSig1, aSig0, term0, term1, zSig1, zSig0);
     while ((int64_t)(*zSig1) < 0) {
@@ -1,64 +1,331 @@
+// Trace cache
+// Traces are looked up through a set-associative table of trace_info entries. The decoded instructions themselves live in a
+// ring of equally-sized segments. When the segment being filled runs out of room, the next (oldest) segment is recycled and
+// only the traces that were decoded into it are dropped, instead of throwing away the entire cache.
 #include "cpu/cpu.h"
 #include "cpu/opcodes.h"
+#include "cpuapi.h"
 #include <string.h>
 
 static struct decoded_instruction temporary_placeholder = {
     .handler = op_trace_end
 };
-static uint32_t hash_eip(uint32_t phys)
+
+// Approximate number of decoded instructions per trace, used to balance the two tables against each other
+#define TRACE_AVERAGE_LENGTH 8
+
+static inline struct trace_info* trace_set(uint32_t phys)
+{
+    return &cpu.trace_info[(phys & cpu.trace_info_set_mask) * TRACE_INFO_WAYS];
+}
+
+// Returns the segment that a committed trace was decoded into
+static inline int trace_segment(struct trace_info* info)
+{
+    return (info->ptr - cpu.trace_cache) / cpu.trace_segment_size;
+}
+
+// Returns the first byte of the page that a trace was decoded from, which is only before its phys if it followed a jump
+// backwards (see decode_follow in decoder.c)
+static inline uint32_t trace_start(struct trace_info* info)
+{
+    return info->phys - TRACE_BACK(info->flags);
+}
+
+// Adds a newly committed trace to the list of its page
+static void trace_link(struct trace_info* info)
+{
+    uint32_t page = info->phys >> 12, index = info - cpu.trace_info;
+    info->page_prev = -1;
+    info->page_next = -1;
+    if (page >= cpu.smc_has_code_length)
+        return;
+    info->page_next = cpu.trace_pages[page];
+    if (info->page_next != (uint32_t)-1)
+        cpu.trace_info[info->page_next].page_prev = index;
+    cpu.trace_pages[page] = index;
+}
+
+// Removes a trace from the list of the page it was decoded from. "phys" is passed separately, since the decoder may
+// already have overwritten the entry with a new trace.
+static void trace_unlink(struct trace_info* info, uint32_t phys)
 {
-    return phys & (TRACE_INFO_ENTRIES - 1);
+    uint32_t page = phys >> 12;
+    if (page >= cpu.smc_has_code_length)
+        return;
+    if (info->page_prev == (uint32_t)-1)
+        cpu.trace_pages[page] = info->page_next;
+    else
+        cpu.trace_info[info->page_prev].page_next = info->page_next;
+    if (info->page_next != (uint32_t)-1)
+        cpu.trace_info[info->page_next].page_prev = info->page_prev;
+}
+
+static void trace_invalidate(struct trace_info* info)
+{
+    if (info->ptr)
+        trace_unlink(info, info->phys);
+    info->phys = -1;
+    info->ptr = NULL;
+}
+
+void cpu_trace_init(uint32_t budget)
+{
+    if (!cpu.trace_length)
+        cpu.trace_length = DEFAULT_TRACE_SIZE;
+    else if (cpu.trace_length < 2)
+        cpu.trace_length = 2;
+    else if (cpu.trace_length > MAX_TRACE_SIZE)
+        cpu.trace_length = MAX_TRACE_SIZE;
+
+    if (!budget) {
+        // Scale with guest memory: more RAM usually means more code
+        budget = cpu.memory_size >> 3;
+        if (budget < TRACE_CACHE_MIN_BUDGET)
+            budget = TRACE_CACHE_MIN_BUDGET;
+        if (budget > TRACE_CACHE_MAX_BUDGET)
+            budget = TRACE_CACHE_MAX_BUDGET;
+    }
+
+    // Find the largest power-of-two set count that fits within the budget
+    uint32_t per_set = TRACE_INFO_WAYS * (sizeof(struct trace_info) + TRACE_AVERAGE_LENGTH * sizeof(struct decoded_instruction)), sets = 1;
+    while ((sets << 1) * per_set <= budget)
+        sets <<= 1;
+
+    free(cpu.trace_info);
+    free(cpu.trace_cache);
+    free(cpu.trace_pages);
+
+    cpu.trace_info_set_mask = sets - 1;
+    cpu.trace_segment_size = (sets * TRACE_INFO_WAYS * TRACE_AVERAGE_LENGTH) / TRACE_CACHE_SEGMENTS;
+    if (cpu.trace_segment_size < MAX_TRACE_SIZE * 2)
+        cpu.trace_segment_size = MAX_TRACE_SIZE * 2;
+    cpu.trace_info = calloc(sets * TRACE_INFO_WAYS, sizeof(struct trace_info));
+    cpu.trace_cache = calloc(cpu.trace_segment_size * TRACE_CACHE_SEGMENTS, sizeof(struct decoded_instruction));
+    cpu.trace_pages = malloc(cpu.smc_has_code_length * sizeof(uint32_t));
+    if (!cpu.trace_info || !cpu.trace_cache || !cpu.trace_pages)
+        CPU_FATAL("Unable to allocate trace cache (%d bytes)\n", budget);
+    memset(cpu.trace_pages, 0xFF, cpu.smc_has_code_length * sizeof(uint32_t));
+
+    CPU_LOG("Trace cache: %d sets, %d ways, %d instructions\n", sets, TRACE_INFO_WAYS, cpu.trace_segment_size * TRACE_CACHE_SEGMENTS);
+    cpu_trace_flush();
 }
 
 void cpu_trace_flush(void)
 {
-    memset(cpu.trace_info, 0, sizeof(struct trace_info) * TRACE_INFO_ENTRIES);
+    uint32_t entries = (cpu.trace_info_set_mask + 1) * TRACE_INFO_WAYS;
+    for (unsigned int i = 0; i < entries; i++)
+        trace_invalidate(&cpu.trace_info[i]);
+    // The table may have been resized, so don't leave indexes into the old one behind
+    memset(cpu.return_stack, 0, sizeof(cpu.return_stack));
     cpu.trace_cache_usage = 0;
+    cpu.trace_cache_segment = 0;
 }
 
-struct trace_info* cpu_trace_get_entry(uint32_t phys)
+// Recycle the next segment in the ring, dropping every trace that was decoded into it
+static void trace_evict_segment(void)
 {
-    struct trace_info* i = &cpu.trace_info[hash_eip(phys)];
-    if (i->phys != phys)
-        return NULL;
-    return i;
+    int segment = (cpu.trace_cache_segment + 1) % TRACE_CACHE_SEGMENTS;
+    struct decoded_instruction *start = cpu.trace_cache + segment * cpu.trace_segment_size,
+                               *end = start + cpu.trace_segment_size;
+
+    uint32_t entries = (cpu.trace_info_set_mask + 1) * TRACE_INFO_WAYS;
+    for (unsigned int i = 0; i < entries; i++) {
+        struct trace_info* info = &cpu.trace_info[i];
+        if (info->ptr >= start && info->ptr < end) {
+            trace_invalidate(info);
+            cpu_stats.trace_evictions++;
+        }
+    }
+
+    cpu.trace_cache_segment = segment;
+    cpu.trace_cache_usage = segment * cpu.trace_segment_size;
 }
-struct decoded_instruction* cpu_get_trace(void)
+
+// Invalidates all traces that start in the page holding "phys", in one of the 128-byte lines set in "lines". Returns 1 if
+// one of them covers "hit"
+int cpu_trace_invalidate_page(uint32_t phys, uint32_t lines, uint32_t hit)
+{
+    uint32_t page = phys >> 12;
+    if (page >= cpu.smc_has_code_length)
+        return 0;
+    int result = 0;
+    for (uint32_t index = cpu.trace_pages[page]; index != (uint32_t)-1;) {
+        struct trace_info* info = &cpu.trace_info[index];
+        index = info->page_next;
+        uint32_t start = trace_start(info);
+        if (!(lines >> (start >> 7 & 31) & 1))
+            continue;
+        // See if trace intersects given physical EIP
+        if (hit >= start && hit <= (start + TRACE_LENGTH(info->flags)))
+            result = 1;
+        trace_invalidate(info);
+        cpu_stats.smc_traces_invalidated++;
+    }
+    return result;
+}
+
+// Invalidates only the traces on the page that overlap a write of "length" bytes at "phys". Returns 1 if one of them
+// covers "phys" itself.
+int cpu_trace_invalidate_write(uint32_t phys, int length)
+{
+    uint32_t page = phys >> 12;
+    if (page >= cpu.smc_has_code_length)
+        return 0;
+    int result = 0;
+    for (uint32_t index = cpu.trace_pages[page]; index != (uint32_t)-1;) {
+        struct trace_info* info = &cpu.trace_info[index];
+        index = info->page_next;
+        uint32_t start = trace_start(info), end = start + TRACE_LENGTH(info->flags);
+        if (start > phys + length - 1 || end < phys)
+            continue;
+        if (phys >= start && phys <= end)
+            result = 1;
+        trace_invalidate(info);
+        cpu_stats.smc_traces_invalidated++;
+    }
+    return result;
+}
+
+// Pick an entry in the set to hold a new trace. Empty entries are used first, then the one in the oldest segment.
+static struct trace_info* trace_victim(struct trace_info* set)
+{
+    struct trace_info* victim = set;
+    int oldest = -1;
+    for (int i = 0; i < TRACE_INFO_WAYS; i++) {
+        if (set[i].ptr == NULL)
+            return &set[i];
+        // Distance from the segment currently being filled, going forward around the ring
+        int age = (TRACE_CACHE_SEGMENTS + cpu.trace_cache_segment - trace_segment(&set[i])) % TRACE_CACHE_SEGMENTS;
+        if (age > oldest) {
+            oldest = age;
+            victim = &set[i];
+        }
+    }
+    cpu_stats.trace_conflicts++;
+    return victim;
+}
+
+// Finds or decodes the trace at the current EIP. On a hit, the index of the entry is stored in *link.
+static inline struct decoded_instruction* trace_lookup(uint32_t* link)
 {
     // If we have gone off the page, recalculate physical EIP
     if ((cpu.phys_eip ^ cpu.last_phys_eip) > 4095) {
         uint32_t virt_eip = VIRT_EIP(), lin_eip = virt_eip + cpu.seg_base[CS];
-        uint8_t tlb_tag = cpu.tlb_tags[lin_eip >> 12];
-        if (TLB_ENTRY_INVALID8(lin_eip, tlb_tag, cpu.tlb_shift_read) || cpu.tlb_attrs[lin_eip >> 12] & TLB_ATTR_NX) {
+        uint8_t tlb_tag = TLB_TAGS(lin_eip);
+        if (TLB_ENTRY_INVALID8(lin_eip, tlb_tag, cpu.tlb_shift_read) || TLB_ATTRS(lin_eip) & TLB_ATTR_NX) {
             if (cpu_mmu_translate(lin_eip, cpu.tlb_shift_read | 8))
                 return &temporary_placeholder;
         }
-        cpu.phys_eip = PTR_TO_PHYS(cpu.tlb[lin_eip >> 12] + lin_eip);
+        cpu.phys_eip = PTR_TO_PHYS(TLB_PTR(lin_eip));
         cpu.eip_phys_bias = virt_eip - cpu.phys_eip;
         cpu.last_phys_eip = cpu.phys_eip & ~0xFFF;
     }
 
-    // Read the trace entry.
-    struct trace_info* trace = &cpu.trace_info[hash_eip(cpu.phys_eip)];
-    // If it matches, return the associated trace
-    if (trace->phys == cpu.phys_eip && trace->state_hash == cpu.state_hash) {
-        if(trace->ptr == NULL) {
-            CPU_FATAL("TRACE is NULL (internal CPU bug 1)\n");
+    // Read the trace entries in this set. If one matches, return the associated trace
+    struct trace_info* set = trace_set(cpu.phys_eip);
+    for (int i = 0; i < TRACE_INFO_WAYS; i++) {
+        struct trace_info* trace = &set[i];
+        if (trace->phys == cpu.phys_eip && trace->state_hash == cpu.state_hash) {
+            if (trace->ptr == NULL) {
+                CPU_FATAL("TRACE is NULL (internal CPU bug 1)\n");
+            }
+            cpu_stats.trace_hits++;
+            *link = trace - cpu.trace_info;
+            return cpu_trace_enter(trace);
         }
-        return trace->ptr;
     }
+    cpu_stats.trace_misses++;
 
-    // Make sure that the trace cache has enough room in it.
-    if ((cpu.trace_cache_usage + MAX_TRACE_SIZE) >= TRACE_CACHE_SIZE) {
-        // If not, flush the trace cache by clearing all trace info entries
-        cpu_trace_flush();
-    }
+    // Make sure that the current segment has enough room in it. If not, move on to the next one.
+    if ((uint32_t)(cpu.trace_cache_usage + cpu.trace_length) > (cpu.trace_cache_segment + 1) * cpu.trace_segment_size)
+        trace_evict_segment();
 
-    // Translate the instructions, as needed
+    // Translate the instructions, as needed. Eviction may have emptied an entry in our set, so choose the victim afterwards.
+    // The link is left alone here: the branch that asked for it may have been in the segment we just recycled.
+    struct trace_info* trace = trace_victim(set);
     struct decoded_instruction* i = &cpu.trace_cache[cpu.trace_cache_usage];
-    cpu.trace_cache_usage += cpu_decode(trace, i);
-    if(i == NULL) {
-        CPU_FATAL("TRACE is NULL from decode (internal CPU bug) 0\n");
+    uint32_t victim_phys = trace->ptr ? trace->phys : (uint32_t)-1;
+    int count = cpu_decode(trace, i);
+    cpu.trace_cache_usage += count;
+    if (count) {
+        // The decoder only commits the trace (and so replaces the victim) when it returns a non-zero count
+        if (victim_phys != (uint32_t)-1)
+            trace_unlink(trace, victim_phys);
+        trace_link(trace);
+        trace->cycles = count - (i[count - 1].handler == op_trace_end);
+        int bucket = 31 - __builtin_clz(trace->cycles | 1);
+        cpu_stats.trace_length[bucket < CPU_STATS_TRACE_LENGTHS ? bucket : CPU_STATS_TRACE_LENGTHS - 1]++;
+        return cpu_trace_enter(trace);
     }
     return i;
-}
\ No newline at end of file
+}
+
+// Enters a committed trace. If the time slice cannot run out inside of it, all of its instructions are charged to
+// cpu.cycles_to_run here, and the dispatch loop in cpu_execute stops counting them one at a time until the trace is left
+// again (see TRACE_SYNC in opcodes.c). The handler that branched here has not been charged by the loop yet, so its cycle
+// is taken as well. Fused instructions charge their second cycle themselves, which the bound allows for.
+struct decoded_instruction* cpu_trace_enter(struct trace_info* trace)
+{
+    struct decoded_instruction* i = trace->ptr;
+    int cycles = trace->cycles;
+    if (cycles && cpu.cycles_to_run > cycles * 2 + 1) {
+        cpu.cycles_to_run -= cycles + 1;
+        cpu.trace_start = i;
+        cpu.trace_end = i + cycles;
+        cpu.trace_phys = trace->phys;
+        cpu_stats.trace_batched++;
+    }
+    return i;
+}
+
+// Goes back to charging instructions one at a time, in the middle of a trace that was charged up front, for code that
+// reads or changes the cycle count without knowing which instruction is running. The instructions that have not started
+// yet are given back. The current one is found by walking the trace from its start to cpu.phys_eip, stepping over the
+// jumps it was decoded through. No two instructions of a trace start at the same address (see decode_follow), and an
+// instruction that moves EIP anywhere else always ends its trace, so if none of them is at cpu.phys_eip, it is the last.
+void cpu_trace_sync(void)
+{
+    struct decoded_instruction *i = cpu.trace_start, *last = cpu.trace_end - 1;
+    uint32_t phys = cpu.trace_phys;
+    while (i != last && phys != cpu.phys_eip) {
+        phys += I_LENGTH(i->flags);
+        if (i->handler == op_jmp_rel32_follow || i->handler == op_call_j32_follow)
+            phys += i->imm32;
+        i++;
+    }
+    cpu.cycles_to_run += cpu.trace_end - i;
+    // cpu_execute runs the rest of a charged trace without looking at cpu.trace_end, so have the next instruction return
+    // to it instead of running, and it will put the handler back and count from there
+    if (i + 1 < cpu.trace_end) {
+        cpu.trace_resync = i + 1;
+        cpu.trace_resync_handler = i[1].handler;
+        i[1].handler = op_trace_resync;
+    }
+    cpu.trace_end = NULL;
+}
+
+// Points *link at the trace for "phys" and the current state if there is one, without decoding it otherwise
+void cpu_trace_find(uint32_t phys, uint32_t* link)
+{
+    struct trace_info* set = trace_set(phys);
+    for (int i = 0; i < TRACE_INFO_WAYS; i++) {
+        if (set[i].phys == phys && set[i].state_hash == cpu.state_hash) {
+            *link = &set[i] - cpu.trace_info;
+            return;
+        }
+    }
+}
+
+struct decoded_instruction* cpu_get_trace(void)
+{
+    uint32_t unused;
+    return trace_lookup(&unused);
+}
+
+// Slow path for linked branches (see STOP_LINKED in opcodes.c). The link is patched once the target is found in the cache,
+// so that the next time the branch goes this way the lookup is skipped.
+struct decoded_instruction* cpu_get_trace_linked(uint32_t* link)
+{
+    return trace_lookup(link);
+}
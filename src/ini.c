@@ -257,6 +257,11 @@ static const struct ini_enum drive_types[] = {
     { "none", DRIVE_TYPE_NONE },
     { NULL, 0 }
 };
+static const struct ini_enum fpu_accuracy_types[] = {
+    { "exact", FPU_ACCURACY_EXACT },
+    { "fast", FPU_ACCURACY_FAST },
+    { NULL, 0 }
+};
 static const struct ini_enum boot_types[] = {
     { "cd", BOOT_CDROM },
     { "hd", BOOT_DISK },
@@ -464,8 +469,14 @@ int parse_cfg(struct pc_settings* pc, char* data)
     struct ini_section* cpu = get_section(global, "cpu");
     if (cpu == NULL) {
         pc->cpu.cpuid_limit_winnt = 0;
+        pc->cpu.trace_cache_size = 0;
+        pc->cpu.trace_length = 0;
+        pc->cpu.fpu_accuracy = FPU_ACCURACY_EXACT;
     } else {
         pc->cpu.cpuid_limit_winnt = get_field_int(cpu, "cpuid_limit_winnt", 0);
+        pc->cpu.trace_cache_size = get_field_int(cpu, "tracecache", 0);
+        pc->cpu.trace_length = get_field_int(cpu, "tracelength", 0);
+        pc->cpu.fpu_accuracy = get_field_enum(cpu, "transcendental", fpu_accuracy_types, FPU_ACCURACY_EXACT);
     }
 
     UNUSED(get_section);
@@ -246,10 +246,82 @@ void mainloop_multi_core_two()
         sprintf(deb, "VGA:%03u", time_vga);
         noSDL_wrapScreenLogAt(deb, 20, 756);
 
+        struct cpu_stats* stats = cpu_get_stats();
+        sprintf(deb, "MMU ctx hit:%llu miss:%llu walk hit:%llu miss:%llu desc hit:%llu miss:%llu",
+            (unsigned long long)stats->tlb_context_hits, (unsigned long long)stats->tlb_context_misses,
+            (unsigned long long)stats->page_walk_hits, (unsigned long long)stats->page_walk_misses,
+            (unsigned long long)stats->seg_desc_cache_hits, (unsigned long long)stats->seg_desc_cache_misses);
+        noSDL_wrapScreenLogAt(deb, 20, 724);
+
+        sprintf(deb, "SMC inv:%llu traces:%llu time:%llums hot:%llu cooled:%llu",
+            (unsigned long long)stats->smc_invalidations, (unsigned long long)stats->smc_traces_invalidated,
+            (unsigned long long)stats->smc_invalidate_usec / 1000,
+            (unsigned long long)stats->smc_hot_pages, (unsigned long long)stats->smc_cooled_pages);
+        noSDL_wrapScreenLogAt(deb, 20, 708);
+
+        sprintf(deb, "FPU host:%llu soft:%llu SSE host:%llu soft:%llu",
+            (unsigned long long)stats->fpu_host_ops, (unsigned long long)stats->fpu_host_fallbacks,
+            (unsigned long long)stats->sse_host_ops, (unsigned long long)stats->sse_host_fallbacks);
+        noSDL_wrapScreenLogAt(deb, 20, 692);
+
+        sprintf(deb, "FPU sin:%llu cos:%llu sincos:%llu tan:%llu atan:%llu yl2x:%llu yl2xp1:%llu 2xm1:%llu",
+            (unsigned long long)stats->fpu_fsin, (unsigned long long)stats->fpu_fcos,
+            (unsigned long long)stats->fpu_fsincos, (unsigned long long)stats->fpu_fptan,
+            (unsigned long long)stats->fpu_fpatan, (unsigned long long)stats->fpu_fyl2x,
+            (unsigned long long)stats->fpu_fyl2xp1, (unsigned long long)stats->fpu_f2xm1);
+        noSDL_wrapScreenLogAt(deb, 20, 676);
+
+        sprintf(deb, "TC hit:%llu miss:%llu conf:%llu evict:%llu chain:%llu batch:%llu",
+            (unsigned long long)stats->trace_hits, (unsigned long long)stats->trace_misses,
+            (unsigned long long)stats->trace_conflicts, (unsigned long long)stats->trace_evictions,
+            (unsigned long long)stats->trace_chained, (unsigned long long)stats->trace_batched);
+        noSDL_wrapScreenLogAt(deb, 20, 772);
+
+        sprintf(deb, "Jcc:%llu fused:%llu deadflags:%llu flat:%llu",
+            (unsigned long long)stats->decoded_jcc, (unsigned long long)stats->fused_pairs,
+            (unsigned long long)stats->dead_flags, (unsigned long long)stats->flat_handlers);
+        noSDL_wrapScreenLogAt(deb, 20, 788);
+
+        sprintf(deb, "Addr forms disp:%llu base:%llu base+disp:%llu index:%llu Memo hit:%llu miss:%llu",
+            (unsigned long long)stats->addr_form_disp, (unsigned long long)stats->addr_form_base,
+            (unsigned long long)stats->addr_form_base_disp, (unsigned long long)stats->addr_form_index,
+            (unsigned long long)stats->decode_memo_hits, (unsigned long long)stats->decode_memo_misses);
+        noSDL_wrapScreenLogAt(deb, 20, 660);
+
+        sprintf(deb, "SB traces:%llu jumps:%llu side exits:%llu IC hit:%llu miss:%llu RSB hit:%llu miss:%llu",
+            (unsigned long long)stats->superblocks, (unsigned long long)stats->superblock_jumps,
+            (unsigned long long)stats->trace_side_exits,
+            (unsigned long long)stats->indirect_hits, (unsigned long long)stats->indirect_misses,
+            (unsigned long long)stats->return_stack_hits, (unsigned long long)stats->return_stack_misses);
+        noSDL_wrapScreenLogAt(deb, 20, 644);
+
+        sprintf(deb, "Decode ahead req:%llu hit:%llu stale:%llu",
+            (unsigned long long)stats->decode_ahead_requests, (unsigned long long)stats->decode_ahead_hits,
+            (unsigned long long)stats->decode_ahead_stale);
+        noSDL_wrapScreenLogAt(deb, 20, 612);
+
+        sprintf(deb, "TC len 1:%llu 2:%llu 4:%llu 8:%llu 16:%llu 32:%llu 64:%llu 128:%llu",
+            (unsigned long long)stats->trace_length[0], (unsigned long long)stats->trace_length[1],
+            (unsigned long long)stats->trace_length[2], (unsigned long long)stats->trace_length[3],
+            (unsigned long long)stats->trace_length[4], (unsigned long long)stats->trace_length[5],
+            (unsigned long long)stats->trace_length[6], (unsigned long long)stats->trace_length[7]);
+        noSDL_wrapScreenLogAt(deb, 20, 628);
+
         SDL_Delay(100);
     }
 }
 
+// Background trace decoding
+void mainloop_multi_core_three()
+{
+    // Requests go stale quickly, so rather than sleep, the core waits for the event that the CPU core signals along with
+    // each one (see decode_ahead_request)
+    while (1) {
+        if (!cpu_decode_ahead())
+            __asm__ volatile("wfe");
+    }
+}
+
 void mainloop_multi_core_one()
 {
     // VGA update loop
@@ -4,6 +4,7 @@
 #include "cpuapi.h"
 #include "display.h"
 #include "state.h"
+#include "noSDL.h"
 #include <stdlib.h>
 
 //#define REALTIME_TIMING
@@ -122,6 +123,11 @@ itick_t get_now(void)
 #endif
 }
 
+uint32_t get_host_usec(void)
+{
+    return noSDL_wrapCheckTimer();
+}
+
 // A function to mess with the emulator's sense of time
 void add_now(itick_t a)
 {
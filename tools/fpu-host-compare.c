@@ -0,0 +1,295 @@
+// Host-side comparison of the x87 host double fast path (include/cpu/fpuhost.h) against softfloat, for FADD, FSUB, FMUL,
+// FDIV, FSQRT and FIST to 16, 32 and 64 bits. Build and run from the top of the tree on the host to be checked:
+//
+//     cc -O2 -Iinclude -o fpu-host-compare tools/fpu-host-compare.c src/cpu/softfloat.c -lm && ./fpu-host-compare [count]
+//
+// Both run with the control word that allows the host path: 53-bit precision, round to nearest and every exception
+// masked. Whenever the host path accepts an operation, the result has to have the same bits as the floatx80_* one, and
+// the flags, which include the precision exception and C1, have to be the same too. The fixed operands are:
+//  - Exponents around the host path limit of 2^-960 .. 2^960, alone and with results that cross it.
+//  - Significands with exactly 53 significant bits, and with 54, which the host path has to decline.
+//  - Ties: sums that fall exactly halfway between two doubles, products of two 27-bit odd numbers, and FIST of n + 0.5
+//    next to the limit of each destination.
+//  - Zero results, whose sign softfloat gets from x - x, x + -x and 0 * y, and square roots and FISTs of signed zeros.
+// Then "count" random operand pairs (1 million by default), with exponents mostly close to 1, some anywhere in range and
+// a few 54-bit significands. Exits with 1 on any mismatch.
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu/fpuhost.h"
+#include "softfloat/softfloatx80.h"
+
+enum {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SQRT,
+    OP_FIST16,
+    OP_FIST32,
+    OP_FIST64,
+    OPS
+};
+static const char* const op_names[OPS] = { "FADD", "FSUB", "FMUL", "FDIV", "FSQRT", "FIST m16", "FIST m32", "FIST m64" };
+static floatx80 (*const soft_binary[])(floatx80 a, floatx80 b, float_status_t* status) = {
+    floatx80_add, floatx80_sub, floatx80_mul, floatx80_div
+};
+
+static unsigned long long accepted[OPS], declined[OPS], failures;
+
+// The status that fpu.c has while fpu.host_double is set
+static float_status_t host_status(void)
+{
+    float_status_t status = { 0 };
+    status.float_rounding_precision = 64;
+    status.float_rounding_mode = float_round_nearest_even;
+    status.float_exception_masks = 0x3F;
+    status.float_nan_handling_mode = float_first_operand_nan;
+    return status;
+}
+
+static floatx80 make(int sign, int exponent, uint64_t significand)
+{
+    floatx80 result;
+    result.exp = (sign ? 0x8000 : 0) | (exponent + 0x3FFF);
+    result.fraction = significand;
+    return result;
+}
+
+static floatx80 zero(int sign)
+{
+    floatx80 result;
+    result.exp = sign ? 0x8000 : 0;
+    result.fraction = 0;
+    return result;
+}
+
+static floatx80 from_double(double d)
+{
+    return d == 0 ? zero(signbit(d)) : fpu_from_host(d);
+}
+
+static void mismatch(int op, floatx80 a, floatx80 b, uint64_t result, int flags, uint64_t expected, int expected_flags)
+{
+    if (failures++ < 20)
+        printf("%s %04x:%016llx, %04x:%016llx: host %016llx (flags %04x), softfloat %016llx (flags %04x)\n",
+            op_names[op], a.exp, (unsigned long long)a.fraction, b.exp, (unsigned long long)b.fraction,
+            (unsigned long long)result, flags, (unsigned long long)expected, expected_flags);
+}
+
+#define BITS(f) ((uint64_t)(f).exp << 48 ^ (f).fraction)
+
+// Runs one operation both ways. "b" is ignored by FSQRT and the FISTs.
+static void compare(int op, floatx80 a, floatx80 b)
+{
+    float_status_t status = host_status(), expected_status = host_status();
+    uint64_t result, expected;
+    int ok;
+    if (op <= OP_DIV) {
+        floatx80 r;
+        ok = fpu_host_binary(op - OP_ADD + FPU_HOST_ADD, a, b, &r, &status);
+        result = BITS(r);
+        expected = ok ? BITS(soft_binary[op](a, b, &expected_status)) : 0;
+    } else if (op == OP_SQRT) {
+        floatx80 r;
+        ok = fpu_host_sqrt(a, &r, &status);
+        result = BITS(r);
+        expected = ok ? BITS(floatx80_sqrt(a, &expected_status)) : 0;
+    } else {
+        static const double limits[3] = { FPU_HOST_INT16_LIMIT, FPU_HOST_INT32_LIMIT, FPU_HOST_INT64_LIMIT };
+        int64_t r;
+        ok = fpu_host_to_int(a, limits[op - OP_FIST16], &r, &status);
+        result = r;
+        if (ok) {
+            if (op == OP_FIST16)
+                expected = (int64_t)floatx80_to_int16(a, &expected_status);
+            else if (op == OP_FIST32)
+                expected = (int64_t)floatx80_to_int32(a, &expected_status);
+            else
+                expected = floatx80_to_int64(a, &expected_status);
+        }
+    }
+    if (!ok) {
+        declined[op]++;
+        return;
+    }
+    accepted[op]++;
+    if (result != expected || status.float_exception_flags != expected_status.float_exception_flags)
+        mismatch(op, a, b, result, status.float_exception_flags, expected, expected_status.float_exception_flags);
+}
+
+static void compare_binary(floatx80 a, floatx80 b)
+{
+    for (int op = OP_ADD; op <= OP_DIV; op++) {
+        compare(op, a, b);
+        compare(op, b, a);
+    }
+}
+
+static void compare_unary(floatx80 a)
+{
+    for (int op = OP_SQRT; op < OPS; op++)
+        compare(op, a, a);
+}
+
+// Operations that the host path must never take, whatever softfloat makes of them
+static void expect_declined(int op, floatx80 a, floatx80 b)
+{
+    unsigned long long before = declined[op];
+    compare(op, a, b);
+    if (declined[op] == before && failures++ < 20)
+        printf("%s %04x:%016llx, %04x:%016llx: taken by the host path\n", op_names[op], a.exp,
+            (unsigned long long)a.fraction, b.exp, (unsigned long long)b.fraction);
+}
+
+static uint64_t state = 0x9E3779B97F4A7C15ULL;
+static uint64_t random64(void)
+{
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+// A random 53-bit significand, or 54-bit one if "wide" is set
+static uint64_t random_significand(int wide)
+{
+    uint64_t significand = (random64() | 1ULL << 63) & ~0x7FFULL;
+    return wide ? significand | 0x400 : significand;
+}
+
+static floatx80 random_operand(void)
+{
+    uint64_t r = random64();
+    int exponent;
+    if (r & 3)
+        exponent = (int)(r >> 8 & 127) - 64;
+    else
+        exponent = (int)((r >> 8) % 2001) - 1000;
+    if ((r >> 32 & 63) == 0)
+        return zero(r >> 40 & 1);
+    return make(r >> 41 & 1, exponent, random_significand((r >> 42 & 15) == 0));
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long long count = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000000;
+    const uint64_t one = 1ULL << 63, last53 = 1ULL << 11, last54 = 1ULL << 10;
+    static const uint64_t significands[] = {
+        0x8000000000000000ULL, 0x8000000000000800ULL, 0xFFFFFFFFFFFFF800ULL, 0xC000000000000000ULL,
+        0xAAAAAAAAAAAAA800ULL, 0xB504F333F9DE6800ULL,
+    };
+#define SIGNIFICANDS (int)(sizeof(significands) / sizeof(significands[0]))
+
+    // Exponents at the edge of the host path range, against partners that keep the result at the edge or cross it
+    for (int e = FPU_HOST_EXP_LIMIT - 3; e <= FPU_HOST_EXP_LIMIT + 2; e++) {
+        for (int s = 0; s < SIGNIFICANDS; s++) {
+            for (int t = 0; t < SIGNIFICANDS; t++) {
+                for (int sign = 0; sign < 4; sign++) {
+                    floatx80 big = make(sign & 1, e, significands[s]), small = make(sign & 1, -e, significands[s]);
+                    for (int p = -2; p <= 2; p++) {
+                        floatx80 partner = make(sign >> 1, p, significands[t]);
+                        compare_binary(big, partner);
+                        compare_binary(small, partner);
+                    }
+                    compare_binary(big, make(sign >> 1, e, significands[t]));
+                    compare_binary(small, make(sign >> 1, -e, significands[t]));
+                    compare_binary(big, small);
+                    compare_unary(big);
+                    compare_unary(small);
+                }
+            }
+        }
+    }
+
+    // 53 significant bits against 54. The 54-bit operands must be declined; the 53-bit ones end in a one in the last place.
+    for (int e = -4; e <= 4; e++) {
+        for (int s = 0; s < SIGNIFICANDS; s++) {
+            floatx80 exact = make(0, e, significands[s] | last53), wide = make(0, e, significands[s] | last54);
+            floatx80 partner = make(1, -e, significands[(s + 1) % SIGNIFICANDS] | last53);
+            compare_binary(exact, partner);
+            compare_unary(exact);
+            for (int op = OP_ADD; op < OPS; op++) {
+                expect_declined(op, wide, partner);
+                if (op <= OP_DIV)
+                    expect_declined(op, partner, wide);
+            }
+        }
+    }
+
+    // Ties. a + half an ulp of a rounds to even either way, and so does a - a quarter ulp when a is a power of two.
+    for (int s = 0; s < SIGNIFICANDS; s++) {
+        for (int sign = 0; sign < 4; sign++) {
+            floatx80 a = make(sign & 1, 0, significands[s]), b = make(sign & 1, 0, significands[s] | last53);
+            floatx80 half = make(sign >> 1, -53, one), quarter = make(sign >> 1, -54, one);
+            compare_binary(a, half);
+            compare_binary(b, half);
+            compare_binary(a, quarter);
+            compare_binary(b, make(sign >> 1, -53, one | one >> 1)); // Three quarters of an ulp, not a tie
+        }
+    }
+    // Products of two odd 27-bit numbers have 53 or 54 bits. The 54-bit ones end in a one, so they are ties. The square
+    // roots are of perfect squares, at both exponent parities.
+    for (int n = 0; n < 20000; n++) {
+        uint64_t x = (1ULL << 26) | (random64() & ((1ULL << 26) - 1)) | 1, y = (1ULL << 26) | (random64() & ((1ULL << 26) - 1)) | 1;
+        if (n < 64)
+            x = (1ULL << 27) - 1 - 2 * n, y = (1ULL << 26) + 1 + 2 * n;
+        compare_binary(make(n & 1, 0, x << 37), make(n >> 1 & 1, 0, y << 37));
+        uint64_t square = (x >> 1) * (x >> 1);
+        compare(OP_SQRT, make(0, n % 7 - 3, square << __builtin_clzll(square)), zero(0));
+    }
+    // FIST halfway between two integers, including next to the limit of each destination
+    for (int k = -40; k <= 40; k++) {
+        compare_unary(from_double(k + 0.5));
+        compare_unary(from_double(k * 0.25));
+    }
+    static const double edges[] = { 0x1p15, 0x1p31, 0x1p52, 0x1p53, 0x1p62 };
+    for (int e = 0; e < 5; e++) {
+        double step = fmax(0.5, edges[e] * 0x1p-52);
+        for (int k = -6; k <= 6; k++) {
+            compare_unary(from_double(edges[e] + k * step));
+            compare_unary(from_double(-edges[e] + k * step));
+            compare_unary(from_double(edges[e] - 1 + k * step));
+        }
+    }
+
+    // Zero results. softfloat gives +0 for x - x and x + -x, and the exclusive or of the signs for 0 * y and 0 / y.
+    for (int e = -FPU_HOST_EXP_LIMIT; e < FPU_HOST_EXP_LIMIT; e += 37) {
+        for (int s = 0; s < SIGNIFICANDS; s++) {
+            for (int sign = 0; sign < 2; sign++) {
+                floatx80 x = make(sign, e, significands[s]), minus_x = make(!sign, e, significands[s]);
+                compare(OP_SUB, x, x);
+                compare(OP_ADD, x, minus_x);
+                compare(OP_ADD, minus_x, x);
+                compare_binary(zero(0), x);
+                compare_binary(zero(1), x);
+            }
+        }
+    }
+    for (int sign = 0; sign < 4; sign++) {
+        compare_binary(zero(sign & 1), zero(sign >> 1));
+        compare_unary(zero(sign & 1));
+    }
+    compare_unary(from_double(-0.5));
+    compare_unary(from_double(-0.25));
+    compare_unary(from_double(0.5));
+    compare_unary(from_double(-1.5));
+
+    // Random operands
+    for (unsigned long long n = 0; n < count; n++) {
+        floatx80 a = random_operand(), b = random_operand();
+        compare_binary(a, b);
+        compare_unary(a);
+        // Values up to 2^63, so that the FISTs see fractions at every scale and every destination overflows
+        compare_unary(make(random64() & 1, (int)(random64() % 64), random_significand(0)));
+    }
+
+    printf("%-9s %12s %12s\n", "", "host path", "declined");
+    for (int op = 0; op < OPS; op++)
+        printf("%-9s %12llu %12llu\n", op_names[op], accepted[op], declined[op]);
+    printf("%llu mismatches\n", failures);
+    return failures != 0;
+}
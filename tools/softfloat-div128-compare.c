@@ -0,0 +1,331 @@
+// Host-side comparison of div128To64 (softfloat-macros.h) against the estimateDiv128To64 paths it replaced in the
+// division and square root routines of softfloat.c. Build and run from the top of the tree with a host compiler that has
+// 128-bit integers:
+//
+//     cc -O2 -Iinclude -o softfloat-div128-compare tools/softfloat-div128-compare.c -lm && ./softfloat-div128-compare [count]
+//
+// For every operand, it checks that:
+//  - div128To64 returns the exact truncated quotient, or all ones if it doesn't fit in 64 bits.
+//  - The old estimate is never below it and at most two above it, so it is a valid estimate.
+//  - Both give the same quotient after the multiply-subtract correction loop that floatx80_div and friends run.
+//  - Both give the same significand, as far as rounding can tell, through the float64_div path, which only corrects the
+//    estimate when its low bits are close to a rounding boundary.
+//  - reciprocal64 is floor((2^128 - 1) / d) - 2^64.
+//  - estimateDiv128To64, which the trig argument reduction still uses, is unchanged.
+//  - The significands that float64_sqrt and floatx80_sqrt pass to rounding are the same with either one in their Newton
+//    step, and the float64_sqrt one rounds like the exact square root.
+// Operands are the divisor and dividend boundaries (powers of two, the edges of each reciprocal table entry, dividends
+// just below the divisor) followed by "count" random ones (10 million by default). The square roots are given the
+// significand boundaries and perfect squares at both exponent parities, then "count" random ones. Exits with 1 on any
+// mismatch.
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "softfloat/softfloat.h"
+#define USE_estimateDiv128To64
+#define USE_estimateSqrt32
+#include "softfloat/softfloat-macros.h"
+
+#ifndef __SIZEOF_INT128__
+#error "The reference quotients need a compiler with 128-bit integers"
+#endif
+typedef unsigned __int128 u128;
+
+// estimateDiv128To64 as it was before div128To64, kept under its own name so that this comparison doesn't change with
+// the header
+static uint64_t old_estimateDiv128To64(uint64_t a0, uint64_t a1, uint64_t b)
+{
+    uint64_t b0, b1;
+    uint64_t rem0, rem1, term0, term1;
+    uint64_t z;
+
+    if (b <= a0) return U64(0xFFFFFFFFFFFFFFFF);
+    b0 = b>>32;
+    z = (b0<<32 <= a0) ? U64(0xFFFFFFFF00000000) : (a0 / b0)<<32;
+    mul64To128(b, z, &term0, &term1);
+    sub128(a0, a1, term0, term1, &rem0, &rem1);
+    while (((int64_t) rem0) < 0) {
+        z -= U64(0x100000000);
+        b1 = b<<32;
+        add128(rem0, rem1, b0, b1, &rem0, &rem1);
+    }
+    rem0 = (rem0<<32) | (rem1>>32);
+    z |= (b0<<32 <= rem0) ? 0xFFFFFFFF : rem0 / b0;
+    return z;
+}
+
+// The correction loop of floatx80_div, float128_div, and the remainder kernel
+static uint64_t corrected(uint64_t z, uint64_t a0, uint64_t a1, uint64_t b)
+{
+    uint64_t term0, term1, rem0, rem1;
+    mul64To128(b, z, &term0, &term1);
+    sub128(a0, a1, term0, term1, &rem0, &rem1);
+    while ((int64_t) rem0 < 0) {
+        --z;
+        add128(rem0, rem1, 0, b, &rem0, &rem1);
+    }
+    return z;
+}
+
+// The significand path of float64_div, reduced to what roundAndPackFloat64 looks at: the bits that are kept, and how the
+// 10 round bits compare with zero and with one half. Two significands with the same key round the same way in every
+// rounding mode, and raise the same inexact flag.
+static uint64_t float64_div_key(uint64_t z, uint64_t a, uint64_t b)
+{
+    uint64_t term0, term1, rem0, rem1;
+    if ((z & 0x1FF) <= 2) {
+        mul64To128(b, z, &term0, &term1);
+        sub128(a, 0, term0, term1, &rem0, &rem1);
+        while ((int64_t) rem0 < 0) {
+            --z;
+            add128(rem0, rem1, 0, b, &rem0, &rem1);
+        }
+        z |= (rem1 != 0);
+    }
+    uint64_t round = z & 0x3FF;
+    return (z >> 10) << 2 | (round == 0 ? 0 : round < 0x200 ? 1 : round == 0x200 ? 2 : 3);
+}
+
+// The square root significand path of float64_sqrt, from the biased exponent and the significand with its implicit bit,
+// up to roundAndPackFloat64, with "divide" in the Newton step. Returns the same kind of key as float64_div_key.
+static uint64_t float64_sqrt_key(int aExp, uint64_t aSig, uint64_t (*divide)(uint64_t, uint64_t, uint64_t))
+{
+    uint64_t zSig, doubleZSig, rem0, rem1, term0, term1;
+    zSig = estimateSqrt32(aExp, (uint32_t)(aSig >> 21));
+    aSig <<= 9 - (aExp & 1);
+    zSig = divide(aSig, 0, zSig << 32) + (zSig << 30);
+    if ((zSig & 0x1FF) <= 5) {
+        doubleZSig = zSig << 1;
+        mul64To128(zSig, zSig, &term0, &term1);
+        sub128(aSig, 0, term0, term1, &rem0, &rem1);
+        while ((int64_t)rem0 < 0) {
+            --zSig;
+            doubleZSig -= 2;
+            add128(rem0, rem1, zSig >> 63, doubleZSig | 1, &rem0, &rem1);
+        }
+        zSig |= ((rem0 | rem1) != 0);
+    }
+    uint64_t round = zSig & 0x3FF;
+    return (zSig >> 10) << 2 | (round == 0 ? 0 : round < 0x200 ? 1 : round == 0x200 ? 2 : 3);
+}
+
+// The same key for the exact square root: float64_sqrt is after floor(sqrt(aSig * 2^64)), with the shifted aSig, and
+// whether that is exact
+static uint64_t float64_sqrt_exact_key(int aExp, uint64_t aSig)
+{
+    u128 a = (u128)(aSig << (9 - (aExp & 1))) << 64;
+    uint64_t z = (uint64_t)sqrtl((long double)a);
+    while ((u128)z * z > a)
+        z--;
+    while (z != U64(0xFFFFFFFFFFFFFFFF) && (u128)(z + 1) * (z + 1) <= a)
+        z++;
+    z |= (u128)z * z != a;
+    uint64_t round = z & 0x3FF;
+    return (z >> 10) << 2 | (round == 0 ? 0 : round < 0x200 ? 1 : round == 0x200 ? 2 : 3);
+}
+
+// The square root significand path of floatx80_sqrt, from the biased exponent and the normalized significand, up to
+// roundAndPackFloatx80. *zSig0 is returned as is, since every rounding precision looks at its low bits; *zSig1 only
+// matters through how it compares with zero and with one half, and is reduced to that.
+static void floatx80_sqrt_key(int32_t aExp, uint64_t aSig0, uint64_t (*divide)(uint64_t, uint64_t, uint64_t),
+    uint64_t* key0, uint64_t* key1)
+{
+    uint64_t aSig1, zSig0, zSig1, doubleZSig0;
+    uint64_t rem0, rem1, rem2, rem3, term0, term1, term2, term3;
+    zSig0 = estimateSqrt32(aExp, aSig0 >> 32);
+    shift128Right(aSig0, 0, 2 + (aExp & 1), &aSig0, &aSig1);
+    zSig0 = divide(aSig0, aSig1, zSig0 << 32) + (zSig0 << 30);
+    doubleZSig0 = zSig0 << 1;
+    mul64To128(zSig0, zSig0, &term0, &term1);
+    sub128(aSig0, aSig1, term0, term1, &rem0, &rem1);
+    while ((int64_t)rem0 < 0) {
+        --zSig0;
+        doubleZSig0 -= 2;
+        add128(rem0, rem1, zSig0 >> 63, doubleZSig0 | 1, &rem0, &rem1);
+    }
+    zSig1 = divide(rem1, 0, doubleZSig0);
+    if ((zSig1 & U64(0x3FFFFFFFFFFFFFFF)) <= 5) {
+        if (zSig1 == 0)
+            zSig1 = 1;
+        mul64To128(doubleZSig0, zSig1, &term1, &term2);
+        sub128(rem1, 0, term1, term2, &rem1, &rem2);
+        mul64To128(zSig1, zSig1, &term2, &term3);
+        sub192(rem1, rem2, 0, 0, term2, term3, &rem1, &rem2, &rem3);
+        while ((int64_t)rem1 < 0) {
+            --zSig1;
+            shortShift128Left(0, zSig1, 1, &term2, &term3);
+            term3 |= 1;
+            term2 |= doubleZSig0;
+            add192(rem1, rem2, rem3, 0, term2, term3, &rem1, &rem2, &rem3);
+        }
+        zSig1 |= ((rem1 | rem2 | rem3) != 0);
+    }
+    shortShift128Left(0, zSig1, 1, &zSig0, &zSig1);
+    *key0 = zSig0 | doubleZSig0;
+    *key1 = zSig1 == 0 ? 0 : zSig1 < U64(0x8000000000000000) ? 1 : zSig1 == U64(0x8000000000000000) ? 2 : 3;
+}
+
+static unsigned long long checked, failures;
+
+static void fail(const char* what, uint64_t a0, uint64_t a1, uint64_t b, uint64_t got, uint64_t expected)
+{
+    if (failures++ < 20)
+        printf("%s: a=%016llx:%016llx b=%016llx got %016llx expected %016llx\n", what, (unsigned long long)a0,
+            (unsigned long long)a1, (unsigned long long)b, (unsigned long long)got, (unsigned long long)expected);
+}
+
+// b must be at least 2^63
+static void compare(uint64_t a0, uint64_t a1, uint64_t b)
+{
+    uint64_t z = div128To64(a0, a1, b), old = old_estimateDiv128To64(a0, a1, b);
+    checked++;
+    if (estimateDiv128To64(a0, a1, b) != old)
+        fail("estimateDiv128To64", a0, a1, b, estimateDiv128To64(a0, a1, b), old);
+    if (b <= a0) {
+        if (z != U64(0xFFFFFFFFFFFFFFFF))
+            fail("overflow", a0, a1, b, z, U64(0xFFFFFFFFFFFFFFFF));
+        return;
+    }
+    uint64_t exact = (uint64_t)((((u128)a0 << 64) | a1) / b);
+    if (z != exact)
+        fail("quotient", a0, a1, b, z, exact);
+    if (old < z || old - z > 2)
+        fail("old estimate out of range", a0, a1, b, old, z);
+    if (corrected(z, a0, a1, b) != corrected(old, a0, a1, b))
+        fail("corrected quotient", a0, a1, b, corrected(z, a0, a1, b), corrected(old, a0, a1, b));
+    // float64_div divides a 54 or 55 bit significand, shifted up by 10, by a 53 bit one shifted up by 11
+    if (a1 == 0 && float64_div_key(z, a0, b) != float64_div_key(old, a0, b))
+        fail("float64_div significand", a0, a1, b, float64_div_key(z, a0, b), float64_div_key(old, a0, b));
+}
+
+static void compare_reciprocal(uint64_t d)
+{
+    uint64_t expected = (uint64_t)(~(u128)0 / d), got = reciprocal64(d);
+    checked++;
+    if (got != expected)
+        fail("reciprocal", 0, 0, d, got, expected);
+}
+
+// "aSig" has its implicit bit (bit 52) set
+static void compare_float64_sqrt(int aExp, uint64_t aSig)
+{
+    uint64_t z = float64_sqrt_key(aExp, aSig, div128To64), old = float64_sqrt_key(aExp, aSig, old_estimateDiv128To64);
+    uint64_t exact = float64_sqrt_exact_key(aExp, aSig);
+    checked++;
+    if (z != old)
+        fail("float64_sqrt significand", aExp, aSig, 0, z, old);
+    if (z != exact)
+        fail("float64_sqrt rounding", aExp, aSig, 0, z, exact);
+}
+
+// "aSig0" is normalized
+static void compare_floatx80_sqrt(int32_t aExp, uint64_t aSig0)
+{
+    uint64_t z0, z1, old0, old1;
+    floatx80_sqrt_key(aExp, aSig0, div128To64, &z0, &z1);
+    floatx80_sqrt_key(aExp, aSig0, old_estimateDiv128To64, &old0, &old1);
+    checked++;
+    if (z0 != old0)
+        fail("floatx80_sqrt significand", aExp, aSig0, 0, z0, old0);
+    if (z1 != old1)
+        fail("floatx80_sqrt round bits", aExp, aSig0, 0, z1, old1);
+}
+
+static uint64_t state = U64(0x9E3779B97F4A7C15);
+static uint64_t random64(void)
+{
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * U64(0x2545F4914F6CDD1D);
+}
+
+// Dividends to try with a divisor: around zero, around the divisor, and a few powers of two in between
+static void compare_dividends(uint64_t b)
+{
+    static const uint64_t lows[] = { 0, 1, U64(0x8000000000000000), U64(0xFFFFFFFFFFFFFFFF) };
+    for (int j = 0; j < 4; j++) {
+        uint64_t a1 = lows[j];
+        compare(0, a1, b);
+        compare(1, a1, b);
+        compare(b - 1, a1, b);
+        compare(b - 2, a1, b);
+        compare(b, a1, b);
+        compare(b >> 1, a1, b);
+        for (int k = 0; k < 64; k += 7)
+            compare((U64(1) << k) % b, a1, b);
+        compare(random64() % b, a1, b);
+    }
+    uint64_t a = random64() % b;
+    compare(a, random64(), b);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long long count = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000000;
+
+    // Divisors at the edges of each reciprocal table entry, and at powers of two
+    for (uint64_t i = 256; i < 512; i++) {
+        uint64_t d = i << 55;
+        uint64_t divisors[] = { d, d + 1, d + (U64(1) << 55) - 1, d + (U64(1) << 54), d | 0xFFFFFFFF, d | (U64(1) << 32) };
+        for (int j = 0; j < 6; j++) {
+            compare_reciprocal(divisors[j]);
+            compare_dividends(divisors[j]);
+        }
+    }
+    for (int k = 0; k < 63; k++) {
+        compare_reciprocal(U64(0x8000000000000000) | (U64(1) << k));
+        compare_dividends(U64(0x8000000000000000) | (U64(1) << k));
+        compare_dividends(U64(0xFFFFFFFFFFFFFFFF) - (U64(1) << k));
+    }
+    compare_reciprocal(U64(0xFFFFFFFFFFFFFFFF));
+    compare_dividends(U64(0xFFFFFFFFFFFFFFFF));
+
+    // Square roots of the smallest and largest significands, of the ones next to them, and of perfect squares, which
+    // have exact results, for both exponent parities. The exponent only matters through its parity, apart from the
+    // largest one, which can make the Newton step overflow.
+    for (int parity = 0; parity < 2; parity++) {
+        for (int k = 0; k < 64; k++) {
+            compare_float64_sqrt(0x3FE + parity, U64(0x0010000000000000) | (U64(0x000FFFFFFFFFFFFF) >> k));
+            compare_float64_sqrt(0x7FE - parity, U64(0x0010000000000000) | (U64(1) << (k % 52)));
+            compare_floatx80_sqrt(0x3FFE + parity, U64(0x8000000000000000) | (U64(0x7FFFFFFFFFFFFFFF) >> k));
+            compare_floatx80_sqrt(0x7FFE - parity, U64(0x8000000000000000) | (U64(1) << (k % 63)));
+        }
+        for (uint64_t n = 0; n < 100000; n++) {
+            // Squares that fill 53 bits, and 54 bit ones of even numbers, halved to fit. The exponents keep them squares.
+            uint64_t s = U64(0x4000000) + n, t = U64(0x5A8279A) + n * 2;
+            compare_float64_sqrt(0x3FF + parity * 2, s * s);
+            compare_float64_sqrt(0x400 + parity * 2, t * t >> 1);
+            // The same with 64 bits, from both ends of the range of 32 bit roots
+            s = U64(0xB504F334) + n;
+            t = U64(0xFFFFFFFF) - n;
+            compare_floatx80_sqrt(0x3FFE + parity * 2, s * s);
+            compare_floatx80_sqrt(0x3FFE + parity * 2, t * t);
+        }
+    }
+
+    // Random operands, half of them shaped like the float64_div significands
+    for (unsigned long long n = 0; n < count; n++) {
+        uint64_t b = random64() | U64(0x8000000000000000);
+        compare_reciprocal(b);
+        if (n & 1) {
+            compare(random64() % b, random64(), b);
+        } else {
+            uint64_t bSig = (b >> 11 | U64(0x0010000000000000)) << 11;
+            uint64_t aSig = ((random64() >> 12) | U64(0x0010000000000000)) << 10;
+            if (bSig <= aSig + aSig)
+                aSig >>= 1;
+            compare(aSig, 0, bSig);
+        }
+        int exp = random64() & 0x7FF;
+        compare_float64_sqrt(exp ? exp : 1, random64() >> 11 | U64(0x0010000000000000));
+        exp = random64() & 0x7FFF;
+        compare_floatx80_sqrt(exp ? exp : 1, random64() | U64(0x8000000000000000));
+    }
+
+    printf("%llu comparisons, %llu mismatches\n", checked, failures);
+    return failures != 0;
+}
@@ -0,0 +1,253 @@
+// Host-side comparison of the vec_* kernels in include/cpu/vector.h that have an intrinsic version (NEON on ARM, SSE2 on
+// x86) against the lane-by-lane loops that VECTOR_PORTABLE selects. Build and run from the top of the tree on the host to
+// be checked, for instance a Raspberry Pi running Linux for the NEON block:
+//
+//     cc -O2 -Iinclude -o vector-compare tools/vector-compare.c && ./vector-compare [count]
+//
+// Every kernel is given boundary lanes (zero, one, the signed and unsigned limits and their neighbours, for 8, 16 and 32
+// bit lanes, in every pairing) and "count" random operands (1 million by default), once as SSE operands of 16 bytes and
+// once as MMX operands of 8 bytes, whose upper half is zero after vec_load. All 16 bytes of the results have to match.
+// Then each version is timed on a dependent chain of calls. Exits with 1 on any mismatch.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(__ARM_NEON) && !defined(__SSE2__)
+#error "vector.h has no intrinsic version for this host, so there is nothing to compare the loops against"
+#endif
+
+// vector.h is included twice: first with VECTOR_PORTABLE and every function renamed, then as the emulator sees it
+#define VECTOR_PORTABLE
+#define vec_load portable_load
+#define vec_store portable_store
+#define vec_all portable_all
+#define vec_adds_i8 portable_adds_i8
+#define vec_adds_u8 portable_adds_u8
+#define vec_adds_i16 portable_adds_i16
+#define vec_adds_u16 portable_adds_u16
+#define vec_subs_i8 portable_subs_i8
+#define vec_subs_u8 portable_subs_u8
+#define vec_subs_i16 portable_subs_i16
+#define vec_subs_u16 portable_subs_u16
+#define vec_min_u8 portable_min_u8
+#define vec_max_u8 portable_max_u8
+#define vec_min_i16 portable_min_i16
+#define vec_max_i16 portable_max_i16
+#define vec_packs_i16 portable_packs_i16
+#define vec_packus_i16 portable_packus_i16
+#define vec_packs_i32 portable_packs_i32
+#define vec_unpacklo portable_unpacklo
+#define vec_unpackhi portable_unpackhi
+#define vec_mulhi_i16 portable_mulhi_i16
+#define vec_mulhi_u16 portable_mulhi_u16
+#include "cpu/vector.h"
+#undef VECTOR_H
+#undef VECTOR_PORTABLE
+#undef vec_load
+#undef vec_store
+#undef vec_all
+#undef vec_adds_i8
+#undef vec_adds_u8
+#undef vec_adds_i16
+#undef vec_adds_u16
+#undef vec_subs_i8
+#undef vec_subs_u8
+#undef vec_subs_i16
+#undef vec_subs_u16
+#undef vec_min_u8
+#undef vec_max_u8
+#undef vec_min_i16
+#undef vec_max_i16
+#undef vec_packs_i16
+#undef vec_packus_i16
+#undef vec_packs_i32
+#undef vec_unpacklo
+#undef vec_unpackhi
+#undef vec_mulhi_i16
+#undef vec_mulhi_u16
+#include "cpu/vector.h"
+
+#if defined(VECTOR_NEON)
+#define INTRINSICS "NEON"
+#else
+#define INTRINSICS "SSE2"
+#endif
+
+#define TIMING_ROUNDS 20000000
+
+// One entry per kernel: both versions, and a timing loop for each, where the kernels are inlined as they are in simd.c
+#define KERNEL(name, expr)                                                                                           \
+    static vec_u8 name##_fast(vec_u8 a, vec_u8 b) { return vec_##expr; }                                            \
+    static vec_u8 name##_portable(vec_u8 a, vec_u8 b) { return portable_##expr; }                                  \
+    static __attribute__((noinline)) vec_u8 name##_time_fast(vec_u8 a, vec_u8 b)                                   \
+    {                                                                                                                \
+        for (int n = 0; n < TIMING_ROUNDS; n++)                                                                      \
+            a = vec_##expr;                                                                                          \
+        return a;                                                                                                    \
+    }                                                                                                                \
+    static __attribute__((noinline)) vec_u8 name##_time_portable(vec_u8 a, vec_u8 b)                               \
+    {                                                                                                                \
+        for (int n = 0; n < TIMING_ROUNDS; n++)                                                                      \
+            a = portable_##expr;                                                                                     \
+        return a;                                                                                                    \
+    }
+KERNEL(adds_i8, adds_i8(a, b))
+KERNEL(adds_u8, adds_u8(a, b))
+KERNEL(adds_i16, adds_i16(a, b))
+KERNEL(adds_u16, adds_u16(a, b))
+KERNEL(subs_i8, subs_i8(a, b))
+KERNEL(subs_u8, subs_u8(a, b))
+KERNEL(subs_i16, subs_i16(a, b))
+KERNEL(subs_u16, subs_u16(a, b))
+KERNEL(min_u8, min_u8(a, b))
+KERNEL(max_u8, max_u8(a, b))
+KERNEL(min_i16, min_i16(a, b))
+KERNEL(max_i16, max_i16(a, b))
+KERNEL(packs_i16, packs_i16(a, b))
+KERNEL(packus_i16, packus_i16(a, b))
+KERNEL(packs_i32, packs_i32(a, b))
+KERNEL(unpacklo_1, unpacklo(a, b, 1))
+KERNEL(unpacklo_2, unpacklo(a, b, 2))
+KERNEL(unpacklo_4, unpacklo(a, b, 4))
+KERNEL(unpacklo_8, unpacklo(a, b, 8))
+KERNEL(unpackhi_1, unpackhi(a, b, 1))
+KERNEL(unpackhi_2, unpackhi(a, b, 2))
+KERNEL(unpackhi_4, unpackhi(a, b, 4))
+KERNEL(unpackhi_8, unpackhi(a, b, 8))
+KERNEL(mulhi_i16, mulhi_i16(a, b))
+KERNEL(mulhi_u16, mulhi_u16(a, b))
+
+#define ENTRY(name) { #name, name##_fast, name##_portable, name##_time_fast, name##_time_portable }
+static const struct kernel {
+    const char* name;
+    vec_u8 (*fast)(vec_u8 a, vec_u8 b);
+    vec_u8 (*portable)(vec_u8 a, vec_u8 b);
+    vec_u8 (*time_fast)(vec_u8 a, vec_u8 b);
+    vec_u8 (*time_portable)(vec_u8 a, vec_u8 b);
+} kernels[] = {
+    ENTRY(adds_i8), ENTRY(adds_u8), ENTRY(adds_i16), ENTRY(adds_u16),
+    ENTRY(subs_i8), ENTRY(subs_u8), ENTRY(subs_i16), ENTRY(subs_u16),
+    ENTRY(min_u8), ENTRY(max_u8), ENTRY(min_i16), ENTRY(max_i16),
+    ENTRY(packs_i16), ENTRY(packus_i16), ENTRY(packs_i32),
+    ENTRY(unpacklo_1), ENTRY(unpacklo_2), ENTRY(unpacklo_4), ENTRY(unpacklo_8),
+    ENTRY(unpackhi_1), ENTRY(unpackhi_2), ENTRY(unpackhi_4), ENTRY(unpackhi_8),
+    ENTRY(mulhi_i16), ENTRY(mulhi_u16),
+};
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static unsigned long long checked, failures;
+static volatile uint8_t timing_sink;
+
+static void print_vector(const char* what, vec_u8 v)
+{
+    printf("  %-9s", what);
+    for (int i = 15; i >= 0; i--)
+        printf("%02x%s", v[i], i == 8 ? " " : "");
+    printf("\n");
+}
+
+// a and b are 16 bytes as they are in memory; "bytes" says how many of them vec_load takes
+static void compare(const uint8_t* a, const uint8_t* b, int bytes)
+{
+    vec_u8 x = vec_load(a, bytes), y = vec_load(b, bytes);
+    for (unsigned int k = 0; k < KERNELS; k++) {
+        vec_u8 got = kernels[k].fast(x, y), expected = kernels[k].portable(x, y);
+        checked++;
+        if (!memcmp(&got, &expected, 16))
+            continue;
+        if (failures++ < 20) {
+            printf("%s, %d bytes:\n", kernels[k].name, bytes);
+            print_vector("a", x);
+            print_vector("b", y);
+            print_vector(INTRINSICS, got);
+            print_vector("portable", expected);
+        }
+    }
+}
+
+static uint64_t state = 0x9E3779B97F4A7C15ULL;
+static uint64_t random64(void)
+{
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+// Fills "v" with "value", "size" bytes at a time
+static void fill(uint8_t* v, uint32_t value, int size)
+{
+    for (int i = 0; i < 16; i += size)
+        memcpy(v + i, &value, size);
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long long count = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000000;
+    static const uint32_t boundaries[3][10] = {
+        { 0, 1, 2, 0x7E, 0x7F, 0x80, 0x81, 0xFE, 0xFF, 0x55 },
+        { 0, 1, 2, 0x7FFE, 0x7FFF, 0x8000, 0x8001, 0xFFFE, 0xFFFF, 0x00FF },
+        { 0, 1, 2, 0x7FFFFFFE, 0x7FFFFFFF, 0x80000000, 0x80000001, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFF8000 },
+    };
+    uint8_t a[16], b[16];
+
+    // Every pair of boundary values, in every lane, and next to each other in neighbouring lanes
+    for (int s = 0; s < 3; s++) {
+        int size = 1 << s;
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 10; j++) {
+                fill(a, boundaries[s][i], size);
+                fill(b, boundaries[s][j], size);
+                compare(a, b, 16);
+                compare(a, b, 8);
+                for (int k = 0; k < 16; k += size * 2) {
+                    memcpy(a + k + size, &boundaries[s][j], size);
+                    memcpy(b + k + size, &boundaries[s][i], size);
+                }
+                compare(a, b, 16);
+                compare(a, b, 8);
+            }
+        }
+    }
+
+    // Random lanes, half of them pulled towards the boundaries by clearing or setting their upper bits
+    for (unsigned long long n = 0; n < count; n++) {
+        uint64_t r[4] = { random64(), random64(), random64(), random64() };
+        if (n & 1) {
+            uint64_t mask = random64() & random64() & 0x7F7F7F7F7F7F7F7FULL;
+            for (int k = 0; k < 4; k++)
+                r[k] = random64() & 1 ? r[k] | mask : r[k] & ~mask;
+        }
+        memcpy(a, r, 16);
+        memcpy(b, r + 2, 16);
+        compare(a, b, 16);
+        compare(a, b, 8);
+    }
+    printf("%llu comparisons, %llu mismatches\n", checked, failures);
+
+    // Timing. The result of each call is the next call's first operand, so the calls can't overlap or be hoisted.
+    printf("%-12s %10s %10s  (ns per call)\n", "", INTRINSICS, "portable");
+    for (unsigned int k = 0; k < KERNELS; k++) {
+        vec_u8 x, y;
+        memcpy(&x, (uint64_t[2]) { random64(), random64() }, 16);
+        memcpy(&y, (uint64_t[2]) { random64(), random64() }, 16);
+        double start = seconds();
+        timing_sink = kernels[k].time_fast(x, y)[0];
+        double fast = seconds() - start;
+        start = seconds();
+        timing_sink = kernels[k].time_portable(x, y)[0];
+        double portable = seconds() - start;
+        printf("%-12s %10.2f %10.2f\n", kernels[k].name, fast * 1e9 / TIMING_ROUNDS, portable * 1e9 / TIMING_ROUNDS);
+    }
+    return failures != 0;
+}